@@ -0,0 +1,7 @@
+#!/bin/bash
+
+export HOMEDIR=`cd $(dirname $0); pwd`
+
+# 在容器中运行压测，参数原样传给 workdir/bench/run.sh，结果写在 workdir/bench/results 下
+docker-compose -f $HOMEDIR/docker-compose.yml up -d --build
+docker exec trynginx bash /root/workdir/bench/run.sh "$@"
@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# 比较两次 run.sh 的结果，逐个场景输出 RPS 和延迟的变化。
+# 用法：compare.sh 基准结果.json 新结果.json [阈值百分比，缺省 10]
+#       compare.sh -s 基准场景,新场景 结果.json [阈值百分比，缺省 10]
+# 新结果的 RPS 下降或 p99 延迟上升超过阈值时返回 1，可以直接用来检查回归。
+# -s 比较同一次结果中的两个场景，比如检查 myupstream_p2c 的 p99 是否低于轮询：
+#   run.sh -s slow_rr,slow_p2c -o p2c.json && compare.sh -s slow_rr,slow_p2c p2c.json 0
+
+set -e
+
+if [ "$1" = "-s" ] && [ $# -ge 3 ]; then
+    BASE_SCENARIO=${2%%,*}
+    NEW_SCENARIO=${2#*,}
+
+    TMP_DIR=`mktemp -d`
+    trap 'rm -rf $TMP_DIR' EXIT
+
+    # 两个场景改成同一个名字，分别作为基准和新结果
+    BASE=$TMP_DIR/base.json
+    NEW=$TMP_DIR/new.json
+    jq --arg s $BASE_SCENARIO --arg n "$BASE_SCENARIO/$NEW_SCENARIO" \
+        '.scenarios |= map(select(.name == $s) | .name = $n)' $3 > $BASE
+    jq --arg s $NEW_SCENARIO --arg n "$BASE_SCENARIO/$NEW_SCENARIO" \
+        '.scenarios |= map(select(.name == $s) | .name = $n)' $3 > $NEW
+    THRESHOLD=${4:-10}
+
+elif [ $# -ge 2 ] && [ "$1" != "-s" ]; then
+    BASE=$1
+    NEW=$2
+    THRESHOLD=${3:-10}
+
+else
+    sed -n '3,8p' $0
+    exit 1
+fi
+
+jq -r -n --slurpfile base $BASE --slurpfile new $NEW --argjson threshold $THRESHOLD '
+    def pct(a; b): if a == 0 then 0 else (b - a) * 100 / a end;
+    def fmt: . * 10 | round / 10 | tostring;
+
+    ($base[0].scenarios | map({ (.name): . }) | add) as $b
+    | [ $new[0].scenarios[] | select($b[.name]) | . as $n | $b[.name] as $o
+        | {
+            name: .name,
+            rps: pct($o.rps; $n.rps),
+            p50: pct($o.latency_ms.p50; $n.latency_ms.p50),
+            p99: pct($o.latency_ms.p99; $n.latency_ms.p99),
+            p999: pct($o.latency_ms.p999; $n.latency_ms.p999),
+            cpu: pct(($o.workers | map(.cpu_pct) | add); ($n.workers | map(.cpu_pct) | add)),
+            rss: pct(($o.workers | map(.rss_kb) | add); ($n.workers | map(.rss_kb) | add))
+          }
+        | . + { regression: (.rps < -$threshold or .p99 > $threshold) } ] as $rows
+    | "scenario\trps%\tp50%\tp99%\tp99.9%\tcpu%\trss%",
+      ($rows[] | "\(.name)\t\(.rps | fmt)\t\(.p50 | fmt)\t\(.p99 | fmt)\t\(.p999 | fmt)\t\(.cpu | fmt)\t\(.rss | fmt)\(if .regression then "\tREGRESSION" else "" end)"),
+      (if ($rows | map(.regression) | any) then "FAIL" else "OK" end)
+' | awk -F '\t' '{ printf "%-20s", $1; for (i = 2; i <= NF; i++) printf "%12s", $i; printf "\n" }' | tee /dev/stderr | tail -1 | grep -q '^OK'
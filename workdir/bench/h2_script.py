@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+#
+# myupstream_http2 的脚本化后端：在 8087 端口以 h2c 按用例发送特殊的帧序列，
+# 再经过前端 nginx（frontend.conf 的 /h2_script）请求，检查客户端收到的响应。
+#   continuation  响应头拆成 HEADERS 和两个 CONTINUATION，其中一个头部约 20KB
+#   padding       HEADERS 和 DATA 都带 PADDED 标志和填充
+#   goaway        第一个连接收到请求后回 GOAWAY（last stream 0），请求应当在新连接上重发
+#   refused       第一个流回 RST_STREAM(REFUSED_STREAM)，请求应当被重发
+#   request_continuation  请求的 :path 约 30KB，nginx 应当把请求头拆成 HEADERS 和 CONTINUATION 发送
+#
+# 用法：h2_script.py [-p 后端端口] [-u 前端 URL] [用例 ...]
+# 前端 nginx 要已经用 frontend.conf 启动（run.sh 运行期间，或者按 run.sh 中 start 的方式单独启动）。
+# 所有用例通过时返回 0。只用 Python 3 标准库，请求头不做 HPACK 解码，只看流 ID 和标志。
+
+import argparse
+import socket
+import struct
+import sys
+import threading
+import time
+import urllib.request
+
+PREFACE = b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+
+DATA, HEADERS, RST_STREAM, SETTINGS, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION = 0x0, 0x1, 0x3, 0x4, 0x6, 0x7, 0x8, 0x9
+END_STREAM, ACK, END_HEADERS, PADDED = 0x1, 0x1, 0x4, 0x8
+REFUSED_STREAM = 0x7
+
+
+def frame(type, flags, stream, payload=b''):
+    return struct.pack('>I', len(payload))[1:] + struct.pack('>BBI', type, flags, stream) + payload
+
+
+def hpack_int(value, prefix, mask=0):
+    # HPACK 整数编码，prefix 是第一个字节中可用的位数
+    limit = (1 << prefix) - 1
+    if value < limit:
+        return bytes([mask | value])
+    out = [mask | limit]
+    value -= limit
+    while value >= 128:
+        out.append(value % 128 + 128)
+        value //= 128
+    out.append(value)
+    return bytes(out)
+
+
+def hpack_literal(name, value):
+    # 不进入动态表、名字不在静态表中的字面量，不用 Huffman 编码
+    return b'\x00' + hpack_int(len(name), 7) + name + hpack_int(len(value), 7) + value
+
+
+def response_block(body, extra=()):
+    block = b'\x88'  # :status 200
+    block += hpack_literal(b'content-type', b'text/plain')
+    block += hpack_literal(b'content-length', str(len(body)).encode())
+    for name, value in extra:
+        block += hpack_literal(name, value)
+    return block
+
+
+class Backend:
+    def __init__(self, port, case):
+        self.case = case
+        self.connections = 0
+        self.streams = 0
+        self.conns = []
+        self.request_frames = 0
+        self.lock = threading.Lock()
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(('127.0.0.1', port))
+        self.sock.listen(16)
+        self.sock.settimeout(0.1)
+        self.stopped = False
+        self.acceptor = threading.Thread(target=self.accept, daemon=True)
+        self.acceptor.start()
+
+    def close(self):
+        # 关闭已经接受的连接，nginx 的下一个用例会建立新的连接
+        self.stopped = True
+        self.acceptor.join()
+        self.sock.close()
+        with self.lock:
+            for conn in self.conns:
+                try:
+                    conn.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+        time.sleep(0.2)
+
+    def accept(self):
+        while not self.stopped:
+            try:
+                conn, _ = self.sock.accept()
+            except socket.timeout:
+                continue
+            conn.settimeout(None)
+            with self.lock:
+                self.connections += 1
+                self.conns.append(conn)
+                n = self.connections
+            threading.Thread(target=self.serve, args=(conn, n), daemon=True).start()
+
+    def read_exact(self, conn, n):
+        data = b''
+        while len(data) < n:
+            chunk = conn.recv(n - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return data
+
+    def serve(self, conn, n):
+        try:
+            if self.read_exact(conn, len(PREFACE)) != PREFACE:
+                return
+            conn.sendall(frame(SETTINGS, 0, 0))
+            block_stream = 0
+            while True:
+                head = self.read_exact(conn, 9)
+                length = struct.unpack('>I', b'\x00' + head[:3])[0]
+                type, flags, stream = head[3], head[4], struct.unpack('>I', head[5:])[0] & 0x7fffffff
+                payload = self.read_exact(conn, length)
+
+                if type == SETTINGS and not flags & ACK:
+                    conn.sendall(frame(SETTINGS, ACK, 0))
+                elif type == PING and not flags & ACK:
+                    conn.sendall(frame(PING, ACK, 0, payload))
+                elif type == HEADERS:
+                    block_stream = stream
+                    frames = 0
+                elif type == CONTINUATION and stream != block_stream:
+                    print('  CONTINUATION for stream %d while expecting %d' % (stream, block_stream), file=sys.stderr)
+                    return
+
+                if type in (HEADERS, CONTINUATION):
+                    frames += 1
+
+                # 请求头块结束，请求没有包体，一定同时带 END_STREAM
+                if type in (HEADERS, CONTINUATION) and flags & END_HEADERS:
+                    with self.lock:
+                        self.streams += 1
+                        self.request_frames = max(self.request_frames, frames)
+                    if not self.respond(conn, n, block_stream):
+                        return
+                    block_stream = 0
+        except (EOFError, OSError):
+            pass
+        finally:
+            conn.close()
+
+    def respond(self, conn, n, stream):
+        body = ('%s %d\n' % (self.case, stream)).encode()
+
+        if self.case == 'continuation':
+            block = response_block(body, [(b'x-big', b'b' * 20000)])
+            a, b = len(block) // 3, 2 * len(block) // 3
+            conn.sendall(frame(HEADERS, 0, stream, block[:a])
+                         + frame(CONTINUATION, 0, stream, block[a:b])
+                         + frame(CONTINUATION, END_HEADERS, stream, block[b:])
+                         + frame(DATA, END_STREAM, stream, body))
+
+        elif self.case == 'padding':
+            block = response_block(body)
+            conn.sendall(frame(HEADERS, END_HEADERS | PADDED, stream, bytes([7]) + block + b'\x00' * 7)
+                         + frame(DATA, PADDED, stream, bytes([3]) + body[:4] + b'\x00' * 3)
+                         + frame(DATA, END_STREAM | PADDED, stream, bytes([0]) + body[4:]))
+
+        elif self.case == 'goaway' and n == 1:
+            # 没有处理任何流就关闭连接，请求应当在新连接上重发
+            conn.sendall(frame(GOAWAY, 0, 0, struct.pack('>II', 0, 0)))
+            return False
+
+        elif self.case == 'refused' and self.streams == 1:
+            conn.sendall(frame(RST_STREAM, 0, stream, struct.pack('>I', REFUSED_STREAM)))
+
+        else:
+            conn.sendall(frame(HEADERS, END_HEADERS, stream, response_block(body))
+                         + frame(DATA, END_STREAM, stream, body))
+
+        return True
+
+
+def run(case, port, url):
+    if case == 'request_continuation':
+        url += '?q=' + 'a' * 30000
+
+    backend = Backend(port, case)
+    try:
+        with urllib.request.urlopen(url, timeout=5) as resp:
+            status, body = resp.status, resp.read()
+    except Exception as e:
+        status, body = None, str(e).encode()
+    finally:
+        backend.close()
+
+    ok = status == 200 and body.startswith(case.encode() + b' ')
+    if case in ('goaway', 'refused'):
+        ok = ok and backend.streams == 2
+    if case == 'request_continuation':
+        ok = ok and backend.request_frames > 1
+    print('%-14s %s (status %s, %d connections, %d streams, body %r)'
+          % (case, 'OK' if ok else 'FAIL', status, backend.connections, backend.streams, body[:40]))
+    return ok
+
+
+def main():
+    cases = ['continuation', 'padding', 'goaway', 'refused', 'request_continuation']
+
+    parser = argparse.ArgumentParser(description='scripted h2c backend for myupstream_http2')
+    parser.add_argument('-p', type=int, default=8087, help='backend port')
+    parser.add_argument('-u', default='http://127.0.0.1:8000/h2_script', help='frontend URL')
+    parser.add_argument('cases', nargs='*', help=', '.join(cases))
+    args = parser.parse_args()
+
+    for case in args.cases:
+        if case not in cases:
+            parser.error('unknown case: ' + case)
+
+    failed = [case for case in args.cases or cases if not run(case, args.p, args.u)]
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
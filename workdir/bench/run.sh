@@ -0,0 +1,228 @@
+#!/bin/bash
+#
+# 端到端压测。在容器中运行（宿主机上用仓库根目录的 bench.sh）：
+#   1. 用 nginx-1.16.1 源码编译带 mymodule 和 myupstream 的 nginx
+#   2. 启动替身后端（backend.conf）和前端（frontend.conf）两个 nginx
+#   3. 用 wrk2 以固定速率（开环）依次压测 mymodule、myupstream、带缓存的 myupstream 和 proxy_pass 基线；
+#      slow_rr 和 slow_p2c 两个场景（需要用 -s 指定）在一快一慢两个后端之间分别用轮询和 myupstream_p2c 选择；
+#      blob 场景（同样需要用 -s 指定）由 mymodule_path 发送 64MB 的文件；
+#      myupstream_h2 场景（同样需要用 -s 指定）用 myupstream_http2 复用到 h2c 后端的两个连接；
+#      myupstream_batch 场景（同样需要用 -s 指定）用 myupstream_batch 把 2ms 内的请求合成一个批量请求；
+#      myupstream_fanout 场景（同样需要用 -s 指定）同时访问快慢两个后端，只合并 20ms 内返回的响应
+#   4. 记录 RPS、p50/p99/p99.9 延迟，以及前端每个 worker 的 CPU 占用和 RSS，写入 JSON 文件
+#
+# 用法：run.sh [-r 每秒请求数] [-d 秒数] [-c 连接数] [-t 线程数] [-w worker数] [-s 场景,...] [-o 输出文件] [-B]
+#   -B 强制重新编译 nginx；环境变量 MYUPSTREAM_POOL_PROFILE=YES 时编译进请求内存池的分配统计（切换时需要 -B）
+# 两次结果用 compare.sh 比较。前端运行时可以用 h2_script.py 检查 myupstream_http2 对 CONTINUATION、填充、GOAWAY 和 REFUSED_STREAM 的处理。
+
+set -e
+
+export BENCH_DIR=`cd $(dirname $0); pwd`
+export WORKDIR=`dirname $BENCH_DIR`
+
+NGINX_SRC=${NGINX_SRC:-/root/nginx-1.16.1}
+BUILD_DIR=${BUILD_DIR:-$BENCH_DIR/build}
+RUN_DIR=$BENCH_DIR/run
+WRK=${WRK:-wrk2}
+
+RATE=2000
+DURATION=30
+WARMUP=5
+CONNECTIONS=64
+THREADS=2
+WORKERS=2
+SCENARIOS=mymodule,myupstream,myupstream_cached,proxy_pass
+OUTPUT=$BENCH_DIR/results/`date +%Y%m%d-%H%M%S`.json
+REBUILD=0
+
+while getopts "r:d:c:t:w:s:o:B" opt; do
+    case $opt in
+        r) RATE=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        c) CONNECTIONS=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        w) WORKERS=$OPTARG ;;
+        s) SCENARIOS=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        B) REBUILD=1 ;;
+        *) sed -n '3,17p' $0; exit 1 ;;
+    esac
+done
+
+# 场景名和压测的 URL
+url() {
+    case $1 in
+        mymodule)          echo "http://127.0.0.1:8000/mymodule/" ;;
+        myupstream)        echo "http://127.0.0.1:8000/search?q=nginx" ;;
+        myupstream_cached) echo "http://127.0.0.1:8000/search_cached?q=nginx" ;;
+        proxy_pass)        echo "http://127.0.0.1:8000/proxy/" ;;
+        slow_rr)           echo "http://127.0.0.1:8000/slow_rr?q=nginx" ;;
+        slow_p2c)          echo "http://127.0.0.1:8000/slow_p2c?q=nginx" ;;
+        blob)              echo "http://127.0.0.1:8000/blobs/model.bin" ;;
+        myupstream_h2)     echo "http://127.0.0.1:8000/search_h2?q=nginx" ;;
+        myupstream_batch)  echo "http://127.0.0.1:8000/search_batch?q=nginx" ;;
+        myupstream_fanout) echo "http://127.0.0.1:8000/search_fanout?q=nginx" ;;
+        *) echo "unknown scenario: $1" >&2; exit 1 ;;
+    esac
+}
+
+# 模块源码比编译结果新时重新编译
+build() {
+    if [ $REBUILD -eq 0 ] && [ -x $BUILD_DIR/sbin/nginx ] \
+       && [ -z "`find $WORKDIR/module -newer $BUILD_DIR/sbin/nginx -type f`" ]; then
+        return
+    fi
+
+    echo "building nginx in $BUILD_DIR" >&2
+
+    cd $NGINX_SRC
+    ./configure --prefix=$BUILD_DIR \
+                --with-threads \
+                --with-http_v2_module \
+                --add-module=$WORKDIR/module/mymodule \
+                --add-module=$WORKDIR/module/myupstream > $BENCH_DIR/configure.log 2>&1
+    make -j`nproc` > $BENCH_DIR/make.log 2>&1
+    make install > /dev/null
+    cd - > /dev/null
+}
+
+# 启动一个 nginx 实例：start 目录 配置文件
+start() {
+    mkdir -p $1/logs $1/html
+    sed -e "s/@WORKERS@/$WORKERS/" $2 > $1/nginx.conf
+    $BUILD_DIR/sbin/nginx -p $1/ -c $1/nginx.conf
+}
+
+stop() {
+    if [ -f $1/logs/nginx.pid ]; then
+        $BUILD_DIR/sbin/nginx -p $1/ -c $1/nginx.conf -s quit || true
+        sleep 1
+    fi
+}
+
+# 前端 worker 的 pid
+workers() {
+    pgrep -P `cat $RUN_DIR/frontend/logs/nginx.pid` | sort -n
+}
+
+# 进程累计使用的 CPU 时间（时钟滴答数）
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+rss_kb() {
+    awk '/^VmRSS:/ { print $2 }' /proc/$1/status
+}
+
+# 把 wrk2 输出的延迟换算成毫秒：latency 输出文件 百分位
+latency_ms() {
+    awk -v p="$2" '
+        /Latency Distribution \(HdrHistogram - Recorded Latency\)/ { found = 1; next }
+        found && $1 == p {
+            v = $2
+            if (v ~ /us$/) { sub(/us$/, "", v); v = v / 1000 }
+            else if (v ~ /ms$/) { sub(/ms$/, "", v) }
+            else if (v ~ /m$/) { sub(/m$/, "", v); v = v * 60000 }
+            else if (v ~ /s$/) { sub(/s$/, "", v); v = v * 1000 }
+            printf "%.3f", v
+            exit
+        }' $1
+}
+
+# 压测一个场景，输出一个 JSON 对象
+run_scenario() {
+    local name=$1 target=`url $1` out=$RUN_DIR/$1.wrk
+    local pids after clk rps non2xx errors first
+    local -A before
+
+    # 预热：建立长连接、填充缓存，结果丢弃
+    $WRK -t$THREADS -c$CONNECTIONS -d${WARMUP}s -R$RATE $target > /dev/null
+
+    pids=`workers`
+    for pid in $pids; do
+        before[$pid]=`cpu_ticks $pid`
+    done
+
+    $WRK -t$THREADS -c$CONNECTIONS -d${DURATION}s -R$RATE --latency $target > $out
+
+    clk=`getconf CLK_TCK`
+    rps=`awk '/^Requests\/sec:/ { print $2 }' $out`
+    non2xx=`awk '/Non-2xx or 3xx responses:/ { print $5 }' $out`
+    errors=`awk '/Socket errors:/ { gsub(/,/, ""); print $4 + $6 + $8 + $10 }' $out`
+
+    printf '    {\n'
+    printf '      "name": "%s",\n' $name
+    printf '      "url": "%s",\n' $target
+    printf '      "rps": %s,\n' ${rps:-0}
+    printf '      "latency_ms": { "p50": %s, "p99": %s, "p999": %s },\n' \
+           `latency_ms $out 50.000%` `latency_ms $out 99.000%` `latency_ms $out 99.900%`
+    printf '      "non_2xx": %s,\n' ${non2xx:-0}
+    printf '      "socket_errors": %s,\n' ${errors:-0}
+    printf '      "workers": ['
+
+    first=1
+    for pid in $pids; do
+        after=`cpu_ticks $pid`
+        [ $first -eq 1 ] || printf ','
+        first=0
+        printf '\n        { "pid": %s, "cpu_pct": %s, "rss_kb": %s }' $pid \
+               `awk -v b=${before[$pid]} -v a=$after -v c=$clk -v d=$DURATION 'BEGIN { printf "%.1f", (a - b) / c / d * 100 }'` \
+               `rss_kb $pid`
+    done
+
+    printf '\n      ]\n    }'
+}
+
+if ! command -v $WRK > /dev/null; then
+    echo "$WRK not found, see Dockerfile" >&2
+    exit 1
+fi
+
+build
+
+stop $RUN_DIR/frontend
+stop $RUN_DIR/backend
+trap 'stop $RUN_DIR/frontend; stop $RUN_DIR/backend' EXIT
+
+# 替身搜索后端返回约 16KB 的结果页，与真实的搜索结果页大小相近
+mkdir -p $RUN_DIR/backend/html
+awk 'BEGIN { printf "<html><body>\n"; for (i = 0; i < 160; i++) printf "<p>result %03d: lorem ipsum dolor sit amet, consectetur adipiscing elit</p>\n", i; printf "</body></html>\n" }' \
+    > $RUN_DIR/backend/html/search.html
+
+# 替身批量接口总是返回 64 个约 1KB 的结果（myupstream_batch 的 size 上限），格式为 "<status> <length>" CRLF 加包体，
+# 批次不满 64 个请求时多出的结果被忽略
+awk 'BEGIN { for (i = 0; i < 16; i++) body = body sprintf("<p>result %03d: lorem ipsum dolor sit amet, consectetur</p>\n", i);
+             for (i = 0; i < 64; i++) printf "200 %d\r\n%s", length(body), body }' \
+    > $RUN_DIR/backend/html/batch.txt
+
+# blob 场景发送的文件
+mkdir -p $RUN_DIR/frontend/blobs
+[ -f $RUN_DIR/frontend/blobs/model.bin ] || head -c 64M /dev/urandom > $RUN_DIR/frontend/blobs/model.bin
+
+start $RUN_DIR/backend $BENCH_DIR/backend.conf
+start $RUN_DIR/frontend $BENCH_DIR/frontend.conf
+sleep 1
+
+mkdir -p `dirname $OUTPUT`
+
+{
+    printf '{\n'
+    printf '  "timestamp": "%s",\n' `date -u +%Y-%m-%dT%H:%M:%SZ`
+    printf '  "commit": "%s",\n' `git -C $WORKDIR rev-parse --short HEAD 2>/dev/null || echo unknown`
+    printf '  "nginx": "%s",\n' `$BUILD_DIR/sbin/nginx -v 2>&1 | sed 's/.*nginx\///'`
+    printf '  "rate": %s,\n  "duration": %s,\n  "connections": %s,\n  "threads": %s,\n  "workers": %s,\n' \
+           $RATE $DURATION $CONNECTIONS $THREADS $WORKERS
+    printf '  "scenarios": [\n'
+
+    first=1
+    for s in `echo $SCENARIOS | tr ',' ' '`; do
+        [ $first -eq 1 ] || printf ',\n'
+        first=0
+        echo "running $s" >&2
+        run_scenario $s
+    done
+
+    printf '\n  ]\n}\n'
+} > $OUTPUT
+
+echo "results written to $OUTPUT" >&2
@@ -2,16 +2,83 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
-static ngx_int_t ngx_http_mymodule_handler(ngx_http_request_t *r);
-static char * ngx_http_mymodule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
-static void* ngx_http_mymodule_create_loc_conf(ngx_conf_t *cf);
-static char *ngx_http_mymodule_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+#include <zlib.h>
+
+/*
+请求内存池的分配统计，由 myupstream 汇总并导出，只在与 myupstream 一起编译且设置了 MYUPSTREAM_POOL_PROFILE=YES 时有效。
+调用点的编号必须与 ngx_http_myupstream_module.h 中的 NGX_HTTP_MYUPSTREAM_POOL_MYMODULE_* 一致
+*/
+#define NGX_HTTP_MYMODULE_POOL_BUF       10
+#define NGX_HTTP_MYMODULE_POOL_FILE      11
+#define NGX_HTTP_MYMODULE_POOL_INGEST    12
+#define NGX_HTTP_MYMODULE_POOL_RESPONSE  13
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+void ngx_http_myupstream_pool_record(ngx_http_request_t *r, ngx_uint_t site, size_t size);
+#define ngx_http_mymodule_pool_profile(r, site, size)  ngx_http_myupstream_pool_record(r, site, size)
+#else
+#define ngx_http_mymodule_pool_profile(r, site, size)
+#endif
+
+/*
+请求跟踪，只在与 myupstream 一起编译时有效，由 location 中的 myupstream_trace 开启，记录写入 myupstream_trace_file。
+编号必须与 ngx_http_myupstream_module.h 中的 NGX_HTTP_MYUPSTREAM_TRACE_MYMODULE 一致
+*/
+#define NGX_HTTP_MYMODULE_TRACE_HANDLER  4
+
+#if (NGX_HTTP_MYUPSTREAM_TRACE)
+void ngx_http_myupstream_trace(ngx_http_request_t *r, ngx_uint_t event);
+#define ngx_http_mymodule_trace(r, event)  ngx_http_myupstream_trace(r, event)
+#else
+#define ngx_http_mymodule_trace(r, event)
+#endif
 
 /* 存储mymodule模块配置项参数的数据结构 */
 typedef struct {
 	ngx_str_t name;
+	ngx_flag_t gzip;         /* mymodule_gzip：同时生成 gzip 压缩的版本 */
+	ngx_str_t path;          /* mymodule_path：不为空时改为发送该路径下的文件，location 的前缀替换为该路径 */
+	ngx_flag_t ingest;       /* mymodule_ingest：接受 POST 上传，边接收边计算长度和校验和 */
+	ngx_str_t ingest_path;   /* mymodule_ingest_path：不为空时把上传的包体追加写入该路径下的文件 */
+	size_t ingest_buffer;    /* mymodule_ingest_buffer：写文件的缓冲区，攒满后一次写入 */
+
+	/* 以下在 merge 时根据 name 生成一次，之后所有请求只读共享 */
+	ngx_str_t body;          /* 完整的响应包体 "Hello <name>\n" */
+	ngx_str_t etag;          /* 由包体内容计算出的 ETag */
+	time_t last_modified;    /* 配置加载的时间，作为 Last-Modified */
+	ngx_buf_t buf;           /* 指向 body 的包体缓冲区模板 */
+
+	/* 压缩版本，压缩后没有变小时 gzip_body 为空，所有请求都发送原始版本 */
+	ngx_str_t gzip_body;
+	ngx_str_t gzip_etag;     /* 两个版本的内容不同，ETag 也必须不同 */
+	ngx_buf_t gzip_buf;
 } ngx_http_mymodule_conf_t;
 
+/* 一个上传请求的状态，只保存长度、校验和以及固定大小的写缓冲区，与包体大小无关 */
+typedef struct {
+	off_t size;              /* 已经收到的包体长度 */
+	uint32_t crc;            /* 已经收到的包体的 CRC32 */
+	ngx_file_t file;         /* 正在写入的临时文件，不保存包体时 fd 为 NGX_INVALID_FILE */
+	ngx_str_t path;          /* 上传完成后临时文件改名为这个文件 */
+	ngx_buf_t *buf;          /* 写缓冲区，从 client_body_buffer_size 大小的读缓冲区中复制过来，攒满后写入文件 */
+	unsigned committed:1;    /* 临时文件已经改名，清理时不再删除 */
+} ngx_http_mymodule_ingest_t;
+
+static ngx_int_t ngx_http_mymodule_handler(ngx_http_request_t *r);
+static char * ngx_http_mymodule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void* ngx_http_mymodule_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_mymodule_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+static ngx_int_t ngx_http_mymodule_init_response(ngx_conf_t *cf, ngx_http_mymodule_conf_t *mycf);
+static ngx_int_t ngx_http_mymodule_init_gzip(ngx_conf_t *cf, ngx_http_mymodule_conf_t *mycf);
+static ngx_int_t ngx_http_mymodule_file_handler(ngx_http_request_t *r, ngx_http_mymodule_conf_t *mycf);
+static ngx_int_t ngx_http_mymodule_ingest_handler(ngx_http_request_t *r, ngx_http_mymodule_conf_t *mycf);
+static void ngx_http_mymodule_ingest_cleanup(void *data);
+static void ngx_http_mymodule_ingest_body(ngx_http_request_t *r);
+static void ngx_http_mymodule_ingest_process(ngx_http_request_t *r);
+static ngx_int_t ngx_http_mymodule_ingest_consume(ngx_http_request_t *r, ngx_http_mymodule_ingest_t *ctx);
+static ngx_int_t ngx_http_mymodule_ingest_flush(ngx_http_request_t *r, ngx_http_mymodule_ingest_t *ctx);
+static ngx_int_t ngx_http_mymodule_ingest_finish(ngx_http_request_t *r, ngx_http_mymodule_ingest_t *ctx);
+
 /* commands 数组 */
 static ngx_command_t ngx_http_mymodule_commands[] = {
 	{
@@ -33,6 +100,46 @@ static ngx_command_t ngx_http_mymodule_commands[] = {
 		0,                                   /* 使用预设方式处理配置项时有用，本模块使用的是自定义模块 */
 		NULL                                 /* 配置项处理后的回调函数，本模块暂时用不到 */
 	},
+	{
+		ngx_string("mymodule_gzip"),         /* 加载配置时同时生成 gzip 压缩的响应，客户端接受时发送压缩版本 */
+		NGX_HTTP_LOC_CONF | NGX_HTTP_SRV_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_mymodule_conf_t, gzip),
+		NULL
+	},
+	{
+		ngx_string("mymodule_path"),         /* 发送该路径下的文件，用 sendfile 或线程池 aio 发送，支持 Range 请求 */
+		NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_mymodule_conf_t, path),
+		NULL
+	},
+	{
+		ngx_string("mymodule_ingest"),       /* 接受 POST 上传，不缓冲包体，逐块计算长度和 CRC32 */
+		NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_mymodule_conf_t, ingest),
+		NULL
+	},
+	{
+		ngx_string("mymodule_ingest_path"),  /* 上传的包体写入该路径下的文件，location 的前缀替换为该路径 */
+		NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_mymodule_conf_t, ingest_path),
+		NULL
+	},
+	{
+		ngx_string("mymodule_ingest_buffer"), /* 写文件的缓冲区大小，包体攒满这么多后才写一次文件 */
+		NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_mymodule_conf_t, ingest_buffer),
+		NULL
+	},
 	ngx_null_command                         /* commands 数组结束标志，其值为{ ngx_null_string, 0, NULL, 0, 0, NULL } */
 };
 
@@ -77,6 +184,10 @@ static void* ngx_http_mymodule_create_loc_conf(ngx_conf_t *cf) {
 		return NULL;
 	}
 
+	mycf->gzip = NGX_CONF_UNSET;
+	mycf->ingest = NGX_CONF_UNSET;
+	mycf->ingest_buffer = NGX_CONF_UNSET_SIZE;
+
 	return mycf;
 }
 
@@ -97,9 +208,161 @@ static char *ngx_http_mymodule_merge_loc_conf(ngx_conf_t *cf, void *parent, void
 		(conf->name).data = (prev->name).data;
 	}
 
+	ngx_conf_merge_value(conf->gzip, prev->gzip, 0);
+	ngx_conf_merge_str_value(conf->path, prev->path, "");
+
+	/* 相对路径以 nginx 的 prefix 为基准；结尾的 / 去掉，拼接时由 URI 提供 */
+	if (conf->path.len) {
+		if (ngx_conf_full_name(cf->cycle, &conf->path, 0) != NGX_OK) {
+			return NGX_CONF_ERROR;
+		}
+
+		while (conf->path.len > 1 && conf->path.data[conf->path.len - 1] == '/') {
+			conf->path.len--;
+		}
+	}
+
+	ngx_conf_merge_value(conf->ingest, prev->ingest, 0);
+	ngx_conf_merge_str_value(conf->ingest_path, prev->ingest_path, "");
+	ngx_conf_merge_size_value(conf->ingest_buffer, prev->ingest_buffer, 64 * 1024);
+
+	/* 与 mymodule_path 相同 */
+	if (conf->ingest_path.len) {
+		if (ngx_conf_full_name(cf->cycle, &conf->ingest_path, 0) != NGX_OK) {
+			return NGX_CONF_ERROR;
+		}
+
+		while (conf->ingest_path.len > 1 && conf->ingest_path.data[conf->ingest_path.len - 1] == '/') {
+			conf->ingest_path.len--;
+		}
+	}
+
+	/* 响应只和配置有关，在这里生成一次，处理请求时不再分配和复制 */
+	if (ngx_http_mymodule_init_response(cf, conf) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
 	return NGX_CONF_OK;
 }
 
+/*
+根据 name 生成完整的响应包体、ETag 和包体缓冲区模板，内存都分配在配置内存池中，reload 之前一直有效
+参数：cf - 配置对象
+     mycf - 该 location 的配置
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t ngx_http_mymodule_init_response(ngx_conf_t *cf, ngx_http_mymodule_conf_t *mycf) {
+	u_char   *p;
+	uint32_t  crc;
+
+	mycf->body.len = sizeof("Hello ") - 1 + mycf->name.len + 1;
+	mycf->body.data = ngx_pnalloc(cf->pool, mycf->body.len);
+	if (mycf->body.data == NULL) {
+		return NGX_ERROR;
+	}
+
+	p = ngx_cpymem(mycf->body.data, "Hello ", sizeof("Hello ") - 1);
+	p = ngx_cpymem(p, mycf->name.data, mycf->name.len);
+	*p = '\n';
+
+	/* ETag 只由包体决定，reload 后内容不变时客户端的缓存仍然有效 */
+	crc = ngx_crc32_short(mycf->body.data, mycf->body.len);
+
+	mycf->etag.data = ngx_pnalloc(cf->pool, sizeof("\"\"-") + 2 * NGX_INT32_LEN);
+	if (mycf->etag.data == NULL) {
+		return NGX_ERROR;
+	}
+
+	mycf->etag.len = ngx_sprintf(mycf->etag.data, "\"%08xD-%xz\"", crc, mycf->body.len) - mycf->etag.data;
+
+	mycf->last_modified = ngx_time();
+
+	/* 包体在内存中且只读，过滤模块不会修改它 */
+	ngx_memzero(&mycf->buf, sizeof(ngx_buf_t));
+	mycf->buf.pos = mycf->body.data;
+	mycf->buf.last = mycf->body.data + mycf->body.len;
+	mycf->buf.start = mycf->buf.pos;
+	mycf->buf.end = mycf->buf.last;
+	mycf->buf.memory = 1;
+	mycf->buf.last_buf = 1;
+	mycf->buf.last_in_chain = 1;
+
+	if (mycf->gzip) {
+		return ngx_http_mymodule_init_gzip(cf, mycf);
+	}
+
+	return NGX_OK;
+}
+
+/*
+把响应包体压缩一次，之后每个接受 gzip 的请求都直接发送这份压缩结果，不再经过 gzip 过滤模块逐个请求压缩。
+压缩后没有变小（比如很短的包体）时不保存压缩版本
+参数：cf - 配置对象
+     mycf - 该 location 的配置，原始版本必须已经生成
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t ngx_http_mymodule_init_gzip(ngx_conf_t *cf, ngx_http_mymodule_conf_t *mycf) {
+	int       rc;
+	size_t    bound;
+	z_stream  zs;
+
+	ngx_memzero(&zs, sizeof(z_stream));
+
+	/* 只在加载配置时压缩一次，使用最高的压缩级别；windowBits 加 16 输出带 gzip 头尾的格式 */
+	rc = deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "deflateInit2() failed: %d", rc);
+		return NGX_ERROR;
+	}
+
+	bound = deflateBound(&zs, mycf->body.len);
+
+	mycf->gzip_body.data = ngx_pnalloc(cf->pool, bound);
+	if (mycf->gzip_body.data == NULL) {
+		deflateEnd(&zs);
+		return NGX_ERROR;
+	}
+
+	zs.next_in = mycf->body.data;
+	zs.avail_in = mycf->body.len;
+	zs.next_out = mycf->gzip_body.data;
+	zs.avail_out = bound;
+
+	rc = deflate(&zs, Z_FINISH);
+
+	mycf->gzip_body.len = bound - zs.avail_out;
+
+	deflateEnd(&zs);
+
+	if (rc != Z_STREAM_END) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "deflate() failed: %d", rc);
+		return NGX_ERROR;
+	}
+
+	if (mycf->gzip_body.len >= mycf->body.len) {
+		ngx_str_null(&mycf->gzip_body);
+		return NGX_OK;
+	}
+
+	mycf->gzip_etag.data = ngx_pnalloc(cf->pool, mycf->etag.len + sizeof("-gzip") - 1);
+	if (mycf->gzip_etag.data == NULL) {
+		return NGX_ERROR;
+	}
+
+	/* 在引号内加上后缀："crc-len" 变为 "crc-len-gzip" */
+	mycf->gzip_etag.len = ngx_sprintf(mycf->gzip_etag.data, "%*s-gzip\"", mycf->etag.len - 1, mycf->etag.data) - mycf->gzip_etag.data;
+
+	mycf->gzip_buf = mycf->buf;
+	mycf->gzip_buf.pos = mycf->gzip_body.data;
+	mycf->gzip_buf.last = mycf->gzip_body.data + mycf->gzip_body.len;
+	mycf->gzip_buf.start = mycf->gzip_buf.pos;
+	mycf->gzip_buf.end = mycf->gzip_buf.last;
+
+	return NGX_OK;
+}
+
 /* 
 commands中定义的回调函数，在解析出mymodule配置项时调用该函数
 参数：cf - 配置对象
@@ -130,6 +393,12 @@ static ngx_int_t ngx_http_mymodule_handler(ngx_http_request_t *r)
 	/* 获取该模块的配置项参数的数据结构 */
 	ngx_http_mymodule_conf_t *mycf = ngx_http_get_module_loc_conf(r, ngx_http_mymodule_module);
 
+	ngx_http_mymodule_trace(r, NGX_HTTP_MYMODULE_TRACE_HANDLER);
+
+	/* 上传模式：边接收边处理包体，不在内存中保存整个包体 */
+	if (mycf->ingest && r->method == NGX_HTTP_POST && r == r->main)
+		return ngx_http_mymodule_ingest_handler(r, mycf);
+
     /* 如果请求方法不是 GET 或 HEAD，则返回 405 状态码 */
 	if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
 		return NGX_HTTP_NOT_ALLOWED;
@@ -139,37 +408,73 @@ static ngx_int_t ngx_http_mymodule_handler(ngx_http_request_t *r)
 	if (rc != NGX_OK)
 			return rc;
 
-    /* 构造响应包头部中的 Content-Type */
-    ngx_str_t type = ngx_string("text/plain");
-    /* 构造返回包体中的内容 */
-	// ngx_str_t response = mycf->name;
-	ngx_str_t response = ngx_string("Hello ");
-	/* 响应包体长度，此处响应包体由“Hello ", mycf->name, "\n"构成 */
-	size_t len = response.len + (mycf->name).len + 1;
+	/* 文件模式：包体不经过用户态内存 */
+	if (mycf->path.len)
+		return ngx_http_mymodule_file_handler(r, mycf);
 
-    /* 设置响应包中的状态码，响应包头中的Content-Length（包体长度）和 Content-Type */
+	/* 有压缩版本且客户端接受 gzip 时发送压缩版本，两个版本都是加载配置时生成的 */
+	ngx_uint_t gzip = 0;
+#if (NGX_HTTP_GZIP)
+	if (mycf->gzip_body.len && (r->gzip_tested ? r->gzip_ok : ngx_http_gzip_ok(r) == NGX_OK))
+		gzip = 1;
+#endif
+
+	/* 设置响应包中的状态码，响应包头中的Content-Length（包体长度）和 Content-Type */
 	r->headers_out.status = NGX_HTTP_OK;
-	r->headers_out.content_length_n = len;
-	r->headers_out.content_type = type;
+	r->headers_out.content_length_n = gzip ? mycf->gzip_body.len : mycf->body.len;
+	ngx_str_set(&r->headers_out.content_type, "text/plain");
+	r->headers_out.content_type_len = sizeof("text/plain") - 1;
+	r->headers_out.last_modified_time = mycf->last_modified;
+
+	/* ETag 的值直接引用配置中的字符串；headers 链表在创建请求时已经预分配，这里不需要分配内存 */
+	ngx_table_elt_t *etag = ngx_list_push(&r->headers_out.headers);
+	if (etag == NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	etag->hash = 1;
+	ngx_str_set(&etag->key, "ETag");
+	etag->value = gzip ? mycf->gzip_etag : mycf->etag;
+	r->headers_out.etag = etag;
+
+	/* 同一个 URL 的响应是否压缩取决于 Accept-Encoding，告诉中间的缓存按它区分；
+	   设置了 Content-Encoding 后 gzip 过滤模块不会再压缩一次 */
+	if (mycf->gzip_body.len) {
+		ngx_table_elt_t *h = ngx_list_push(&r->headers_out.headers);
+		if (h == NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		h->hash = 1;
+		ngx_str_set(&h->key, "Vary");
+		ngx_str_set(&h->value, "Accept-Encoding");
+
+		if (gzip) {
+			h = ngx_list_push(&r->headers_out.headers);
+			if (h == NULL)
+				return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-    /* 发送包响应头 */
+			h->hash = 1;
+			ngx_str_set(&h->key, "Content-Encoding");
+			ngx_str_set(&h->value, "gzip");
+			r->headers_out.content_encoding = h;
+		}
+	}
+
+    /* 发送包响应头。带 If-None-Match 或 If-Modified-Since 且内容没有变化时，
+       not_modified 过滤模块会把响应改为 304 并置位 header_only，此处直接返回 */
 	rc = ngx_http_send_header(r);
     /* 如果没有包体，在此处就可以返回 */
 	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
 			return rc;
 
-    /* 构造ngx_buf_t结构体，ngx_buf_t 主要是用来处理大量数据的数据结构 */
-	ngx_buf_t *b = ngx_create_temp_buf(r->pool, len);
+    /* 过滤模块发送时会移动 pos，所以每个请求使用模板的一份拷贝，包体本身仍然是配置中的那一份 */
+	ngx_buf_t *b = ngx_palloc(r->pool, sizeof(ngx_buf_t));
 	if (b == NULL)
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    /* 将 “Hello ", mycf->name, "\n" 复制到 ngx_buf_t 指向的内存，构造响应包体 */
-	ngx_memcpy(b->pos, response.data, response.len);
-	ngx_memcpy(b->pos + response.len, (mycf->name).data, (mycf->name).len);
-	ngx_memcpy(b->pos + response.len + (mycf->name).len, "\n", 1);
-    /* b->last 必须要设置 */
-	b->last = b->pos + len;
-    /* 表明这是最后一块 buff */
-	b->last_buf = 1;
+	ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_BUF, sizeof(ngx_buf_t));
+
+	*b = gzip ? mycf->gzip_buf : mycf->buf;
+    /* 子请求的包体不是整个响应的最后一块 */
+	b->last_buf = (r == r->main) ? 1 : 0;
 
     /* ngx_chain_t 是以 ngx_buf_t 为基础的链表 */
 	ngx_chain_t out;
@@ -180,4 +485,406 @@ static ngx_int_t ngx_http_mymodule_handler(ngx_http_request_t *r)
 
     /* 调用 ngx_http_output_filter 发送包体 */
 	return ngx_http_output_filter(r, &out);
-}
\ No newline at end of file
+}
+
+/*
+文件模式的处理函数。文件描述符和 stat 结果由 open_file_cache 缓存，包体是指向文件的缓冲区：
+开启 sendfile 时由内核直接发送，否则按 output_buffers 分块读取（配置了 aio threads 时在线程池中读），
+内存占用与文件大小无关。Range 请求由 range 过滤模块切分文件缓冲区，同样不读取文件内容
+参数：r - 请求
+     mycf - 该 location 的配置
+返回值：HTTP响应码或者 Nginx 错误码
+*/
+static ngx_int_t ngx_http_mymodule_file_handler(ngx_http_request_t *r, ngx_http_mymodule_conf_t *mycf)
+{
+	u_char                    *last;
+	size_t                     alias;
+	ngx_int_t                  rc;
+	ngx_str_t                  path;
+	ngx_uint_t                 level;
+	ngx_buf_t                 *b;
+	ngx_chain_t                out;
+	ngx_open_file_info_t       of;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	/* 与 alias 相同，URI 中 location 前缀之后的部分拼接在 mymodule_path 之后；正则 location 拼接整个 URI */
+	alias = clcf->regex ? 0 : ngx_min(clcf->name.len, r->uri.len);
+
+	path.len = mycf->path.len + r->uri.len - alias;
+	path.data = ngx_pnalloc(r->pool, path.len + 1);
+	if (path.data == NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_FILE, path.len + 1);
+
+	last = ngx_cpymem(path.data, mycf->path.data, mycf->path.len);
+	last = ngx_cpymem(last, r->uri.data + alias, r->uri.len - alias);
+	*last = '\0';
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mymodule filename: \"%s\"", path.data);
+
+	ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+	of.read_ahead = clcf->read_ahead;
+	of.directio = clcf->directio;
+	of.valid = clcf->open_file_cache_valid;
+	of.min_uses = clcf->open_file_cache_min_uses;
+	of.errors = clcf->open_file_cache_errors;
+	of.events = clcf->open_file_cache_events;
+
+	if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	/* 命中 open_file_cache 时不再 open() 和 fstat()，描述符在缓存项失效前一直保持打开 */
+	if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK) {
+		switch (of.err) {
+
+		case 0:
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		case NGX_ENOENT:
+		case NGX_ENOTDIR:
+		case NGX_ENAMETOOLONG:
+			level = NGX_LOG_ERR;
+			rc = NGX_HTTP_NOT_FOUND;
+			break;
+
+		case NGX_EACCES:
+#if (NGX_HAVE_OPENAT)
+		case NGX_EMLINK:
+		case NGX_ELOOP:
+#endif
+			level = NGX_LOG_ERR;
+			rc = NGX_HTTP_FORBIDDEN;
+			break;
+
+		default:
+			level = NGX_LOG_CRIT;
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			break;
+		}
+
+		if (rc != NGX_HTTP_NOT_FOUND || clcf->log_not_found)
+			ngx_log_error(level, r->connection->log, of.err, "%s \"%s\" failed", of.failed, path.data);
+
+		return rc;
+	}
+
+	/* 只发送普通文件，目录不列出内容 */
+	if (!of.is_file)
+		return NGX_HTTP_NOT_FOUND;
+
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = of.size;
+	r->headers_out.last_modified_time = of.mtime;
+
+	/* ETag 由修改时间和大小生成，文件被替换后自然改变 */
+	if (ngx_http_set_etag(r) != NGX_OK)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	if (ngx_http_set_content_type(r) != NGX_OK)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	/* 交给 range 过滤模块处理 Range 和 If-Range */
+	r->allow_ranges = 1;
+
+	/* 子请求发送空文件时没有包体 */
+	if (r != r->main && of.size == 0)
+		return ngx_http_send_header(r);
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+	if (b->file == NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_FILE, sizeof(ngx_buf_t) + sizeof(ngx_file_t));
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+		return rc;
+
+	b->file_pos = 0;
+	b->file_last = of.size;
+
+	b->in_file = b->file_last ? 1 : 0;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	b->file->fd = of.fd;
+	b->file->name = path;
+	b->file->log = r->connection->log;
+	b->file->directio = of.is_directio;
+
+	out.buf = b;
+	out.next = NULL;
+
+	return ngx_http_output_filter(r, &out);
+}
+
+/*
+上传模式的处理函数。包体不缓冲：nginx 每读到一块就交给本模块，处理完后读缓冲区立即复用，
+读缓冲区还没有处理完时 nginx 暂停读取客户端，所以不论上传多大，内存占用只有
+client_body_buffer_size 大小的读缓冲区和 mymodule_ingest_buffer 大小的写缓冲区。
+配置了 mymodule_ingest_path 时包体先写入同一目录下的临时文件，接收完整后改名，中途失败时删除
+参数：r - 请求
+     mycf - 该 location 的配置
+返回值：HTTP响应码或者 Nginx 错误码，开始读包体后返回 NGX_DONE
+*/
+static ngx_int_t ngx_http_mymodule_ingest_handler(ngx_http_request_t *r, ngx_http_mymodule_conf_t *mycf)
+{
+	u_char                      *last;
+	size_t                       alias;
+	ngx_int_t                    rc;
+	ngx_pool_cleanup_t          *cln;
+	ngx_http_core_loc_conf_t    *clcf;
+	ngx_http_mymodule_ingest_t  *ctx;
+
+	ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_mymodule_ingest_t));
+	if (ctx == NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_INGEST, sizeof(ngx_http_mymodule_ingest_t));
+
+	ngx_crc32_init(ctx->crc);
+	ctx->file.fd = NGX_INVALID_FILE;
+	ctx->file.log = r->connection->log;
+
+	if (mycf->ingest_path.len) {
+		clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+		/* 文件名的规则与 mymodule_path 相同 */
+		alias = clcf->regex ? 0 : ngx_min(clcf->name.len, r->uri.len);
+
+		if (r->uri.len == alias || r->uri.data[r->uri.len - 1] == '/')
+			return NGX_HTTP_BAD_REQUEST;
+
+		ctx->path.len = mycf->ingest_path.len + r->uri.len - alias;
+		ctx->path.data = ngx_pnalloc(r->pool, ctx->path.len + 1);
+
+		/* 临时文件名加上 worker 的进程号和连接序号，同一个文件的并发上传互不影响 */
+		ctx->file.name.data = ngx_pnalloc(r->pool, ctx->path.len + sizeof(".") - 1 + NGX_INT64_LEN + sizeof(".") - 1 + NGX_ATOMIC_T_LEN + 1);
+
+		if (ctx->path.data == NULL || ctx->file.name.data == NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_INGEST, ctx->path.len + 1);
+		ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_INGEST,
+			ctx->path.len + sizeof(".") - 1 + NGX_INT64_LEN + sizeof(".") - 1 + NGX_ATOMIC_T_LEN + 1);
+
+		last = ngx_cpymem(ctx->path.data, mycf->ingest_path.data, mycf->ingest_path.len);
+		last = ngx_cpymem(last, r->uri.data + alias, r->uri.len - alias);
+		*last = '\0';
+
+		last = ngx_sprintf(ctx->file.name.data, "%V.%P.%uA", &ctx->path, ngx_pid, r->connection->number);
+		*last = '\0';
+		ctx->file.name.len = last - ctx->file.name.data;
+
+		ctx->buf = ngx_create_temp_buf(r->pool, mycf->ingest_buffer);
+		if (ctx->buf == NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_INGEST, mycf->ingest_buffer);
+
+		cln = ngx_pool_cleanup_add(r->pool, 0);
+		if (cln == NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ctx->file.fd = ngx_open_file(ctx->file.name.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+		if (ctx->file.fd == NGX_INVALID_FILE) {
+			ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_open_file_n " \"%s\" failed", ctx->file.name.data);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		cln->handler = ngx_http_mymodule_ingest_cleanup;
+		cln->data = ctx;
+	}
+
+	ngx_http_set_ctx(r, ctx, ngx_http_mymodule_module);
+
+	/* 不缓冲包体，也不写 client_body_temp_path 下的临时文件 */
+	r->request_body_no_buffering = 1;
+
+	rc = ngx_http_read_client_request_body(r, ngx_http_mymodule_ingest_body);
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+		return rc;
+
+	return NGX_DONE;
+}
+
+/* 请求结束时关闭临时文件，没有完整接收的上传删除临时文件 */
+static void ngx_http_mymodule_ingest_cleanup(void *data)
+{
+	ngx_http_mymodule_ingest_t *ctx = data;
+
+	if (ctx->file.fd != NGX_INVALID_FILE) {
+		if (ngx_close_file(ctx->file.fd) == NGX_FILE_ERROR)
+			ngx_log_error(NGX_LOG_ALERT, ctx->file.log, ngx_errno, ngx_close_file_n " \"%s\" failed", ctx->file.name.data);
+
+		ctx->file.fd = NGX_INVALID_FILE;
+	}
+
+	if (!ctx->committed && ngx_delete_file(ctx->file.name.data) == NGX_FILE_ERROR)
+		ngx_log_error(NGX_LOG_CRIT, ctx->file.log, ngx_errno, ngx_delete_file_n " \"%s\" failed", ctx->file.name.data);
+}
+
+/*
+ngx_http_read_client_request_body 的回调。不缓冲模式下读到第一块包体（或者整个包体）时就会调用，
+之后由读事件继续读取
+*/
+static void ngx_http_mymodule_ingest_body(ngx_http_request_t *r)
+{
+	r->read_event_handler = ngx_http_mymodule_ingest_process;
+
+	ngx_http_mymodule_ingest_process(r);
+}
+
+/* 处理已经读到的包体，再继续读，直到客户端暂时没有数据或者包体结束 */
+static void ngx_http_mymodule_ingest_process(ngx_http_request_t *r)
+{
+	ngx_int_t                    rc;
+	ngx_http_mymodule_ingest_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_mymodule_module);
+
+	for ( ;; ) {
+		if (ngx_http_mymodule_ingest_consume(r, ctx) != NGX_OK) {
+			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+			return;
+		}
+
+		if (!r->reading_body)
+			break;
+
+		rc = ngx_http_read_unbuffered_request_body(r);
+		if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+			ngx_http_finalize_request(r, rc);
+			return;
+		}
+
+		/* 客户端暂时没有数据，等下一个读事件 */
+		if (r->request_body->bufs == NULL && r->reading_body)
+			return;
+	}
+
+	ngx_http_finalize_request(r, ngx_http_mymodule_ingest_finish(r, ctx));
+}
+
+/*
+累计 r->request_body->bufs 中新读到的包体的长度和 CRC32，需要保存时复制到写缓冲区，
+处理完的缓冲区标记为已消费，nginx 随后复用它继续读取
+参数：r - 请求
+     ctx - 上传的状态
+返回值：成功 - NGX_OK
+       写文件失败 - NGX_ERROR
+*/
+static ngx_int_t ngx_http_mymodule_ingest_consume(ngx_http_request_t *r, ngx_http_mymodule_ingest_t *ctx)
+{
+	size_t        size, n;
+	u_char       *p;
+	ngx_buf_t    *b;
+	ngx_chain_t  *cl;
+
+	for (cl = r->request_body->bufs; cl; cl = cl->next) {
+		b = cl->buf;
+		p = b->pos;
+		size = b->last - b->pos;
+
+		ngx_crc32_update(&ctx->crc, p, size);
+		ctx->size += size;
+
+		while (ctx->buf && size) {
+			n = ngx_min(size, (size_t) (ctx->buf->end - ctx->buf->last));
+
+			ctx->buf->last = ngx_cpymem(ctx->buf->last, p, n);
+			p += n;
+			size -= n;
+
+			if (ctx->buf->last == ctx->buf->end && ngx_http_mymodule_ingest_flush(r, ctx) != NGX_OK)
+				return NGX_ERROR;
+		}
+
+		b->pos = b->last;
+	}
+
+	r->request_body->bufs = NULL;
+
+	return NGX_OK;
+}
+
+/* 把写缓冲区中的数据追加到临时文件，每次写入 mymodule_ingest_buffer 大小的一整块 */
+static ngx_int_t ngx_http_mymodule_ingest_flush(ngx_http_request_t *r, ngx_http_mymodule_ingest_t *ctx)
+{
+	size_t  size;
+
+	size = ctx->buf->last - ctx->buf->pos;
+
+	if (size == 0)
+		return NGX_OK;
+
+	if (ngx_write_file(&ctx->file, ctx->buf->pos, size, ctx->file.offset) != (ssize_t) size)
+		return NGX_ERROR;
+
+	ctx->buf->pos = ctx->buf->start;
+	ctx->buf->last = ctx->buf->start;
+
+	return NGX_OK;
+}
+
+/*
+包体接收完整后调用。写入剩余的数据并把临时文件改名，然后返回包体的长度和 CRC32
+参数：r - 请求
+     ctx - 上传的状态
+返回值：HTTP响应码或者 Nginx 错误码
+*/
+static ngx_int_t ngx_http_mymodule_ingest_finish(ngx_http_request_t *r, ngx_http_mymodule_ingest_t *ctx)
+{
+	ngx_int_t     rc;
+	ngx_buf_t    *b;
+	ngx_chain_t   out;
+
+	ngx_crc32_final(ctx->crc);
+
+	if (ctx->file.fd != NGX_INVALID_FILE) {
+		if (ngx_http_mymodule_ingest_flush(r, ctx) != NGX_OK)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		if (ngx_rename_file(ctx->file.name.data, ctx->path.data) == NGX_FILE_ERROR) {
+			ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%s\" failed", ctx->file.name.data, ctx->path.data);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		ctx->committed = 1;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mymodule ingest: %O bytes, crc32 %08xD", ctx->size, ctx->crc);
+
+	b = ngx_create_temp_buf(r->pool, sizeof("size: " CRLF "crc32: " CRLF) - 1 + NGX_OFF_T_LEN + 8);
+	if (b == NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_mymodule_pool_profile(r, NGX_HTTP_MYMODULE_POOL_RESPONSE, sizeof("size: " CRLF "crc32: " CRLF) - 1 + NGX_OFF_T_LEN + 8);
+
+	b->last = ngx_sprintf(b->last, "size: %O" CRLF "crc32: %08xD" CRLF, ctx->size, ctx->crc);
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	/* 保存了文件时返回 201 */
+	r->headers_out.status = ctx->committed ? NGX_HTTP_CREATED : NGX_HTTP_OK;
+	r->headers_out.content_length_n = b->last - b->pos;
+	ngx_str_set(&r->headers_out.content_type, "text/plain");
+	r->headers_out.content_type_len = sizeof("text/plain") - 1;
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+		return rc;
+
+	out.buf = b;
+	out.next = NULL;
+
+	return ngx_http_output_filter(r, &out);
+}
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# 编译响应头解析的微基准 myupstream_parser_bench（源码说明见 myupstream_parser_bench.c）。
+# 需要 nginx-1.16.1 源码：用与 bench/run.sh 相同的参数 configure 并 make，之后链接 nginx 的全部目标文件，
+# 但是去掉 myupstream 模块本身（基准程序直接编译模块源码，才能调用其中的 static 函数），
+# nginx.o 中的 main 改名，由基准程序提供 main。
+#
+# 用法：build.sh [-B]
+#   -B 强制重新 configure；环境变量 NGINX_SRC 指定 nginx 源码目录，OUTPUT 指定输出文件
+# 之后运行：module/myupstream/bench/myupstream_parser_bench [-n 次数] [-m 最大读取长度] [录制的响应 ...]
+
+set -e
+
+BENCH_DIR=`cd $(dirname $0); pwd`
+MODULE_DIR=`dirname $BENCH_DIR`
+WORKDIR=`cd $MODULE_DIR/../..; pwd`
+
+NGINX_SRC=${NGINX_SRC:-/root/nginx-1.16.1}
+OUTPUT=${OUTPUT:-$BENCH_DIR/myupstream_parser_bench}
+RECONFIGURE=0
+
+while getopts "B" opt; do
+    case $opt in
+        B) RECONFIGURE=1 ;;
+        *) sed -n '3,10p' $0; exit 1 ;;
+    esac
+done
+
+cd $NGINX_SRC
+
+# 没有 configure 过，或者上次 configure 的不是这份模块源码
+if [ $RECONFIGURE -eq 1 ] || [ ! -f objs/Makefile ] || ! grep -q "$MODULE_DIR" objs/Makefile; then
+    echo "configuring nginx in $NGINX_SRC" >&2
+    ./configure --with-threads \
+                --with-http_v2_module \
+                --add-module=$WORKDIR/module/mymodule \
+                --add-module=$MODULE_DIR > $BENCH_DIR/configure.log 2>&1
+fi
+
+make -j`nproc` > $BENCH_DIR/make.log 2>&1
+
+TMP_DIR=`mktemp -d`
+trap 'rm -rf $TMP_DIR' EXIT
+
+# 取出 objs/Makefile 中的编译器、编译参数和头文件目录
+cat > $TMP_DIR/vars.mk <<EOF
+include objs/Makefile
+print-%:
+	@echo \$(\$*)
+EOF
+
+CC=`make -s -f $TMP_DIR/vars.mk print-CC`
+CFLAGS=`make -s -f $TMP_DIR/vars.mk print-CFLAGS`
+INCS=`make -s -f $TMP_DIR/vars.mk print-ALL_INCS`
+
+# 链接 nginx 时的库：链接命令中除目标文件以外的参数
+LIBS=`awk '/\\$\\(LINK\\) -o objs\\/nginx/ { found = 1; next }
+           found && /^[ \t]*$/ { exit }
+           found { sub(/\\\\$/, ""); if ($1 !~ /^objs\\//) printf "%s ", $0 }' objs/Makefile`
+
+cp objs/src/core/nginx.o $TMP_DIR/nginx.o
+objcopy --redefine-sym main=ngx_nginx_main $TMP_DIR/nginx.o
+
+OBJS=`find objs -name '*.o' ! -path objs/src/core/nginx.o ! -name ngx_http_myupstream_module.o`
+
+$CC $CFLAGS $INCS -I $MODULE_DIR -o $OUTPUT $BENCH_DIR/myupstream_parser_bench.c $OBJS $TMP_DIR/nginx.o $LIBS
+
+echo "built $OUTPUT" >&2
@@ -0,0 +1,855 @@
+/*
+myupstream 响应行和响应头解析的微基准，不启动 nginx，也不需要后端。
+把完整的响应按随机长度切成多段，像 upstream 每收到一段 TCP 流那样依次追加到 u->buffer 并调用 process_header，
+统计每个响应的耗时和内存池分配，并逐个响应与一个独立实现的参考解析比较结果。
+
+编译：module/myupstream/bench/build.sh（需要 nginx-1.16.1 源码，见脚本说明）
+用法：myupstream_parser_bench [-n 次数] [-m 最大读取长度] [-r 随机种子] [-z 0|1] [录制的响应 ...]
+  -n  每个用例解析的次数，缺省 10000
+  -m  每次“读取”的最大字节数，每次在 1 到该值之间随机，缺省 1460；0 表示整个响应一次读完
+  -r  随机种子，缺省 1，相同的种子切分方式相同
+  -z  只测 myupstream_zero_copy_headers 为 off（0）或 on（1）的解析，缺省两种都测
+不指定文件时使用内置的用例：响应头数量 8/16/64 与头部值长度 16/128/1024 的组合，
+以及一个把很长的响应头名字拆在两次读取之间的用例（split-name，切分位置固定，不受 -m 影响）；
+指定文件时每个文件是一个录制的原始响应（响应行、响应头和空行，之后的包体可有可无），比如：
+  printf 'GET /search?q=nginx HTTP/1.1\r\nHost: cn.bing.com\r\nConnection: close\r\n\r\n' | nc cn.bing.com 80 > bing.resp
+每行输出一个用例，耗时包括把每段数据复制进接收缓冲区（相当于 recv 的复制），已扣除计时本身的开销：
+  case headers bytes zero_copy reads ns_mean ns_p50 ns_p99 allocs alloc_bytes
+reads 是平均每个响应调用 process_header 的次数，allocs 和 alloc_bytes 是平均每个响应在内存池中的分配（包括响应头链表扩容）。
+任何一次解析的结果与参考解析不同都会输出差异，进程以 1 退出。
+模块在内存池中的每次分配之后都多留 BENCH_CANARY_LEN 字节并填上固定的内容，每次解析之后检查，
+越界写（比如小写名字的内存算小了）同样报告为差异。内存池的一块内存是一次 malloc 得到的，ASan 发现不了这种越界。
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#define BENCH_CANARY_LEN    16
+#define BENCH_CANARY_BYTE   0xa5
+#define BENCH_CANARY_MAX    1024
+
+/* 解析过程中内存池分配的次数和字节数 */
+static ngx_uint_t  bench_allocs;
+static size_t      bench_alloc_bytes;
+
+/* 本次解析中各次分配之后的保护字节，超过 BENCH_CANARY_MAX 次的分配不再检查 */
+static u_char     *bench_canaries[BENCH_CANARY_MAX];
+static ngx_uint_t  bench_ncanaries;
+
+static void *bench_guard(u_char *p, size_t size) {
+    if (p == NULL) {
+        return NULL;
+    }
+
+    ngx_memset(p + size, BENCH_CANARY_BYTE, BENCH_CANARY_LEN);
+
+    if (bench_ncanaries < BENCH_CANARY_MAX) {
+        bench_canaries[bench_ncanaries++] = p + size;
+    }
+
+    return p;
+}
+
+static void *bench_palloc(ngx_pool_t *pool, size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return bench_guard(ngx_palloc(pool, size + BENCH_CANARY_LEN), size);
+}
+
+static void *bench_pnalloc(ngx_pool_t *pool, size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return bench_guard(ngx_pnalloc(pool, size + BENCH_CANARY_LEN), size);
+}
+
+static void *bench_pcalloc(ngx_pool_t *pool, size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return bench_guard(ngx_pcalloc(pool, size + BENCH_CANARY_LEN), size);
+}
+
+/* 当前部分已满时 ngx_list_push 会从内存池再分配一个部分 */
+static void *bench_list_push(ngx_list_t *l) {
+    if (l->last->nelts == l->nalloc) {
+        bench_allocs++;
+        bench_alloc_bytes += sizeof(ngx_list_part_t) + l->nalloc * l->size;
+    }
+
+    return ngx_list_push(l);
+}
+
+/* 被测的两个函数是 static 的，直接编译模块源码，模块中的分配都经过上面的计数 */
+#define ngx_palloc     bench_palloc
+#define ngx_pnalloc    bench_pnalloc
+#define ngx_pcalloc    bench_pcalloc
+#define ngx_list_push  bench_list_push
+
+#include "ngx_http_myupstream_module.c"
+
+#undef ngx_palloc
+#undef ngx_pnalloc
+#undef ngx_pcalloc
+#undef ngx_list_push
+
+/* 参考解析得到的一个响应头 */
+typedef struct {
+    ngx_str_t               key;
+    ngx_str_t               value;
+} bench_header_t;
+
+/* 一个用例：原始响应和它的参考解析结果 */
+typedef struct {
+    ngx_str_t               name;
+    u_char                 *data;
+    size_t                  len;
+    size_t                  header_len;   /* 响应行和响应头的长度，之后是包体 */
+    size_t                  split;        /* 不为 0 时固定分两次读取，第一次读到这里为止 */
+    ngx_uint_t              status;
+    ngx_str_t               status_line;  /* 状态码和原因短语，同 u->headers_in.status_line */
+    ngx_array_t             headers;      /* bench_header_t */
+    unsigned                has_server:1;
+    unsigned                has_date:1;
+} bench_case_t;
+
+/* 伪造的请求用到的模块配置和内存 */
+typedef struct {
+    ngx_cycle_t                    cycle;      /* 只提供 ngx_cycle->log 和 ngx_cycle->pool */
+    ngx_log_t                      log;
+    ngx_open_file_t                log_file;
+    ngx_connection_t               connection;
+    ngx_pool_t                    *pool;       /* 每次解析前重置 */
+    void                          *ctx[3];
+    void                          *main_conf[3];
+    void                          *loc_conf[3];
+    ngx_http_myupstream_conf_t     mycf;
+    ngx_http_myupstream_main_conf_t  mmcf;
+    ngx_http_core_loc_conf_t       clcf;
+    u_char                        *buffer;     /* 接收缓冲区，u->buffer 指向这里 */
+    size_t                         buffer_size;
+    size_t                        *reads;      /* 本次解析每段的长度 */
+    uint64_t                      *samples;    /* 每次解析的纳秒数 */
+    uint64_t                       rand;
+    uint64_t                       timer_overhead;
+} bench_t;
+
+static ngx_int_t bench_init(bench_t *b, ngx_uint_t n);
+static ngx_int_t bench_generate(bench_case_t *c, ngx_uint_t nheaders, size_t value_len, uint64_t *rand);
+static ngx_int_t bench_generate_split(bench_case_t *c);
+static ngx_int_t bench_load(bench_case_t *c, char *path);
+static ngx_int_t bench_reference(bench_case_t *c);
+static ngx_int_t bench_run(bench_t *b, bench_case_t *c, ngx_uint_t n, size_t max_read, ngx_flag_t zero_copy);
+static ngx_http_request_t *bench_request(bench_t *b);
+static const char *bench_verify(bench_case_t *c, ngx_http_request_t *r, u_char *start, ngx_uint_t *index);
+static const char *bench_check_canaries(void);
+static uint64_t bench_now(void);
+static uint64_t bench_random(uint64_t *state);
+static int bench_cmp(const void *a, const void *b);
+static void bench_usage(void);
+
+int main(int argc, char **argv) {
+    int             opt, failed;
+    size_t          max_read, max_len;
+    uint64_t        seed, rand;
+    ngx_int_t       zero_copy;
+    ngx_uint_t      i, j, k, n, ncases;
+    bench_t         b;
+    bench_case_t   *cases;
+    static ngx_uint_t  nheaders[] = { 8, 16, 64 };
+    static size_t      value_lens[] = { 16, 128, 1024 };
+
+    n = 10000;
+    max_read = 1460;
+    seed = 1;
+    zero_copy = -1;
+
+    while ((opt = getopt(argc, argv, "n:m:r:z:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = (ngx_uint_t) atol(optarg);
+            break;
+        case 'm':
+            max_read = (size_t) atol(optarg);
+            break;
+        case 'r':
+            seed = (uint64_t) atoll(optarg);
+            break;
+        case 'z':
+            zero_copy = atoi(optarg) ? 1 : 0;
+            break;
+        default:
+            bench_usage();
+            return 1;
+        }
+    }
+
+    if (n == 0) {
+        bench_usage();
+        return 1;
+    }
+
+    if (bench_init(&b, n) != NGX_OK) {
+        return 1;
+    }
+
+    rand = seed ? seed : 1;
+
+    if (optind < argc) {
+        ncases = argc - optind;
+    } else {
+        ncases = (sizeof(nheaders) / sizeof(nheaders[0])) * (sizeof(value_lens) / sizeof(value_lens[0])) + 1;
+    }
+
+    cases = ngx_alloc(ncases * sizeof(bench_case_t), &b.log);
+    if (cases == NULL) {
+        return 1;
+    }
+
+    k = 0;
+
+    if (optind < argc) {
+        for (i = 0; i < ncases; i++) {
+            if (bench_load(&cases[k], argv[optind + i]) == NGX_OK) {
+                k++;
+            }
+        }
+
+    } else {
+        for (i = 0; i < sizeof(nheaders) / sizeof(nheaders[0]); i++) {
+            for (j = 0; j < sizeof(value_lens) / sizeof(value_lens[0]); j++) {
+                if (bench_generate(&cases[k], nheaders[i], value_lens[j], &rand) != NGX_OK) {
+                    return 1;
+                }
+
+                k++;
+            }
+        }
+
+        if (bench_generate_split(&cases[k]) != NGX_OK) {
+            return 1;
+        }
+
+        k++;
+    }
+
+    ncases = k;
+    max_len = 0;
+
+    for (i = 0; i < ncases; i++) {
+        max_len = ngx_max(max_len, cases[i].len);
+    }
+
+    b.buffer_size = max_len + 1;
+    b.buffer = ngx_alloc(b.buffer_size, &b.log);
+    b.reads = ngx_alloc((max_len + 1) * sizeof(size_t), &b.log);
+    if (b.buffer == NULL || b.reads == NULL) {
+        return 1;
+    }
+
+    printf("# case headers bytes zero_copy reads ns_mean ns_p50 ns_p99 allocs alloc_bytes\n");
+
+    failed = 0;
+
+    for (i = 0; i < ncases; i++) {
+        for (j = 0; j < 2; j++) {
+            if (zero_copy != -1 && (ngx_int_t) j != zero_copy) {
+                continue;
+            }
+
+            /* 每个用例的切分方式只取决于种子，改动解析代码前后比较的是同样的输入 */
+            b.rand = (seed ? seed : 1) + i;
+
+            if (bench_run(&b, &cases[i], n, max_read, j) != NGX_OK) {
+                failed = 1;
+            }
+        }
+    }
+
+    return failed;
+}
+
+/* 准备伪造请求需要的日志、内存池和配置，upstream 的响应头处理表与 nginx 启动时的构建方式相同 */
+static ngx_int_t bench_init(bench_t *b, ngx_uint_t n) {
+    uint64_t                        t0, t1;
+    ngx_uint_t                      i;
+    ngx_conf_t                      cf;
+    ngx_pool_t                     *pool;
+    ngx_http_module_t              *module;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    ngx_memzero(b, sizeof(bench_t));
+
+    ngx_pagesize = getpagesize();
+    for (i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    ngx_time_init();
+
+    b->log_file.fd = ngx_stderr;
+    b->log.file = &b->log_file;
+    b->log.log_level = NGX_LOG_ERR;
+    b->connection.log = &b->log;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &b->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->cycle.pool = pool;
+    b->cycle.log = &b->log;
+    ngx_cycle = &b->cycle;
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+    cf.cycle = &b->cycle;
+    cf.pool = pool;
+    cf.temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &b->log);
+    cf.log = &b->log;
+
+    if (cf.temp_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    module = ngx_http_upstream_module.ctx;
+
+    umcf = module->create_main_conf(&cf);
+    if (umcf == NULL || module->init_main_conf(&cf, umcf) != NGX_CONF_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_destroy_pool(cf.temp_pool);
+
+    /* 只有这三个模块的配置和上下文会被访问到，其余模块的 ctx_index 保持未设置 */
+    ngx_http_upstream_module.ctx_index = 0;
+    ngx_http_myupstream_module.ctx_index = 1;
+    ngx_http_core_module.ctx_index = 2;
+
+    b->main_conf[0] = umcf;
+    b->main_conf[1] = &b->mmcf;
+    b->loc_conf[1] = &b->mycf;
+    b->loc_conf[2] = &b->clcf;
+
+    b->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &b->log);
+    if (b->pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->samples = ngx_alloc(n * sizeof(uint64_t), &b->log);
+    if (b->samples == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* 两次连续取时间的最小间隔作为计时的开销 */
+    b->timer_overhead = (uint64_t) -1;
+
+    for (i = 0; i < 1000; i++) {
+        t0 = bench_now();
+        t1 = bench_now();
+        b->timer_overhead = ngx_min(b->timer_overhead, t1 - t0);
+    }
+
+    return NGX_OK;
+}
+
+/* 生成一个响应：4 个常见的响应头，其余是值长度为 value_len 的自定义头部，每 4 个中有一个名字超过 32 字节 */
+static ngx_int_t bench_generate(bench_case_t *c, ngx_uint_t nheaders, size_t value_len, uint64_t *rand) {
+    u_char      *p;
+    size_t       len;
+    ngx_uint_t   i, j;
+    static u_char  chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-_=;/ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+    len = sizeof("HTTP/1.1 200 OK" CRLF) - 1
+          + sizeof("Content-Type: text/html; charset=utf-8" CRLF) - 1
+          + sizeof("Content-Length: 5" CRLF) - 1
+          + sizeof("Server: bench" CRLF) - 1
+          + sizeof("Date: Sat, 17 Oct 2026 08:00:00 GMT" CRLF) - 1
+          + nheaders * (sizeof("X-Bench-Very-Long-Header-Name-For-Lowcase-: " CRLF) - 1 + NGX_INT_T_LEN + value_len)
+          + sizeof(CRLF "hello") - 1;
+
+    c->data = ngx_alloc(len, ngx_cycle->log);
+    if (c->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(c->data, "HTTP/1.1 200 OK" CRLF, sizeof("HTTP/1.1 200 OK" CRLF) - 1);
+    p = ngx_cpymem(p, "Content-Type: text/html; charset=utf-8" CRLF, sizeof("Content-Type: text/html; charset=utf-8" CRLF) - 1);
+    p = ngx_cpymem(p, "Content-Length: 5" CRLF, sizeof("Content-Length: 5" CRLF) - 1);
+    p = ngx_cpymem(p, "Server: bench" CRLF, sizeof("Server: bench" CRLF) - 1);
+    p = ngx_cpymem(p, "Date: Sat, 17 Oct 2026 08:00:00 GMT" CRLF, sizeof("Date: Sat, 17 Oct 2026 08:00:00 GMT" CRLF) - 1);
+
+    for (i = 4; i < nheaders; i++) {
+        if (i % 4 == 3) {
+            p = ngx_sprintf(p, "X-Bench-Very-Long-Header-Name-For-Lowcase-%ui: ", i);
+        } else {
+            p = ngx_sprintf(p, "X-Bench-%ui: ", i);
+        }
+
+        for (j = 0; j < value_len; j++) {
+            *p++ = chars[bench_random(rand) % (sizeof(chars) - 1)];
+        }
+
+        *p++ = CR; *p++ = LF;
+    }
+
+    p = ngx_cpymem(p, CRLF "hello", sizeof(CRLF "hello") - 1);
+
+    c->len = p - c->data;
+
+    c->name.data = ngx_alloc(sizeof("generated-h-v") + 2 * NGX_INT_T_LEN, ngx_cycle->log);
+    if (c->name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->name.len = ngx_sprintf(c->name.data, "generated-h%ui-v%uz", nheaders, value_len) - c->name.data;
+    c->split = 0;
+
+    return bench_reference(c);
+}
+
+/*
+生成一个最后一个响应头名字有 200 字节的响应，第一次读取在这个名字的中间结束，第二次读到结尾。
+第二次调用 process_header 时名字的开头已经在 buffer.pos 之前，小写名字的内存必须从名字的开头算起
+*/
+static ngx_int_t bench_generate_split(bench_case_t *c) {
+    u_char  *p, *name;
+    size_t   len;
+
+    len = sizeof("HTTP/1.1 200 OK" CRLF) - 1
+          + sizeof("Content-Length: 0" CRLF) - 1
+          + sizeof("X-Bench-Split-" CRLF) - 1 + 200 + sizeof(": v" CRLF CRLF) - 1;
+
+    c->data = ngx_alloc(len, ngx_cycle->log);
+    if (c->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(c->data, "HTTP/1.1 200 OK" CRLF, sizeof("HTTP/1.1 200 OK" CRLF) - 1);
+    p = ngx_cpymem(p, "Content-Length: 0" CRLF, sizeof("Content-Length: 0" CRLF) - 1);
+
+    name = p;
+    p = ngx_cpymem(p, "X-Bench-Split-", sizeof("X-Bench-Split-") - 1);
+    ngx_memset(p, 'N', 200 - (sizeof("X-Bench-Split-") - 1));
+    p = name + 200;
+    p = ngx_cpymem(p, ": v" CRLF CRLF, sizeof(": v" CRLF CRLF) - 1);
+
+    c->len = p - c->data;
+    c->split = name + 150 - c->data;
+
+    ngx_str_set(&c->name, "generated-split-name");
+
+    return bench_reference(c);
+}
+
+/* 读入一个录制的响应，无法解析的文件跳过 */
+static ngx_int_t bench_load(bench_case_t *c, char *path) {
+    ssize_t          n;
+    ngx_fd_t         fd;
+    ngx_file_info_t  fi;
+
+    fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        fprintf(stderr, "open \"%s\": %s\n", path, strerror(ngx_errno));
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR || ngx_file_size(&fi) == 0) {
+        fprintf(stderr, "\"%s\" is empty\n", path);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    c->len = ngx_file_size(&fi);
+    c->data = ngx_alloc(c->len, ngx_cycle->log);
+    if (c->data == NULL) {
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, c->data, c->len);
+    ngx_close_file(fd);
+
+    if (n != (ssize_t) c->len) {
+        fprintf(stderr, "read \"%s\" failed\n", path);
+        return NGX_ERROR;
+    }
+
+    c->name.data = (u_char *) path;
+    c->name.len = ngx_strlen(path);
+
+    if (bench_reference(c) != NGX_OK) {
+        fprintf(stderr, "\"%s\" is not a complete HTTP response header, skipped\n", path);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+参考解析，逐行切分，不使用 nginx 的状态机：
+响应行取第一个空格之后的状态码和原因短语；响应头按第一个 ':' 分成名字和值，值去掉首尾的空格；
+行尾可以是 CRLF 或者 LF，遇到空行结束
+*/
+static ngx_int_t bench_reference(bench_case_t *c) {
+    u_char          *p, *eol, *end, *colon, *v, *e;
+    ngx_int_t        status;
+    bench_header_t  *h;
+
+    if (ngx_array_init(&c->headers, ngx_cycle->pool, 16, sizeof(bench_header_t)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->has_server = 0;
+    c->has_date = 0;
+
+    p = c->data;
+    end = c->data + c->len;
+
+    eol = ngx_strlchr(p, end, LF);
+    if (eol == NULL || eol - p < (ssize_t) sizeof("HTTP/1.1 200") - 1 || ngx_strncmp(p, "HTTP/", 5) != 0) {
+        return NGX_ERROR;
+    }
+
+    e = (eol > p && eol[-1] == CR) ? eol - 1 : eol;
+
+    v = ngx_strlchr(p, e, ' ');
+    if (v == NULL || e - v < 4) {
+        return NGX_ERROR;
+    }
+
+    v++;
+
+    status = ngx_atoi(v, 3);
+    if (status == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    c->status = status;
+    c->status_line.data = v;
+    c->status_line.len = e - v;
+
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = ngx_strlchr(p, end, LF);
+        if (eol == NULL) {
+            return NGX_ERROR;
+        }
+
+        e = (eol > p && eol[-1] == CR) ? eol - 1 : eol;
+
+        if (e == p) {
+            c->header_len = eol + 1 - c->data;
+            return NGX_OK;
+        }
+
+        colon = ngx_strlchr(p, e, ':');
+        if (colon == NULL || colon == p) {
+            return NGX_ERROR;
+        }
+
+        for (v = colon + 1; v < e && *v == ' '; v++) { /* void */ }
+        while (e > v && e[-1] == ' ') { e--; }
+
+        h = ngx_array_push(&c->headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->key.data = p;
+        h->key.len = colon - p;
+        h->value.data = v;
+        h->value.len = e - v;
+
+        if (h->key.len == sizeof("server") - 1 && ngx_strncasecmp(p, (u_char *) "server", h->key.len) == 0) {
+            c->has_server = 1;
+        }
+
+        if (h->key.len == sizeof("date") - 1 && ngx_strncasecmp(p, (u_char *) "date", h->key.len) == 0) {
+            c->has_date = 1;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+/* 解析一个用例 n 次，输出一行统计；解析结果与参考解析不同时输出第一处差异 */
+static ngx_int_t bench_run(bench_t *b, bench_case_t *c, ngx_uint_t n, size_t max_read, ngx_flag_t zero_copy) {
+    size_t               off, len, nreads, total_reads, total_bytes;
+    uint64_t             t0, t1, sum;
+    ngx_int_t            rc;
+    ngx_uint_t           i, k, index, total_allocs;
+    const char          *err;
+    ngx_http_request_t  *r;
+    ngx_http_upstream_t *u;
+
+    b->mycf.zero_copy_headers = zero_copy;
+
+    sum = 0;
+    total_reads = 0;
+    total_allocs = 0;
+    total_bytes = 0;
+
+    for (i = 0; i < n; i++) {
+        /* 预先决定每段的长度，随机数不计入耗时 */
+        nreads = 0;
+
+        for (off = 0; off < c->len; off += len) {
+            len = max_read ? 1 + bench_random(&b->rand) % max_read : c->len;
+
+            if (c->split) {
+                len = off ? c->len - off : c->split;
+            }
+
+            len = ngx_min(len, c->len - off);
+            b->reads[nreads++] = len;
+        }
+
+        r = bench_request(b);
+        if (r == NULL) {
+            return NGX_ERROR;
+        }
+
+        u = r->upstream;
+
+        bench_allocs = 0;
+        bench_alloc_bytes = 0;
+        bench_ncanaries = 0;
+
+        rc = NGX_AGAIN;
+        off = 0;
+        k = 0;
+
+        t0 = bench_now();
+
+        while (rc == NGX_AGAIN && k < nreads) {
+            u->buffer.last = ngx_cpymem(u->buffer.last, c->data + off, b->reads[k]);
+            off += b->reads[k++];
+
+            rc = u->process_header(r);
+        }
+
+        t1 = bench_now();
+
+        b->samples[i] = (t1 - t0 > b->timer_overhead) ? t1 - t0 - b->timer_overhead : 0;
+        sum += b->samples[i];
+        total_reads += k;
+        total_allocs += bench_allocs;
+        total_bytes += bench_alloc_bytes;
+
+        index = 0;
+        err = bench_check_canaries();
+
+        if (err == NULL) {
+            err = (rc == NGX_OK) ? bench_verify(c, r, b->buffer, &index) : "parser did not return NGX_OK";
+        }
+
+        if (err) {
+            fprintf(stderr, "%.*s zero_copy=%d iteration %lu: %s (rc=%ld, header %lu, %lu reads)\n",
+                    (int) c->name.len, c->name.data, (int) zero_copy, (unsigned long) i, err,
+                    (long) rc, (unsigned long) index, (unsigned long) k);
+            return NGX_ERROR;
+        }
+    }
+
+    qsort(b->samples, n, sizeof(uint64_t), bench_cmp);
+
+    printf("%.*s %lu %lu %d %.1f %.1f %lu %lu %.1f %.1f\n",
+           (int) c->name.len, c->name.data, (unsigned long) c->headers.nelts, (unsigned long) c->header_len, (int) zero_copy,
+           (double) total_reads / n, (double) sum / n,
+           (unsigned long) b->samples[n / 2], (unsigned long) b->samples[n * 99 / 100],
+           (double) total_allocs / n, (double) total_bytes / n);
+
+    return NGX_OK;
+}
+
+/* 在重置过的内存池中伪造一个刚连上后端、还没有收到响应的请求，与 ngx_http_upstream_process_header 第一次调用前的状态相同 */
+static ngx_http_request_t *bench_request(bench_t *b) {
+    ngx_http_request_t         *r;
+    ngx_http_upstream_t        *u;
+    ngx_http_myupstream_ctx_t  *ctx;
+
+    ngx_reset_pool(b->pool);
+
+    r = ngx_pcalloc(b->pool, sizeof(ngx_http_request_t));
+    u = ngx_pcalloc(b->pool, sizeof(ngx_http_upstream_t));
+    ctx = ngx_pcalloc(b->pool, sizeof(ngx_http_myupstream_ctx_t));
+
+    if (r == NULL || u == NULL || ctx == NULL) {
+        return NULL;
+    }
+
+    u->state = ngx_pcalloc(b->pool, sizeof(ngx_http_upstream_state_t));
+    if (u->state == NULL) {
+        return NULL;
+    }
+
+    if (ngx_list_init(&u->headers_in.headers, b->pool, 8, sizeof(ngx_table_elt_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
+    u->conf = &b->mycf.upstream;
+    u->process_header = myupstream_process_status_line;
+
+    u->buffer.start = b->buffer;
+    u->buffer.pos = b->buffer;
+    u->buffer.last = b->buffer;
+    u->buffer.end = b->buffer + b->buffer_size;
+    u->buffer.temporary = 1;
+
+    b->ctx[1] = ctx;
+
+    r->pool = b->pool;
+    r->connection = &b->connection;
+    r->main = r;
+    r->upstream = u;
+    r->ctx = b->ctx;
+    r->main_conf = b->main_conf;
+    r->loc_conf = b->loc_conf;
+
+    return r;
+}
+
+/*
+比较解析结果和参考解析：状态码、响应头的名字、值、小写名字和哈希值逐个相同，
+没有 Server 和 Date 时各补一个空的，包体从响应头之后开始
+返回值：NULL - 相同，否则是差异的说明，*index 为出错的响应头序号
+*/
+static const char *bench_verify(bench_case_t *c, ngx_http_request_t *r, u_char *start, ngx_uint_t *index) {
+    ngx_uint_t         i, j, k, extra;
+    ngx_list_part_t   *part;
+    ngx_table_elt_t   *h;
+    bench_header_t    *ref;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+    ref = c->headers.elts;
+    *index = 0;
+
+    if (u->headers_in.status_n != c->status) {
+        return "status code differs";
+    }
+
+    if (u->headers_in.status_line.len != c->status_line.len
+        || ngx_strncmp(u->headers_in.status_line.data, c->status_line.data, c->status_line.len) != 0)
+    {
+        return "status line differs";
+    }
+
+    if (u->buffer.pos != start + c->header_len) {
+        return "body does not start right after the header";
+    }
+
+    extra = 0;
+    i = 0;
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (j = 0; /* void */ ; j++) {
+
+        if (j >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            j = 0;
+        }
+
+        *index = i;
+
+        if (i >= c->headers.nelts) {
+            /* 解析完成后补上的 Server 和 Date */
+            if (h[j].value.len != 0
+                || !((h[j].key.len == sizeof("Server") - 1 && !c->has_server && ngx_strncmp(h[j].key.data, "Server", h[j].key.len) == 0)
+                     || (h[j].key.len == sizeof("Date") - 1 && !c->has_date && ngx_strncmp(h[j].key.data, "Date", h[j].key.len) == 0)))
+            {
+                return "unexpected extra header";
+            }
+
+            extra++;
+            i++;
+            continue;
+        }
+
+        if (h[j].key.len != ref[i].key.len || ngx_strncmp(h[j].key.data, ref[i].key.data, ref[i].key.len) != 0) {
+            return "header name differs";
+        }
+
+        if (h[j].value.len != ref[i].value.len || ngx_strncmp(h[j].value.data, ref[i].value.data, ref[i].value.len) != 0) {
+            return "header value differs";
+        }
+
+        if (h[j].key.data[h[j].key.len] != '\0' || h[j].value.data[h[j].value.len] != '\0') {
+            return "header is not null-terminated";
+        }
+
+        for (k = 0; k < ref[i].key.len; k++) {
+            if (h[j].lowcase_key[k] != ngx_tolower(ref[i].key.data[k])) {
+                return "lowercase header name differs";
+            }
+        }
+
+        if (h[j].hash != ngx_hash_key_lc(ref[i].key.data, ref[i].key.len)) {
+            return "header hash differs";
+        }
+
+        i++;
+    }
+
+    *index = i;
+
+    if (i < c->headers.nelts) {
+        return "missing headers";
+    }
+
+    if (extra != (ngx_uint_t) (!c->has_server + !c->has_date)) {
+        return "missing default Server or Date header";
+    }
+
+    return NULL;
+}
+
+/* 检查本次解析中每次分配之后的保护字节 */
+static const char *bench_check_canaries(void) {
+    ngx_uint_t  i, j;
+
+    for (i = 0; i < bench_ncanaries; i++) {
+        for (j = 0; j < BENCH_CANARY_LEN; j++) {
+            if (bench_canaries[i][j] != BENCH_CANARY_BYTE) {
+                return "write past the end of a pool allocation";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t bench_now(void) {
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64，保证同一个种子在不同机器上切分方式相同 */
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t  x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t  x = *(const uint64_t *) a;
+    uint64_t  y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_usage(void) {
+    fprintf(stderr, "usage: myupstream_parser_bench [-n iterations] [-m max_read] [-r seed] [-z 0|1] [response ...]\n");
+}
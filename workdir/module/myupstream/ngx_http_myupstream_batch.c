@@ -0,0 +1,925 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 后端没有给出 Content-Length 时，接收批量响应的缓冲区的初始大小，不够时翻倍 */
+#define NGX_HTTP_MYUPSTREAM_BATCH_BUFFER        16384
+/* 批量响应的最大长度，超出时整批失败 */
+#define NGX_HTTP_MYUPSTREAM_BATCH_MAX_RESPONSE  (16 * 1024 * 1024)
+
+/* 每个 worker 中一个 location 正在收集请求的批次，挂在 location 配置上 */
+struct ngx_http_myupstream_batch_queue_s {
+    ngx_http_myupstream_batch_t            *open;
+};
+
+/*
+一个批次，分配在自己的内存池中。收集请求时不属于任何一个请求；
+发出后由第一个请求（carrier）的后台子请求访问后端，子请求结束时把响应分给等待的请求，然后销毁
+*/
+struct ngx_http_myupstream_batch_s {
+    ngx_pool_t                             *pool;
+    ngx_http_myupstream_conf_t             *conf;
+
+    ngx_queue_t                             members;     /* 收集中的请求 */
+    ngx_uint_t                              n;
+    ngx_event_t                             timer;       /* 收集窗口，到期或者收满后发出 */
+
+    ngx_http_myupstream_batch_member_t    **slots;       /* 发出后第 i 行参数对应的请求，请求离开后置为 NULL */
+    ngx_uint_t                              nslots;
+    ngx_str_t                               body;        /* 发往后端的请求包体，每行一个参数 */
+    ngx_buf_t                              *response;    /* 收到的响应包体 */
+
+    ngx_http_request_t                     *carrier;     /* 发出子请求的请求，子请求共用它的连接和内存池 */
+    ngx_pool_cleanup_t                     *cleanup;     /* 注册在 carrier 的内存池上，子请求没有正常结束时兜底 */
+
+    unsigned                                sent:1;
+    unsigned                                overflow:1;  /* 响应超出了 NGX_HTTP_MYUPSTREAM_BATCH_MAX_RESPONSE */
+};
+
+/* 每个请求的批量状态，从请求内存池中分配 */
+struct ngx_http_myupstream_batch_member_s {
+    ngx_http_request_t                     *request;
+    ngx_http_myupstream_batch_t            *batch;       /* 所在的批次，不在批次中时为 NULL */
+    ngx_queue_t                             queue;       /* 在 batch->members 中的位置 */
+    ngx_uint_t                              slot;
+    ngx_event_t                             timer;       /* 最后期限 */
+    ngx_msec_t                              start;       /* 进入 myupstream 的时间，重新加入批次时不重置 */
+    ngx_msec_t                              wait;        /* 等到批次发出用的时间 */
+
+    ngx_int_t                               rc;          /* carrier 推迟结束时保存的结果 */
+    ngx_uint_t                              result;
+
+    unsigned                                sent:1;      /* 所在的批次已经发出 */
+    unsigned                                deferred:1;  /* carrier 等待子请求释放引用后结束 */
+};
+
+static ngx_http_myupstream_batch_t *ngx_http_myupstream_batch_create(ngx_http_myupstream_conf_t *mycf);
+static void ngx_http_myupstream_batch_destroy(ngx_http_myupstream_batch_t *b);
+static ngx_http_myupstream_batch_member_t *ngx_http_myupstream_batch_member_create(ngx_http_request_t *r);
+static void ngx_http_myupstream_batch_member_cleanup(void *data);
+static void ngx_http_myupstream_batch_leave(ngx_http_myupstream_batch_member_t *m);
+static void ngx_http_myupstream_batch_deadline(ngx_event_t *ev);
+static void ngx_http_myupstream_batch_send(ngx_event_t *ev);
+static ngx_int_t ngx_http_myupstream_batch_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static void ngx_http_myupstream_batch_carrier_cleanup(void *data);
+static void ngx_http_myupstream_batch_split(ngx_http_myupstream_batch_t *b, ngx_http_request_t *sr);
+static u_char *ngx_http_myupstream_batch_parse(u_char *p, u_char *last, ngx_uint_t *status, size_t *len);
+static ngx_int_t ngx_http_myupstream_batch_output(ngx_http_request_t *r, ngx_uint_t status, u_char *pos, size_t len, ngx_str_t *content_type);
+static void ngx_http_myupstream_batch_fail(ngx_http_myupstream_batch_t *b, ngx_int_t rc);
+static void ngx_http_myupstream_batch_requeue(ngx_http_myupstream_batch_t *b);
+static void ngx_http_myupstream_batch_complete(ngx_http_myupstream_batch_t *b, ngx_http_myupstream_batch_member_t *m, ngx_int_t rc, ngx_uint_t result);
+static void ngx_http_myupstream_batch_carrier_handler(ngx_http_request_t *r);
+static void ngx_http_myupstream_batch_finish(ngx_http_myupstream_batch_member_t *m, ngx_int_t rc, ngx_uint_t result);
+
+/*
+myupstream_batch 配置项的回调函数。window 内到达的 GET 请求合成一个批量请求，以 POST uri 发往后端，
+包体每行一个请求的参数；一批最多 size 个请求，每个请求从进入 myupstream 起最多等待 timeout
+格式：myupstream_batch uri [window=time] [size=N] [timeout=time] | off;
+*/
+char *ngx_http_myupstream_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s;
+    ngx_uint_t                  i;
+
+    if (mycf->batch_size != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mycf->batch_size = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].data[0] != '/') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid batch uri \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mycf->batch_uri = value[1];
+    mycf->batch_window = 2;
+    mycf->batch_size = 16;
+    mycf->batch_timeout = 1000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            mycf->batch_window = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n == NGX_ERROR || n == 0 || n > NGX_HTTP_MYUPSTREAM_BATCH_MAX_SIZE) {
+                goto invalid;
+            }
+
+            mycf->batch_size = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            mycf->batch_timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/* 每个 worker 中每个配置了 myupstream_batch 的 location 一个收集队列 */
+ngx_http_myupstream_batch_queue_t *ngx_http_myupstream_batch_init(ngx_conf_t *cf) {
+    return ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_batch_queue_t));
+}
+
+/*
+请求进入 myupstream 之后调用，加入本 worker 中正在收集的批次。
+批次在第一个请求加入 window 之后或者收满 size 个请求时发出
+参数：r - 请求，myupstream 上下文必须已经创建
+返回值：NGX_DECLINED - 本请求不参与批量，单独访问后端
+       NGX_DONE - 本请求在等待批量响应，已经增加了引用计数
+       NGX_ERROR - 内存不足
+*/
+ngx_int_t ngx_http_myupstream_batch_join(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t           *myctx;
+    ngx_http_myupstream_conf_t          *mycf;
+    ngx_http_myupstream_batch_t         *b;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    /* 只批量 GET 请求；发送批量请求的子请求本身也不参与 */
+    if (r != r->main || r->method != NGX_HTTP_GET) {
+        return NGX_DECLINED;
+    }
+
+    m = myctx->batch;
+
+    if (m == NULL) {
+        m = ngx_http_myupstream_batch_member_create(r);
+        if (m == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    b = mycf->batch_queue->open;
+
+    if (b == NULL) {
+        b = ngx_http_myupstream_batch_create(mycf);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        mycf->batch_queue->open = b;
+        ngx_add_timer(&b->timer, mycf->batch_window);
+    }
+
+    ngx_queue_insert_tail(&b->members, &m->queue);
+    b->n++;
+
+    m->batch = b;
+    m->sent = 0;
+
+    /* 收满后立即发出。子请求要由批次中的第一个请求创建，不一定是当前请求，所以放到 posted 事件中发送 */
+    if (b->n >= mycf->batch_size) {
+        mycf->batch_queue->open = NULL;
+
+        if (b->timer.timer_set) {
+            ngx_del_timer(&b->timer);
+        }
+
+        ngx_post_event(&b->timer, &ngx_posted_events);
+    }
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/*
+发送批量请求的子请求创建 upstream 请求时调用，生成 POST 请求，包体每行一个参数
+参数：r - 发送批量请求的子请求
+返回值：成功 - 完整的请求缓冲区
+       失败 - NULL
+*/
+ngx_buf_t *ngx_http_myupstream_batch_render(ngx_http_request_t *r) {
+    size_t                        len;
+    ngx_buf_t                    *buf;
+    ngx_http_myupstream_ctx_t    *myctx;
+    ngx_http_myupstream_conf_t   *mycf;
+    ngx_http_myupstream_batch_t  *b;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    b = myctx->batch_call;
+
+    len = sizeof("POST  HTTP/1.1" CRLF) - 1 + mycf->batch_uri.len
+          + sizeof("Host: " CRLF) - 1 + mycf->host.len
+          + sizeof("Content-Type: text/plain" CRLF) - 1
+          + sizeof("Content-Length: " CRLF) - 1 + NGX_SIZE_T_LEN
+          + sizeof("Connection: close" CRLF) - 1
+          + sizeof(CRLF) - 1 + b->body.len;
+
+    buf = ngx_create_temp_buf(r->pool, len);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_REQUEST, len);
+
+    buf->last = ngx_sprintf(buf->last, "POST %V HTTP/1.1" CRLF "Host: %V" CRLF "Content-Type: text/plain" CRLF "Content-Length: %uz" CRLF,
+                            &mycf->batch_uri, &mycf->host, b->body.len);
+
+    /* 与请求模板一样，使用长连接时不带 Connection 头部 */
+    if (!mycf->keepalive) {
+        buf->last = ngx_cpymem(buf->last, "Connection: close" CRLF, sizeof("Connection: close" CRLF) - 1);
+    }
+
+    *buf->last++ = CR; *buf->last++ = LF;
+
+    buf->last = ngx_cpymem(buf->last, b->body.data, b->body.len);
+
+    return buf;
+}
+
+/*
+发送批量请求的子请求收到一段包体时调用，复制到批次的缓冲区中，子请求结束后再拆分
+参数：r - 发送批量请求的子请求
+     pos, len - 收到的包体
+*/
+void ngx_http_myupstream_batch_capture(ngx_http_request_t *r, u_char *pos, size_t len) {
+    size_t                        used, size;
+    ngx_buf_t                    *buf, *nb;
+    ngx_http_myupstream_ctx_t    *myctx;
+    ngx_http_myupstream_batch_t  *b;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    b = myctx->batch_call;
+
+    if (b == NULL || b->overflow || len == 0) {
+        return;
+    }
+
+    buf = b->response;
+    used = buf ? (size_t) (buf->last - buf->pos) : 0;
+
+    if (used + len > NGX_HTTP_MYUPSTREAM_BATCH_MAX_RESPONSE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "myupstream: batch response is larger than %d bytes", NGX_HTTP_MYUPSTREAM_BATCH_MAX_RESPONSE);
+        b->overflow = 1;
+        return;
+    }
+
+    if (buf == NULL || (size_t) (buf->end - buf->last) < len) {
+
+        if (buf) {
+            size = 2 * (buf->end - buf->start);
+
+        } else if (r->upstream->headers_in.content_length_n > 0) {
+            size = (size_t) ngx_min(r->upstream->headers_in.content_length_n, NGX_HTTP_MYUPSTREAM_BATCH_MAX_RESPONSE);
+
+        } else {
+            size = NGX_HTTP_MYUPSTREAM_BATCH_BUFFER;
+        }
+
+        while (size < used + len) {
+            size *= 2;
+        }
+
+        size = ngx_min(size, NGX_HTTP_MYUPSTREAM_BATCH_MAX_RESPONSE);
+
+        nb = ngx_create_temp_buf(b->pool, size);
+        if (nb == NULL) {
+            b->overflow = 1;
+            return;
+        }
+
+        if (buf) {
+            nb->last = ngx_cpymem(nb->last, buf->pos, used);
+            ngx_pfree(b->pool, buf->start);
+        }
+
+        b->response = buf = nb;
+    }
+
+    buf->last = ngx_cpymem(buf->last, pos, len);
+}
+
+/* $myupstream_batch_size：本请求所在批次实际包含的请求数 */
+ngx_int_t ngx_http_myupstream_batch_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char                     *p;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx == NULL || myctx->batch_size == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", myctx->batch_size) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/* 创建一个空的批次 */
+static ngx_http_myupstream_batch_t *ngx_http_myupstream_batch_create(ngx_http_myupstream_conf_t *mycf) {
+    ngx_pool_t                   *pool;
+    ngx_http_myupstream_batch_t  *b;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    b = ngx_pcalloc(pool, sizeof(ngx_http_myupstream_batch_t));
+    if (b == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    b->pool = pool;
+    b->conf = mycf;
+
+    ngx_queue_init(&b->members);
+
+    b->timer.handler = ngx_http_myupstream_batch_send;
+    b->timer.data = b;
+    b->timer.log = ngx_cycle->log;
+
+    return b;
+}
+
+static void ngx_http_myupstream_batch_destroy(ngx_http_myupstream_batch_t *b) {
+    if (b->timer.timer_set) {
+        ngx_del_timer(&b->timer);
+    }
+
+    if (b->timer.posted) {
+        ngx_delete_posted_event(&b->timer);
+    }
+
+    if (b->conf->batch_queue->open == b) {
+        b->conf->batch_queue->open = NULL;
+    }
+
+    ngx_destroy_pool(b->pool);
+}
+
+/* 第一次加入批次时创建批量状态，注册请求销毁时的清理函数，并开始计算最后期限 */
+static ngx_http_myupstream_batch_member_t *ngx_http_myupstream_batch_member_create(ngx_http_request_t *r) {
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_myupstream_ctx_t           *myctx;
+    ngx_http_myupstream_conf_t          *mycf;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    m = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_batch_member_t));
+    if (m == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    m->request = r;
+    m->start = ngx_current_msec;
+
+    m->timer.handler = ngx_http_myupstream_batch_deadline;
+    m->timer.data = m;
+    m->timer.log = r->connection->log;
+
+    cln->handler = ngx_http_myupstream_batch_member_cleanup;
+    cln->data = m;
+
+    myctx->batch = m;
+
+    ngx_add_timer(&m->timer, mycf->batch_timeout);
+
+    return m;
+}
+
+/* 请求销毁时离开批次 */
+static void ngx_http_myupstream_batch_member_cleanup(void *data) {
+    ngx_http_myupstream_batch_member_t  *m = data;
+
+    if (m->timer.timer_set) {
+        ngx_del_timer(&m->timer);
+    }
+
+    ngx_http_myupstream_batch_leave(m);
+}
+
+/*
+请求离开所在的批次。还在收集的批次没有请求后直接销毁；
+已经发出的批次只清空对应的位置，响应中的这一部分随后被丢弃
+*/
+static void ngx_http_myupstream_batch_leave(ngx_http_myupstream_batch_member_t *m) {
+    ngx_http_myupstream_batch_t  *b = m->batch;
+
+    if (b == NULL) {
+        return;
+    }
+
+    m->batch = NULL;
+
+    if (m->sent) {
+        b->slots[m->slot] = NULL;
+        return;
+    }
+
+    ngx_queue_remove(&m->queue);
+    b->n--;
+
+    if (b->n == 0 && !b->sent) {
+        ngx_http_myupstream_batch_destroy(b);
+    }
+}
+
+/* 最后期限的定时器回调，还没有拿到结果的请求返回504 */
+static void ngx_http_myupstream_batch_deadline(ngx_event_t *ev) {
+    ngx_connection_t                    *c;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    m = ev->data;
+    c = m->request->connection;
+
+    ngx_log_error(NGX_LOG_WARN, c->log, 0, "myupstream: batched request timed out after %M ms", ngx_current_msec - m->start);
+
+    ngx_http_myupstream_batch_finish(m, NGX_HTTP_GATEWAY_TIME_OUT, NGX_HTTP_MYUPSTREAM_BATCH_TIMEOUT);
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+收集窗口到期或者批次收满后调用，拼出每行一个参数的请求包体，由第一个请求发出后台子请求访问后端。
+子请求经过同一个 location，在 handler 中跳过批量阶段，结束时由 ngx_http_myupstream_batch_done 拆分响应
+*/
+static void ngx_http_myupstream_batch_send(ngx_event_t *ev) {
+    size_t                               len;
+    u_char                              *p;
+    ngx_uint_t                           i;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_request_t                  *r, *sr;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_post_subrequest_t          *ps;
+    ngx_http_myupstream_ctx_t           *myctx, *sctx;
+    ngx_http_myupstream_batch_t         *b;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    b = ev->data;
+    b->sent = 1;
+
+    if (b->conf->batch_queue->open == b) {
+        b->conf->batch_queue->open = NULL;
+    }
+
+    len = 0;
+
+    for (q = ngx_queue_head(&b->members); q != ngx_queue_sentinel(&b->members); q = ngx_queue_next(q)) {
+        m = ngx_queue_data(q, ngx_http_myupstream_batch_member_t, queue);
+        len += m->request->args.len + 1;
+    }
+
+    b->slots = ngx_palloc(b->pool, b->n * sizeof(ngx_http_myupstream_batch_member_t *));
+    b->body.data = ngx_pnalloc(b->pool, len);
+
+    if (b->slots == NULL || b->body.data == NULL) {
+        goto failed;
+    }
+
+    p = b->body.data;
+
+    for (i = 0; !ngx_queue_empty(&b->members); i++) {
+        q = ngx_queue_head(&b->members);
+        ngx_queue_remove(q);
+
+        m = ngx_queue_data(q, ngx_http_myupstream_batch_member_t, queue);
+        m->sent = 1;
+        m->slot = i;
+        m->wait = ngx_current_msec - m->start;
+
+        myctx = ngx_http_get_module_ctx(m->request, ngx_http_myupstream_module);
+        myctx->batch_size = b->n;
+
+        b->slots[i] = m;
+
+        p = ngx_cpymem(p, m->request->args.data, m->request->args.len);
+        *p++ = LF;
+    }
+
+    b->nslots = i;
+    b->body.len = p - b->body.data;
+
+    if (b->conf->metrics_zone) {
+        ngx_http_myupstream_metrics_batch(b->conf->metrics_zone, b->nslots);
+    }
+
+    r = b->slots[0]->request;
+    c = r->connection;
+
+    sctx = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_ctx_t));
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+
+    if (sctx == NULL || ps == NULL || cln == NULL) {
+        goto failed;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_CTX, sizeof(ngx_http_myupstream_ctx_t));
+
+    ps->handler = ngx_http_myupstream_batch_done;
+    ps->data = b;
+
+    if (ngx_http_subrequest(r, &r->uri, NULL, &sr, ps, NGX_HTTP_SUBREQUEST_CLONE|NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK) {
+        goto failed;
+    }
+
+    sctx->batch_call = b;
+    ngx_http_set_ctx(sr, sctx, ngx_http_myupstream_module);
+
+    cln->handler = ngx_http_myupstream_batch_carrier_cleanup;
+    cln->data = b;
+
+    b->carrier = r;
+    b->cleanup = cln;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "myupstream batch: %ui requests, %uz bytes", b->nslots, b->body.len);
+
+    ngx_http_run_posted_requests(c);
+    return;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, ev->log, 0, "myupstream: failed to send a batch of %ui requests", b->n);
+
+    ngx_http_myupstream_batch_fail(b, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    ngx_http_myupstream_batch_destroy(b);
+}
+
+/*
+发送批量请求的子请求结束时调用（post_subrequest），拆分响应交给等待的请求。
+批量请求失败时所有请求一起失败；carrier 的客户端断开导致子请求结束时，其他请求重新加入批次
+参数：r - 子请求
+     data - 批次
+     rc - 子请求结束的原因
+返回值：rc，子请求照常结束
+*/
+static ngx_int_t ngx_http_myupstream_batch_done(ngx_http_request_t *r, void *data, ngx_int_t rc) {
+    ngx_uint_t                    status;
+    ngx_http_myupstream_ctx_t    *myctx;
+    ngx_http_myupstream_batch_t  *b = data;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    /* 同一个子请求可能不止一次结束，只处理第一次 */
+    r->post_subrequest = NULL;
+    myctx->batch_call = NULL;
+    b->cleanup->handler = NULL;
+
+    status = r->upstream ? r->upstream->headers_in.status_n : 0;
+
+    if (rc == NGX_OK && status == NGX_HTTP_OK && !b->overflow) {
+        ngx_http_myupstream_batch_split(b, r);
+
+    } else if (rc == NGX_HTTP_CLIENT_CLOSED_REQUEST || r->connection->error) {
+        ngx_http_myupstream_batch_requeue(b);
+
+    } else {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "myupstream: batch of %ui requests failed, rc:%i, status:%ui", b->nslots, rc, status);
+
+        ngx_http_myupstream_batch_fail(b, rc >= NGX_HTTP_SPECIAL_RESPONSE ? rc : NGX_HTTP_BAD_GATEWAY);
+    }
+
+    ngx_http_myupstream_batch_destroy(b);
+
+    return rc;
+}
+
+/* 子请求没有经过 post_subrequest 就随 carrier 一起销毁了，carrier 正在销毁，只让其他请求重新加入批次 */
+static void ngx_http_myupstream_batch_carrier_cleanup(void *data) {
+    ngx_uint_t                    i;
+    ngx_http_myupstream_batch_t  *b = data;
+
+    for (i = 0; i < b->nslots; i++) {
+        if (b->slots[i] && b->slots[i]->request == b->carrier) {
+            ngx_http_myupstream_batch_leave(b->slots[i]);
+        }
+    }
+
+    ngx_http_myupstream_batch_requeue(b);
+    ngx_http_myupstream_batch_destroy(b);
+}
+
+/*
+按 "<status> <length>" CRLF 加 length 字节包体的格式，依次把批量响应的每一部分交给对应的请求。
+缺少的部分和格式错误之后的部分返回502，多出的部分忽略
+*/
+static void ngx_http_myupstream_batch_split(ngx_http_myupstream_batch_t *b, ngx_http_request_t *sr) {
+    size_t                               len;
+    u_char                              *p, *last, *pos;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, status;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    p = b->response ? b->response->pos : NULL;
+    last = b->response ? b->response->last : NULL;
+
+    for (i = 0; i < b->nslots; i++) {
+
+        pos = p ? ngx_http_myupstream_batch_parse(p, last, &status, &len) : NULL;
+
+        if (pos == NULL && p) {
+            ngx_log_error(NGX_LOG_ERR, sr->connection->log, 0, "myupstream: invalid batch response at part %ui of %ui", i + 1, b->nslots);
+        }
+
+        p = pos ? pos + len : NULL;
+
+        m = b->slots[i];
+
+        if (m == NULL) {
+            continue;
+        }
+
+        if (pos == NULL) {
+            ngx_http_myupstream_batch_complete(b, m, NGX_HTTP_BAD_GATEWAY, NGX_HTTP_MYUPSTREAM_BATCH_FAILED);
+            continue;
+        }
+
+        rc = ngx_http_myupstream_batch_output(m->request, status, pos, len, &sr->headers_out.content_type);
+
+        ngx_http_myupstream_batch_complete(b, m, rc, NGX_HTTP_MYUPSTREAM_BATCH_OK);
+    }
+}
+
+/*
+解析批量响应中一部分的头部 "<status> <length>" CRLF，也接受单独的 LF
+参数：p, last - 剩余的响应
+     status, len - 输出，这一部分的状态码和包体长度
+返回值：这一部分包体的起始位置，格式错误或者数据不完整时返回 NULL
+*/
+static u_char *ngx_http_myupstream_batch_parse(u_char *p, u_char *last, ngx_uint_t *status, size_t *len) {
+    u_char     *start;
+    ssize_t     size;
+    ngx_int_t   n;
+
+    for (start = p; p < last && *p >= '0' && *p <= '9'; p++) { /* void */ }
+
+    n = ngx_atoi(start, p - start);
+
+    if (n < NGX_HTTP_OK || n > 599 || p == last || *p != ' ') {
+        return NULL;
+    }
+
+    for (start = ++p; p < last && *p >= '0' && *p <= '9'; p++) { /* void */ }
+
+    size = ngx_atosz(start, p - start);
+
+    if (size == NGX_ERROR) {
+        return NULL;
+    }
+
+    if (p < last && *p == CR) {
+        p++;
+    }
+
+    if (p == last || *p != LF) {
+        return NULL;
+    }
+
+    p++;
+
+    if (last - p < size) {
+        return NULL;
+    }
+
+    *status = n;
+    *len = size;
+
+    return p;
+}
+
+/*
+把批量响应中的一部分作为请求的响应发出
+参数：r - 等待的请求
+     status - 这一部分的状态码
+     pos, len - 这一部分的包体，在批次的内存池中，要复制到请求的内存池
+     content_type - 批量响应的 Content-Type，每一部分都使用它
+返回值：交给 ngx_http_finalize_request 的返回值
+*/
+static ngx_int_t ngx_http_myupstream_batch_output(ngx_http_request_t *r, ngx_uint_t status, u_char *pos, size_t len, ngx_str_t *content_type) {
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    /* 没有包体的错误响应使用 nginx 的错误页面 */
+    if (len == 0 && status >= NGX_HTTP_BAD_REQUEST) {
+        return status;
+    }
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = len;
+
+    if (content_type->len) {
+        r->headers_out.content_type.data = ngx_pstrdup(r->pool, content_type);
+        if (r->headers_out.content_type.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        r->headers_out.content_type.len = content_type->len;
+        r->headers_out.content_type_len = content_type->len;
+    }
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (len) {
+        b = ngx_create_temp_buf(r->pool, len);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->last = ngx_cpymem(b->last, pos, len);
+
+    } else {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* 批次中所有还在等待的请求以 rc 结束，包括还没有发出时就失败的批次 */
+static void ngx_http_myupstream_batch_fail(ngx_http_myupstream_batch_t *b, ngx_int_t rc) {
+    ngx_uint_t                           i;
+    ngx_queue_t                         *q;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    while (!ngx_queue_empty(&b->members)) {
+        q = ngx_queue_head(&b->members);
+        m = ngx_queue_data(q, ngx_http_myupstream_batch_member_t, queue);
+
+        ngx_http_myupstream_batch_complete(b, m, rc, NGX_HTTP_MYUPSTREAM_BATCH_FAILED);
+    }
+
+    for (i = 0; i < b->nslots; i++) {
+        m = b->slots[i];
+
+        if (m) {
+            ngx_http_myupstream_batch_complete(b, m, rc, NGX_HTTP_MYUPSTREAM_BATCH_FAILED);
+        }
+    }
+}
+
+/*
+批量请求没有结果但也不是后端的问题（carrier 的客户端断开）时，其他请求重新执行 handler，加入新的批次，
+最后期限仍从第一次进入 myupstream 算起；carrier 自己以499结束
+*/
+static void ngx_http_myupstream_batch_requeue(ngx_http_myupstream_batch_t *b) {
+    ngx_uint_t                           i;
+    ngx_connection_t                    *c;
+    ngx_http_request_t                  *r;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    for (i = 0; i < b->nslots; i++) {
+        m = b->slots[i];
+
+        if (m == NULL) {
+            continue;
+        }
+
+        r = m->request;
+
+        if (r == b->carrier) {
+            ngx_http_myupstream_batch_complete(b, m, NGX_HTTP_CLIENT_CLOSED_REQUEST, NGX_HTTP_MYUPSTREAM_BATCH_FAILED);
+            continue;
+        }
+
+        ngx_http_myupstream_batch_leave(m);
+
+        c = r->connection;
+
+        ngx_http_finalize_request(r, ngx_http_myupstream_handler(r));
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+/*
+向一个请求交付结果。carrier 在子请求结束的过程中被调用，此时子请求还持有引用，
+直接结束会使 carrier 的连接不能保持长连接，所以推迟到子请求释放引用之后再结束
+*/
+static void ngx_http_myupstream_batch_complete(ngx_http_myupstream_batch_t *b, ngx_http_myupstream_batch_member_t *m, ngx_int_t rc, ngx_uint_t result) {
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = m->request;
+    c = r->connection;
+
+    if (r == b->carrier) {
+        ngx_http_myupstream_batch_leave(m);
+
+        if (m->timer.timer_set) {
+            ngx_del_timer(&m->timer);
+        }
+
+        m->rc = rc;
+        m->result = result;
+        m->deferred = 1;
+
+        r->write_event_handler = ngx_http_myupstream_batch_carrier_handler;
+        ngx_http_post_request(r, NULL);
+        return;
+    }
+
+    ngx_http_myupstream_batch_finish(m, rc, result);
+    ngx_http_run_posted_requests(c);
+}
+
+/* carrier 推迟结束，由 ngx_http_run_posted_requests 调用；在此之前先来的写事件同样会调用这里，只处理一次 */
+static void ngx_http_myupstream_batch_carrier_handler(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t           *myctx;
+    ngx_http_myupstream_batch_member_t  *m;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    m = myctx->batch;
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (!m->deferred) {
+        return;
+    }
+
+    m->deferred = 0;
+
+    ngx_http_myupstream_batch_finish(m, m->rc, m->result);
+}
+
+/* 请求离开批次，记录结果后结束 */
+static void ngx_http_myupstream_batch_finish(ngx_http_myupstream_batch_member_t *m, ngx_int_t rc, ngx_uint_t result) {
+    ngx_http_request_t          *r;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    r = m->request;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    if (!m->sent) {
+        m->wait = ngx_current_msec - m->start;
+    }
+
+    ngx_http_myupstream_batch_leave(m);
+
+    if (m->timer.timer_set) {
+        ngx_del_timer(&m->timer);
+    }
+
+    if (mycf->metrics_zone) {
+        ngx_http_myupstream_metrics_batch_request(mycf->metrics_zone, result, m->wait);
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
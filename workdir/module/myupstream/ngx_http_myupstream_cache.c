@@ -0,0 +1,1386 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 缓存键（规范化之后的请求参数）的最大长度 */
+#define NGX_HTTP_MYUPSTREAM_CACHE_MAX_KEY   4096
+
+/* 后台更新缓存的子请求最长占用更新标记的时间（秒），超过后允许其他请求重新发起更新 */
+#define NGX_HTTP_MYUPSTREAM_CACHE_UPDATING  60
+
+/*
+共享内存中的一个缓存项，紧跟在 ngx_rbtree_node_t 的 color 成员之后。
+data 中依次存放缓存键、Content-Type、其余要重放的响应头、响应包体和开启 myupstream_gzip 时的压缩版本，整个节点只占用一块 slab 内存。
+每个响应头按 2 字节名字长度、2 字节值长度（网络字节序）、名字、值依次存放。
+*/
+typedef struct {
+    u_char                      color;
+    u_char                      dummy;
+    u_short                     key_len;
+    u_short                     content_type_len;
+    unsigned                    removed:1;    /* 已经从红黑树和 LRU 队列中摘除，等最后一个使用者释放 */
+
+    ngx_queue_t                 queue;        /* LRU 队列，最近使用的在队头 */
+    ngx_uint_t                  count;        /* 正在直接从共享内存发送该项的请求数 */
+
+    ngx_uint_t                  status;
+    time_t                      expire;       /* 在此之前是新鲜的 */
+    time_t                      stale;        /* 在此之前可以先返回旧内容，同时在后台更新 */
+    time_t                      updating;     /* 后台更新开始的时间，0 表示没有在更新 */
+
+    size_t                      size;         /* 整个节点占用的内存 */
+    size_t                      headers_len;
+    size_t                      body_len;
+    size_t                      gzip_len;     /* 压缩版本的长度，0 表示没有压缩版本 */
+    u_char                      data[1];
+} ngx_http_myupstream_cache_node_t;
+
+/*
+共享内存中的一把合并请求锁，同样紧跟在 ngx_rbtree_node_t 的 color 成员之后，data 中存放缓存键。
+持有锁的 worker 异常退出时锁不会被释放，所以锁带有过期时间。
+*/
+typedef struct {
+    u_char                      color;
+    u_char                      dummy;
+    u_short                     key_len;
+    ngx_msec_t                  expire;
+    u_char                      data[1];
+} ngx_http_myupstream_cache_lock_t;
+
+/* 发送缓存项的请求结束时用来释放引用的数据 */
+typedef struct {
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_node_t  *node;
+} ngx_http_myupstream_cache_cleanup_t;
+
+static ngx_int_t ngx_http_myupstream_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_myupstream_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_myupstream_cache_key(ngx_http_request_t *r, ngx_str_t *key);
+static int ngx_libc_cdecl ngx_http_myupstream_cache_cmp_args(const void *one, const void *two);
+static ngx_http_myupstream_cache_node_t *ngx_http_myupstream_cache_find(ngx_http_myupstream_cache_t *cache, ngx_str_t *key, uint32_t hash);
+static void ngx_http_myupstream_cache_delete(ngx_http_myupstream_cache_t *cache, ngx_http_myupstream_cache_node_t *cn);
+static void ngx_http_myupstream_cache_free(ngx_http_myupstream_cache_t *cache, ngx_http_myupstream_cache_node_t *cn);
+static void *ngx_http_myupstream_cache_alloc(ngx_http_myupstream_cache_t *cache, size_t size);
+static ngx_int_t ngx_http_myupstream_cache_send(ngx_http_request_t *r, ngx_http_myupstream_cache_t *cache, ngx_http_myupstream_cache_node_t *cn);
+static ngx_int_t ngx_http_myupstream_cache_send_headers(ngx_http_request_t *r, u_char *p, u_char *last);
+static ngx_uint_t ngx_http_myupstream_cache_header_stored(ngx_http_request_t *r, ngx_table_elt_t *h);
+static ngx_int_t ngx_http_myupstream_cache_seconds(u_char *p, u_char *last, time_t *n);
+static void ngx_http_myupstream_cache_unpin(void *data);
+static ngx_int_t ngx_http_myupstream_cache_background_update(ngx_http_request_t *r);
+static void ngx_http_myupstream_cache_store(ngx_http_request_t *r);
+static void ngx_http_myupstream_cache_clear_updating(ngx_http_request_t *r);
+static ngx_int_t ngx_http_myupstream_cache_stats_handler(ngx_http_request_t *r);
+static void ngx_http_myupstream_cache_lock_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_myupstream_cache_lock_t *ngx_http_myupstream_cache_lock_find(ngx_http_myupstream_cache_t *cache, ngx_str_t *key, uint32_t hash);
+
+/* $myupstream_cache_status 的取值，下标即 ctx->cache_status */
+/* 不随缓存项保存的响应头：逐跳的、由缓存项的其他字段或 nginx 重新生成的、以及不能在用户之间共享的 */
+static ngx_str_t ngx_http_myupstream_cache_skip_headers[] = {
+    ngx_string("connection"),
+    ngx_string("keep-alive"),
+    ngx_string("transfer-encoding"),
+    ngx_string("content-length"),
+    ngx_string("content-type"),
+    ngx_string("content-encoding"),
+    ngx_string("set-cookie"),
+    ngx_null_string
+};
+
+static ngx_str_t ngx_http_myupstream_cache_status[] = {
+    ngx_null_string,
+    ngx_string("BYPASS"),
+    ngx_string("MISS"),
+    ngx_string("EXPIRED"),
+    ngx_string("STALE"),
+    ngx_string("UPDATING"),
+    ngx_string("HIT")
+};
+
+/*
+myupstream_cache_zone 配置项的回调函数，在 http 块中定义一块所有 worker 共享的缓存内存
+格式：myupstream_cache_zone name size;
+*/
+char *ngx_http_myupstream_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ssize_t                       size;
+    ngx_str_t                    *value;
+    ngx_shm_zone_t               *shm_zone;
+    ngx_http_myupstream_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size, &ngx_http_myupstream_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_myupstream_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_cache 配置项的回调函数，在 location 中引用 myupstream_cache_zone 定义的共享内存
+格式：myupstream_cache name | off;
+*/
+char *ngx_http_myupstream_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+
+    if (mycf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mycf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    /* size 为 0 表示只是引用，zone 可以在后面才定义 */
+    mycf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (mycf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_cache_stats 配置项的回调函数，该 location 以文本形式输出指定缓存的统计信息
+格式：myupstream_cache_stats name;
+*/
+char *ngx_http_myupstream_cache_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_http_core_loc_conf_t   *clcf;
+
+    value = cf->args->elts;
+
+    mycf->cache_stats_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (mycf->cache_stats_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_myupstream_cache_stats_handler;
+
+    return NGX_CONF_OK;
+}
+
+/* 初始化共享内存，reload 时沿用旧的缓存内容 */
+static ngx_int_t ngx_http_myupstream_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_myupstream_cache_t  *ocache = data;
+    ngx_http_myupstream_cache_t  *cache;
+    size_t                        len;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_myupstream_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_http_myupstream_cache_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+    ngx_rbtree_init(&cache->sh->locks, &cache->sh->locks_sentinel, ngx_http_myupstream_cache_lock_insert_value);
+
+    len = sizeof(" in myupstream cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in myupstream cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+    /* 内存不足时会淘汰旧的缓存项，不需要 slab 打印错误日志 */
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+static void ngx_http_myupstream_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t                 **p;
+    ngx_http_myupstream_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            cn = (ngx_http_myupstream_cache_node_t *) &node->color;
+            cnt = (ngx_http_myupstream_cache_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->key_len, cnt->key_len) < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/*
+请求进入 myupstream 时查询缓存。缓存命中时直接从共享内存发送响应，完全不创建 upstream。
+参数：r - 请求，myupstream 上下文必须已经创建
+返回值：NGX_DECLINED - 需要访问后端
+       其他 - 已经由缓存处理，作为 handler 的返回值
+*/
+ngx_int_t ngx_http_myupstream_cache_lookup(ngx_http_request_t *r) {
+    time_t                             now;
+    ngx_int_t                          rc;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_node_t  *cn;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    cache = mycf->cache_zone->data;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_BYPASS;
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_myupstream_request_key(r) != NGX_OK) {
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_BYPASS;
+        return NGX_DECLINED;
+    }
+
+    /* 后台更新缓存的子请求总是访问后端 */
+    if (myctx->cache_update) {
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_UPDATING;
+        return NGX_DECLINED;
+    }
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_myupstream_cache_find(cache, &myctx->cache_key, myctx->cache_hash);
+
+    if (cn == NULL) {
+        cache->sh->misses++;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_MISS;
+        return NGX_DECLINED;
+    }
+
+    if (cn->expire <= now && cn->stale <= now) {
+        cache->sh->misses++;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_EXPIRED;
+        return NGX_DECLINED;
+    }
+
+    if (cn->expire > now) {
+        cache->sh->hits++;
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_HIT;
+
+    } else {
+        /* 已过期但仍在 stale-while-revalidate 窗口内：先返回旧内容，同时只让一个请求去后台更新 */
+        cache->sh->stale_hits++;
+        myctx->cache_status = NGX_HTTP_MYUPSTREAM_CACHE_STALE;
+
+        if (cn->updating == 0 || now - cn->updating > NGX_HTTP_MYUPSTREAM_CACHE_UPDATING) {
+            cn->updating = now;
+            myctx->cache_start_update = 1;
+        }
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    /* 发送期间该项不能被释放 */
+    cn->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (myctx->cache_start_update) {
+        if (ngx_http_myupstream_cache_background_update(r) != NGX_OK) {
+            ngx_http_myupstream_cache_clear_updating(r);
+        }
+    }
+
+    rc = ngx_http_myupstream_cache_send(r, cache, cn);
+
+    return rc;
+}
+
+/*
+计算请求的缓存键和它的 crc32，保存在上下文中。响应缓存和请求合并使用同一个键，只计算一次。
+返回值：NGX_OK - 成功
+       NGX_DECLINED - 请求参数太长，不参与缓存和合并
+       NGX_ERROR - 内存不足
+*/
+ngx_int_t ngx_http_myupstream_request_key(ngx_http_request_t *r) {
+    ngx_int_t                   rc;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx->cache_key.data) {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_myupstream_cache_key(r, &myctx->cache_key);
+    if (rc != NGX_OK) {
+        ngx_str_null(&myctx->cache_key);
+        return rc;
+    }
+
+    myctx->cache_hash = ngx_crc32_short(myctx->cache_key.data, myctx->cache_key.len);
+
+    return NGX_OK;
+}
+
+/*
+生成缓存键：按 '&' 拆分请求参数，去掉空参数后排序再拼接，
+这样 "b=2&a=1" 和 "a=1&b=2&" 会命中同一个缓存项
+*/
+static ngx_int_t ngx_http_myupstream_cache_key(ngx_http_request_t *r, ngx_str_t *key) {
+    u_char       *p, *last, *start;
+    ngx_str_t    *arg, *args;
+    ngx_uint_t    i;
+    ngx_array_t   a;
+
+    if (r->args.len > NGX_HTTP_MYUPSTREAM_CACHE_MAX_KEY) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_array_init(&a, r->pool, 8, sizeof(ngx_str_t)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = r->args.data;
+    last = p + r->args.len;
+
+    while (p < last) {
+        start = p;
+
+        while (p < last && *p != '&') {
+            p++;
+        }
+
+        if (p > start) {
+            arg = ngx_array_push(&a);
+            if (arg == NULL) {
+                return NGX_ERROR;
+            }
+
+            arg->data = start;
+            arg->len = p - start;
+        }
+
+        p++;
+    }
+
+    ngx_sort(a.elts, a.nelts, sizeof(ngx_str_t), ngx_http_myupstream_cache_cmp_args);
+
+    key->data = ngx_pnalloc(r->pool, r->args.len);
+    if (key->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    args = a.elts;
+    p = key->data;
+
+    for (i = 0; i < a.nelts; i++) {
+        if (i) {
+            *p++ = '&';
+        }
+
+        p = ngx_cpymem(p, args[i].data, args[i].len);
+    }
+
+    key->len = p - key->data;
+
+    return NGX_OK;
+}
+
+static int ngx_libc_cdecl ngx_http_myupstream_cache_cmp_args(const void *one, const void *two) {
+    ngx_str_t *first = (ngx_str_t *) one;
+    ngx_str_t *second = (ngx_str_t *) two;
+
+    return ngx_memn2cmp(first->data, second->data, first->len, second->len);
+}
+
+/* 在红黑树中查找缓存项，调用者必须持有共享内存的锁 */
+static ngx_http_myupstream_cache_node_t *ngx_http_myupstream_cache_find(ngx_http_myupstream_cache_t *cache, ngx_str_t *key, uint32_t hash) {
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_http_myupstream_cache_node_t  *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        cn = (ngx_http_myupstream_cache_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, cn->data, key->len, (size_t) cn->key_len);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* 把缓存项从红黑树和 LRU 队列中摘除，没有请求在使用时立即释放内存。调用者必须持有锁 */
+static void ngx_http_myupstream_cache_delete(ngx_http_myupstream_cache_t *cache, ngx_http_myupstream_cache_node_t *cn) {
+    ngx_rbtree_node_t  *node;
+
+    node = (ngx_rbtree_node_t *) ((u_char *) cn - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, node);
+
+    cn->removed = 1;
+    cache->sh->entries--;
+
+    if (cn->count == 0) {
+        ngx_http_myupstream_cache_free(cache, cn);
+    }
+}
+
+static void ngx_http_myupstream_cache_free(ngx_http_myupstream_cache_t *cache, ngx_http_myupstream_cache_node_t *cn) {
+    cache->sh->bytes -= cn->size;
+    ngx_slab_free_locked(cache->shpool, (u_char *) cn - offsetof(ngx_rbtree_node_t, color));
+}
+
+/* 从共享内存中分配内存，不够时按 LRU 淘汰最久没有使用的缓存项。调用者必须持有锁 */
+static void *ngx_http_myupstream_cache_alloc(ngx_http_myupstream_cache_t *cache, size_t size) {
+    void                              *p;
+    ngx_queue_t                       *q;
+    ngx_http_myupstream_cache_node_t  *cn;
+
+    for ( ;; ) {
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+        if (p) {
+            return p;
+        }
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        cn = ngx_queue_data(q, ngx_http_myupstream_cache_node_t, queue);
+
+        ngx_http_myupstream_cache_delete(cache, cn);
+        cache->sh->evictions++;
+    }
+}
+
+/*
+直接用共享内存中的包体构造 ngx_buf_t 发送，不做任何复制。
+缓存项已经被加了引用，请求内存池销毁时（响应已经完全发出）才释放引用。
+*/
+static ngx_int_t ngx_http_myupstream_cache_send(ngx_http_request_t *r, ngx_http_myupstream_cache_t *cache, ngx_http_myupstream_cache_node_t *cn) {
+    u_char                               *body, *headers;
+    size_t                                len;
+    ngx_int_t                             rc;
+    ngx_buf_t                            *b;
+    ngx_uint_t                            gzip;
+    ngx_chain_t                           out;
+    ngx_pool_cleanup_t                   *cln;
+    ngx_http_myupstream_conf_t           *mycf;
+    ngx_http_myupstream_cache_cleanup_t  *cc;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_myupstream_cache_cleanup_t));
+    if (cln == NULL) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        cn->count--;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cc = cln->data;
+    cc->cache = cache;
+    cc->node = cn;
+    cln->handler = ngx_http_myupstream_cache_unpin;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    /* 客户端接受 gzip 时发送写缓存时压缩好的版本，不需要每个请求再压缩一次 */
+    body = cn->data + cn->key_len + cn->content_type_len + cn->headers_len;
+    len = cn->body_len;
+    gzip = 0;
+
+    if (cn->gzip_len && ngx_http_myupstream_gzip_accepted(r) == NGX_OK) {
+        body += cn->body_len;
+        len = cn->gzip_len;
+        gzip = 1;
+    }
+
+    r->headers_out.status = cn->status;
+    r->headers_out.content_length_n = len;
+
+    if ((mycf->gzip || cn->gzip_len) && ngx_http_myupstream_gzip_headers(r, gzip) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (cn->content_type_len) {
+        r->headers_out.content_type.len = cn->content_type_len;
+        r->headers_out.content_type.data = cn->data + cn->key_len;
+        r->headers_out.content_type_len = cn->content_type_len;
+    }
+
+    headers = cn->data + cn->key_len + cn->content_type_len;
+
+    if (ngx_http_myupstream_cache_send_headers(r, headers, headers + cn->headers_len) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (len == 0) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = body;
+    b->last = body + len;
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static void ngx_http_myupstream_cache_unpin(void *data) {
+    ngx_http_myupstream_cache_cleanup_t *cc = data;
+
+    ngx_shmtx_lock(&cc->cache->shpool->mutex);
+
+    cc->node->count--;
+
+    if (cc->node->removed && cc->node->count == 0) {
+        ngx_http_myupstream_cache_free(cc->cache, cc->node);
+    }
+
+    ngx_shmtx_unlock(&cc->cache->shpool->mutex);
+}
+
+/*
+把缓存项中保存的响应头加入 r->headers_out。名字和值直接指向共享内存，发送期间缓存项被引用，不会释放
+参数：p, last - 缓存项中响应头的开始和结束
+*/
+static ngx_int_t ngx_http_myupstream_cache_send_headers(ngx_http_request_t *r, u_char *p, u_char *last) {
+    time_t            date;
+    ngx_table_elt_t  *h;
+
+    while (p < last) {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = 1;
+        h->key.len = (p[0] << 8) | p[1];
+        h->value.len = (p[2] << 8) | p[3];
+        h->key.data = p + 4;
+        h->value.data = h->key.data + h->key.len;
+        h->lowcase_key = NULL;
+
+        p = h->value.data + h->value.len;
+
+        /* 条件请求和 not_modified 过滤模块需要这两个头部 */
+        if (h->key.len == sizeof("ETag") - 1 && ngx_strncasecmp(h->key.data, (u_char *) "ETag", h->key.len) == 0) {
+            r->headers_out.etag = h;
+
+        } else if (h->key.len == sizeof("Last-Modified") - 1 && ngx_strncasecmp(h->key.data, (u_char *) "Last-Modified", h->key.len) == 0) {
+            date = ngx_parse_http_time(h->value.data, h->value.len);
+            if (date != NGX_ERROR) {
+                r->headers_out.last_modified = h;
+                r->headers_out.last_modified_time = date;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* 判断后端的一个响应头是否随缓存项保存：upstream 会隐藏的（hide_headers）和 skip_headers 中的都不保存 */
+static ngx_uint_t ngx_http_myupstream_cache_header_stored(ngx_http_request_t *r, ngx_table_elt_t *h) {
+    ngx_uint_t                   i;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    if (h->key.len > 0xffff || h->value.len > 0xffff || h->lowcase_key == NULL) {
+        return 0;
+    }
+
+    for (i = 0; ngx_http_myupstream_cache_skip_headers[i].len; i++) {
+        if (h->key.len == ngx_http_myupstream_cache_skip_headers[i].len
+            && ngx_strncmp(h->lowcase_key, ngx_http_myupstream_cache_skip_headers[i].data, h->key.len) == 0)
+        {
+            return 0;
+        }
+    }
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    /* 开启 myupstream_gzip 时 Vary 由发送缓存项时重新添加 */
+    if (mycf->gzip && h->key.len == sizeof("vary") - 1 && ngx_strncmp(h->lowcase_key, "vary", h->key.len) == 0) {
+        return 0;
+    }
+
+    if (ngx_hash_find(&mycf->upstream.hide_headers_hash, h->hash, h->lowcase_key, h->key.len)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+发起一个后台子请求去后端更新缓存，当前请求先返回旧内容。
+子请求的响应不会发给客户端，只用来写缓存。
+*/
+static ngx_int_t ngx_http_myupstream_cache_background_update(ngx_http_request_t *r) {
+    ngx_http_request_t         *sr;
+    ngx_http_myupstream_ctx_t  *sctx;
+
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL, NGX_HTTP_SUBREQUEST_CLONE|NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* 子请求的任何输出（包括出错时的错误页）都不能到达客户端，创建时就只发送响应头 */
+    sr->header_only = 1;
+
+    sctx = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_ctx_t));
+    if (sctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_CTX, sizeof(ngx_http_myupstream_ctx_t));
+
+    sctx->cache_update = 1;
+    ngx_http_set_ctx(sr, sctx, ngx_http_myupstream_module);
+
+    return NGX_OK;
+}
+
+/*
+解析后端返回的 Cache-Control 头部，决定响应能否缓存以及缓存多久。
+s-maxage 优先于 max-age；no-store、no-cache、private 的响应不缓存。
+*/
+void ngx_http_myupstream_cache_control(ngx_http_request_t *r, ngx_str_t *value) {
+    u_char                     *p, *last;
+    time_t                      n;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    p = value->data;
+    last = p + value->len;
+
+    if (ngx_strlcasestrn(p, last, (u_char *) "no-store", 8 - 1) != NULL
+        || ngx_strlcasestrn(p, last, (u_char *) "no-cache", 8 - 1) != NULL
+        || ngx_strlcasestrn(p, last, (u_char *) "private", 7 - 1) != NULL)
+    {
+        myctx->cache_no_store = 1;
+        return;
+    }
+
+    p = ngx_strlcasestrn(value->data, last, (u_char *) "s-maxage=", 9 - 1);
+
+    if (p == NULL) {
+        p = ngx_strlcasestrn(value->data, last, (u_char *) "max-age=", 8 - 1);
+        if (p) {
+            p += 8;
+        }
+
+    } else {
+        p += 9;
+    }
+
+    if (p) {
+        /* 与 ngx_http_upstream_process_cache_control 相同，无法解析的 max-age 使响应不能缓存 */
+        if (ngx_http_myupstream_cache_seconds(p, last, &n) != NGX_OK) {
+            myctx->cache_no_store = 1;
+            return;
+        }
+
+        myctx->cache_valid = n;
+        myctx->cache_valid_set = 1;
+    }
+
+    p = ngx_strlcasestrn(value->data, last, (u_char *) "stale-while-revalidate=", 23 - 1);
+
+    if (p && ngx_http_myupstream_cache_seconds(p + 23, last, &n) == NGX_OK) {
+        myctx->cache_swr = n;
+    }
+}
+
+/*
+解析 Cache-Control 中的秒数，到 ','、';'、空格或值的结尾为止
+返回值：NGX_OK - 成功
+       NGX_ERROR - 没有数字、含有其他字符或者溢出
+*/
+static ngx_int_t ngx_http_myupstream_cache_seconds(u_char *p, u_char *last, time_t *n) {
+    u_char     *start;
+    ngx_int_t   v;
+
+    v = 0;
+
+    for (start = p; p < last; p++) {
+        if (*p == ',' || *p == ';' || *p == ' ') {
+            break;
+        }
+
+        if (*p < '0' || *p > '9' || v >= NGX_MAX_INT_T_VALUE / 10) {
+            return NGX_ERROR;
+        }
+
+        v = v * 10 + (*p - '0');
+    }
+
+    if (p == start) {
+        return NGX_ERROR;
+    }
+
+    *n = (time_t) v;
+
+    return NGX_OK;
+}
+
+/*
+开始接收响应包体之前调用，决定本次响应是否写入缓存。
+只缓存 200 响应，包体不能超过 myupstream_cache_max_size。
+*/
+void ngx_http_myupstream_cache_init_store(ngx_http_request_t *r) {
+    size_t                       size;
+    time_t                       valid;
+    ngx_http_upstream_t         *u;
+    ngx_http_myupstream_ctx_t   *myctx;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    u = r->upstream;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx->cache_key.data == NULL || myctx->cache_no_store || u->headers_in.status_n != NGX_HTTP_OK) {
+        return;
+    }
+
+#if (NGX_HTTP_GZIP)
+    /* 缓存项不保存 Content-Encoding，后端返回的已编码包体不能缓存 */
+    if (u->headers_in.content_encoding) {
+        return;
+    }
+#endif
+
+    valid = myctx->cache_valid_set ? myctx->cache_valid : mycf->cache_valid;
+    if (valid <= 0) {
+        return;
+    }
+
+    if (u->headers_in.content_length_n > (off_t) mycf->cache_max_size) {
+        return;
+    }
+
+    size = (u->headers_in.content_length_n >= 0) ? (size_t) u->headers_in.content_length_n : ngx_min(mycf->cache_max_size, ngx_pagesize);
+
+    myctx->cache_body = ngx_create_temp_buf(r->pool, ngx_max(size, 1));
+    if (myctx->cache_body == NULL) {
+        return;
+    }
+
+    myctx->cache_valid = valid;
+    myctx->cache_store = 1;
+}
+
+/*
+把收到的包体复制一份用于写缓存。超过 myupstream_cache_max_size 时放弃缓存，不影响向客户端转发。
+*/
+void ngx_http_myupstream_cache_capture(ngx_http_request_t *r, u_char *pos, size_t len) {
+    size_t                       size;
+    ngx_buf_t                   *b, *nb;
+    ngx_http_myupstream_ctx_t   *myctx;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    b = myctx->cache_body;
+
+    if ((size_t) (b->end - b->last) < len) {
+        mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+        size = (b->last - b->pos) + len;
+
+        if (size > mycf->cache_max_size) {
+            myctx->cache_store = 0;
+            return;
+        }
+
+        size = ngx_min(ngx_max(size, (size_t) (b->end - b->start) * 2), mycf->cache_max_size);
+
+        nb = ngx_create_temp_buf(r->pool, size);
+        if (nb == NULL) {
+            myctx->cache_store = 0;
+            return;
+        }
+
+        nb->last = ngx_cpymem(nb->pos, b->pos, b->last - b->pos);
+
+        myctx->cache_body = nb;
+        b = nb;
+    }
+
+    b->last = ngx_cpymem(b->last, pos, len);
+}
+
+/* upstream 结束时调用，响应完整接收后写入缓存 */
+void ngx_http_myupstream_cache_finalize(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_http_upstream_t        *u = r->upstream;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx->cache_store && rc == NGX_OK && (u->length == 0 || u->length == -1)) {
+        ngx_http_myupstream_cache_store(r);
+        return;
+    }
+
+    if (myctx->cache_update) {
+        ngx_http_myupstream_cache_clear_updating(r);
+    }
+}
+
+/* 把完整的响应写入共享内存，替换旧的缓存项 */
+static void ngx_http_myupstream_cache_store(ngx_http_request_t *r) {
+    u_char                            *p;
+    size_t                             size, body_len, headers_len;
+    ngx_str_t                          content_type, body, gzip;
+    ngx_uint_t                         i;
+    ngx_list_part_t                   *part;
+    ngx_table_elt_t                   *h;
+    ngx_rbtree_node_t                 *node;
+    ngx_http_upstream_t               *u;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_node_t  *cn;
+
+    u = r->upstream;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    cache = mycf->cache_zone->data;
+
+    ngx_str_null(&content_type);
+
+    if (u->headers_in.content_type && u->headers_in.content_type->value.len <= 0xffff) {
+        content_type = u->headers_in.content_type->value;
+    }
+
+    body_len = myctx->cache_body->last - myctx->cache_body->pos;
+
+    headers_len = 0;
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (ngx_http_myupstream_cache_header_stored(r, &h[i])) {
+            headers_len += 4 + h[i].key.len + h[i].value.len;
+        }
+    }
+
+    /* 压缩在加锁之前完成，每个缓存项只压缩这一次；压缩后没有变小就只保存原始版本 */
+    ngx_str_null(&gzip);
+
+    if (mycf->gzip) {
+        body.data = myctx->cache_body->pos;
+        body.len = body_len;
+
+        if (ngx_http_myupstream_gzip_compress(r->pool, &body, &gzip, r->connection->log) != NGX_OK) {
+            ngx_str_null(&gzip);
+        }
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color) + offsetof(ngx_http_myupstream_cache_node_t, data) + myctx->cache_key.len + content_type.len + headers_len + body_len + gzip.len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_myupstream_cache_find(cache, &myctx->cache_key, myctx->cache_hash);
+    if (cn) {
+        ngx_http_myupstream_cache_delete(cache, cn);
+    }
+
+    node = ngx_http_myupstream_cache_alloc(cache, size);
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "myupstream: could not allocate %uz bytes in cache zone \"%V\"", size, &mycf->cache_zone->shm.name);
+        return;
+    }
+
+    node->key = myctx->cache_hash;
+
+    cn = (ngx_http_myupstream_cache_node_t *) &node->color;
+
+    cn->key_len = (u_short) myctx->cache_key.len;
+    cn->content_type_len = (u_short) content_type.len;
+    cn->removed = 0;
+    cn->count = 0;
+    cn->status = u->headers_in.status_n;
+    cn->expire = ngx_time() + myctx->cache_valid;
+    cn->stale = cn->expire + myctx->cache_swr;
+    cn->updating = 0;
+    cn->size = size;
+    cn->headers_len = headers_len;
+    cn->body_len = body_len;
+    cn->gzip_len = gzip.len;
+
+    p = ngx_cpymem(cn->data, myctx->cache_key.data, myctx->cache_key.len);
+    p = ngx_cpymem(p, content_type.data, content_type.len);
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (ngx_http_myupstream_cache_header_stored(r, &h[i])) {
+            *p++ = (u_char) (h[i].key.len >> 8);
+            *p++ = (u_char) h[i].key.len;
+            *p++ = (u_char) (h[i].value.len >> 8);
+            *p++ = (u_char) h[i].value.len;
+            p = ngx_cpymem(p, h[i].key.data, h[i].key.len);
+            p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+        }
+    }
+
+    p = ngx_cpymem(p, myctx->cache_body->pos, body_len);
+    ngx_memcpy(p, gzip.data, gzip.len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    cache->sh->entries++;
+    cache->sh->stores++;
+    cache->sh->bytes += size;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: cached \"%V\", %uz bytes, %uz gzipped, valid %T", &myctx->cache_key, body_len, gzip.len, myctx->cache_valid);
+}
+
+/* 后台更新失败时清除更新标记，让后面的请求可以再次尝试 */
+static void ngx_http_myupstream_cache_clear_updating(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_node_t  *cn;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    cache = mycf->cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_myupstream_cache_find(cache, &myctx->cache_key, myctx->cache_hash);
+    if (cn) {
+        cn->updating = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/*
+合并请求时跨 worker 的锁：同一个缓存键同时只允许一个请求访问后端，
+其他 worker 中相同的请求等它把响应写入缓存后直接从缓存返回。
+参数：r - 请求，缓存键必须已经计算好
+     timeout - 锁的有效时间，超过后即使没有释放也视为无效
+返回值：NGX_OK - 拿到了锁，本请求负责访问后端
+       NGX_BUSY - 锁被其他请求持有
+       NGX_ERROR - 共享内存不足，调用者应直接访问后端
+*/
+ngx_int_t ngx_http_myupstream_cache_lock(ngx_http_request_t *r, ngx_msec_t timeout) {
+    size_t                             size;
+    ngx_rbtree_node_t                 *node;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_lock_t  *lock;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    cache = mycf->cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lock = ngx_http_myupstream_cache_lock_find(cache, &myctx->cache_key, myctx->cache_hash);
+
+    if (lock) {
+        if ((ngx_msec_int_t) (lock->expire - ngx_current_msec) > 0) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_BUSY;
+        }
+
+        /* 上一个持有者没有按时释放，直接接管 */
+        lock->expire = ngx_current_msec + timeout;
+        myctx->cache_locked = 1;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_OK;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color) + offsetof(ngx_http_myupstream_cache_lock_t, data) + myctx->cache_key.len;
+
+    node = ngx_http_myupstream_cache_alloc(cache, size);
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    node->key = myctx->cache_hash;
+
+    lock = (ngx_http_myupstream_cache_lock_t *) &node->color;
+
+    lock->key_len = (u_short) myctx->cache_key.len;
+    lock->expire = ngx_current_msec + timeout;
+    ngx_memcpy(lock->data, myctx->cache_key.data, myctx->cache_key.len);
+
+    ngx_rbtree_insert(&cache->sh->locks, node);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    myctx->cache_locked = 1;
+
+    return NGX_OK;
+}
+
+/* 释放本请求持有的合并请求锁 */
+void ngx_http_myupstream_cache_unlock(ngx_http_request_t *r) {
+    ngx_rbtree_node_t                 *node;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_lock_t  *lock;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    cache = mycf->cache_zone->data;
+
+    if (!myctx->cache_locked) {
+        return;
+    }
+
+    myctx->cache_locked = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lock = ngx_http_myupstream_cache_lock_find(cache, &myctx->cache_key, myctx->cache_hash);
+
+    if (lock) {
+        node = (ngx_rbtree_node_t *) ((u_char *) lock - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&cache->sh->locks, node);
+        ngx_slab_free_locked(cache->shpool, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/*
+等待其他 worker 的请求时轮询调用。
+返回值：NGX_AGAIN - 锁仍然有效，缓存中也还没有新鲜的响应，需要继续等
+       NGX_OK - 缓存已经写好或者锁已经释放（后端失败、响应不可缓存等），可以重新处理请求
+*/
+ngx_int_t ngx_http_myupstream_cache_lock_wait(ngx_http_request_t *r) {
+    ngx_int_t                          rc;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_cache_t       *cache;
+    ngx_http_myupstream_cache_lock_t  *lock;
+    ngx_http_myupstream_cache_node_t  *cn;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    cache = mycf->cache_zone->data;
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lock = ngx_http_myupstream_cache_lock_find(cache, &myctx->cache_key, myctx->cache_hash);
+
+    if (lock && (ngx_msec_int_t) (lock->expire - ngx_current_msec) > 0) {
+        cn = ngx_http_myupstream_cache_find(cache, &myctx->cache_key, myctx->cache_hash);
+
+        if (cn == NULL || cn->expire <= ngx_time()) {
+            rc = NGX_AGAIN;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+static void ngx_http_myupstream_cache_lock_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t                 **p;
+    ngx_http_myupstream_cache_lock_t   *lock, *lockt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            lock = (ngx_http_myupstream_cache_lock_t *) &node->color;
+            lockt = (ngx_http_myupstream_cache_lock_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lock->data, lockt->data, lock->key_len, lockt->key_len) < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/* 查找合并请求锁，调用者必须持有共享内存的锁 */
+static ngx_http_myupstream_cache_lock_t *ngx_http_myupstream_cache_lock_find(ngx_http_myupstream_cache_t *cache, ngx_str_t *key, uint32_t hash) {
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_http_myupstream_cache_lock_t  *lock;
+
+    node = cache->sh->locks.root;
+    sentinel = cache->sh->locks.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        lock = (ngx_http_myupstream_cache_lock_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lock->data, key->len, (size_t) lock->key_len);
+
+        if (rc == 0) {
+            return lock;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* $myupstream_cache_status：BYPASS、MISS、EXPIRED、STALE、UPDATING 或 HIT */
+ngx_int_t ngx_http_myupstream_cache_status_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx == NULL || myctx->cache_status == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_http_myupstream_cache_status[myctx->cache_status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_http_myupstream_cache_status[myctx->cache_status].data;
+
+    return NGX_OK;
+}
+
+/* myupstream_cache_stats 的 handler，输出命中率、内存占用和淘汰次数 */
+static ngx_int_t ngx_http_myupstream_cache_stats_handler(ngx_http_request_t *r) {
+    size_t                           len;
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_uint_t                       lookups, hits;
+    ngx_chain_t                      out;
+    ngx_http_myupstream_conf_t      *mycf;
+    ngx_http_myupstream_cache_t     *cache;
+    ngx_http_myupstream_cache_sh_t   sh;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    cache = mycf->cache_stats_zone->data;
+
+    /* 在锁内复制一份统计数据，输出时不再持有锁 */
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    sh = *cache->sh;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    hits = sh.hits + sh.stale_hits;
+    lookups = hits + sh.misses;
+
+    len = sizeof("zone: \n") + mycf->cache_stats_zone->shm.name.len
+          + sizeof("size: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("used: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("entries: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("hits: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("stale_hits: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("misses: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("hit_ratio: 0.0000\n")
+          + sizeof("stores: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("evictions: \n") + NGX_ATOMIC_T_LEN;
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "zone: %V\n", &mycf->cache_stats_zone->shm.name);
+    b->last = ngx_sprintf(b->last, "size: %uz\n", mycf->cache_stats_zone->shm.size);
+    b->last = ngx_sprintf(b->last, "used: %uz\n", sh.bytes);
+    b->last = ngx_sprintf(b->last, "entries: %ui\n", sh.entries);
+    b->last = ngx_sprintf(b->last, "hits: %ui\n", sh.hits);
+    b->last = ngx_sprintf(b->last, "stale_hits: %ui\n", sh.stale_hits);
+    b->last = ngx_sprintf(b->last, "misses: %ui\n", sh.misses);
+    b->last = ngx_sprintf(b->last, "hit_ratio: %.4f\n", lookups ? (double) hits / lookups : 0.0);
+    b->last = ngx_sprintf(b->last, "stores: %ui\n", sh.stores);
+    b->last = ngx_sprintf(b->last, "evictions: %ui\n", sh.evictions);
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
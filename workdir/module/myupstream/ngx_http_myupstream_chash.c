@@ -0,0 +1,324 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 每个权重对应的虚拟节点数，与 memcached 的 ketama 算法一致 */
+#define NGX_HTTP_MYUPSTREAM_CHASH_POINTS    160
+
+/* 连续多少次都没有选中可用的后端后退化为轮询 */
+#define NGX_HTTP_MYUPSTREAM_CHASH_MAX_TRIES 20
+
+/* 哈希环上的一个虚拟节点 */
+typedef struct {
+    uint32_t                            hash;
+    ngx_str_t                          *server;
+} ngx_http_myupstream_chash_point_t;
+
+/* 按 hash 排好序的哈希环 */
+struct ngx_http_myupstream_chash_points_s {
+    ngx_uint_t                          number;
+    ngx_http_myupstream_chash_point_t   point[1];
+};
+
+/* 每个请求的负载均衡数据，rrp 必须是第一个成员，轮询算法的 free 回调会把 data 当作 rrp 使用 */
+typedef struct {
+    ngx_http_upstream_rr_peer_data_t    rrp;
+    ngx_http_myupstream_chash_points_t *points;
+    ngx_uint_t                          hash;  /* 当前在哈希环上的位置 */
+    ngx_uint_t                          tries;
+    ngx_event_get_peer_pt               get_rr_peer;
+} ngx_http_myupstream_chash_peer_data_t;
+
+static ngx_int_t ngx_http_myupstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+static int ngx_libc_cdecl ngx_http_myupstream_chash_cmp_points(const void *one, const void *two);
+static ngx_uint_t ngx_http_myupstream_find_chash_point(ngx_http_myupstream_chash_points_t *points, uint32_t hash);
+static ngx_int_t ngx_http_myupstream_init_chash_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_myupstream_get_chash_peer(ngx_peer_connection_t *pc, void *data);
+
+/*
+myupstream_chash 配置项的回调函数，只能出现在 upstream {} 块中。
+把该 upstream 块的负载均衡算法替换为按请求参数 r->args 做一致性哈希，同一个查询总是落到同一个后端上。
+*/
+char *ngx_http_myupstream_chash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_myupstream_init_chash;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    return NGX_CONF_OK;
+}
+
+/*
+配置解析完成后构建哈希环。每个 server 按 weight * 160 个虚拟节点分布在环上，
+虚拟节点的位置只和 server 本身的名字有关，所以增删一个 server 时只有大约 1/N 的查询会换后端。
+参数：cf - 配置对象
+     us - upstream 配置块
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t ngx_http_myupstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us) {
+    u_char                              prev[4];
+    size_t                              size;
+    uint32_t                            hash, base_hash;
+    ngx_str_t                          *server;
+    ngx_uint_t                          npoints, i, j;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_myupstream_srv_conf_t     *myscf;
+    ngx_http_myupstream_chash_points_t *points;
+
+    /* 后端列表、权重、失败重试等仍然复用轮询算法的数据结构 */
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_myupstream_init_chash_peer;
+
+    peers = us->peer.data;
+    npoints = peers->total_weight * NGX_HTTP_MYUPSTREAM_CHASH_POINTS;
+
+    size = sizeof(ngx_http_myupstream_chash_points_t) + sizeof(ngx_http_myupstream_chash_point_t) * (npoints - 1);
+
+    points = ngx_palloc(cf->pool, size);
+    if (points == NULL) {
+        return NGX_ERROR;
+    }
+
+    points->number = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        server = &peer->server;
+
+        ngx_crc32_init(base_hash);
+        ngx_crc32_update(&base_hash, server->data, server->len);
+
+        ngx_memzero(prev, 4);
+        npoints = peer->weight * NGX_HTTP_MYUPSTREAM_CHASH_POINTS;
+
+        /* 每个虚拟节点的位置由 server 名字和上一个虚拟节点的位置共同决定 */
+        for (j = 0; j < npoints; j++) {
+            hash = base_hash;
+
+            ngx_crc32_update(&hash, prev, 4);
+            ngx_crc32_final(hash);
+
+            points->point[points->number].hash = hash;
+            points->point[points->number].server = server;
+            points->number++;
+
+            prev[0] = (u_char) (hash & 0xff);
+            prev[1] = (u_char) ((hash >> 8) & 0xff);
+            prev[2] = (u_char) ((hash >> 16) & 0xff);
+            prev[3] = (u_char) ((hash >> 24) & 0xff);
+        }
+    }
+
+    ngx_qsort(points->point, points->number, sizeof(ngx_http_myupstream_chash_point_t), ngx_http_myupstream_chash_cmp_points);
+
+    /* 去掉重复的点 */
+    for (i = 0, j = 1; j < points->number; j++) {
+        if (points->point[i].hash != points->point[j].hash) {
+            points->point[++i] = points->point[j];
+        }
+    }
+
+    points->number = i + 1;
+
+    myscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_myupstream_module);
+    myscf->points = points;
+
+    return NGX_OK;
+}
+
+static int ngx_libc_cdecl ngx_http_myupstream_chash_cmp_points(const void *one, const void *two) {
+    ngx_http_myupstream_chash_point_t *first = (ngx_http_myupstream_chash_point_t *) one;
+    ngx_http_myupstream_chash_point_t *second = (ngx_http_myupstream_chash_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+
+    } else if (first->hash > second->hash) {
+        return 1;
+
+    } else {
+        return 0;
+    }
+}
+
+/* 二分查找环上第一个 hash 不小于给定值的点 */
+static ngx_uint_t ngx_http_myupstream_find_chash_point(ngx_http_myupstream_chash_points_t *points, uint32_t hash) {
+    ngx_uint_t                          i, j, k;
+    ngx_http_myupstream_chash_point_t  *point;
+
+    point = &points->point[0];
+
+    i = 0;
+    j = points->number;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > point[k].hash) {
+            i = k + 1;
+
+        } else if (hash < point[k].hash) {
+            j = k;
+
+        } else {
+            return k;
+        }
+    }
+
+    return i;
+}
+
+/* 每个请求连接后端之前调用，计算请求参数在哈希环上的位置 */
+static ngx_int_t ngx_http_myupstream_init_chash_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us) {
+    uint32_t                                hash;
+    ngx_http_myupstream_srv_conf_t         *myscf;
+    ngx_http_myupstream_chash_peer_data_t  *hp;
+
+    hp = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_chash_peer_data_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &hp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_myupstream_get_chash_peer;
+
+    myscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_myupstream_module);
+
+    hash = ngx_crc32_long(r->args.data, r->args.len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream chash key:\"%V\", hash: %uD", &r->args, hash);
+
+    hp->points = myscf->points;
+    hp->hash = ngx_http_myupstream_find_chash_point(hp->points, hash);
+    hp->tries = 0;
+    hp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+
+    return NGX_OK;
+}
+
+/*
+沿着哈希环顺时针查找第一个可用的后端。同一个 server 名字可能解析出多个地址，在它们之间按权重轮询；
+后端失败重试时 upstream 机制会再次调用本函数，已经尝试过的后端会被跳过。
+*/
+static ngx_int_t ngx_http_myupstream_get_chash_peer(ngx_peer_connection_t *pc, void *data) {
+    ngx_http_myupstream_chash_peer_data_t  *hp = data;
+
+    time_t                        now;
+    intptr_t                      m;
+    ngx_str_t                    *server;
+    ngx_int_t                     total;
+    ngx_uint_t                    i, n, best_i;
+    ngx_http_upstream_rr_peer_t  *peer, *best;
+
+    ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
+
+    if (hp->tries > NGX_HTTP_MYUPSTREAM_CHASH_MAX_TRIES || hp->rrp.peers->single) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    for ( ;; ) {
+
+        server = hp->points->point[hp->hash % hp->points->number].server;
+
+        best = NULL;
+        best_i = 0;
+        total = 0;
+
+        for (peer = hp->rrp.peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            n = i / (8 * sizeof(uintptr_t));
+            m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+            if (hp->rrp.tried[n] & m) {
+                continue;
+            }
+
+            if (peer->down) {
+                continue;
+            }
+
+            if (peer->server.len != server->len || ngx_strncmp(peer->server.data, server->data, server->len) != 0) {
+                continue;
+            }
+
+            if (peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout) {
+                continue;
+            }
+
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                continue;
+            }
+
+            peer->current_weight += peer->effective_weight;
+            total += peer->effective_weight;
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            if (best == NULL || peer->current_weight > best->current_weight) {
+                best = peer;
+                best_i = i;
+            }
+        }
+
+        if (best) {
+            best->current_weight -= total;
+            break;
+        }
+
+        /* 该点对应的后端都不可用，继续找环上的下一个点 */
+        hp->hash++;
+        hp->tries++;
+
+        if (hp->tries > NGX_HTTP_MYUPSTREAM_CHASH_MAX_TRIES) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = best;
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    n = best_i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << best_i % (8 * sizeof(uintptr_t));
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
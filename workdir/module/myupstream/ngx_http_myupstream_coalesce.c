@@ -0,0 +1,629 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 等待其他 worker 的请求时，多久（毫秒）检查一次共享内存中的锁和缓存 */
+#define NGX_HTTP_MYUPSTREAM_COALESCE_POLL   50
+
+/* 一个正在访问后端的请求，同一个缓存键的后续请求挂在 followers 上等待它的响应 */
+typedef struct {
+    ngx_str_node_t                    sn;          /* 键为缓存键 */
+    ngx_http_request_t               *leader;
+    ngx_queue_t                       followers;
+    unsigned                          streaming:1; /* 已经开始向等待的请求转发响应 */
+    unsigned                          gzip:1;      /* 领头请求向后端要了 gzip 压缩的响应 */
+} ngx_http_myupstream_inflight_t;
+
+/* 每个请求的合并状态，从请求内存池中分配 */
+struct ngx_http_myupstream_coalesce_s {
+    ngx_http_request_t               *request;
+    ngx_http_myupstream_inflight_t   *inflight;    /* 领头请求自己的表项，或者跟随的表项 */
+    ngx_queue_t                       queue;       /* 跟随者在 inflight->followers 中的位置 */
+    ngx_event_t                       timer;       /* 跟随者的等待超时，或者领头请求轮询共享内存锁 */
+    ngx_msec_t                        start;       /* 开始等待的时间，重新处理请求时不重置 */
+
+    unsigned                          leader:1;
+    unsigned                          follower:1;
+    unsigned                          waiting:1;   /* 领头请求在等待其他 worker 释放锁 */
+    unsigned                          bypass:1;    /* 等待超时或者领头请求失败，直接访问后端 */
+};
+
+/* 这些头部在 headers_out 中另有指针指向，复制头部时要同时修正 */
+static ngx_uint_t ngx_http_myupstream_coalesce_headers[] = {
+    offsetof(ngx_http_headers_out_t, server),
+    offsetof(ngx_http_headers_out_t, date),
+    offsetof(ngx_http_headers_out_t, content_length),
+    offsetof(ngx_http_headers_out_t, content_encoding),
+    offsetof(ngx_http_headers_out_t, location),
+    offsetof(ngx_http_headers_out_t, refresh),
+    offsetof(ngx_http_headers_out_t, last_modified),
+    offsetof(ngx_http_headers_out_t, content_range),
+    offsetof(ngx_http_headers_out_t, accept_ranges),
+    offsetof(ngx_http_headers_out_t, www_authenticate),
+    offsetof(ngx_http_headers_out_t, expires),
+    offsetof(ngx_http_headers_out_t, etag)
+};
+
+static ngx_http_myupstream_coalesce_t *ngx_http_myupstream_coalesce_create(ngx_http_request_t *r);
+static void ngx_http_myupstream_coalesce_cleanup(void *data);
+static void ngx_http_myupstream_coalesce_leave(ngx_http_myupstream_coalesce_t *co);
+static void ngx_http_myupstream_coalesce_timer_handler(ngx_event_t *ev);
+static ngx_uint_t ngx_http_myupstream_coalesce_detach(ngx_http_request_t *r, ngx_queue_t *followers);
+static void ngx_http_myupstream_coalesce_wake(ngx_queue_t *followers, ngx_uint_t streaming, ngx_int_t rc, ngx_uint_t bypass);
+static void ngx_http_myupstream_coalesce_resume(ngx_http_request_t *r);
+static ngx_int_t ngx_http_myupstream_coalesce_send_header(ngx_http_request_t *r, ngx_http_request_t *leader);
+static ngx_int_t ngx_http_myupstream_coalesce_output(ngx_http_request_t *r, ngx_chain_t *in);
+static void ngx_http_myupstream_coalesce_writer(ngx_http_request_t *r);
+
+/*
+请求进入 myupstream、缓存没有命中之后调用，合并相同参数的并发请求。
+同一个 worker 中第一个请求成为领头请求去访问后端，后续请求挂在它上面，收到响应头后与它同步转发同一份响应；
+配置了响应缓存时，领头请求还要拿到共享内存中的锁，其他 worker 已经持有锁时等它把响应写入缓存。
+等待超过 myupstream_coalesce_timeout 后放弃等待，自己访问后端。
+参数：r - 请求，myupstream 上下文必须已经创建
+返回值：NGX_DECLINED - 本请求需要访问后端
+       NGX_DONE - 本请求在等待，已经增加了引用计数
+*/
+ngx_int_t ngx_http_myupstream_coalesce(ngx_http_request_t *r) {
+    ngx_int_t                        rc;
+    ngx_msec_t                       elapsed;
+    ngx_str_node_t                  *sn;
+    ngx_http_myupstream_ctx_t       *myctx;
+    ngx_http_myupstream_conf_t      *mycf;
+    ngx_http_myupstream_coalesce_t  *co;
+    ngx_http_myupstream_inflight_t  *inflight;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    /* HEAD 请求的领头请求不会转发包体，所以只合并 GET；后台更新缓存的子请求也不参与合并 */
+    if (r != r->main || r->method != NGX_HTTP_GET || myctx->cache_update) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_myupstream_request_key(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    co = myctx->coalesce;
+
+    if (co == NULL) {
+        co = ngx_http_myupstream_coalesce_create(r);
+        if (co == NULL) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (co->bypass) {
+        return NGX_DECLINED;
+    }
+
+    elapsed = ngx_current_msec - co->start;
+
+    if (elapsed >= mycf->coalesce_timeout) {
+        co->bypass = 1;
+        return NGX_DECLINED;
+    }
+
+    sn = ngx_str_rbtree_lookup(&mycf->coalesce_tree->rbtree, &myctx->cache_key, myctx->cache_hash);
+
+    if (sn) {
+        inflight = (ngx_http_myupstream_inflight_t *) sn;
+
+        /* 响应已经开始转发，中途加入会缺少前面的包体；编码不同的响应也不能共用 */
+        if (inflight->streaming || inflight->gzip != myctx->gzip) {
+            return NGX_DECLINED;
+        }
+
+        ngx_queue_insert_tail(&inflight->followers, &co->queue);
+        co->inflight = inflight;
+        co->follower = 1;
+
+        ngx_add_timer(&co->timer, mycf->coalesce_timeout - elapsed);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: coalesced \"%V\" into in-flight request", &myctx->cache_key);
+
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    inflight = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_inflight_t));
+    if (inflight == NULL) {
+        return NGX_DECLINED;
+    }
+
+    inflight->sn.node.key = myctx->cache_hash;
+    inflight->sn.str = myctx->cache_key;
+    inflight->leader = r;
+    inflight->gzip = myctx->gzip;
+    ngx_queue_init(&inflight->followers);
+
+    ngx_rbtree_insert(&mycf->coalesce_tree->rbtree, &inflight->sn.node);
+
+    co->inflight = inflight;
+    co->leader = 1;
+
+    if (mycf->cache_zone == NULL) {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_myupstream_cache_lock(r, mycf->coalesce_timeout);
+
+    if (rc != NGX_BUSY) {
+        return NGX_DECLINED;
+    }
+
+    /* 其他 worker 正在访问后端，定时检查它是否已经写好缓存 */
+    co->waiting = 1;
+
+    ngx_add_timer(&co->timer, ngx_min(NGX_HTTP_MYUPSTREAM_COALESCE_POLL, mycf->coalesce_timeout - elapsed));
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: \"%V\" is locked by another worker, waiting", &myctx->cache_key);
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/* 第一次参与合并时创建合并状态，并注册请求销毁时的清理函数 */
+static ngx_http_myupstream_coalesce_t *ngx_http_myupstream_coalesce_create(ngx_http_request_t *r) {
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_myupstream_ctx_t       *myctx;
+    ngx_http_myupstream_coalesce_t  *co;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    co = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_coalesce_t));
+    if (co == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    co->request = r;
+    co->start = ngx_current_msec;
+
+    co->timer.handler = ngx_http_myupstream_coalesce_timer_handler;
+    co->timer.data = co;
+    co->timer.log = r->connection->log;
+
+    cln->handler = ngx_http_myupstream_coalesce_cleanup;
+    cln->data = co;
+
+    myctx->coalesce = co;
+
+    return co;
+}
+
+/* 请求销毁时从等待队列中摘除；领头请求没有正常结束时唤醒跟随者 */
+static void ngx_http_myupstream_coalesce_cleanup(void *data) {
+    ngx_http_myupstream_coalesce_t  *co = data;
+    ngx_uint_t                       streaming;
+    ngx_queue_t                      followers;
+
+    if (co->timer.timer_set) {
+        ngx_del_timer(&co->timer);
+    }
+
+    if (co->follower) {
+        ngx_http_myupstream_coalesce_leave(co);
+        return;
+    }
+
+    if (co->leader) {
+        streaming = ngx_http_myupstream_coalesce_detach(co->request, &followers);
+        ngx_http_myupstream_coalesce_wake(&followers, streaming, NGX_ERROR, 0);
+    }
+}
+
+/* 跟随者离开等待队列，之后领头请求不会再向它转发 */
+static void ngx_http_myupstream_coalesce_leave(ngx_http_myupstream_coalesce_t *co) {
+    if (!co->follower) {
+        return;
+    }
+
+    ngx_queue_remove(&co->queue);
+    co->follower = 0;
+    co->inflight = NULL;
+}
+
+/*
+定时器回调。跟随者等待超时后自己访问后端；
+等待其他 worker 的领头请求在缓存写好、锁被释放或者等待超时后重新处理，挂在它上面的跟随者随后一起重新处理。
+*/
+static void ngx_http_myupstream_coalesce_timer_handler(ngx_event_t *ev) {
+    ngx_msec_t                       elapsed;
+    ngx_uint_t                       bypass;
+    ngx_queue_t                      followers;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_myupstream_conf_t      *mycf;
+    ngx_http_myupstream_coalesce_t  *co;
+
+    co = ev->data;
+    r = co->request;
+    c = r->connection;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    elapsed = ngx_current_msec - co->start;
+
+    if (co->follower) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0, "myupstream: coalesced request waited %M ms, fetching from backend", elapsed);
+
+        ngx_http_myupstream_coalesce_leave(co);
+        co->bypass = 1;
+
+        ngx_http_myupstream_coalesce_resume(r);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (!co->waiting) {
+        return;
+    }
+
+    if (elapsed < mycf->coalesce_timeout && ngx_http_myupstream_cache_lock_wait(r) == NGX_AGAIN) {
+        ngx_add_timer(ev, ngx_min(NGX_HTTP_MYUPSTREAM_COALESCE_POLL, mycf->coalesce_timeout - elapsed));
+        return;
+    }
+
+    co->waiting = 0;
+
+    bypass = 0;
+
+    if (elapsed >= mycf->coalesce_timeout) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0, "myupstream: request waited %M ms for another worker, fetching from backend", elapsed);
+        co->bypass = 1;
+        bypass = 1;
+    }
+
+    /* 先摘下跟随者，本请求重新处理时可能已经被销毁 */
+    (void) ngx_http_myupstream_coalesce_detach(r, &followers);
+
+    ngx_http_myupstream_coalesce_resume(r);
+    ngx_http_myupstream_coalesce_wake(&followers, 0, NGX_OK, bypass);
+
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+把领头请求的表项从请求表中删除，释放共享内存中的锁，跟随者移到调用者提供的队列中。
+参数：r - 领头请求
+     followers - 输出，等待该请求的跟随者
+返回值：是否已经开始向跟随者转发响应
+*/
+static ngx_uint_t ngx_http_myupstream_coalesce_detach(ngx_http_request_t *r, ngx_queue_t *followers) {
+    ngx_uint_t                       streaming;
+    ngx_http_myupstream_ctx_t       *myctx;
+    ngx_http_myupstream_conf_t      *mycf;
+    ngx_http_myupstream_coalesce_t  *co;
+    ngx_http_myupstream_inflight_t  *inflight;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    co = myctx->coalesce;
+    inflight = co->inflight;
+
+    ngx_rbtree_delete(&mycf->coalesce_tree->rbtree, &inflight->sn.node);
+
+    co->leader = 0;
+    co->inflight = NULL;
+
+    if (myctx->cache_locked) {
+        ngx_http_myupstream_cache_unlock(r);
+    }
+
+    ngx_queue_init(followers);
+
+    if (!ngx_queue_empty(&inflight->followers)) {
+        ngx_queue_add(followers, &inflight->followers);
+        ngx_queue_init(&inflight->followers);
+    }
+
+    streaming = inflight->streaming;
+
+    return streaming;
+}
+
+/*
+领头请求结束后处理跟随者。已经开始转发的跟随者随领头请求一起结束，
+还没有开始转发的重新处理：此时缓存里可能已经有响应，否则由其中一个成为新的领头请求。
+参数：followers - ngx_http_myupstream_coalesce_detach 摘下的跟随者
+     streaming - 是否已经开始转发
+     rc - 领头请求结束的原因，0 表示响应完整
+     bypass - 重新处理时不再合并，直接访问后端
+*/
+static void ngx_http_myupstream_coalesce_wake(ngx_queue_t *followers, ngx_uint_t streaming, ngx_int_t rc, ngx_uint_t bypass) {
+    ngx_queue_t                     *q;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *f;
+    ngx_http_myupstream_coalesce_t  *fco;
+
+    while (!ngx_queue_empty(followers)) {
+        q = ngx_queue_head(followers);
+        ngx_queue_remove(q);
+
+        fco = ngx_queue_data(q, ngx_http_myupstream_coalesce_t, queue);
+        f = fco->request;
+        c = f->connection;
+
+        fco->follower = 0;
+        fco->inflight = NULL;
+
+        if (fco->timer.timer_set) {
+            ngx_del_timer(&fco->timer);
+        }
+
+        if (streaming) {
+            /* 响应已经发出一部分，领头请求失败时只能关闭连接 */
+            ngx_http_finalize_request(f, rc == NGX_OK ? ngx_http_send_special(f, NGX_HTTP_LAST) : NGX_ERROR);
+
+        } else {
+            if (bypass) {
+                fco->bypass = 1;
+            }
+
+            ngx_http_myupstream_coalesce_resume(f);
+        }
+
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+/* 重新执行 myupstream 的 handler，相当于请求再一次进入 content 阶段 */
+static void ngx_http_myupstream_coalesce_resume(ngx_http_request_t *r) {
+    ngx_http_finalize_request(r, ngx_http_myupstream_handler(r));
+}
+
+/*
+领头请求收到响应头、开始转发包体之前调用，向跟随者发送同样的响应头
+参数：r - 领头请求
+返回值：还在等待包体的跟随者个数
+*/
+ngx_uint_t ngx_http_myupstream_coalesce_header(ngx_http_request_t *r) {
+    ngx_int_t                        rc;
+    ngx_uint_t                       n;
+    ngx_queue_t                     *q, *next;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *f;
+    ngx_http_myupstream_ctx_t       *myctx;
+    ngx_http_myupstream_coalesce_t  *co, *fco;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    co = myctx->coalesce;
+
+    if (co == NULL || !co->leader) {
+        return 0;
+    }
+
+    co->inflight->streaming = 1;
+
+    n = 0;
+
+    for (q = ngx_queue_head(&co->inflight->followers); q != ngx_queue_sentinel(&co->inflight->followers); q = next) {
+        next = ngx_queue_next(q);
+
+        fco = ngx_queue_data(q, ngx_http_myupstream_coalesce_t, queue);
+        f = fco->request;
+        c = f->connection;
+
+        if (fco->timer.timer_set) {
+            ngx_del_timer(&fco->timer);
+        }
+
+        rc = ngx_http_myupstream_coalesce_send_header(f, r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || f->header_only) {
+            ngx_http_myupstream_coalesce_leave(fco);
+
+            ngx_http_finalize_request(f, rc);
+            ngx_http_run_posted_requests(c);
+            continue;
+        }
+
+        f->write_event_handler = ngx_http_myupstream_coalesce_writer;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+领头请求每收到一段包体调用一次，复制给每个跟随者。
+包体缓冲区在领头请求发送完后就会被复用，所以每个跟随者都需要自己的一份。
+*/
+void ngx_http_myupstream_coalesce_body(ngx_http_request_t *r, u_char *pos, size_t len) {
+    ngx_buf_t                       *b;
+    ngx_queue_t                     *q, *next;
+    ngx_chain_t                     *cl;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *f;
+    ngx_http_myupstream_ctx_t       *myctx;
+    ngx_http_myupstream_coalesce_t  *co, *fco;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    co = myctx->coalesce;
+
+    if (co == NULL || !co->leader || !co->inflight->streaming || len == 0) {
+        return;
+    }
+
+    for (q = ngx_queue_head(&co->inflight->followers); q != ngx_queue_sentinel(&co->inflight->followers); q = next) {
+        next = ngx_queue_next(q);
+
+        fco = ngx_queue_data(q, ngx_http_myupstream_coalesce_t, queue);
+        f = fco->request;
+        c = f->connection;
+
+        b = ngx_create_temp_buf(f->pool, len);
+        cl = ngx_alloc_chain_link(f->pool);
+
+        if (b && cl) {
+            b->last = ngx_cpymem(b->pos, pos, len);
+            b->flush = 1;
+
+            cl->buf = b;
+            cl->next = NULL;
+
+            if (ngx_http_myupstream_coalesce_output(f, cl) == NGX_OK) {
+                continue;
+            }
+        }
+
+        ngx_http_myupstream_coalesce_leave(fco);
+
+        ngx_http_finalize_request(f, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+/* 领头请求的 upstream 结束时调用，跟随者随之结束或者重新处理 */
+void ngx_http_myupstream_coalesce_finalize(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_uint_t                       streaming;
+    ngx_queue_t                      followers;
+    ngx_http_myupstream_ctx_t       *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx->coalesce == NULL || !myctx->coalesce->leader) {
+        return;
+    }
+
+    streaming = ngx_http_myupstream_coalesce_detach(r, &followers);
+    ngx_http_myupstream_coalesce_wake(&followers, streaming, rc, 0);
+}
+
+/* 把领头请求的响应行和响应头复制到跟随者中并发送，字符串都复制到跟随者的内存池 */
+static ngx_int_t ngx_http_myupstream_coalesce_send_header(ngx_http_request_t *r, ngx_http_request_t *leader) {
+    ngx_int_t          rc;
+    ngx_uint_t         i, j, n;
+    ngx_list_part_t   *part;
+    ngx_table_elt_t   *h, *ho, **ph;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.status = leader->headers_out.status;
+    r->headers_out.content_length_n = leader->headers_out.content_length_n;
+    r->headers_out.last_modified_time = leader->headers_out.last_modified_time;
+
+    if (leader->headers_out.status_line.len) {
+        r->headers_out.status_line.len = leader->headers_out.status_line.len;
+        r->headers_out.status_line.data = ngx_pstrdup(r->pool, &leader->headers_out.status_line);
+        if (r->headers_out.status_line.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (leader->headers_out.content_type.len) {
+        r->headers_out.content_type.len = leader->headers_out.content_type.len;
+        r->headers_out.content_type.data = ngx_pstrdup(r->pool, &leader->headers_out.content_type);
+        if (r->headers_out.content_type.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        r->headers_out.content_type_len = leader->headers_out.content_type_len;
+    }
+
+    n = sizeof(ngx_http_myupstream_coalesce_headers) / sizeof(ngx_uint_t);
+
+    part = &leader->headers_out.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0) {
+            continue;
+        }
+
+        ho = ngx_list_push(&r->headers_out.headers);
+        if (ho == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ho->hash = h[i].hash;
+        ho->key.len = h[i].key.len;
+        ho->value.len = h[i].value.len;
+
+        ho->key.data = ngx_pnalloc(r->pool, ho->key.len + ho->value.len + ho->key.len);
+        if (ho->key.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ho->value.data = ngx_cpymem(ho->key.data, h[i].key.data, ho->key.len);
+        ho->lowcase_key = ngx_cpymem(ho->value.data, h[i].value.data, ho->value.len);
+        ngx_strlow(ho->lowcase_key, ho->key.data, ho->key.len);
+
+        for (j = 0; j < n; j++) {
+            ph = (ngx_table_elt_t **) ((char *) &leader->headers_out + ngx_http_myupstream_coalesce_headers[j]);
+
+            if (*ph == &h[i]) {
+                *(ngx_table_elt_t **) ((char *) &r->headers_out + ngx_http_myupstream_coalesce_headers[j]) = ho;
+                break;
+            }
+        }
+    }
+
+    return ngx_http_send_header(r);
+}
+
+/* 向跟随者发送数据。客户端太慢时数据留在请求的 out 链中，由可写事件继续发送 */
+static ngx_int_t ngx_http_myupstream_coalesce_output(ngx_http_request_t *r, ngx_chain_t *in) {
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+
+    if (ngx_http_output_filter(r, in) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (c->buffered) {
+        if (!c->write->timer_set) {
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+            ngx_add_timer(c->write, clcf->send_timeout);
+        }
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    return NGX_OK;
+}
+
+/* 跟随者在转发期间的可写事件回调 */
+static void ngx_http_myupstream_coalesce_writer(ngx_http_request_t *r) {
+    ngx_connection_t           *c;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    c = r->connection;
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (c->write->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        c->timedout = 1;
+
+        ngx_http_myupstream_coalesce_leave(myctx->coalesce);
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (ngx_http_myupstream_coalesce_output(r, NULL) == NGX_ERROR) {
+        ngx_http_myupstream_coalesce_leave(myctx->coalesce);
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+}
@@ -0,0 +1,554 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 一次竞速最多连接的地址数，更多的地址只有在排序靠前时才会被尝试 */
+#define NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX          8
+/* 连接失败后第一次排到最后的时间（毫秒），连续失败时每次加倍，不超过上限 */
+#define NGX_HTTP_MYUPSTREAM_EYEBALLS_BACKOFF      1000
+#define NGX_HTTP_MYUPSTREAM_EYEBALLS_BACKOFF_MAX  60000
+
+/* 参与竞速的一个地址，从地址缓存中复制而来，竞速期间缓存被刷新也不受影响 */
+typedef struct {
+    ngx_http_myupstream_eyeballs_t   *race;
+    ngx_peer_connection_t             peer;
+    ngx_msec_t                        start;       /* 发起连接的时间 */
+
+    ngx_sockaddr_t                    sockaddr;
+    socklen_t                         socklen;
+    ngx_str_t                         name;
+    u_char                            text[NGX_SOCKADDR_STRLEN];
+} ngx_http_myupstream_eyeballs_addr_t;
+
+/* 每个请求的竞速状态，从请求内存池中分配 */
+struct ngx_http_myupstream_eyeballs_s {
+    ngx_http_request_t               *request;
+    ngx_http_myupstream_dns_t        *dns;
+
+    ngx_event_t                       delay;       /* 到期后连接下一个地址 */
+    ngx_event_t                       timeout;     /* 整个竞速的期限，即 connect_timeout */
+    ngx_msec_t                        start;
+
+    ngx_uint_t                        next;        /* 下一个要连接的地址 */
+    ngx_uint_t                        pending;     /* 正在连接的地址数 */
+    ngx_connection_t                 *connection;  /* 先连上的连接，交给 upstream 机制之前不为 NULL */
+    unsigned                          done:1;
+
+    ngx_uint_t                        naddrs;
+    ngx_http_myupstream_eyeballs_addr_t  addr[1];
+};
+
+static ngx_uint_t ngx_http_myupstream_eyeballs_order(ngx_http_myupstream_dns_t *dns, ngx_uint_t first, ngx_uint_t *order);
+static ngx_int_t ngx_http_myupstream_eyeballs_connect(ngx_http_myupstream_eyeballs_t *race);
+static void ngx_http_myupstream_eyeballs_handler(ngx_event_t *ev);
+static void ngx_http_myupstream_eyeballs_delay_handler(ngx_event_t *ev);
+static void ngx_http_myupstream_eyeballs_timeout_handler(ngx_event_t *ev);
+static void ngx_http_myupstream_eyeballs_win(ngx_http_myupstream_eyeballs_addr_t *a);
+static void ngx_http_myupstream_eyeballs_fail(ngx_http_myupstream_eyeballs_addr_t *a);
+static void ngx_http_myupstream_eyeballs_down(ngx_http_myupstream_eyeballs_addr_t *a);
+static void ngx_http_myupstream_eyeballs_finish(ngx_http_myupstream_eyeballs_t *race, ngx_int_t rc);
+static void ngx_http_myupstream_eyeballs_close(ngx_http_myupstream_eyeballs_t *race);
+static void ngx_http_myupstream_eyeballs_cleanup(void *data);
+static ngx_http_myupstream_dns_stat_t *ngx_http_myupstream_eyeballs_stat(ngx_http_myupstream_dns_t *dns, struct sockaddr *sockaddr, socklen_t socklen);
+
+/*
+myupstream_happy_eyeballs 配置项的回调函数。解析出多个地址时按 RFC 8305 错开连接各个地址，
+上一个地址在指定时间内没有连上就同时连接下一个，先连上的一个用来发送请求
+格式：myupstream_happy_eyeballs time | off;
+*/
+char *ngx_http_myupstream_happy_eyeballs(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_int_t                   n;
+
+    if (mycf->eyeballs_delay != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mycf->eyeballs_delay = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_parse_time(&value[1], 0);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mycf->eyeballs_delay = (ngx_msec_t) n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+在地址缓存的多个地址之间竞速建立连接。
+地址按本 worker 记录的连接耗时和失败次数排序：连上过的按耗时从小到大，没有记录的按 IPv6、IPv4 交替，
+最近连接失败的排在最后；配置了 myupstream_p2c 时它选中的地址排在最前面。
+排在前面的某个地址在长连接池中有空闲连接时不竞速，直接复用
+参数：r - 请求，myupstream 上下文必须已经创建
+     dns - 地址缓存，至少有两个地址
+     index - 返回 NGX_DECLINED 时为要使用的地址
+返回值：NGX_OK - 已经连上，地址复制到了请求上下文中，连接由 peer.get 交给 upstream 机制
+       NGX_DONE - 正在连接，连上后启动 upstream，调用者需要增加请求的引用计数
+       NGX_DECLINED - 不需要竞速，使用 *index 指向的地址
+       其他 - HTTP 错误码或 NGX_ERROR
+*/
+ngx_int_t ngx_http_myupstream_eyeballs_start(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns, ngx_uint_t *index) {
+    ngx_int_t                             rc;
+    ngx_uint_t                            i, n, first, order[NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX];
+    ngx_resolver_addr_t                  *addr;
+    ngx_http_cleanup_t                   *cln;
+    ngx_http_myupstream_ctx_t            *myctx;
+    ngx_http_myupstream_conf_t           *mycf;
+    ngx_http_myupstream_dns_stat_t       *st;
+    ngx_http_myupstream_eyeballs_t       *race;
+    ngx_http_myupstream_eyeballs_addr_t  *a;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    first = NGX_CONF_UNSET_UINT;
+
+    if (mycf->p2c_zone) {
+        first = ngx_http_myupstream_p2c_select(mycf->p2c_zone, dns->addrs, dns->naddrs, r->connection->log);
+    }
+
+    n = ngx_http_myupstream_eyeballs_order(dns, first, order);
+
+    /* 复用长连接比任何新连接都快，但不复用到最近连接失败的地址上 */
+    if (mycf->keepalive_pool) {
+        for (i = 0; i < n; i++) {
+            st = &dns->stats[order[i]];
+
+            if (st->down_until && (ngx_msec_int_t) (st->down_until - ngx_current_msec) > 0) {
+                break;
+            }
+
+            addr = &dns->addrs[order[i]];
+
+            if (ngx_http_myupstream_keepalive_cached(mycf->keepalive_pool, addr->sockaddr, addr->socklen)) {
+                *index = order[i];
+                return NGX_DECLINED;
+            }
+        }
+    }
+
+    race = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_eyeballs_t) + (n - 1) * sizeof(ngx_http_myupstream_eyeballs_addr_t));
+    if (race == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* 竞速期间请求被提前销毁时关闭所有正在建立的连接 */
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_myupstream_eyeballs_cleanup;
+    cln->data = race;
+
+    race->request = r;
+    race->dns = dns;
+    race->start = ngx_current_msec;
+    race->naddrs = n;
+
+    for (i = 0; i < n; i++) {
+        a = &race->addr[i];
+        addr = &dns->addrs[order[i]];
+
+        a->race = race;
+        a->socklen = addr->socklen;
+        ngx_memcpy(&a->sockaddr, addr->sockaddr, addr->socklen);
+
+        a->name.data = a->text;
+        a->name.len = ngx_min(addr->name.len, NGX_SOCKADDR_STRLEN);
+        ngx_memcpy(a->text, addr->name.data, a->name.len);
+    }
+
+    race->delay.handler = ngx_http_myupstream_eyeballs_delay_handler;
+    race->delay.data = race;
+    race->delay.log = r->connection->log;
+
+    race->timeout.handler = ngx_http_myupstream_eyeballs_timeout_handler;
+    race->timeout.data = race;
+    race->timeout.log = r->connection->log;
+
+    myctx->eyeballs = race;
+
+    rc = ngx_http_myupstream_eyeballs_connect(race);
+
+    if (race->connection) {
+        return NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        race->done = 1;
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    ngx_add_timer(&race->timeout, mycf->upstream.connect_timeout);
+
+    return NGX_DONE;
+}
+
+/*
+取出竞速胜出的连接，只能取一次，由 peer.init 调用
+返回值：没有竞速或者已经取走时为 NULL
+*/
+ngx_connection_t *ngx_http_myupstream_eyeballs_connection(ngx_http_request_t *r) {
+    ngx_connection_t                *c;
+    ngx_http_myupstream_ctx_t       *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx == NULL || myctx->eyeballs == NULL) {
+        return NULL;
+    }
+
+    c = myctx->eyeballs->connection;
+    myctx->eyeballs->connection = NULL;
+
+    return c;
+}
+
+/*
+选出参与竞速的地址并排序，排序键的高位是分类，低位是分类内的顺序
+参数：dns - 地址缓存
+     first - 排在最前面的地址，NGX_CONF_UNSET_UINT 表示没有
+     order - 返回排好序的下标
+返回值：地址数
+*/
+static ngx_uint_t ngx_http_myupstream_eyeballs_order(ngx_http_myupstream_dns_t *dns, ngx_uint_t first, ngx_uint_t *order) {
+    uint64_t                         key, keys[NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX];
+    ngx_uint_t                       i, j, n, family[2];
+    ngx_msec_t                       now;
+    ngx_http_myupstream_dns_stat_t  *st;
+
+    now = ngx_current_msec;
+    n = 0;
+    family[0] = 0;
+    family[1] = 0;
+
+    for (i = 0; i < dns->naddrs; i++) {
+        st = &dns->stats[i];
+
+        if (i == first) {
+            key = 0;
+
+        } else if (st->down_until && (ngx_msec_int_t) (st->down_until - now) > 0) {
+            key = ((uint64_t) 3 << 48) + (st->down_until - now);
+
+        } else if (st->rtt) {
+            key = ((uint64_t) 1 << 48) + st->rtt;
+
+        } else if (dns->addrs[i].sockaddr->sa_family == AF_INET6) {
+            key = ((uint64_t) 2 << 48) + 2 * family[0]++;
+
+        } else {
+            key = ((uint64_t) 2 << 48) + 2 * family[1]++ + 1;
+        }
+
+        /* 插入排序，只保留最靠前的 NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX 个 */
+        for (j = n; j > 0 && keys[j - 1] > key; j--) {
+            if (j < NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX) {
+                keys[j] = keys[j - 1];
+                order[j] = order[j - 1];
+            }
+        }
+
+        if (j < NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX) {
+            keys[j] = key;
+            order[j] = i;
+
+            if (n < NGX_HTTP_MYUPSTREAM_EYEBALLS_MAX) {
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+/*
+依次连接还没有尝试过的地址，直到有一个正在连接或者已经连上。
+立即失败的地址（例如没有到 IPv6 的路由）不占用等待时间，马上尝试下一个
+返回值：NGX_OK - 有连接正在建立或者已经连上，NGX_DECLINED - 所有地址都已经尝试过
+*/
+static ngx_int_t ngx_http_myupstream_eyeballs_connect(ngx_http_myupstream_eyeballs_t *race) {
+    ngx_int_t                             rc;
+    ngx_connection_t                     *c;
+    ngx_http_myupstream_conf_t           *mycf;
+    ngx_http_myupstream_eyeballs_addr_t  *a;
+
+    mycf = ngx_http_get_module_loc_conf(race->request, ngx_http_myupstream_module);
+
+    while (race->next < race->naddrs) {
+        a = &race->addr[race->next++];
+
+        a->peer.sockaddr = (struct sockaddr *) &a->sockaddr;
+        a->peer.socklen = a->socklen;
+        a->peer.name = &a->name;
+        a->peer.get = ngx_event_get_peer;
+        a->peer.log = race->request->connection->log;
+        a->peer.log_error = NGX_ERROR_ERR;
+        a->start = ngx_current_msec;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, a->peer.log, 0, "myupstream: happy eyeballs connecting to %V, attempt %ui", &a->name, race->next);
+
+        rc = ngx_event_connect_peer(&a->peer);
+
+        if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+            a->peer.connection = NULL;
+            ngx_http_myupstream_eyeballs_down(a);
+            continue;
+        }
+
+        c = a->peer.connection;
+        c->data = a;
+        c->read->handler = ngx_http_myupstream_eyeballs_handler;
+        c->write->handler = ngx_http_myupstream_eyeballs_handler;
+
+        race->pending++;
+
+        if (rc == NGX_OK) {
+            ngx_http_myupstream_eyeballs_win(a);
+            return NGX_OK;
+        }
+
+        /* 还有地址没有尝试时，间隔到期就同时连接下一个 */
+        if (race->next < race->naddrs) {
+            ngx_add_timer(&race->delay, mycf->eyeballs_delay);
+        }
+
+        return NGX_OK;
+    }
+
+    return race->pending ? NGX_OK : NGX_DECLINED;
+}
+
+/* 正在建立的连接上的读写事件：连接完成或者出错 */
+static void ngx_http_myupstream_eyeballs_handler(ngx_event_t *ev) {
+    int                                   err;
+    socklen_t                             len;
+    ngx_connection_t                     *c;
+    ngx_http_myupstream_eyeballs_addr_t  *a;
+
+    c = ev->data;
+    a = c->data;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "myupstream: happy eyeballs connect() failed");
+        ngx_http_myupstream_eyeballs_fail(a);
+        return;
+    }
+
+    /* 连接成功时只有可写事件，可读事件可能是对端已经关闭，等可写事件再判断 */
+    if (!ev->write) {
+        return;
+    }
+
+    ngx_http_myupstream_eyeballs_win(a);
+}
+
+/* 间隔到期，前面的地址还没有连上，同时连接下一个地址 */
+static void ngx_http_myupstream_eyeballs_delay_handler(ngx_event_t *ev) {
+    ngx_http_myupstream_eyeballs_t *race = ev->data;
+
+    if (ngx_http_myupstream_eyeballs_connect(race) == NGX_DECLINED && !race->done) {
+        ngx_http_myupstream_eyeballs_finish(race, NGX_HTTP_BAD_GATEWAY);
+    }
+}
+
+/* 超过 connect_timeout 仍然没有连上任何地址，正在连接的地址都记为失败 */
+static void ngx_http_myupstream_eyeballs_timeout_handler(ngx_event_t *ev) {
+    ngx_uint_t                       i;
+    ngx_http_myupstream_eyeballs_t  *race = ev->data;
+
+    ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT, "myupstream: no address of %V connected in time", &race->dns->host);
+
+    for (i = 0; i < race->next; i++) {
+        if (race->addr[i].peer.connection) {
+            ngx_http_myupstream_eyeballs_down(&race->addr[i]);
+        }
+    }
+
+    ngx_http_myupstream_eyeballs_finish(race, NGX_HTTP_GATEWAY_TIME_OUT);
+}
+
+/*
+一个地址先连上：记录它的连接耗时，关闭其他正在建立的连接，把地址复制到请求上下文中。
+竞速是异步进行的就在这里启动 upstream，否则由 ngx_http_myupstream_eyeballs_start 的调用者启动
+*/
+static void ngx_http_myupstream_eyeballs_win(ngx_http_myupstream_eyeballs_addr_t *a) {
+    ngx_msec_t                       rtt;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_myupstream_ctx_t       *myctx;
+    ngx_http_myupstream_eyeballs_t  *race;
+    ngx_http_myupstream_dns_stat_t  *st;
+
+    race = a->race;
+    r = race->request;
+    c = a->peer.connection;
+
+    rtt = ngx_current_msec - a->start;
+
+    st = ngx_http_myupstream_eyeballs_stat(race->dns, a->peer.sockaddr, a->peer.socklen);
+    if (st) {
+        st->rtt = st->rtt ? (3 * st->rtt + rtt) / 4 : rtt;
+        st->rtt = ngx_max(st->rtt, 1);
+        st->fails = 0;
+        st->down_until = 0;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: happy eyeballs connected to %V in %M ms, attempt %ui",
+                   &a->name, rtt, (ngx_uint_t) (a - race->addr) + 1);
+
+    /* 胜出的连接不再由竞速关闭 */
+    a->peer.connection = NULL;
+    race->pending--;
+    race->connection = c;
+
+    c->read->handler = ngx_http_empty_handler;
+    c->write->handler = ngx_http_empty_handler;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    myctx->sockaddr = (struct sockaddr *) &a->sockaddr;
+    myctx->socklen = a->socklen;
+    myctx->backendServer = a->name;
+    myctx->eyeballs_time = ngx_current_msec - race->start;
+    myctx->eyeballs_connected = 1;
+
+    ngx_http_myupstream_trace(r, NGX_HTTP_MYUPSTREAM_TRACE_CONNECT);
+
+    ngx_http_myupstream_eyeballs_finish(race, NGX_OK);
+}
+
+/* 正在建立的连接出错，没有其他地址正在连接时不再等待间隔，马上尝试下一个 */
+static void ngx_http_myupstream_eyeballs_fail(ngx_http_myupstream_eyeballs_addr_t *a) {
+    ngx_http_myupstream_eyeballs_t  *race = a->race;
+
+    ngx_http_myupstream_eyeballs_down(a);
+
+    ngx_close_connection(a->peer.connection);
+    a->peer.connection = NULL;
+    race->pending--;
+
+    if (race->pending) {
+        return;
+    }
+
+    if (race->delay.timer_set) {
+        ngx_del_timer(&race->delay);
+    }
+
+    if (ngx_http_myupstream_eyeballs_connect(race) == NGX_DECLINED) {
+        ngx_http_myupstream_eyeballs_finish(race, NGX_HTTP_BAD_GATEWAY);
+    }
+}
+
+/* 记下一个地址连接失败，连续失败的次数越多，排在最后的时间越长 */
+static void ngx_http_myupstream_eyeballs_down(ngx_http_myupstream_eyeballs_addr_t *a) {
+    ngx_http_myupstream_dns_stat_t  *st;
+
+    st = ngx_http_myupstream_eyeballs_stat(a->race->dns, (struct sockaddr *) &a->sockaddr, a->socklen);
+    if (st == NULL) {
+        return;
+    }
+
+    st->fails++;
+    st->down_until = ngx_current_msec
+                     + ngx_min((ngx_msec_t) NGX_HTTP_MYUPSTREAM_EYEBALLS_BACKOFF << ngx_min(st->fails - 1, 6),
+                               NGX_HTTP_MYUPSTREAM_EYEBALLS_BACKOFF_MAX);
+}
+
+/*
+竞速结束，关闭其余的连接。异步进行的竞速在这里启动 upstream 或者结束请求，
+之前由调用者增加的请求引用计数交给 upstream 机制或者在结束请求时减去
+*/
+static void ngx_http_myupstream_eyeballs_finish(ngx_http_myupstream_eyeballs_t *race, ngx_int_t rc) {
+    ngx_uint_t           async;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = race->request;
+    c = r->connection;
+
+    async = race->timeout.timer_set || race->timeout.timedout;
+
+    ngx_http_myupstream_eyeballs_close(race);
+
+    race->done = 1;
+
+    if (!async) {
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_init(r);
+
+    } else {
+        ngx_http_finalize_request(r, rc);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+/* 删除定时器，关闭所有还在建立的连接，不包括已经胜出的连接 */
+static void ngx_http_myupstream_eyeballs_close(ngx_http_myupstream_eyeballs_t *race) {
+    ngx_uint_t  i;
+
+    if (race->delay.timer_set) {
+        ngx_del_timer(&race->delay);
+    }
+
+    if (race->timeout.timer_set) {
+        ngx_del_timer(&race->timeout);
+    }
+
+    for (i = 0; i < race->next; i++) {
+        if (race->addr[i].peer.connection) {
+            ngx_close_connection(race->addr[i].peer.connection);
+            race->addr[i].peer.connection = NULL;
+        }
+    }
+
+    race->pending = 0;
+}
+
+/* 请求被销毁时关闭竞速中的连接，以及胜出之后还没有交给 upstream 机制的连接 */
+static void ngx_http_myupstream_eyeballs_cleanup(void *data) {
+    ngx_http_myupstream_eyeballs_t *race = data;
+
+    ngx_http_myupstream_eyeballs_close(race);
+
+    if (race->connection) {
+        ngx_close_connection(race->connection);
+        race->connection = NULL;
+    }
+
+    race->done = 1;
+}
+
+/* 在地址缓存中找到一个地址的统计，竞速期间缓存被刷新、地址已经不在解析结果中时返回 NULL */
+static ngx_http_myupstream_dns_stat_t *ngx_http_myupstream_eyeballs_stat(ngx_http_myupstream_dns_t *dns, struct sockaddr *sockaddr, socklen_t socklen) {
+    ngx_uint_t  i;
+
+    for (i = 0; i < dns->naddrs; i++) {
+        if (ngx_cmp_sockaddr(dns->addrs[i].sockaddr, dns->addrs[i].socklen, sockaddr, socklen, 1) == NGX_OK) {
+            return &dns->stats[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,583 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 后端没有给出 Content-Length 时，接收一个目标响应的缓冲区的初始大小，不够时翻倍 */
+#define NGX_HTTP_MYUPSTREAM_FANOUT_BUFFER        16384
+/* 一个目标响应的最大长度，超出时这个目标按失败处理 */
+#define NGX_HTTP_MYUPSTREAM_FANOUT_MAX_RESPONSE  (4 * 1024 * 1024)
+
+/* 一次扇出，分配在主请求的内存池中 */
+struct ngx_http_myupstream_fanout_s {
+    ngx_http_request_t                     *request;
+    ngx_http_myupstream_fanout_part_t      *parts;       /* 每个目标一项，顺序与配置相同 */
+    ngx_uint_t                              nparts;
+    ngx_uint_t                              pending;     /* 还没有结束的子请求数 */
+    ngx_uint_t                              ok;          /* 成功的目标数 */
+    ngx_uint_t                              first;       /* 收到这么多个成功的响应后不再等待 */
+    ngx_event_t                             timer;       /* 最后期限 */
+    ngx_msec_t                              start;
+    u_char                                  boundary[sizeof("myupstream-") - 1 + 16];
+
+    unsigned                                finished:1;  /* 已经合并出响应，之后结束的子请求被忽略 */
+    unsigned                                expired:1;   /* 因为最后期限而结束 */
+    unsigned                                deferred:1;  /* 等待子请求释放引用后再合并 */
+};
+
+/* 一个目标，子请求的上下文通过 fanout_part 指向它 */
+struct ngx_http_myupstream_fanout_part_s {
+    ngx_http_myupstream_fanout_t           *fanout;
+    ngx_str_t                              *target;
+    ngx_http_request_t                     *request;     /* 子请求，结束或者取消之后为 NULL */
+    ngx_buf_t                              *body;        /* 收到的响应包体 */
+    ngx_str_t                               content_type;
+    ngx_uint_t                              status;
+    ngx_uint_t                              result;
+
+    unsigned                                overflow:1;  /* 包体超出了 NGX_HTTP_MYUPSTREAM_FANOUT_MAX_RESPONSE */
+};
+
+static ngx_int_t ngx_http_myupstream_fanout_handler(ngx_http_request_t *r);
+static void ngx_http_myupstream_fanout_cleanup(void *data);
+static ngx_int_t ngx_http_myupstream_fanout_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static void ngx_http_myupstream_fanout_expire(ngx_event_t *ev);
+static void ngx_http_myupstream_fanout_posted(ngx_http_request_t *r);
+static void ngx_http_myupstream_fanout_finish(ngx_http_myupstream_fanout_t *f);
+static void ngx_http_myupstream_fanout_cancel(ngx_http_myupstream_fanout_part_t *part);
+static ngx_int_t ngx_http_myupstream_fanout_output(ngx_http_myupstream_fanout_t *f);
+
+/*
+myupstream_fanout 配置项的回调函数。把请求同时发往多个目标 location，这些 location 用 myupstream 访问各自的搜索引擎；
+在 timeout 之内返回的响应合并成一个 multipart/mixed 响应，收到 first 个成功的响应后不再等待其他目标，
+还没有返回的后端请求被取消
+格式：myupstream_fanout uri ... [first=N] [timeout=time];
+*/
+char *ngx_http_myupstream_fanout(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_int_t                   n;
+    ngx_str_t                  *value, *target, s;
+    ngx_uint_t                  i;
+    ngx_http_core_loc_conf_t   *clcf;
+
+    if (mycf->fanout) {
+        return "is duplicate";
+    }
+
+    mycf->fanout = ngx_array_create(cf->pool, 4, sizeof(ngx_str_t));
+    if (mycf->fanout == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mycf->fanout_first = 0;
+    mycf->fanout_timeout = 1000;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (value[i].data[0] == '/') {
+            if (mycf->fanout->nelts == NGX_HTTP_MYUPSTREAM_FANOUT_MAX_TARGETS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too many fanout targets, at most %d", NGX_HTTP_MYUPSTREAM_FANOUT_MAX_TARGETS);
+                return NGX_CONF_ERROR;
+            }
+
+            target = ngx_array_push(mycf->fanout);
+            if (target == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *target = value[i];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "first=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            mycf->fanout_first = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            mycf->fanout_timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (mycf->fanout->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no fanout targets");
+        return NGX_CONF_ERROR;
+    }
+
+    if (mycf->fanout_first > mycf->fanout->nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"first\" is greater than the number of fanout targets");
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_myupstream_fanout_handler;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/*
+扇出的子请求收到一段包体时调用，复制到对应目标的缓冲区中，扇出结束后的包体直接丢弃
+参数：r - 扇出的子请求
+     pos, len - 收到的包体
+*/
+void ngx_http_myupstream_fanout_capture(ngx_http_request_t *r, u_char *pos, size_t len) {
+    size_t                              used, size;
+    ngx_buf_t                          *buf, *nb;
+    ngx_http_myupstream_ctx_t          *myctx;
+    ngx_http_myupstream_fanout_part_t  *part;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    part = myctx->fanout_part;
+
+    if (part == NULL || part->fanout->finished || part->overflow || len == 0) {
+        return;
+    }
+
+    buf = part->body;
+    used = buf ? (size_t) (buf->last - buf->pos) : 0;
+
+    if (used + len > NGX_HTTP_MYUPSTREAM_FANOUT_MAX_RESPONSE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "myupstream: fanout response from \"%V\" is larger than %d bytes", part->target, NGX_HTTP_MYUPSTREAM_FANOUT_MAX_RESPONSE);
+        part->overflow = 1;
+        return;
+    }
+
+    if (buf == NULL || (size_t) (buf->end - buf->last) < len) {
+
+        if (buf) {
+            size = 2 * (buf->end - buf->start);
+
+        } else if (r->upstream->headers_in.content_length_n > 0) {
+            size = (size_t) ngx_min(r->upstream->headers_in.content_length_n, NGX_HTTP_MYUPSTREAM_FANOUT_MAX_RESPONSE);
+
+        } else {
+            size = NGX_HTTP_MYUPSTREAM_FANOUT_BUFFER;
+        }
+
+        while (size < used + len) {
+            size *= 2;
+        }
+
+        size = ngx_min(size, NGX_HTTP_MYUPSTREAM_FANOUT_MAX_RESPONSE);
+
+        nb = ngx_create_temp_buf(r->pool, size);
+        if (nb == NULL) {
+            part->overflow = 1;
+            return;
+        }
+
+        if (buf) {
+            nb->last = ngx_cpymem(nb->last, buf->pos, used);
+            ngx_pfree(r->pool, buf->start);
+        }
+
+        part->body = buf = nb;
+    }
+
+    buf->last = ngx_cpymem(buf->last, pos, len);
+}
+
+/* $myupstream_fanout：合并进响应的目标数和目标总数，如 "2/3" */
+ngx_int_t ngx_http_myupstream_fanout_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char                        *p;
+    ngx_http_myupstream_ctx_t     *myctx;
+    ngx_http_myupstream_fanout_t  *f;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx == NULL || myctx->fanout == NULL || !myctx->fanout->finished) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    f = myctx->fanout;
+
+    p = ngx_pnalloc(r->pool, 2 * NGX_INT_T_LEN + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui/%ui", f->ok, f->nparts) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/*
+配置了 myupstream_fanout 的 location 的 handler。为每个目标创建一个后台子请求，
+子请求的上下文预先指向对应的目标，目标 location 的 myupstream 据此收集包体而不向客户端输出
+*/
+static ngx_int_t ngx_http_myupstream_fanout_handler(ngx_http_request_t *r) {
+    ngx_int_t                           rc;
+    ngx_str_t                          *targets;
+    ngx_uint_t                          i;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_request_t                 *sr;
+    ngx_http_post_subrequest_t         *ps;
+    ngx_http_myupstream_ctx_t          *myctx, *sctx;
+    ngx_http_myupstream_conf_t         *mycf;
+    ngx_http_myupstream_fanout_t       *f;
+    ngx_http_myupstream_fanout_part_t  *part;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    if (myctx == NULL) {
+        myctx = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_ctx_t));
+        if (myctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_set_ctx(r, myctx, ngx_http_myupstream_module);
+    }
+
+    f = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_fanout_t));
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    f->nparts = mycf->fanout->nelts;
+    f->parts = ngx_pcalloc(r->pool, f->nparts * sizeof(ngx_http_myupstream_fanout_part_t));
+    if (f->parts == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_myupstream_fanout_cleanup;
+    cln->data = f;
+
+    f->request = r;
+    f->first = mycf->fanout_first ? mycf->fanout_first : f->nparts;
+    f->start = ngx_current_msec;
+
+    /* 分隔符不能出现在各个目标的包体中，每个请求随机生成 */
+    ngx_sprintf(f->boundary, "myupstream-%08xD%08xD", (uint32_t) ngx_random(), (uint32_t) ngx_random());
+
+    f->timer.handler = ngx_http_myupstream_fanout_expire;
+    f->timer.data = f;
+    f->timer.log = r->connection->log;
+
+    myctx->fanout = f;
+
+    targets = mycf->fanout->elts;
+
+    for (i = 0; i < f->nparts; i++) {
+        part = &f->parts[i];
+        part->fanout = f;
+        part->target = &targets[i];
+
+        sctx = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_ctx_t));
+        ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+
+        if (sctx == NULL || ps == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_CTX, sizeof(ngx_http_myupstream_ctx_t));
+
+        ps->handler = ngx_http_myupstream_fanout_done;
+        ps->data = part;
+
+        if (ngx_http_subrequest(r, part->target, &r->args, &sr, ps, NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        sctx->fanout_part = part;
+        ngx_http_set_ctx(sr, sctx, ngx_http_myupstream_module);
+
+        part->request = sr;
+        f->pending++;
+    }
+
+    ngx_add_timer(&f->timer, mycf->fanout_timeout);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream fanout: %ui targets, first:%ui", f->nparts, f->first);
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/* 请求销毁时删除最后期限的定时器 */
+static void ngx_http_myupstream_fanout_cleanup(void *data) {
+    ngx_http_myupstream_fanout_t  *f = data;
+
+    f->finished = 1;
+
+    if (f->timer.timer_set) {
+        ngx_del_timer(&f->timer);
+    }
+}
+
+/*
+扇出的子请求结束时调用（post_subrequest），记录这个目标的结果。
+所有目标都已结束，或者成功的目标达到 first 个时合并响应；
+此时子请求还持有引用，直接结束主请求会使连接不能保持长连接，所以推迟到子请求释放引用之后
+参数：r - 子请求
+     data - 对应的目标
+     rc - 子请求结束的原因
+返回值：rc，子请求照常结束
+*/
+static ngx_int_t ngx_http_myupstream_fanout_done(ngx_http_request_t *r, void *data, ngx_int_t rc) {
+    ngx_http_request_t                 *mr;
+    ngx_http_myupstream_fanout_t       *f;
+    ngx_http_myupstream_fanout_part_t  *part = data;
+
+    f = part->fanout;
+
+    /* 同一个子请求可能不止一次结束，只处理第一次 */
+    r->post_subrequest = NULL;
+    part->request = NULL;
+
+    if (f->finished) {
+        return rc;
+    }
+
+    f->pending--;
+
+    part->status = r->upstream ? r->upstream->headers_in.status_n : 0;
+
+    if (rc == NGX_OK && part->status == NGX_HTTP_OK && !part->overflow) {
+        part->result = NGX_HTTP_MYUPSTREAM_FANOUT_OK;
+        f->ok++;
+
+        if (r->headers_out.content_type.len) {
+            part->content_type.data = ngx_pstrdup(r->pool, &r->headers_out.content_type);
+            part->content_type.len = r->headers_out.content_type.len;
+        }
+
+        if (part->content_type.data == NULL) {
+            ngx_str_set(&part->content_type, "application/octet-stream");
+        }
+
+    } else {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "myupstream: fanout target \"%V\" failed, rc:%i, status:%ui", part->target, rc, part->status);
+
+        part->result = NGX_HTTP_MYUPSTREAM_FANOUT_FAILED;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream fanout: \"%V\" done after %M ms, result:%ui", part->target, ngx_current_msec - f->start, part->result);
+
+    if (f->pending && f->ok < f->first) {
+        return rc;
+    }
+
+    if (!f->deferred) {
+        f->deferred = 1;
+
+        mr = f->request;
+        mr->write_event_handler = ngx_http_myupstream_fanout_posted;
+        ngx_http_post_request(mr, NULL);
+    }
+
+    return rc;
+}
+
+/* 最后期限的定时器回调，用已经收到的响应合并，其他目标按超时取消 */
+static void ngx_http_myupstream_fanout_expire(ngx_event_t *ev) {
+    ngx_connection_t              *c;
+    ngx_http_myupstream_fanout_t  *f;
+
+    f = ev->data;
+    c = f->request->connection;
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0, "myupstream: fanout deadline reached with %ui of %ui targets pending", f->pending, f->nparts);
+
+    f->expired = 1;
+
+    ngx_http_myupstream_fanout_finish(f);
+    ngx_http_run_posted_requests(c);
+}
+
+/* 推迟的合并，由 ngx_http_run_posted_requests 调用；在此之前先来的写事件同样会调用这里，只处理一次 */
+static void ngx_http_myupstream_fanout_posted(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (myctx->fanout->finished) {
+        return;
+    }
+
+    ngx_http_myupstream_fanout_finish(myctx->fanout);
+}
+
+/* 取消还没有结束的目标，记录每个目标的结果，合并响应后结束主请求 */
+static void ngx_http_myupstream_fanout_finish(ngx_http_myupstream_fanout_t *f) {
+    ngx_uint_t                          i;
+    ngx_http_request_t                 *r;
+    ngx_http_myupstream_conf_t         *mycf;
+    ngx_http_myupstream_fanout_part_t  *part;
+
+    r = f->request;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    f->finished = 1;
+
+    if (f->timer.timer_set) {
+        ngx_del_timer(&f->timer);
+    }
+
+    for (i = 0; i < f->nparts; i++) {
+        part = &f->parts[i];
+
+        if (part->request) {
+            ngx_http_myupstream_fanout_cancel(part);
+        }
+
+        if (mycf->metrics_zone) {
+            ngx_http_myupstream_metrics_fanout(mycf->metrics_zone, part->result);
+        }
+    }
+
+    if (f->ok == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "myupstream: no fanout target responded in %M ms", ngx_current_msec - f->start);
+
+        ngx_http_finalize_request(r, f->expired ? NGX_HTTP_GATEWAY_TIME_OUT : NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    ngx_http_finalize_request(r, ngx_http_myupstream_fanout_output(f));
+}
+
+/*
+取消一个还没有结束的目标。已经连上后端的子请求通过 upstream 的清理函数关闭后端连接，
+子请求随之以 NGX_DONE 结束并释放对主请求的引用；还在排队或者解析域名的子请求无法中途取消，
+它们结束时因为扇出已经结束而被忽略
+*/
+static void ngx_http_myupstream_fanout_cancel(ngx_http_myupstream_fanout_part_t *part) {
+    ngx_http_request_t   *sr;
+    ngx_http_upstream_t  *u;
+
+    sr = part->request;
+    u = sr->upstream;
+
+    part->request = NULL;
+    part->result = NGX_HTTP_MYUPSTREAM_FANOUT_LATE;
+
+    sr->post_subrequest = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0, "myupstream fanout: cancel \"%V\"", part->target);
+
+    if (u && u->cleanup) {
+        (*u->cleanup)(sr);
+    }
+}
+
+/*
+把成功的目标按配置的顺序合并成一个 multipart/mixed 响应，
+每一部分带上原来的 Content-Type，Content-Location 为目标的 uri
+返回值：交给 ngx_http_finalize_request 的返回值
+*/
+static ngx_int_t ngx_http_myupstream_fanout_output(ngx_http_myupstream_fanout_t *f) {
+    size_t                              len, blen;
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          i;
+    ngx_chain_t                         out;
+    ngx_http_request_t                 *r;
+    ngx_http_myupstream_fanout_part_t  *part;
+
+    r = f->request;
+    blen = sizeof(f->boundary);
+
+    len = sizeof("--" "--" CRLF) - 1 + blen;
+
+    for (i = 0; i < f->nparts; i++) {
+        part = &f->parts[i];
+
+        if (part->result != NGX_HTTP_MYUPSTREAM_FANOUT_OK) {
+            continue;
+        }
+
+        len += sizeof("--" CRLF "Content-Type: " CRLF "Content-Location: " CRLF CRLF CRLF) - 1
+               + blen + part->content_type.len + part->target->len
+               + (part->body ? part->body->last - part->body->pos : 0);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = len;
+
+    r->headers_out.content_type.len = sizeof("multipart/mixed; boundary=") - 1 + blen;
+    r->headers_out.content_type.data = ngx_pnalloc(r->pool, r->headers_out.content_type.len);
+    if (r->headers_out.content_type.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(r->headers_out.content_type.data, "multipart/mixed; boundary=%*s", blen, f->boundary);
+    r->headers_out.content_type_len = sizeof("multipart/mixed") - 1;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < f->nparts; i++) {
+        part = &f->parts[i];
+
+        if (part->result != NGX_HTTP_MYUPSTREAM_FANOUT_OK) {
+            continue;
+        }
+
+        b->last = ngx_sprintf(b->last, "--%*s" CRLF "Content-Type: %V" CRLF "Content-Location: %V" CRLF CRLF,
+                              blen, f->boundary, &part->content_type, part->target);
+
+        if (part->body) {
+            b->last = ngx_cpymem(b->last, part->body->pos, part->body->last - part->body->pos);
+        }
+
+        *b->last++ = CR; *b->last++ = LF;
+    }
+
+    b->last = ngx_sprintf(b->last, "--%*s--" CRLF, blen, f->boundary);
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
@@ -0,0 +1,128 @@
+#include "ngx_http_myupstream_module.h"
+
+#include <zlib.h>
+
+/* 缓存项的压缩级别。每个缓存项只压缩一次，可以比 gzip 过滤模块常用的级别高一些 */
+#define NGX_HTTP_MYUPSTREAM_GZIP_LEVEL       6
+/* 包体短于该值时不压缩，gzip 的头尾就有 18 个字节 */
+#define NGX_HTTP_MYUPSTREAM_GZIP_MIN_LENGTH  256
+
+/*
+客户端是否接受 gzip 编码的响应。按 gzip_http_version、gzip_proxied、gzip_disable 的规则判断，
+与 gzip 过滤模块一样把结果记在 r->gzip_tested 和 r->gzip_ok 中
+返回值：NGX_OK - 接受
+       NGX_DECLINED - 不接受，或者 nginx 编译时没有 gzip 支持
+*/
+ngx_int_t ngx_http_myupstream_gzip_accepted(ngx_http_request_t *r) {
+#if (NGX_HTTP_GZIP)
+
+    if (r->gzip_tested) {
+        return r->gzip_ok ? NGX_OK : NGX_DECLINED;
+    }
+
+    return ngx_http_gzip_ok(r);
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+/*
+把数据压缩成 gzip 格式
+参数：pool - 分配压缩结果的内存池
+     src - 原始数据
+     dst - 压缩结果
+     log - 日志
+返回值：NGX_OK - 成功
+       NGX_DECLINED - 数据太短或者压缩后没有变小，不值得保存压缩版本
+       NGX_ERROR - 失败
+*/
+ngx_int_t ngx_http_myupstream_gzip_compress(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst, ngx_log_t *log) {
+    int        rc;
+    size_t     bound;
+    z_stream   zs;
+
+    if (src->len < NGX_HTTP_MYUPSTREAM_GZIP_MIN_LENGTH) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    /* windowBits 加 16 输出带 gzip 头尾的格式 */
+    rc = deflateInit2(&zs, NGX_HTTP_MYUPSTREAM_GZIP_LEVEL, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "deflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    /* 一次压缩完，输出缓冲区按最坏情况分配 */
+    bound = deflateBound(&zs, src->len);
+
+    dst->data = ngx_pnalloc(pool, bound);
+    if (dst->data == NULL) {
+        deflateEnd(&zs);
+        return NGX_ERROR;
+    }
+
+    zs.next_in = src->data;
+    zs.avail_in = src->len;
+    zs.next_out = dst->data;
+    zs.avail_out = bound;
+
+    rc = deflate(&zs, Z_FINISH);
+
+    dst->len = bound - zs.avail_out;
+
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "deflate() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    if (dst->len >= src->len) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/*
+给发往客户端的响应加上 Vary: Accept-Encoding，发送压缩版本时再加上 Content-Encoding: gzip。
+设置了 content_encoding 之后 gzip 过滤模块不会再压缩一次
+参数：r - 请求
+     encoded - 包体是否是 gzip 编码的
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+ngx_int_t ngx_http_myupstream_gzip_headers(ngx_http_request_t *r, ngx_uint_t encoded) {
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Vary");
+    ngx_str_set(&h->value, "Accept-Encoding");
+
+    if (!encoded) {
+        return NGX_OK;
+    }
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Content-Encoding");
+    ngx_str_set(&h->value, "gzip");
+
+    r->headers_out.content_encoding = h;
+
+    return NGX_OK;
+}
@@ -0,0 +1,776 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 首字节延迟的分布，单位毫秒，与 myupstream_metrics 相同的对数线性分桶：0~3 各一个桶，之后每个2的幂区间4个桶 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS  4
+#define NGX_HTTP_MYUPSTREAM_HEDGE_MAX_EXP      17
+#define NGX_HTTP_MYUPSTREAM_HEDGE_BUCKETS                                     \
+    (NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS                                    \
+     + (NGX_HTTP_MYUPSTREAM_HEDGE_MAX_EXP - 1) * NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS)
+
+/* 样本不够时不按百分位对冲 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_MIN_SAMPLES  100
+/* 样本数达到该值后所有桶减半，分布跟随后端最近的表现 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_WINDOW       1024
+/* 每新增这么多样本重新计算一次百分位 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_RECALC       64
+/* 对冲预算最多累积的次数，避免空闲之后突然集中对冲 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_BURST        10
+
+/* 每个 worker 进程私有的对冲状态，挂在 location 配置上，fork 之后每个 worker 各有一份，读写都不需要加锁 */
+struct ngx_http_myupstream_hedge_stats_s {
+    ngx_uint_t                   bucket[NGX_HTTP_MYUPSTREAM_HEDGE_BUCKETS];
+    ngx_uint_t                   samples;
+    ngx_uint_t                   pending;   /* 上次计算百分位之后新增的样本数 */
+    ngx_msec_t                   delay;     /* 按百分位得出的等待时间，0 表示样本还不够 */
+    ngx_uint_t                   tokens;    /* 对冲预算，单位为 1/100 次 */
+};
+
+/* 每个请求的对冲状态，从请求内存池中分配 */
+struct ngx_http_myupstream_hedge_s {
+    ngx_http_request_t          *request;
+    ngx_event_t                  timer;     /* 等待主请求响应的时间 */
+    ngx_msec_t                   start;     /* 开始访问后端的时间 */
+
+    ngx_peer_connection_t        peer;      /* 对冲连接，peer.get 是包装函数 */
+    ngx_event_get_peer_pt        get;       /* 后端选择方法自己的 get/free/data */
+    ngx_event_free_peer_pt       free;
+    void                        *data;
+    u_char                      *pos;       /* 请求中还没有发送的部分 */
+
+    unsigned                     connected:1;
+    unsigned                     sent:1;
+    unsigned                     racing:1;  /* 对冲连接与主请求的连接正在比谁先响应 */
+    unsigned                     header:1;  /* 已经收到响应 */
+};
+
+static ngx_str_t ngx_http_myupstream_hedge_status[] = {
+    ngx_null_string,
+    ngx_string("won"),
+    ngx_string("lost"),
+    ngx_string("failed"),
+    ngx_string("throttled")
+};
+
+static void ngx_http_myupstream_hedge_cleanup(void *data);
+static void ngx_http_myupstream_hedge_timer_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_myupstream_hedge_connect(ngx_http_myupstream_hedge_t *h);
+static ngx_int_t ngx_http_myupstream_hedge_get_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_int_t ngx_http_myupstream_hedge_send(ngx_http_myupstream_hedge_t *h);
+static void ngx_http_myupstream_hedge_write_handler(ngx_event_t *wev);
+static void ngx_http_myupstream_hedge_read_handler(ngx_event_t *rev);
+static void ngx_http_myupstream_hedge_swap(ngx_http_myupstream_hedge_t *h);
+static void ngx_http_myupstream_hedge_fail(ngx_http_myupstream_hedge_t *h);
+static void ngx_http_myupstream_hedge_close(ngx_http_myupstream_hedge_t *h, ngx_uint_t state);
+static void ngx_http_myupstream_hedge_sample(ngx_http_myupstream_conf_t *mycf, ngx_msec_t ms);
+static ngx_uint_t ngx_http_myupstream_hedge_bucket(ngx_msec_t ms);
+static ngx_msec_t ngx_http_myupstream_hedge_bound(ngx_uint_t bucket);
+
+/*
+myupstream_hedge 配置项的回调函数，主请求在指定时间内没有响应时向另一个后端再发一次同样的请求
+格式：myupstream_hedge time | pN | off;
+pN 表示使用该 location 最近首字节延迟的第N百分位，例如 p95、p99.9
+*/
+char *ngx_http_myupstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_int_t                   n;
+
+    if (mycf->hedge_delay != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    mycf->hedge_delay = 0;
+    mycf->hedge_percentile = 0;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].data[0] == 'p') {
+        n = ngx_atofp(value[1].data + 1, value[1].len - 1, 1);
+
+        if (n == NGX_ERROR || n < 1 || n > 999) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid percentile \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        mycf->hedge_percentile = n;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_parse_time(&value[1], 0);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mycf->hedge_delay = (ngx_msec_t) n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_hedge_budget 配置项的回调函数，对冲请求最多占该 location 请求数的百分比
+格式：myupstream_hedge_budget N%;
+*/
+char *ngx_http_myupstream_hedge_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_int_t                   n;
+    size_t                      len;
+
+    if (mycf->hedge_budget != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    len = value[1].len;
+    if (len && value[1].data[len - 1] == '%') {
+        len--;
+    }
+
+    n = ngx_atoi(value[1].data, len);
+
+    if (n == NGX_ERROR || n > 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mycf->hedge_budget = n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+为开启了对冲的 location 分配延迟分布和预算
+参数：cf - 配置对象
+返回值：成功 - 对冲状态
+       失败 - NULL
+*/
+ngx_http_myupstream_hedge_stats_t *ngx_http_myupstream_hedge_init(ngx_conf_t *cf) {
+    return ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_hedge_stats_t));
+}
+
+/*
+create_request 时调用，开始统计首字节延迟，并在等待时间到了之后准备对冲。
+只对冲幂等的 GET，后台更新缓存的子请求也不对冲
+参数：r - 请求
+*/
+void ngx_http_myupstream_hedge_start(ngx_http_request_t *r) {
+    ngx_msec_t                          delay;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_myupstream_ctx_t          *myctx;
+    ngx_http_myupstream_conf_t         *mycf;
+    ngx_http_myupstream_hedge_t        *h;
+    ngx_http_myupstream_hedge_stats_t  *stats;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    stats = mycf->hedge_stats;
+
+    if (r != r->main || r->method != NGX_HTTP_GET || myctx->cache_update || myctx->hedge) {
+        return;
+    }
+
+    h = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_hedge_t));
+    if (h == NULL) {
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return;
+    }
+
+    h->request = r;
+    h->start = ngx_current_msec;
+
+    h->timer.handler = ngx_http_myupstream_hedge_timer_handler;
+    h->timer.data = h;
+    h->timer.log = r->connection->log;
+
+    cln->handler = ngx_http_myupstream_hedge_cleanup;
+    cln->data = h;
+
+    myctx->hedge = h;
+
+    /* 每个请求积累 hedge_budget/100 次对冲的预算 */
+    stats->tokens = ngx_min(stats->tokens + mycf->hedge_budget, 100 * NGX_HTTP_MYUPSTREAM_HEDGE_BURST);
+
+    delay = mycf->hedge_delay ? mycf->hedge_delay : stats->delay;
+
+    if (delay) {
+        ngx_add_timer(&h->timer, delay);
+    }
+}
+
+/*
+收到响应的第一段数据、开始解析响应行时调用。记录首字节延迟；
+对冲连接还在等待时说明主请求先响应了，关闭对冲连接
+参数：r - 请求
+*/
+void ngx_http_myupstream_hedge_header(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t    *myctx;
+    ngx_http_myupstream_conf_t   *mycf;
+    ngx_http_myupstream_hedge_t  *h;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    h = myctx->hedge;
+
+    if (h == NULL || h->header) {
+        return;
+    }
+
+    h->header = 1;
+
+    ngx_http_myupstream_hedge_sample(mycf, ngx_current_msec - h->start);
+
+    if (h->racing) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: primary answered first, closing hedge to %V", h->peer.name);
+
+        myctx->hedge_status = NGX_HTTP_MYUPSTREAM_HEDGE_LOST;
+    }
+
+    ngx_http_myupstream_hedge_close(h, 0);
+}
+
+/* upstream 结束时调用，关闭还没有响应的对冲连接 */
+void ngx_http_myupstream_hedge_finalize(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t    *myctx;
+    ngx_http_myupstream_hedge_t  *h;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    h = myctx->hedge;
+
+    if (h == NULL) {
+        return;
+    }
+
+    if (h->racing) {
+        myctx->hedge_status = NGX_HTTP_MYUPSTREAM_HEDGE_LOST;
+    }
+
+    ngx_http_myupstream_hedge_close(h, 0);
+}
+
+/* $myupstream_hedge，本请求对冲的结果：won、lost、failed、throttled，没有对冲时为空 */
+ngx_int_t ngx_http_myupstream_hedge_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx == NULL || myctx->hedge_status == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_http_myupstream_hedge_status[myctx->hedge_status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_http_myupstream_hedge_status[myctx->hedge_status].data;
+
+    return NGX_OK;
+}
+
+/* 请求销毁时关闭对冲连接 */
+static void ngx_http_myupstream_hedge_cleanup(void *data) {
+    ngx_http_myupstream_hedge_close(data, 0);
+}
+
+/* 等待时间到了主请求还没有响应，在预算允许时发起对冲 */
+static void ngx_http_myupstream_hedge_timer_handler(ngx_event_t *ev) {
+    ngx_http_request_t                 *r;
+    ngx_http_upstream_t                *u;
+    ngx_http_myupstream_ctx_t          *myctx;
+    ngx_http_myupstream_conf_t         *mycf;
+    ngx_http_myupstream_hedge_t        *h;
+    ngx_http_myupstream_hedge_stats_t  *stats;
+
+    h = ev->data;
+    r = h->request;
+    u = r->upstream;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    stats = mycf->hedge_stats;
+
+    if (h->header || u == NULL || u->peer.connection == NULL) {
+        return;
+    }
+
+    if (stats->tokens < 100) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: hedge budget exhausted");
+
+        myctx->hedge_status = NGX_HTTP_MYUPSTREAM_HEDGE_THROTTLED;
+        return;
+    }
+
+    stats->tokens -= 100;
+
+    if (ngx_http_myupstream_hedge_connect(h) != NGX_OK) {
+        ngx_http_myupstream_hedge_fail(h);
+    }
+}
+
+/*
+选择另一个后端建立对冲连接。用 upstream 配置块的 peer.init 为对冲单独初始化一份后端选择的状态，
+这样主请求和对冲各自的 free 都记在自己选中的后端上；init 会改写 u->peer，完成后恢复
+返回值：NGX_OK - 连接已经建立或者正在建立
+       NGX_ERROR - 没有可用的后端或者连接失败
+*/
+static ngx_int_t ngx_http_myupstream_hedge_connect(ngx_http_myupstream_hedge_t *h) {
+    ngx_int_t               rc;
+    ngx_connection_t       *c;
+    ngx_http_request_t     *r;
+    ngx_http_upstream_t    *u;
+    ngx_peer_connection_t   saved;
+
+    r = h->request;
+    u = r->upstream;
+
+    saved = u->peer;
+    u->peer.data = NULL;
+
+    rc = u->upstream->peer.init(r, u->upstream);
+
+    h->get = u->peer.get;
+    h->free = u->peer.free;
+    h->data = u->peer.data;
+    h->peer.tries = u->peer.tries;
+
+    u->peer = saved;
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    h->peer.get = ngx_http_myupstream_hedge_get_peer;
+    h->peer.data = h;
+    h->peer.local = u->peer.local;
+    h->peer.log = r->connection->log;
+    h->peer.log_error = NGX_ERROR_ERR;
+    h->peer.start_time = ngx_current_msec;
+
+    rc = ngx_event_connect_peer(&h->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (rc != NGX_BUSY && h->peer.sockaddr) {
+            h->free(&h->peer, h->data, NGX_PEER_FAILED);
+        }
+
+        h->peer.connection = NULL;
+        return NGX_ERROR;
+    }
+
+    c = h->peer.connection;
+
+    c->data = h;
+    c->read->handler = ngx_http_myupstream_hedge_read_handler;
+    c->write->handler = ngx_http_myupstream_hedge_write_handler;
+
+    if (c->pool == NULL) {
+        c->pool = ngx_create_pool(128, r->connection->log);
+        if (c->pool == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    c->log = r->connection->log;
+    c->pool->log = c->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    /* 请求在 create_request 中一次生成，主请求发送时会移动 pos，这里从头发送 */
+    h->pos = u->request_bufs->buf->start;
+    h->racing = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "myupstream: hedging request to %V, primary is %V", h->peer.name, u->peer.name);
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, u->conf->connect_timeout);
+        return NGX_OK;
+    }
+
+    /* 已经连接上，或者复用了长连接 */
+    h->connected = 1;
+
+    if (ngx_http_myupstream_hedge_send(h) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+对冲连接的 peer.get。选中了主请求正在使用的后端时放回去换下一个，已经尝试过的后端不会再被选中；
+不使用 upstream {} 块时只有一个地址，只能在新的连接上重发
+*/
+static ngx_int_t ngx_http_myupstream_hedge_get_peer(ngx_peer_connection_t *pc, void *data) {
+    ngx_http_myupstream_hedge_t  *h = data;
+    ngx_int_t                     rc;
+    ngx_http_upstream_t          *u;
+    ngx_http_myupstream_conf_t   *mycf;
+
+    u = h->request->upstream;
+    mycf = ngx_http_get_module_loc_conf(h->request, ngx_http_myupstream_module);
+
+    for ( ;; ) {
+        rc = h->get(pc, h->data);
+
+        if (rc != NGX_OK || mycf->pass == NULL
+            || ngx_memn2cmp((u_char *) pc->sockaddr, (u_char *) u->peer.sockaddr, pc->socklen, u->peer.socklen) != 0)
+        {
+            return rc;
+        }
+
+        h->free(pc, h->data, 0);
+
+        if (pc->tries == 0) {
+            return NGX_BUSY;
+        }
+    }
+}
+
+/*
+在对冲连接上发送请求
+返回值：NGX_OK - 发送完毕，NGX_AGAIN - 等待可写事件，NGX_ERROR - 出错
+*/
+static ngx_int_t ngx_http_myupstream_hedge_send(ngx_http_myupstream_hedge_t *h) {
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_connection_t  *c;
+
+    c = h->peer.connection;
+    b = h->request->upstream->request_bufs->buf;
+
+    while (h->pos < b->last) {
+        n = c->send(c, h->pos, b->last - h->pos);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (!c->write->timer_set) {
+                ngx_add_timer(c->write, h->request->upstream->conf->send_timeout);
+            }
+
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        h->pos += n;
+    }
+
+    h->sent = 1;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* 对冲连接的可写事件：连接建立完成或者可以继续发送请求 */
+static void ngx_http_myupstream_hedge_write_handler(ngx_event_t *wev) {
+    int                           err;
+    socklen_t                     len;
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_http_myupstream_hedge_t  *h;
+
+    c = wev->data;
+    h = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "myupstream: hedge to %V timed out", h->peer.name);
+        goto failed;
+    }
+
+    if (h->sent) {
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            goto failed;
+        }
+
+        return;
+    }
+
+    if (!h->connected) {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "myupstream: hedge connect() failed");
+            goto failed;
+        }
+
+        h->connected = 1;
+    }
+
+    rc = ngx_http_myupstream_hedge_send(h);
+
+    if (rc == NGX_ERROR) {
+        goto failed;
+    }
+
+    if (rc == NGX_OK && c->read->ready) {
+        ngx_http_myupstream_hedge_read_handler(c->read);
+    }
+
+    return;
+
+failed:
+
+    ngx_http_myupstream_hedge_fail(h);
+}
+
+/*
+对冲连接的可读事件。只窥探一个字节，不从套接字中取走数据：
+有数据说明对冲连接先响应，交给 upstream 机制从这里开始读取；连接关闭或出错时放弃对冲
+*/
+static void ngx_http_myupstream_hedge_read_handler(ngx_event_t *rev) {
+    ssize_t                       n;
+    char                          buf[1];
+    ngx_connection_t             *c;
+    ngx_http_myupstream_hedge_t  *h;
+
+    c = rev->data;
+    h = c->data;
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        rev->ready = 0;
+
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_http_myupstream_hedge_fail(h);
+        }
+
+        return;
+    }
+
+    /* 请求还没有发完后端就响应了，多半是错误响应，不用它替换主请求 */
+    if (n <= 0 || !h->sent) {
+        ngx_http_myupstream_hedge_fail(h);
+        return;
+    }
+
+    ngx_http_myupstream_hedge_swap(h);
+}
+
+/*
+对冲连接先响应：关闭主请求的连接，把对冲连接换进 u->peer，之后的处理与主请求自己收到响应完全相同。
+主请求的连接还没有收到任何数据（否则对冲连接已经被关闭），与 upstream 机制重试其他后端时一样直接关闭它
+*/
+static void ngx_http_myupstream_hedge_swap(ngx_http_myupstream_hedge_t *h) {
+    ngx_connection_t           *c, *pc;
+    ngx_event_handler_pt        handler;
+    ngx_http_request_t         *r;
+    ngx_http_upstream_t        *u;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    r = h->request;
+    u = r->upstream;
+    c = h->peer.connection;
+    pc = u->peer.connection;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (pc == NULL) {
+        ngx_http_myupstream_hedge_fail(h);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream: hedge to %V answered first, closing %V", h->peer.name, u->peer.name);
+
+    /* upstream 机制的事件处理函数是静态函数，从主请求的连接上取 */
+    handler = pc->read->handler;
+
+    u->peer.free(&u->peer, u->peer.data, 0);
+
+    if (u->peer.connection) {
+        if (pc->pool) {
+            ngx_destroy_pool(pc->pool);
+        }
+
+        ngx_close_connection(pc);
+    }
+
+    u->peer.connection = c;
+    u->peer.sockaddr = h->peer.sockaddr;
+    u->peer.socklen = h->peer.socklen;
+    u->peer.name = h->peer.name;
+    u->peer.get = h->get;
+    u->peer.free = h->free;
+    u->peer.data = h->data;
+    u->peer.cached = h->peer.cached;
+    u->peer.tries = 1;
+
+    if (u->state) {
+        u->state->peer = u->peer.name;
+    }
+
+    h->peer.connection = NULL;
+    h->racing = 0;
+    myctx->hedge_status = NGX_HTTP_MYUPSTREAM_HEDGE_WON;
+
+    c->data = r;
+    c->read->handler = handler;
+    c->write->handler = handler;
+    c->sendfile &= r->connection->sendfile;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    /* 请求已经由对冲连接发送，清掉主请求没有发完的部分，upstream 机制不会再发送 */
+    u->output.sendfile = c->sendfile;
+    u->output.in = NULL;
+    u->output.busy = NULL;
+    u->writer.out = NULL;
+    u->writer.last = &u->writer.out;
+    u->writer.connection = c;
+    u->request_sent = 1;
+
+    if (!u->request_body_sent) {
+        /* 主请求还没有发完请求，由发送函数完成收尾并开始读取响应 */
+        u->write_event_handler(r, u);
+
+    } else {
+        ngx_add_timer(c->read, u->conf->read_timeout);
+        u->read_event_handler(r, u);
+    }
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+static void ngx_http_myupstream_hedge_fail(ngx_http_myupstream_hedge_t *h) {
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(h->request, ngx_http_myupstream_module);
+    myctx->hedge_status = NGX_HTTP_MYUPSTREAM_HEDGE_FAILED;
+
+    ngx_http_myupstream_hedge_close(h, NGX_PEER_FAILED);
+}
+
+/*
+关闭对冲连接。连接上可能还有没读的响应，不能放回长连接池，
+所以先把 peer.connection 置空再调用 free，让长连接池跳过它
+*/
+static void ngx_http_myupstream_hedge_close(ngx_http_myupstream_hedge_t *h, ngx_uint_t state) {
+    ngx_connection_t  *c;
+
+    if (h->timer.timer_set) {
+        ngx_del_timer(&h->timer);
+    }
+
+    h->racing = 0;
+
+    c = h->peer.connection;
+    if (c == NULL) {
+        return;
+    }
+
+    h->peer.connection = NULL;
+    h->free(&h->peer, h->data, state);
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+}
+
+/* 记录一次首字节延迟，按百分位对冲时定期重新计算等待时间 */
+static void ngx_http_myupstream_hedge_sample(ngx_http_myupstream_conf_t *mycf, ngx_msec_t ms) {
+    ngx_uint_t                          i, n, target;
+    ngx_http_myupstream_hedge_stats_t  *stats = mycf->hedge_stats;
+
+    stats->bucket[ngx_http_myupstream_hedge_bucket(ms)]++;
+    stats->samples++;
+
+    if (stats->samples >= NGX_HTTP_MYUPSTREAM_HEDGE_WINDOW) {
+        stats->samples = 0;
+
+        for (i = 0; i < NGX_HTTP_MYUPSTREAM_HEDGE_BUCKETS; i++) {
+            stats->bucket[i] /= 2;
+            stats->samples += stats->bucket[i];
+        }
+    }
+
+    if (mycf->hedge_percentile == 0 || ++stats->pending < NGX_HTTP_MYUPSTREAM_HEDGE_RECALC) {
+        return;
+    }
+
+    stats->pending = 0;
+
+    if (stats->samples < NGX_HTTP_MYUPSTREAM_HEDGE_MIN_SAMPLES) {
+        stats->delay = 0;
+        return;
+    }
+
+    /* hedge_percentile 的单位是千分之一 */
+    target = (stats->samples * mycf->hedge_percentile + 999) / 1000;
+
+    for (i = 0, n = 0; i < NGX_HTTP_MYUPSTREAM_HEDGE_BUCKETS - 1; i++) {
+        n += stats->bucket[i];
+        if (n >= target) {
+            break;
+        }
+    }
+
+    stats->delay = ngx_max(ngx_http_myupstream_hedge_bound(i), 1);
+}
+
+/* 计算一个毫秒值所在的桶，超出范围的计入最后一个桶 */
+static ngx_uint_t ngx_http_myupstream_hedge_bucket(ngx_msec_t ms) {
+    ngx_uint_t  e;
+
+    if (ms < NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS) {
+        return (ngx_uint_t) ms;
+    }
+
+    for (e = 2; ms >> (e + 1); e++) { /* void */ }
+
+    if (e > NGX_HTTP_MYUPSTREAM_HEDGE_MAX_EXP) {
+        return NGX_HTTP_MYUPSTREAM_HEDGE_BUCKETS - 1;
+    }
+
+    return NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS + (e - 2) * NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS
+           + ((ms >> (e - 2)) & (NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS - 1));
+}
+
+/* 桶的上界（包含），单位毫秒 */
+static ngx_msec_t ngx_http_myupstream_hedge_bound(ngx_uint_t bucket) {
+    ngx_uint_t  e, m;
+
+    if (bucket < NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    e = (bucket - NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS) / NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS + 2;
+    m = (bucket - NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS) % NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS;
+
+    return ((ngx_msec_t) (NGX_HTTP_MYUPSTREAM_HEDGE_SUB_BUCKETS + 1 + m) << (e - 2)) - 1;
+}
@@ -0,0 +1,2537 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 帧的编解码和 Huffman 编码借用 ngx_http_v2_module，没有编译该模块时 merge 阶段会报错 */
+#if (NGX_HTTP_V2)
+
+/* 帧头的长度和帧类型 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER     9
+
+#define NGX_HTTP_MYUPSTREAM_HTTP2_DATA             0x0
+#define NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS          0x1
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PRIORITY         0x2
+#define NGX_HTTP_MYUPSTREAM_HTTP2_RST_STREAM       0x3
+#define NGX_HTTP_MYUPSTREAM_HTTP2_SETTINGS         0x4
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PUSH_PROMISE     0x5
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PING             0x6
+#define NGX_HTTP_MYUPSTREAM_HTTP2_GOAWAY           0x7
+#define NGX_HTTP_MYUPSTREAM_HTTP2_WINDOW_UPDATE    0x8
+#define NGX_HTTP_MYUPSTREAM_HTTP2_CONTINUATION     0x9
+
+#define NGX_HTTP_MYUPSTREAM_HTTP2_END_STREAM       0x01
+#define NGX_HTTP_MYUPSTREAM_HTTP2_ACK              0x01
+#define NGX_HTTP_MYUPSTREAM_HTTP2_END_HEADERS      0x04
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PADDED           0x08
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PRIORITY_FLAG    0x20
+
+#define NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE_PARAM        0x1
+#define NGX_HTTP_MYUPSTREAM_HTTP2_ENABLE_PUSH_PARAM       0x2
+#define NGX_HTTP_MYUPSTREAM_HTTP2_MAX_STREAMS_PARAM       0x3
+#define NGX_HTTP_MYUPSTREAM_HTTP2_INITIAL_WINDOW_PARAM    0x4
+#define NGX_HTTP_MYUPSTREAM_HTTP2_MAX_FRAME_SIZE_PARAM    0x5
+
+#define NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR         0x0
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR   0x1
+#define NGX_HTTP_MYUPSTREAM_HTTP2_FLOW_CTRL_ERROR  0x3
+#define NGX_HTTP_MYUPSTREAM_HTTP2_REFUSED_STREAM   0x7
+#define NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL           0x8
+#define NGX_HTTP_MYUPSTREAM_HTTP2_COMP_ERROR       0x9
+
+#define NGX_HTTP_MYUPSTREAM_HTTP2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+/* 协议规定的缺省值 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_DEFAULT_WINDOW   65535
+#define NGX_HTTP_MYUPSTREAM_HTTP2_MAX_WINDOW       0x7fffffff
+#define NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE       16384
+#define NGX_HTTP_MYUPSTREAM_HTTP2_MAX_FRAME_SIZE   ((1 << 24) - 1)
+#define NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE       4096
+
+/* HPACK 动态表中每一项额外占用 32 个字节，表中最多 4096 / 32 项 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_ENTRY_OVERHEAD   32
+#define NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES    (NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE / NGX_HTTP_MYUPSTREAM_HTTP2_ENTRY_OVERHEAD)
+
+/*
+每个流的接收窗口。只有发给客户端的数据发送出去之后才归还窗口，
+所以一个流在内存中积压的响应包体不会超过这个值，慢速客户端不会拖累同一个连接上的其他流
+*/
+#define NGX_HTTP_MYUPSTREAM_HTTP2_STREAM_WINDOW    (256 * 1024)
+/* 连接的接收窗口，收到数据就归还，只用来避免连接级的流控成为瓶颈 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_CONN_WINDOW      (16 * 1024 * 1024)
+
+/* 读缓冲区至少要能放下一个完整的帧 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_IN_SIZE          (2 * NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE + NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER)
+#define NGX_HTTP_MYUPSTREAM_HTTP2_OUT_SIZE         (64 * 1024)
+/* 一个响应头块（HEADERS 加上 CONTINUATION）的最大长度 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_MAX_HEADER_BLOCK (64 * 1024)
+/* 长度为 len 的请求头块拆成帧之后占用的发送缓冲区，按对端允许的最小帧长度计算 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS_SPACE(len)                                                 \
+    ((len) + ((len) / NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE + 1) * NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER)
+
+/* 对端发来 SETTINGS 之前，一个连接上最多同时打开的流 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_INITIAL_STREAMS  100
+/* 流被拒绝（REFUSED_STREAM、GOAWAY 之后的流、连接在响应之前断开）时最多重试的次数 */
+#define NGX_HTTP_MYUPSTREAM_HTTP2_RETRIES          2
+
+/* HPACK 动态表中的一项，名字和值连续存放 */
+typedef struct {
+    size_t                                 name_len;
+    size_t                                 value_len;
+    u_char                                 data[1];
+} ngx_http_myupstream_http2_entry_t;
+
+/* HPACK 动态表，编码和解码各一张，在连接的整个生命周期中保持 */
+typedef struct {
+    ngx_http_myupstream_http2_entry_t     *entries[NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES];
+    ngx_uint_t                             last;        /* 最新一项所在的槽位 */
+    ngx_uint_t                             n;
+    size_t                                 size;
+    size_t                                 max;
+} ngx_http_myupstream_http2_table_t;
+
+typedef struct ngx_http_myupstream_http2_conn_s  ngx_http_myupstream_http2_conn_t;
+
+/* 一个后端地址 */
+typedef struct {
+    struct sockaddr                       *sockaddr;
+    socklen_t                              socklen;
+    ngx_str_t                              name;
+} ngx_http_myupstream_http2_peer_t;
+
+/* 每个 worker 中一个 location 的 HTTP/2 连接池，挂在 location 配置上 */
+struct ngx_http_myupstream_http2_s {
+    ngx_http_myupstream_conf_t            *conf;
+
+    ngx_http_myupstream_http2_peer_t      *peers;
+    ngx_uint_t                             npeers;
+    ngx_uint_t                             next_peer;
+
+    ngx_queue_t                            connections;
+    ngx_uint_t                             nconnections;
+    ngx_uint_t                             max_connections;
+
+    ngx_queue_t                            waiting;     /* 所有连接都没有空闲的流时排队的请求 */
+};
+
+/* 一个到后端的 HTTP/2 连接，内存从自己的内存池中分配，连接关闭时一起释放 */
+struct ngx_http_myupstream_http2_conn_s {
+    ngx_http_myupstream_http2_t           *pool;
+    ngx_queue_t                            queue;
+    ngx_peer_connection_t                  peer;
+    ngx_pool_t                            *mpool;
+    ngx_log_t                              log;
+
+    ngx_queue_t                            streams;     /* 分配到该连接上的流，按打开的顺序 */
+    ngx_uint_t                             nstreams;
+    ngx_uint_t                             max_streams; /* 对端的 SETTINGS_MAX_CONCURRENT_STREAMS */
+    ngx_uint_t                             next_id;
+    ngx_uint_t                             last_id;     /* GOAWAY 中对端处理过的最大流 ID */
+    size_t                                 frame_size;  /* 对端的 SETTINGS_MAX_FRAME_SIZE */
+
+    size_t                                 recv_window; /* 连接的接收窗口还剩多少 */
+    size_t                                 recv_unacked;
+
+    ngx_http_myupstream_http2_table_t      encoder;
+    ngx_http_myupstream_http2_table_t      decoder;
+
+    ngx_buf_t                             *in;
+    ngx_buf_t                             *out;         /* 待发送的帧，控制帧和 HEADERS 在发送前才生成 */
+
+    u_char                                *block;       /* 正在接收的响应头块 */
+    size_t                                 block_len;
+    size_t                                 block_size;
+    ngx_uint_t                             block_stream;
+    ngx_uint_t                             block_end_stream;
+
+    u_char                                *scratch;     /* 解码时存放一个头部的名字和值 */
+    size_t                                 scratch_size;
+
+    u_char                                 ping[8];
+    ngx_uint_t                             settings_ack;
+    ngx_uint_t                             goaway_error; /* 要发送的 GOAWAY 的错误码 */
+
+    unsigned                               connected:1;
+    unsigned                               table_update:1;  /* 下一个头块开头要通知对端新的表大小 */
+    unsigned                               ping_ack:1;
+    unsigned                               goaway:1;        /* 收到了 GOAWAY，不再打开新的流 */
+    unsigned                               send_goaway:1;
+    unsigned                               processing:1;    /* 正在处理读事件，推迟关闭 */
+    unsigned                               closing:1;
+    unsigned                               closed:1;
+};
+
+/* 一个请求对应的流，从请求内存池中分配 */
+struct ngx_http_myupstream_http2_stream_s {
+    ngx_http_request_t                    *request;
+    ngx_http_myupstream_http2_conn_t      *conn;        /* 为 NULL 时在连接池的等待队列中，或者已经结束 */
+    ngx_queue_t                            queue;
+    ngx_event_t                            timer;
+
+    ngx_buf_t                             *request_buf; /* 由请求模板生成的 HTTP/1.1 请求，发送时转换成 HEADERS */
+    ngx_uint_t                             id;          /* 发送 HEADERS 时才分配，保证流 ID 按发送顺序递增 */
+    ngx_uint_t                             retries;
+    ngx_uint_t                             status;
+
+    size_t                                 recv_window;
+    size_t                                 window_update;
+
+    ngx_chain_t                           *out;         /* 本轮读事件中收到、还没有交给过滤模块的包体 */
+    ngx_chain_t                          **last_out;
+    ngx_chain_t                           *tail;        /* out 中的最后一个缓冲区 */
+    ngx_chain_t                           *free;
+    ngx_chain_t                           *busy;
+
+    unsigned                               waiting:1;
+    unsigned                               headers_pending:1;  /* HEADERS 还没有写入发送缓冲区 */
+    unsigned                               informational:1;    /* 正在解码 1xx 响应头 */
+    unsigned                               response:1;         /* 已经收到最终的响应头 */
+    unsigned                               done:1;             /* 收到了 END_STREAM */
+};
+
+/* HPACK 静态表 */
+static ngx_str_t ngx_http_myupstream_http2_static_table[][2] = {
+    { ngx_string(":authority"), ngx_null_string },
+    { ngx_string(":method"), ngx_string("GET") },
+    { ngx_string(":method"), ngx_string("POST") },
+    { ngx_string(":path"), ngx_string("/") },
+    { ngx_string(":path"), ngx_string("/index.html") },
+    { ngx_string(":scheme"), ngx_string("http") },
+    { ngx_string(":scheme"), ngx_string("https") },
+    { ngx_string(":status"), ngx_string("200") },
+    { ngx_string(":status"), ngx_string("204") },
+    { ngx_string(":status"), ngx_string("206") },
+    { ngx_string(":status"), ngx_string("304") },
+    { ngx_string(":status"), ngx_string("400") },
+    { ngx_string(":status"), ngx_string("404") },
+    { ngx_string(":status"), ngx_string("500") },
+    { ngx_string("accept-charset"), ngx_null_string },
+    { ngx_string("accept-encoding"), ngx_string("gzip, deflate") },
+    { ngx_string("accept-language"), ngx_null_string },
+    { ngx_string("accept-ranges"), ngx_null_string },
+    { ngx_string("accept"), ngx_null_string },
+    { ngx_string("access-control-allow-origin"), ngx_null_string },
+    { ngx_string("age"), ngx_null_string },
+    { ngx_string("allow"), ngx_null_string },
+    { ngx_string("authorization"), ngx_null_string },
+    { ngx_string("cache-control"), ngx_null_string },
+    { ngx_string("content-disposition"), ngx_null_string },
+    { ngx_string("content-encoding"), ngx_null_string },
+    { ngx_string("content-language"), ngx_null_string },
+    { ngx_string("content-length"), ngx_null_string },
+    { ngx_string("content-location"), ngx_null_string },
+    { ngx_string("content-range"), ngx_null_string },
+    { ngx_string("content-type"), ngx_null_string },
+    { ngx_string("cookie"), ngx_null_string },
+    { ngx_string("date"), ngx_null_string },
+    { ngx_string("etag"), ngx_null_string },
+    { ngx_string("expect"), ngx_null_string },
+    { ngx_string("expires"), ngx_null_string },
+    { ngx_string("from"), ngx_null_string },
+    { ngx_string("host"), ngx_null_string },
+    { ngx_string("if-match"), ngx_null_string },
+    { ngx_string("if-modified-since"), ngx_null_string },
+    { ngx_string("if-none-match"), ngx_null_string },
+    { ngx_string("if-range"), ngx_null_string },
+    { ngx_string("if-unmodified-since"), ngx_null_string },
+    { ngx_string("last-modified"), ngx_null_string },
+    { ngx_string("link"), ngx_null_string },
+    { ngx_string("location"), ngx_null_string },
+    { ngx_string("max-forwards"), ngx_null_string },
+    { ngx_string("proxy-authenticate"), ngx_null_string },
+    { ngx_string("proxy-authorization"), ngx_null_string },
+    { ngx_string("range"), ngx_null_string },
+    { ngx_string("referer"), ngx_null_string },
+    { ngx_string("refresh"), ngx_null_string },
+    { ngx_string("retry-after"), ngx_null_string },
+    { ngx_string("server"), ngx_null_string },
+    { ngx_string("set-cookie"), ngx_null_string },
+    { ngx_string("strict-transport-security"), ngx_null_string },
+    { ngx_string("transfer-encoding"), ngx_null_string },
+    { ngx_string("user-agent"), ngx_null_string },
+    { ngx_string("vary"), ngx_null_string },
+    { ngx_string("via"), ngx_null_string },
+    { ngx_string("www-authenticate"), ngx_null_string }
+};
+
+#define NGX_HTTP_MYUPSTREAM_HTTP2_STATIC_ENTRIES \
+    (sizeof(ngx_http_myupstream_http2_static_table) / sizeof(ngx_http_myupstream_http2_static_table[0]))
+
+/* 不转发给客户端的响应头：nginx 自己生成的，以及 HTTP/1.1 中逐跳的头部 */
+static ngx_str_t ngx_http_myupstream_http2_hide_headers[] = {
+    ngx_string("date"),
+    ngx_string("server"),
+    ngx_string("connection"),
+    ngx_string("keep-alive"),
+    ngx_string("transfer-encoding"),
+    ngx_string("x-pad"),
+    ngx_string("x-accel-expires"),
+    ngx_string("x-accel-redirect"),
+    ngx_string("x-accel-limit-rate"),
+    ngx_string("x-accel-buffering"),
+    ngx_string("x-accel-charset"),
+    ngx_null_string
+};
+
+static ngx_int_t ngx_http_myupstream_http2_dispatch(ngx_http_myupstream_http2_stream_t *st);
+static void ngx_http_myupstream_http2_dispatch_waiting(ngx_http_myupstream_http2_t *pool);
+static ngx_http_myupstream_http2_conn_t *ngx_http_myupstream_http2_connect(ngx_http_myupstream_http2_t *pool, ngx_log_t *log);
+static void ngx_http_myupstream_http2_detach(ngx_http_myupstream_http2_stream_t *st);
+static void ngx_http_myupstream_http2_requeue(ngx_http_myupstream_http2_stream_t *st);
+static void ngx_http_myupstream_http2_fail(ngx_http_myupstream_http2_stream_t *st, ngx_int_t rc);
+static void ngx_http_myupstream_http2_finish(ngx_http_myupstream_http2_stream_t *st, ngx_int_t rc);
+static void ngx_http_myupstream_http2_reset(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t id, ngx_uint_t error);
+static void ngx_http_myupstream_http2_close(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t error);
+static void ngx_http_myupstream_http2_idle(ngx_http_myupstream_http2_conn_t *hc);
+
+static void ngx_http_myupstream_http2_read_handler(ngx_event_t *rev);
+static void ngx_http_myupstream_http2_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_myupstream_http2_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_http_myupstream_http2_flush(ngx_http_myupstream_http2_conn_t *hc);
+static void ngx_http_myupstream_http2_write_frames(ngx_http_myupstream_http2_conn_t *hc);
+static u_char *ngx_http_myupstream_http2_frame_head(u_char *p, size_t len, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t id);
+static size_t ngx_http_myupstream_http2_request_bound(ngx_buf_t *b);
+static u_char *ngx_http_myupstream_http2_encode_request(ngx_http_myupstream_http2_conn_t *hc, ngx_http_myupstream_http2_stream_t *st, u_char *p, u_char *end);
+
+static ngx_int_t ngx_http_myupstream_http2_process_frame(ngx_http_myupstream_http2_conn_t *hc, u_char *p, size_t len);
+static ngx_int_t ngx_http_myupstream_http2_data_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t flags, ngx_uint_t id, u_char *p, size_t len);
+static ngx_int_t ngx_http_myupstream_http2_headers_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t id, u_char *p, size_t len);
+static ngx_int_t ngx_http_myupstream_http2_settings_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t flags, u_char *p, size_t len);
+static ngx_int_t ngx_http_myupstream_http2_goaway_frame(ngx_http_myupstream_http2_conn_t *hc, u_char *p, size_t len);
+static void ngx_http_myupstream_http2_rst_stream_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t id, u_char *p);
+static ngx_http_myupstream_http2_stream_t *ngx_http_myupstream_http2_find(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t id);
+
+static ngx_int_t ngx_http_myupstream_http2_decode(ngx_http_myupstream_http2_conn_t *hc, ngx_http_myupstream_http2_stream_t *st);
+static ngx_int_t ngx_http_myupstream_http2_decode_int(u_char **pos, u_char *end, ngx_uint_t prefix, ngx_uint_t *value);
+static ngx_int_t ngx_http_myupstream_http2_decode_string(ngx_http_myupstream_http2_conn_t *hc, u_char **pos, u_char *end, u_char **dst);
+static ngx_int_t ngx_http_myupstream_http2_lookup(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t index, ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_myupstream_http2_header(ngx_http_myupstream_http2_stream_t *st, ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_myupstream_http2_response(ngx_http_myupstream_http2_stream_t *st);
+
+static ngx_int_t ngx_http_myupstream_http2_table_add(ngx_http_myupstream_http2_table_t *t, ngx_str_t *name, ngx_str_t *value);
+static void ngx_http_myupstream_http2_table_size(ngx_http_myupstream_http2_table_t *t, size_t max);
+static ngx_http_myupstream_http2_entry_t *ngx_http_myupstream_http2_table_get(ngx_http_myupstream_http2_table_t *t, ngx_uint_t k);
+static void ngx_http_myupstream_http2_table_free(ngx_http_myupstream_http2_table_t *t);
+static u_char *ngx_http_myupstream_http2_encode_int(u_char *p, ngx_uint_t prefix, ngx_uint_t mask, ngx_uint_t value);
+static u_char *ngx_http_myupstream_http2_encode_string(u_char *p, u_char *data, size_t len, u_char *tmp);
+static u_char *ngx_http_myupstream_http2_encode_header(ngx_http_myupstream_http2_conn_t *hc, u_char *p, ngx_str_t *name, ngx_str_t *value, ngx_uint_t index, u_char *tmp);
+
+static ngx_int_t ngx_http_myupstream_http2_append(ngx_http_myupstream_http2_stream_t *st, u_char *data, size_t len);
+static void ngx_http_myupstream_http2_deliver(ngx_http_myupstream_http2_stream_t *st);
+static void ngx_http_myupstream_http2_update_window(ngx_http_myupstream_http2_stream_t *st);
+static void ngx_http_myupstream_http2_client_write(ngx_http_request_t *r);
+static void ngx_http_myupstream_http2_timeout(ngx_event_t *ev);
+static void ngx_http_myupstream_http2_cleanup(void *data);
+
+/*
+为配置了 myupstream_http2 的 location 创建连接池。后端地址取自 myupstream_pass 指定的 upstream {} 块，
+每个 worker 按顺序轮流向这些地址建立连接
+参数：cf - 配置对象
+     conf - 该 location 的配置
+返回值：成功 - 连接池
+       失败 - NULL
+*/
+ngx_http_myupstream_http2_t *ngx_http_myupstream_http2_init(ngx_conf_t *cf, ngx_http_myupstream_conf_t *conf) {
+    ngx_uint_t                         i, j, n;
+    ngx_http_upstream_server_t        *server;
+    ngx_http_myupstream_http2_t       *pool;
+    ngx_http_myupstream_http2_peer_t  *peer;
+
+    if (conf->pass == NULL || conf->pass->servers == NULL || conf->pass->servers->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_http2\" requires \"myupstream_pass\" to an upstream block with servers");
+        return NULL;
+    }
+
+    pool = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_http2_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    server = conf->pass->servers->elts;
+    n = 0;
+
+    for (i = 0; i < conf->pass->servers->nelts; i++) {
+        if (!server[i].down && !server[i].backup) {
+            n += server[i].naddrs;
+        }
+    }
+
+    if (n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no usable servers in upstream \"%V\"", &conf->pass->host);
+        return NULL;
+    }
+
+    pool->peers = ngx_palloc(cf->pool, n * sizeof(ngx_http_myupstream_http2_peer_t));
+    if (pool->peers == NULL) {
+        return NULL;
+    }
+
+    peer = pool->peers;
+
+    for (i = 0; i < conf->pass->servers->nelts; i++) {
+        if (server[i].down || server[i].backup) {
+            continue;
+        }
+
+        for (j = 0; j < server[i].naddrs; j++) {
+            peer->sockaddr = server[i].addrs[j].sockaddr;
+            peer->socklen = server[i].addrs[j].socklen;
+            peer->name = server[i].addrs[j].name;
+            peer++;
+        }
+    }
+
+    pool->npeers = n;
+    pool->conf = conf;
+    pool->max_connections = conf->http2_connections;
+
+    ngx_queue_init(&pool->connections);
+    ngx_queue_init(&pool->waiting);
+
+    return pool;
+}
+
+/*
+用 HTTP/2 向后端发送请求，代替 ngx_http_upstream_create 和 ngx_http_upstream_init。
+请求作为一个流复用已有的连接，没有可用的连接时新建，连接数达到上限时排队
+参数：r - 请求
+返回值：NGX_DONE - 已经增加了引用计数，响应由连接的读事件转发
+       其他 - HTTP 错误码或 NGX_ERROR
+*/
+ngx_int_t ngx_http_myupstream_http2_start(ngx_http_request_t *r) {
+    ngx_int_t                            rc;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_myupstream_ctx_t           *myctx;
+    ngx_http_myupstream_conf_t          *mycf;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    /* 发往后端的总是 GET 请求，客户端的包体没有用处 */
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    st = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_http2_stream_t));
+    if (st == NULL) {
+        return NGX_ERROR;
+    }
+
+    st->request_buf = ngx_http_myupstream_template_render(r, mycf->request_template);
+    if (st->request_buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* 请求头超过对端的帧长度时拆成 HEADERS 和 CONTINUATION，但是整个头块要能一次放进发送缓冲区 */
+    if (NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS_SPACE(ngx_http_myupstream_http2_request_bound(st->request_buf)) > NGX_HTTP_MYUPSTREAM_HTTP2_OUT_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "myupstream http2: request headers do not fit into the send buffer");
+        return NGX_HTTP_REQUEST_HEADER_TOO_LARGE;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    st->request = r;
+    st->last_out = &st->out;
+    st->timer.handler = ngx_http_myupstream_http2_timeout;
+    st->timer.data = st;
+    st->timer.log = r->connection->log;
+
+    cln->handler = ngx_http_myupstream_http2_cleanup;
+    cln->data = st;
+
+    myctx->http2 = st;
+
+    r->write_event_handler = ngx_http_myupstream_http2_client_write;
+
+    rc = ngx_http_myupstream_http2_dispatch(st);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/*
+为流选择一个连接：优先使用打开的流最少、还有余量的连接，都满了就新建连接，连接数达到上限时排队
+返回值：NGX_OK - 已经分配了连接或者进入了等待队列
+       NGX_HTTP_BAD_GATEWAY - 无法连接后端
+*/
+static ngx_int_t ngx_http_myupstream_http2_dispatch(ngx_http_myupstream_http2_stream_t *st) {
+    ngx_queue_t                       *q;
+    ngx_http_request_t                *r;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_http2_t       *pool;
+    ngx_http_myupstream_http2_conn_t  *hc, *best;
+
+    r = st->request;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    pool = mycf->http2_pool;
+
+    best = NULL;
+
+    for (q = ngx_queue_head(&pool->connections); q != ngx_queue_sentinel(&pool->connections); q = ngx_queue_next(q)) {
+        hc = ngx_queue_data(q, ngx_http_myupstream_http2_conn_t, queue);
+
+        if (hc->goaway || hc->closing || hc->nstreams >= hc->max_streams) {
+            continue;
+        }
+
+        if (best == NULL || hc->nstreams < best->nstreams) {
+            best = hc;
+        }
+    }
+
+    if (best == NULL && pool->nconnections < pool->max_connections) {
+        best = ngx_http_myupstream_http2_connect(pool, r->connection->log);
+        if (best == NULL) {
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+    }
+
+    if (st->timer.timer_set) {
+        ngx_del_timer(&st->timer);
+    }
+
+    if (best == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream http2: all %ui connections busy, waiting", pool->nconnections);
+
+        ngx_queue_insert_tail(&pool->waiting, &st->queue);
+        st->waiting = 1;
+
+        ngx_add_timer(&st->timer, mycf->upstream.connect_timeout);
+        return NGX_OK;
+    }
+
+    ngx_queue_insert_tail(&best->streams, &st->queue);
+    best->nstreams++;
+
+    st->conn = best;
+    st->id = 0;
+    st->headers_pending = 1;
+    st->recv_window = NGX_HTTP_MYUPSTREAM_HTTP2_STREAM_WINDOW;
+    st->window_update = 0;
+
+    /* 连接空闲时读事件上挂着空闲超时的定时器 */
+    if (best->peer.connection->read->timer_set && best->nstreams == 1) {
+        ngx_del_timer(best->peer.connection->read);
+    }
+
+    ngx_add_timer(&st->timer, mycf->upstream.read_timeout);
+
+    /*
+    HEADERS 留到本轮事件循环结束时由写事件统一发送：同一轮中分配到这个连接的流合并成一次 send()，
+    发送失败时也不会在请求的 handler 返回之前就结束请求。连接还没有建立时由连接成功的写事件发送
+    */
+    if (best->connected) {
+        ngx_post_event(best->peer.connection->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+/* 有流结束或者连接的并发上限变大时，把排队的请求分配出去 */
+static void ngx_http_myupstream_http2_dispatch_waiting(ngx_http_myupstream_http2_t *pool) {
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    while (!ngx_queue_empty(&pool->waiting)) {
+        q = ngx_queue_head(&pool->waiting);
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+
+        ngx_queue_remove(q);
+        st->waiting = 0;
+
+        rc = ngx_http_myupstream_http2_dispatch(st);
+
+        if (rc != NGX_OK) {
+            c = st->request->connection;
+            ngx_http_myupstream_http2_fail(st, rc);
+            ngx_http_run_posted_requests(c);
+            continue;
+        }
+
+        /* 又回到了等待队列，说明没有空闲的流了 */
+        if (st->waiting) {
+            break;
+        }
+    }
+}
+
+/*
+向下一个后端地址发起连接，连接建立之前就把连接前言、SETTINGS 和 HEADERS 写入发送缓冲区
+返回值：成功 - 新的连接
+       失败 - NULL
+*/
+static ngx_http_myupstream_http2_conn_t *ngx_http_myupstream_http2_connect(ngx_http_myupstream_http2_t *pool, ngx_log_t *log) {
+    int                                tcp_nodelay;
+    u_char                            *p;
+    ngx_int_t                          rc;
+    ngx_pool_t                        *mpool;
+    ngx_connection_t                  *c;
+    ngx_http_myupstream_http2_peer_t  *peer;
+    ngx_http_myupstream_http2_conn_t  *hc;
+
+    mpool = ngx_create_pool(1024, log);
+    if (mpool == NULL) {
+        return NULL;
+    }
+
+    hc = ngx_pcalloc(mpool, sizeof(ngx_http_myupstream_http2_conn_t));
+    if (hc == NULL) {
+        goto failed;
+    }
+
+    hc->mpool = mpool;
+    hc->pool = pool;
+
+    /* 连接比发起它的请求活得久，日志不能引用请求的连接 */
+    hc->log = *ngx_cycle->log;
+
+    hc->in = ngx_create_temp_buf(mpool, NGX_HTTP_MYUPSTREAM_HTTP2_IN_SIZE);
+    hc->out = ngx_create_temp_buf(mpool, NGX_HTTP_MYUPSTREAM_HTTP2_OUT_SIZE);
+    if (hc->in == NULL || hc->out == NULL) {
+        goto failed;
+    }
+
+    ngx_queue_init(&hc->streams);
+    hc->max_streams = NGX_HTTP_MYUPSTREAM_HTTP2_INITIAL_STREAMS;
+    hc->next_id = 1;
+    hc->frame_size = NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE;
+    hc->recv_window = NGX_HTTP_MYUPSTREAM_HTTP2_CONN_WINDOW;
+    hc->encoder.max = NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE;
+    hc->decoder.max = NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE;
+
+    peer = &pool->peers[pool->next_peer++ % pool->npeers];
+
+    hc->peer.sockaddr = peer->sockaddr;
+    hc->peer.socklen = peer->socklen;
+    hc->peer.name = &peer->name;
+    hc->peer.get = ngx_event_get_peer;
+    hc->peer.log = &hc->log;
+    hc->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&hc->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "myupstream http2: connect to %V failed", &peer->name);
+
+        if (hc->peer.connection) {
+            ngx_close_connection(hc->peer.connection);
+        }
+
+        goto failed;
+    }
+
+    c = hc->peer.connection;
+    c->data = hc;
+    c->pool = mpool;
+    c->read->handler = ngx_http_myupstream_http2_read_handler;
+    c->write->handler = ngx_http_myupstream_http2_write_handler;
+
+    tcp_nodelay = 1;
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &tcp_nodelay, sizeof(int)) == -1) {
+        ngx_connection_error(c, ngx_socket_errno, "setsockopt(TCP_NODELAY) failed");
+    }
+
+    /* 连接前言；关闭服务器推送，通告流的接收窗口；然后把连接的接收窗口放大 */
+    p = ngx_cpymem(hc->out->last, NGX_HTTP_MYUPSTREAM_HTTP2_PREFACE, sizeof(NGX_HTTP_MYUPSTREAM_HTTP2_PREFACE) - 1);
+
+    p = ngx_http_myupstream_http2_frame_head(p, 12, NGX_HTTP_MYUPSTREAM_HTTP2_SETTINGS, 0, 0);
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_MYUPSTREAM_HTTP2_ENABLE_PUSH_PARAM);
+    p = ngx_http_v2_write_uint32(p, 0);
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_MYUPSTREAM_HTTP2_INITIAL_WINDOW_PARAM);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_MYUPSTREAM_HTTP2_STREAM_WINDOW);
+
+    p = ngx_http_myupstream_http2_frame_head(p, 4, NGX_HTTP_MYUPSTREAM_HTTP2_WINDOW_UPDATE, 0, 0);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_MYUPSTREAM_HTTP2_CONN_WINDOW - NGX_HTTP_MYUPSTREAM_HTTP2_DEFAULT_WINDOW);
+
+    hc->out->last = p;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, pool->conf->upstream.connect_timeout);
+
+    } else {
+        hc->connected = 1;
+    }
+
+    ngx_queue_insert_tail(&pool->connections, &hc->queue);
+    pool->nconnections++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "myupstream http2: new connection to %V, %ui total", &peer->name, pool->nconnections);
+
+    return hc;
+
+failed:
+
+    ngx_destroy_pool(mpool);
+    return NULL;
+}
+
+/* 流离开连接：连接上空出了一个流，排队的请求可以使用；收到过 GOAWAY 的连接在最后一个流结束后关闭 */
+static void ngx_http_myupstream_http2_detach(ngx_http_myupstream_http2_stream_t *st) {
+    ngx_http_myupstream_http2_conn_t  *hc;
+
+    if (st->timer.timer_set) {
+        ngx_del_timer(&st->timer);
+    }
+
+    if (st->waiting) {
+        ngx_queue_remove(&st->queue);
+        st->waiting = 0;
+        return;
+    }
+
+    hc = st->conn;
+    if (hc == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&st->queue);
+    hc->nstreams--;
+    st->conn = NULL;
+
+    if (hc->closing) {
+        return;
+    }
+
+    if (hc->nstreams == 0) {
+        ngx_http_myupstream_http2_idle(hc);
+    }
+
+    if (!hc->goaway) {
+        ngx_http_myupstream_http2_dispatch_waiting(hc->pool);
+    }
+}
+
+/* 流被拒绝或者连接在响应之前断开，后端没有处理过这个请求，换一个连接重发 */
+static void ngx_http_myupstream_http2_requeue(ngx_http_myupstream_http2_stream_t *st) {
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    if (st->conn) {
+        ngx_queue_remove(&st->queue);
+        st->conn->nstreams--;
+        st->conn = NULL;
+    }
+
+    c = st->request->connection;
+
+    if (++st->retries > NGX_HTTP_MYUPSTREAM_HTTP2_RETRIES) {
+        ngx_http_myupstream_http2_fail(st, NGX_HTTP_BAD_GATEWAY);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    rc = ngx_http_myupstream_http2_dispatch(st);
+
+    if (rc != NGX_OK) {
+        ngx_http_myupstream_http2_fail(st, rc);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+/*
+流出错时结束请求：响应头还没有发送时返回错误码，否则只能关闭客户端连接
+参数：st - 流，调用后不能再访问
+     rc - 错误码
+*/
+static void ngx_http_myupstream_http2_fail(ngx_http_myupstream_http2_stream_t *st, ngx_int_t rc) {
+    if (st->response) {
+        rc = NGX_ERROR;
+    }
+
+    ngx_http_myupstream_http2_finish(st, rc);
+}
+
+/* 流结束，归还 myupstream_limit 的名额，结束请求 */
+static void ngx_http_myupstream_http2_finish(ngx_http_myupstream_http2_stream_t *st, ngx_int_t rc) {
+    ngx_http_request_t          *r;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    r = st->request;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    ngx_http_myupstream_http2_detach(st);
+
+    /* 之后请求可能被释放，流也随之释放 */
+    st->request = NULL;
+
+    if (mycf->limit_zone) {
+        ngx_http_myupstream_limit_release(r, rc);
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+/* 取消一个流。RST_STREAM 直接写入发送缓冲区，放不下时对端会在流结束后发现这个流已经没人接收 */
+static void ngx_http_myupstream_http2_reset(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t id, ngx_uint_t error) {
+    u_char  *p;
+
+    if (hc == NULL || id == 0 || hc->closing) {
+        return;
+    }
+
+    if ((size_t) (hc->out->end - hc->out->last) < NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + 4) {
+        return;
+    }
+
+    p = ngx_http_myupstream_http2_frame_head(hc->out->last, 4, NGX_HTTP_MYUPSTREAM_HTTP2_RST_STREAM, 0, id);
+    hc->out->last = ngx_http_v2_write_uint32(p, error);
+
+    /* 可能在请求的清理函数中调用，不在这里直接发送，留给连接的写事件 */
+    if (hc->connected) {
+        ngx_post_event(hc->peer.connection->write, &ngx_posted_events);
+    }
+}
+
+/*
+关闭连接。没有收到响应的流换一个连接重发，已经开始转发响应的流只能失败
+参数：hc - 连接，调用后不能再访问
+     error - 为 NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR 以外的值时先尽量发送 GOAWAY
+*/
+static void ngx_http_myupstream_http2_close(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t error) {
+    u_char                              *p;
+    ngx_queue_t                          streams, *q;
+    ngx_connection_t                    *c;
+    ngx_http_myupstream_http2_t         *pool;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    if (hc->processing) {
+        /* 读事件处理完之后再关闭 */
+        hc->closing = 1;
+
+        if (error != NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR) {
+            hc->goaway_error = error;
+        }
+
+        return;
+    }
+
+    hc->closing = 1;
+    c = hc->peer.connection;
+    pool = hc->pool;
+
+    if (error != NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR && hc->connected
+        && (size_t) (hc->out->end - hc->out->last) >= NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + 8)
+    {
+        p = ngx_http_myupstream_http2_frame_head(hc->out->last, 8, NGX_HTTP_MYUPSTREAM_HTTP2_GOAWAY, 0, 0);
+        p = ngx_http_v2_write_uint32(p, hc->next_id > 1 ? hc->next_id - 2 : 0);
+        hc->out->last = ngx_http_v2_write_uint32(p, error);
+
+        (void) c->send(c, hc->out->pos, hc->out->last - hc->out->pos);
+    }
+
+    ngx_queue_remove(&hc->queue);
+    pool->nconnections--;
+
+    /* 先把所有流摘下来，结束请求时不会再回到这个连接 */
+    ngx_queue_init(&streams);
+
+    while (!ngx_queue_empty(&hc->streams)) {
+        q = ngx_queue_head(&hc->streams);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&streams, q);
+
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+        st->conn = NULL;
+    }
+
+    hc->nstreams = 0;
+
+    ngx_close_connection(c);
+    hc->peer.connection = NULL;
+
+    ngx_http_myupstream_http2_table_free(&hc->encoder);
+    ngx_http_myupstream_http2_table_free(&hc->decoder);
+
+    if (hc->scratch) {
+        ngx_free(hc->scratch);
+    }
+
+    if (hc->block) {
+        ngx_free(hc->block);
+    }
+
+    ngx_destroy_pool(hc->mpool);
+
+    while (!ngx_queue_empty(&streams)) {
+        q = ngx_queue_head(&streams);
+        ngx_queue_remove(q);
+
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+
+        if (st->response) {
+            ngx_http_myupstream_http2_fail(st, NGX_ERROR);
+            continue;
+        }
+
+        ngx_http_myupstream_http2_requeue(st);
+    }
+
+    ngx_http_myupstream_http2_dispatch_waiting(pool);
+}
+
+/* 连接上没有流了：收到过 GOAWAY 就关闭，否则等待 myupstream_keepalive_timeout 后关闭 */
+static void ngx_http_myupstream_http2_idle(ngx_http_myupstream_http2_conn_t *hc) {
+    ngx_connection_t  *c;
+
+    c = hc->peer.connection;
+
+    if (hc->goaway) {
+        ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+        return;
+    }
+
+    ngx_add_timer(c->read, hc->pool->conf->keepalive_timeout);
+}
+
+/* 后端连接的读事件：读出所有完整的帧逐个处理，再把本轮收到的包体交给客户端 */
+static void ngx_http_myupstream_http2_read_handler(ngx_event_t *rev) {
+    size_t                               size;
+    ssize_t                              n;
+    ngx_int_t                            rc;
+    ngx_buf_t                           *in;
+    ngx_queue_t                         *q, *next;
+    ngx_connection_t                    *c;
+    ngx_http_myupstream_http2_conn_t    *hc;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    c = rev->data;
+    hc = c->data;
+    in = hc->in;
+
+    if (rev->timedout) {
+        rev->timedout = 0;
+
+        if (hc->nstreams == 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "myupstream http2: idle connection closed");
+
+            /* 空闲超时主动关闭，告诉对端这个连接上不会再有新的流 */
+            hc->goaway = 1;
+            ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+            return;
+        }
+    }
+
+    if (!hc->connected) {
+        return;
+    }
+
+    hc->processing = 1;
+    rc = NGX_OK;
+
+    for ( ;; ) {
+        n = c->recv(c, in->last, in->end - in->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            if (n == 0 && hc->nstreams) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0, "myupstream http2: backend closed connection with %ui open streams", hc->nstreams);
+            }
+
+            rc = NGX_ERROR;
+            break;
+        }
+
+        in->last += n;
+
+        while (in->last - in->pos >= NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER) {
+            size = (in->pos[0] << 16) | (in->pos[1] << 8) | in->pos[2];
+
+            if (size > NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0, "myupstream http2: backend sent too large frame: %uz", size);
+                hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+                rc = NGX_ERROR;
+                break;
+            }
+
+            if ((size_t) (in->last - in->pos) < NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + size) {
+                break;
+            }
+
+            rc = ngx_http_myupstream_http2_process_frame(hc, in->pos, size);
+            if (rc != NGX_OK || hc->closing) {
+                break;
+            }
+
+            in->pos += NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + size;
+        }
+
+        if (rc != NGX_OK || hc->closing) {
+            break;
+        }
+
+        /* 不完整的帧移到缓冲区开头 */
+        size = in->last - in->pos;
+        ngx_memmove(in->start, in->pos, size);
+        in->pos = in->start;
+        in->last = in->start + size;
+    }
+
+    /* 把本轮收到的包体交给客户端，过程中流可能结束并离开连接 */
+    for (q = ngx_queue_head(&hc->streams); q != ngx_queue_sentinel(&hc->streams); q = next) {
+        next = ngx_queue_next(q);
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+
+        if (st->out || st->done) {
+            ngx_http_myupstream_http2_deliver(st);
+        }
+    }
+
+    hc->processing = 0;
+
+    if (rc != NGX_OK || hc->closing) {
+        ngx_http_myupstream_http2_close(hc, hc->goaway_error);
+        return;
+    }
+
+    if (hc->goaway && hc->nstreams == 0) {
+        ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+        return;
+    }
+
+    if (ngx_http_myupstream_http2_flush(hc) != NGX_OK) {
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+    }
+}
+
+/* 后端连接的写事件：连接建立，或者发送缓冲区可以继续发送 */
+static void ngx_http_myupstream_http2_write_handler(ngx_event_t *wev) {
+    ngx_connection_t                  *c;
+    ngx_http_myupstream_http2_conn_t  *hc;
+
+    c = wev->data;
+    hc = c->data;
+
+    if (!hc->connected) {
+        if (wev->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "myupstream http2: connect to %V timed out", hc->peer.name);
+            ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+            return;
+        }
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        if (ngx_http_myupstream_http2_test_connect(c) != NGX_OK) {
+            ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+            return;
+        }
+
+        hc->connected = 1;
+
+        /* 连接过程中对端可能已经发来了 SETTINGS */
+        if (c->read->ready) {
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+    }
+
+    (void) ngx_http_myupstream_http2_flush(hc);
+}
+
+/* 检查非阻塞 connect() 的结果 */
+static ngx_int_t ngx_http_myupstream_http2_test_connect(ngx_connection_t *c) {
+    int        err;
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        c->log->action = "connecting to upstream";
+        (void) ngx_connection_error(c, err, "connect() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+生成待发送的帧并尽量发送出去
+返回值：NGX_OK - 成功，或者暂时不能发送
+       NGX_ERROR - 连接已经关闭，调用后不能再访问 hc
+*/
+static ngx_int_t ngx_http_myupstream_http2_flush(ngx_http_myupstream_http2_conn_t *hc) {
+    size_t             size;
+    ssize_t            n;
+    ngx_buf_t         *out;
+    ngx_connection_t  *c;
+
+    c = hc->peer.connection;
+    out = hc->out;
+
+    if (hc->closing) {
+        return NGX_OK;
+    }
+
+    ngx_http_myupstream_http2_write_frames(hc);
+
+    if (!hc->connected) {
+        return NGX_OK;
+    }
+
+    while (out->pos < out->last) {
+        n = c->send(c, out->pos, out->last - out->pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            if (hc->processing) {
+                hc->closing = 1;
+                return NGX_OK;
+            }
+
+            ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+            return NGX_ERROR;
+        }
+
+        out->pos += n;
+
+        if (out->pos == out->last) {
+            out->pos = out->start;
+            out->last = out->start;
+
+            /* 缓冲区腾空之后，之前放不下的帧可以继续生成 */
+            ngx_http_myupstream_http2_write_frames(hc);
+        }
+    }
+
+    /* 已发送的部分移出缓冲区，给后面的帧留出空间 */
+    if (out->pos != out->start) {
+        size = out->last - out->pos;
+        ngx_memmove(out->start, out->pos, size);
+        out->pos = out->start;
+        out->last = out->start + size;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        if (hc->processing) {
+            hc->closing = 1;
+            return NGX_OK;
+        }
+
+        ngx_http_myupstream_http2_close(hc, NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+把挂起的控制帧、WINDOW_UPDATE 和新流的 HEADERS 写入发送缓冲区，放不下的留到下一次。
+HEADERS 按写入顺序分配流 ID 并更新 HPACK 编码表，所以对端解码的顺序和编码的顺序一致
+*/
+static void ngx_http_myupstream_http2_write_frames(ngx_http_myupstream_http2_conn_t *hc) {
+    u_char                              *p, *end;
+    ngx_queue_t                         *q;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    p = hc->out->last;
+    end = hc->out->end;
+
+    while (hc->settings_ack && end - p >= NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER) {
+        p = ngx_http_myupstream_http2_frame_head(p, 0, NGX_HTTP_MYUPSTREAM_HTTP2_SETTINGS, NGX_HTTP_MYUPSTREAM_HTTP2_ACK, 0);
+        hc->settings_ack--;
+    }
+
+    if (hc->ping_ack && end - p >= NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + 8) {
+        p = ngx_http_myupstream_http2_frame_head(p, 8, NGX_HTTP_MYUPSTREAM_HTTP2_PING, NGX_HTTP_MYUPSTREAM_HTTP2_ACK, 0);
+        p = ngx_cpymem(p, hc->ping, 8);
+        hc->ping_ack = 0;
+    }
+
+    /* 连接的窗口用掉一半时一次归还 */
+    if (hc->recv_unacked >= NGX_HTTP_MYUPSTREAM_HTTP2_CONN_WINDOW / 2 && end - p >= NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + 4) {
+        p = ngx_http_myupstream_http2_frame_head(p, 4, NGX_HTTP_MYUPSTREAM_HTTP2_WINDOW_UPDATE, 0, 0);
+        p = ngx_http_v2_write_uint32(p, hc->recv_unacked);
+        hc->recv_window += hc->recv_unacked;
+        hc->recv_unacked = 0;
+    }
+
+    for (q = ngx_queue_head(&hc->streams); q != ngx_queue_sentinel(&hc->streams); q = ngx_queue_next(q)) {
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+
+        if (st->window_update && st->id && !st->done) {
+            if (end - p < NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + 4) {
+                break;
+            }
+
+            p = ngx_http_myupstream_http2_frame_head(p, 4, NGX_HTTP_MYUPSTREAM_HTTP2_WINDOW_UPDATE, 0, st->id);
+            p = ngx_http_v2_write_uint32(p, st->window_update);
+            st->window_update = 0;
+
+            /* 后面的 HEADERS 放不下时不能丢掉已经清零的窗口 */
+            hc->out->last = p;
+        }
+
+        if (!st->headers_pending) {
+            continue;
+        }
+
+        /* 收到 GOAWAY 之后不再打开新的流，这些流已经被重新排队 */
+        if (hc->goaway) {
+            break;
+        }
+
+        p = ngx_http_myupstream_http2_encode_request(hc, st, p, end);
+        if (p == NULL) {
+            /* 放不下，之前写入的部分保持不变 */
+            p = hc->out->last;
+            break;
+        }
+
+        hc->out->last = p;
+    }
+
+    hc->out->last = p;
+}
+
+static u_char *ngx_http_myupstream_http2_frame_head(u_char *p, size_t len, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t id) {
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) type;
+    *p++ = (u_char) flags;
+
+    return ngx_http_v2_write_uint32(p, id);
+}
+
+/* 请求转换成 HEADERS 帧之后长度的上限：每个头部最多多出 1 字节的类型和各 6 字节的长度 */
+static size_t ngx_http_myupstream_http2_request_bound(ngx_buf_t *b) {
+    u_char      *p;
+    ngx_uint_t   n;
+
+    n = 4;
+    for (p = b->pos; p < b->last; p++) {
+        if (*p == LF) {
+            n++;
+        }
+    }
+
+    return 8 + (b->last - b->pos) + n * 16;
+}
+
+/*
+把模板生成的 HTTP/1.1 请求转换成 HEADERS 帧写入发送缓冲区，超过对端的帧长度时后面的部分放在紧随的 CONTINUATION 帧中。
+请求行变为 :method、:path，Host 变为 :authority，Connection 去掉，头部名转为小写。
+:path 每个请求都不同，不进入动态表；其余的头部在各个请求之间基本不变，进入动态表之后每个只占一两个字节
+参数：hc - 连接
+     st - 流
+     p, end - 发送缓冲区的空闲部分
+返回值：成功 - 写入之后的位置
+       放不下 - NULL，编码表没有被修改
+*/
+static u_char *ngx_http_myupstream_http2_encode_request(ngx_http_myupstream_http2_conn_t *hc, ngx_http_myupstream_http2_stream_t *st, u_char *p, u_char *end) {
+    u_char      *pos, *last, *start, *colon, *tmp, *lower, *frame;
+    size_t       len, block, size;
+    ngx_str_t    name, value;
+    ngx_buf_t   *b;
+    ngx_uint_t   n, flags;
+
+    b = st->request_buf;
+
+    /* 长度在 ngx_http_myupstream_http2_start 中已经检查过，空的发送缓冲区一定放得下 */
+    if ((size_t) (end - p) < NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS_SPACE(ngx_http_myupstream_http2_request_bound(b))) {
+        return NULL;
+    }
+
+    /* Huffman 编码和小写转换的临时空间，从请求内存池分配 */
+    tmp = ngx_pnalloc(st->request->pool, 2 * (b->last - b->pos));
+    if (tmp == NULL) {
+        return NULL;
+    }
+
+    lower = tmp + (b->last - b->pos);
+
+    start = p;
+    p += NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER;
+
+    if (hc->table_update) {
+        p = ngx_http_myupstream_http2_encode_int(p, 5, 0x20, hc->encoder.max);
+        hc->table_update = 0;
+    }
+
+    /* :method GET 和 :scheme http 都在静态表中 */
+    *p++ = 0x82;
+    *p++ = 0x86;
+
+    /* 请求行 "GET /path HTTP/1.1" */
+    pos = b->pos + sizeof("GET ") - 1;
+    last = ngx_strlchr(pos, b->last, ' ');
+    if (last == NULL) {
+        last = pos;
+    }
+
+    if (last - pos == 1 && *pos == '/') {
+        *p++ = 0x84;
+
+    } else {
+        /* 不进入动态表的字面量，名字是静态表中的 :path */
+        p = ngx_http_myupstream_http2_encode_int(p, 4, 0x00, 4);
+        p = ngx_http_myupstream_http2_encode_string(p, pos, last - pos, tmp);
+    }
+
+    pos = ngx_strlchr(last, b->last, LF);
+    pos = pos ? pos + 1 : b->last;
+
+    /* 头部 "Name: value\r\n"，空行结束 */
+    while (pos < b->last) {
+        last = ngx_strlchr(pos, b->last, LF);
+        if (last == NULL) {
+            last = b->last;
+        }
+
+        len = last - pos;
+        if (len && pos[len - 1] == CR) {
+            len--;
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        colon = ngx_strlchr(pos, pos + len, ':');
+
+        if (colon) {
+            name.data = lower;
+            name.len = colon - pos;
+            ngx_strlow(name.data, pos, name.len);
+
+            value.data = colon + 1;
+            value.len = pos + len - value.data;
+
+            while (value.len && value.data[0] == ' ') {
+                value.data++;
+                value.len--;
+            }
+
+            if (name.len == sizeof("host") - 1 && ngx_strncmp(name.data, "host", name.len) == 0) {
+                ngx_str_set(&name, ":authority");
+                p = ngx_http_myupstream_http2_encode_header(hc, p, &name, &value, 1, tmp);
+
+            } else if (!(name.len == sizeof("connection") - 1 && ngx_strncmp(name.data, "connection", name.len) == 0)) {
+                p = ngx_http_myupstream_http2_encode_header(hc, p, &name, &value, 1, tmp);
+            }
+        }
+
+        pos = last + 1;
+    }
+
+    st->id = hc->next_id;
+    hc->next_id += 2;
+    st->headers_pending = 0;
+
+    /* 流 ID 用完了，这个连接上不再打开新的流，等现有的流结束后关闭 */
+    if (hc->next_id > NGX_HTTP_MYUPSTREAM_HTTP2_MAX_WINDOW) {
+        hc->goaway = 1;
+    }
+
+    block = p - start - NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER;
+    size = ngx_min(block, hc->frame_size);
+
+    /* 头块超过一帧：从最后一段开始往后挪，给每个 CONTINUATION 空出帧头，最后一帧带 END_HEADERS */
+    n = block ? (block - 1) / size : 0;
+    flags = NGX_HTTP_MYUPSTREAM_HTTP2_END_HEADERS;
+
+    for (/* void */; n > 0; n--) {
+        pos = start + NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER + n * size;
+        len = ngx_min(size, block - n * size);
+        frame = pos + n * NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER;
+
+        ngx_memmove(frame, pos, len);
+        (void) ngx_http_myupstream_http2_frame_head(frame - NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER, len,
+                                                    NGX_HTTP_MYUPSTREAM_HTTP2_CONTINUATION, flags, st->id);
+
+        if (flags) {
+            p = frame + len;
+            flags = 0;
+        }
+    }
+
+    /* 请求没有包体，HEADERS 同时结束这个流 */
+    (void) ngx_http_myupstream_http2_frame_head(start, size, NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS, flags | NGX_HTTP_MYUPSTREAM_HTTP2_END_STREAM, st->id);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, st->request->connection->log, 0, "myupstream http2: stream %ui, %uz bytes of headers",
+                   st->id, block);
+
+    return p;
+}
+
+/*
+处理一个完整的帧
+返回值：NGX_OK - 成功
+       NGX_ERROR - 连接级的错误，hc->goaway_error 中是要发送给对端的错误码
+*/
+static ngx_int_t ngx_http_myupstream_http2_process_frame(ngx_http_myupstream_http2_conn_t *hc, u_char *p, size_t len) {
+    ngx_uint_t  type, flags, id;
+
+    type = p[3];
+    flags = p[4];
+    id = ngx_http_v2_parse_uint32(&p[5]) & 0x7fffffff;
+    p += NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_HEADER;
+
+    /* 响应头块被拆开时，中间只能是同一个流的 CONTINUATION */
+    if (hc->block_stream && (type != NGX_HTTP_MYUPSTREAM_HTTP2_CONTINUATION || id != hc->block_stream)) {
+        ngx_log_error(NGX_LOG_ERR, &hc->log, 0, "myupstream http2: expected CONTINUATION for stream %ui", hc->block_stream);
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+        return NGX_ERROR;
+    }
+
+    switch (type) {
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_DATA:
+        return ngx_http_myupstream_http2_data_frame(hc, flags, id, p, len);
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS:
+    case NGX_HTTP_MYUPSTREAM_HTTP2_CONTINUATION:
+        return ngx_http_myupstream_http2_headers_frame(hc, type, flags, id, p, len);
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_RST_STREAM:
+        if (len != 4 || id == 0) {
+            break;
+        }
+
+        ngx_http_myupstream_http2_rst_stream_frame(hc, id, p);
+        return NGX_OK;
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_SETTINGS:
+        return ngx_http_myupstream_http2_settings_frame(hc, flags, p, len);
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_PING:
+        if (len != 8 || id != 0) {
+            break;
+        }
+
+        if (!(flags & NGX_HTTP_MYUPSTREAM_HTTP2_ACK)) {
+            ngx_memcpy(hc->ping, p, 8);
+            hc->ping_ack = 1;
+        }
+
+        return NGX_OK;
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_GOAWAY:
+        return ngx_http_myupstream_http2_goaway_frame(hc, p, len);
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_PUSH_PROMISE:
+        /* SETTINGS 中已经关闭了服务器推送 */
+        break;
+
+    case NGX_HTTP_MYUPSTREAM_HTTP2_WINDOW_UPDATE:
+        /*
+         * 只有 DATA 帧受流控，而发往后端的请求总是没有包体的 GET（客户端的包体被丢弃），
+         * 所以不记录发送窗口，只检查帧的格式
+         */
+        if (len != 4 || (ngx_http_v2_parse_uint32(p) & 0x7fffffff) == 0) {
+            break;
+        }
+
+        return NGX_OK;
+
+    default:
+        /* PRIORITY 和未知的帧类型 */
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, &hc->log, 0, "myupstream http2: backend sent invalid frame, type %ui", type);
+    hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+    return NGX_ERROR;
+}
+
+/* DATA 帧：扣除连接和流的窗口，包体暂存在流上，本轮读事件结束时交给客户端 */
+static ngx_int_t ngx_http_myupstream_http2_data_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t flags, ngx_uint_t id, u_char *p, size_t len) {
+    size_t                               padding;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    if (id == 0) {
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (len > hc->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, &hc->log, 0, "myupstream http2: backend violated connection flow control");
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_FLOW_CTRL_ERROR;
+        return NGX_ERROR;
+    }
+
+    hc->recv_window -= len;
+    hc->recv_unacked += len;
+
+    padding = 0;
+
+    if (flags & NGX_HTTP_MYUPSTREAM_HTTP2_PADDED) {
+        if (len == 0 || (size_t) p[0] >= len) {
+            hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+            return NGX_ERROR;
+        }
+
+        padding = p[0] + 1;
+    }
+
+    st = ngx_http_myupstream_http2_find(hc, id);
+
+    /* 已经取消的流，数据丢弃，连接的窗口照样归还 */
+    if (st == NULL || !st->response || st->done) {
+        return NGX_OK;
+    }
+
+    if (len > st->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, &hc->log, 0, "myupstream http2: backend violated flow control of stream %ui", id);
+        ngx_http_myupstream_http2_reset(hc, id, NGX_HTTP_MYUPSTREAM_HTTP2_FLOW_CTRL_ERROR);
+        ngx_http_myupstream_http2_fail(st, NGX_ERROR);
+        return NGX_OK;
+    }
+
+    st->recv_window -= len;
+
+    if (ngx_http_myupstream_http2_append(st, p + (padding ? 1 : 0), len - padding) != NGX_OK) {
+        ngx_http_myupstream_http2_reset(hc, id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+        ngx_http_myupstream_http2_fail(st, NGX_ERROR);
+        return NGX_OK;
+    }
+
+    if (flags & NGX_HTTP_MYUPSTREAM_HTTP2_END_STREAM) {
+        st->done = 1;
+    }
+
+    ngx_add_timer(&st->timer, hc->pool->conf->upstream.read_timeout);
+
+    return NGX_OK;
+}
+
+/* HEADERS 和 CONTINUATION：拼出完整的头块再解码，取消了的流也要解码，否则动态表会和对端不一致 */
+static ngx_int_t ngx_http_myupstream_http2_headers_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t id, u_char *p, size_t len) {
+    size_t                               padding, size;
+    u_char                              *block;
+    ngx_int_t                            rc;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    if (id == 0) {
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (type == NGX_HTTP_MYUPSTREAM_HTTP2_HEADERS) {
+        padding = 0;
+
+        if (flags & NGX_HTTP_MYUPSTREAM_HTTP2_PADDED) {
+            if (len == 0) {
+                hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+                return NGX_ERROR;
+            }
+
+            padding = p[0];
+            p++;
+            len--;
+        }
+
+        if (flags & NGX_HTTP_MYUPSTREAM_HTTP2_PRIORITY_FLAG) {
+            if (len < 5) {
+                hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+                return NGX_ERROR;
+            }
+
+            p += 5;
+            len -= 5;
+        }
+
+        if (padding > len) {
+            hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+            return NGX_ERROR;
+        }
+
+        len -= padding;
+
+        hc->block_len = 0;
+        hc->block_end_stream = flags & NGX_HTTP_MYUPSTREAM_HTTP2_END_STREAM;
+    }
+
+    size = hc->block_len + len;
+
+    if (size > NGX_HTTP_MYUPSTREAM_HTTP2_MAX_HEADER_BLOCK) {
+        ngx_log_error(NGX_LOG_ERR, &hc->log, 0, "myupstream http2: backend sent too large header block");
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (size > hc->block_size) {
+        block = ngx_alloc(ngx_max(size, 4096), &hc->log);
+        if (block == NULL) {
+            hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+            return NGX_ERROR;
+        }
+
+        if (hc->block) {
+            ngx_memcpy(block, hc->block, hc->block_len);
+            ngx_free(hc->block);
+        }
+
+        hc->block = block;
+        hc->block_size = ngx_max(size, 4096);
+    }
+
+    ngx_memcpy(hc->block + hc->block_len, p, len);
+    hc->block_len = size;
+
+    if (!(flags & NGX_HTTP_MYUPSTREAM_HTTP2_END_HEADERS)) {
+        hc->block_stream = id;
+        return NGX_OK;
+    }
+
+    hc->block_stream = 0;
+
+    st = ngx_http_myupstream_http2_find(hc, id);
+
+    rc = ngx_http_myupstream_http2_decode(hc, st);
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, &hc->log, 0, "myupstream http2: backend sent invalid header block");
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_COMP_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (st == NULL || st->request == NULL) {
+        return NGX_OK;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_myupstream_http2_reset(hc, id, NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR);
+        ngx_http_myupstream_http2_fail(st, NGX_HTTP_BAD_GATEWAY);
+        return NGX_OK;
+    }
+
+    ngx_add_timer(&st->timer, hc->pool->conf->upstream.read_timeout);
+
+    /* 1xx 响应之后还有最终的响应头 */
+    if (st->informational) {
+        st->informational = 0;
+        st->status = 0;
+        return NGX_OK;
+    }
+
+    /* 包体之后的 trailer 不转发 */
+    if (st->response) {
+        if (hc->block_end_stream) {
+            st->done = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_http_myupstream_http2_response(st) != NGX_OK) {
+        ngx_http_myupstream_http2_reset(hc, id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+        return NGX_OK;
+    }
+
+    if (hc->block_end_stream) {
+        st->done = 1;
+    }
+
+    return NGX_OK;
+}
+
+/* SETTINGS：更新对端的限制并确认 */
+static ngx_int_t ngx_http_myupstream_http2_settings_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t flags, u_char *p, size_t len) {
+    ngx_uint_t  id, value;
+
+    if (flags & NGX_HTTP_MYUPSTREAM_HTTP2_ACK) {
+        if (len) {
+            hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (len % 6) {
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; len; len -= 6, p += 6) {
+        id = ngx_http_v2_parse_uint16(p);
+        value = ngx_http_v2_parse_uint32(&p[2]);
+
+        switch (id) {
+
+        case NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE_PARAM:
+            /* 编码表不超过 4096 字节，对端要求更小时在下一个头块开头通知对端 */
+            value = ngx_min(value, NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE);
+
+            if (value != hc->encoder.max) {
+                ngx_http_myupstream_http2_table_size(&hc->encoder, value);
+                hc->table_update = 1;
+            }
+
+            break;
+
+        case NGX_HTTP_MYUPSTREAM_HTTP2_MAX_STREAMS_PARAM:
+            hc->max_streams = value;
+            break;
+
+        case NGX_HTTP_MYUPSTREAM_HTTP2_INITIAL_WINDOW_PARAM:
+            if (value > NGX_HTTP_MYUPSTREAM_HTTP2_MAX_WINDOW) {
+                hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_FLOW_CTRL_ERROR;
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_HTTP_MYUPSTREAM_HTTP2_MAX_FRAME_SIZE_PARAM:
+            if (value < NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE || value > NGX_HTTP_MYUPSTREAM_HTTP2_MAX_FRAME_SIZE) {
+                hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+                return NGX_ERROR;
+            }
+
+            hc->frame_size = value;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    hc->settings_ack++;
+
+    if (hc->nstreams < hc->max_streams) {
+        ngx_http_myupstream_http2_dispatch_waiting(hc->pool);
+    }
+
+    return NGX_OK;
+}
+
+/*
+GOAWAY：不再在这个连接上打开新的流。对端处理过的流（ID 不大于 last_id）正常结束，
+其余的流对端保证没有处理过，换一个连接重发
+*/
+static ngx_int_t ngx_http_myupstream_http2_goaway_frame(ngx_http_myupstream_http2_conn_t *hc, u_char *p, size_t len) {
+    ngx_uint_t                           error;
+    ngx_queue_t                         *q, *next;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    if (len < 8) {
+        hc->goaway_error = NGX_HTTP_MYUPSTREAM_HTTP2_PROTOCOL_ERROR;
+        return NGX_ERROR;
+    }
+
+    hc->last_id = ngx_http_v2_parse_uint32(p) & 0x7fffffff;
+    error = ngx_http_v2_parse_uint32(&p[4]);
+
+    ngx_log_error(error ? NGX_LOG_WARN : NGX_LOG_INFO, &hc->log, 0, "myupstream http2: backend sent GOAWAY, last stream %ui, error %ui",
+                  hc->last_id, error);
+
+    hc->goaway = 1;
+
+    for (q = ngx_queue_head(&hc->streams); q != ngx_queue_sentinel(&hc->streams); q = next) {
+        next = ngx_queue_next(q);
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+
+        if (st->id == 0 || st->id > hc->last_id) {
+            ngx_http_myupstream_http2_requeue(st);
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* RST_STREAM：被拒绝的流没有被处理过，可以重发；其余的流失败 */
+static void ngx_http_myupstream_http2_rst_stream_frame(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t id, u_char *p) {
+    ngx_uint_t                           error;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    st = ngx_http_myupstream_http2_find(hc, id);
+    if (st == NULL) {
+        return;
+    }
+
+    error = ngx_http_v2_parse_uint32(p);
+
+    if (error == NGX_HTTP_MYUPSTREAM_HTTP2_REFUSED_STREAM && !st->response) {
+        ngx_http_myupstream_http2_requeue(st);
+        return;
+    }
+
+    /* 包体已经完整收到时，对端用 NO_ERROR 复位表示不需要请求的剩余部分 */
+    if (error == NGX_HTTP_MYUPSTREAM_HTTP2_NO_ERROR && st->done) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, st->request->connection->log, 0, "myupstream http2: backend reset stream %ui, error %ui", id, error);
+
+    ngx_http_myupstream_http2_fail(st, NGX_HTTP_BAD_GATEWAY);
+}
+
+/* 按流 ID 查找。一个连接上同时打开的流不多，顺序查找就够了 */
+static ngx_http_myupstream_http2_stream_t *ngx_http_myupstream_http2_find(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t id) {
+    ngx_queue_t                         *q;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    for (q = ngx_queue_head(&hc->streams); q != ngx_queue_sentinel(&hc->streams); q = ngx_queue_next(q)) {
+        st = ngx_queue_data(q, ngx_http_myupstream_http2_stream_t, queue);
+
+        if (st->id == id) {
+            return st;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+解码 hc->block 中的响应头块，结果交给流。流为 NULL 时只更新动态表
+返回值：NGX_OK - 成功
+       NGX_DECLINED - 头部本身不合法，只影响这个流
+       NGX_ERROR - 头块无法解码，动态表已经不可信，整个连接都要关闭
+*/
+static ngx_int_t ngx_http_myupstream_http2_decode(ngx_http_myupstream_http2_conn_t *hc, ngx_http_myupstream_http2_stream_t *st) {
+    u_char      *pos, *end, *dst, ch;
+    size_t       size;
+    ngx_int_t    rc;
+    ngx_str_t    name, value;
+    ngx_uint_t   index, indexing;
+
+    /* 名字和值解码后不会超过头块长度的 1.6 倍（Huffman 最短 5 比特一个字符） */
+    size = hc->block_len * 2 + 64;
+
+    if (size > hc->scratch_size) {
+        if (hc->scratch) {
+            ngx_free(hc->scratch);
+        }
+
+        hc->scratch = ngx_alloc(size, &hc->log);
+        if (hc->scratch == NULL) {
+            hc->scratch_size = 0;
+            return NGX_ERROR;
+        }
+
+        hc->scratch_size = size;
+    }
+
+    pos = hc->block;
+    end = hc->block + hc->block_len;
+    rc = NGX_OK;
+
+    while (pos < end) {
+        ch = *pos;
+        dst = hc->scratch;
+
+        if (ch & 0x80) {
+            /* 索引 */
+            if (ngx_http_myupstream_http2_decode_int(&pos, end, 7, &index) != NGX_OK
+                || ngx_http_myupstream_http2_lookup(hc, index, &name, &value) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            indexing = 0;
+
+        } else if ((ch & 0xe0) == 0x20) {
+            /* 动态表大小更新，不能超过我们通告的大小 */
+            if (ngx_http_myupstream_http2_decode_int(&pos, end, 5, &index) != NGX_OK || index > NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_SIZE) {
+                return NGX_ERROR;
+            }
+
+            ngx_http_myupstream_http2_table_size(&hc->decoder, index);
+            continue;
+
+        } else {
+            /* 字面量：01 进入动态表，0000 和 0001 不进入 */
+            indexing = (ch & 0xc0) == 0x40;
+
+            if (ngx_http_myupstream_http2_decode_int(&pos, end, indexing ? 6 : 4, &index) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (index) {
+                if (ngx_http_myupstream_http2_lookup(hc, index, &name, &value) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+            } else {
+                name.data = dst;
+                if (ngx_http_myupstream_http2_decode_string(hc, &pos, end, &dst) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+                name.len = dst - name.data;
+            }
+
+            value.data = dst;
+            if (ngx_http_myupstream_http2_decode_string(hc, &pos, end, &dst) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            value.len = dst - value.data;
+        }
+
+        /* 先交给流复制走再加入动态表，名字可能引用表中将被淘汰的项 */
+        if (st && st->request && rc == NGX_OK && ngx_http_myupstream_http2_header(st, &name, &value) != NGX_OK) {
+            rc = NGX_DECLINED;
+        }
+
+        if (indexing && ngx_http_myupstream_http2_table_add(&hc->decoder, &name, &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return rc;
+}
+
+/* 解码 HPACK 整数，prefix 是第一个字节中可用的位数 */
+static ngx_int_t ngx_http_myupstream_http2_decode_int(u_char **pos, u_char *end, ngx_uint_t prefix, ngx_uint_t *value) {
+    u_char      *p;
+    ngx_uint_t   mask, v, shift;
+
+    p = *pos;
+    mask = (1 << prefix) - 1;
+
+    if (p >= end) {
+        return NGX_ERROR;
+    }
+
+    v = *p++ & mask;
+
+    if (v == mask) {
+        /* 后续字节每个 7 位，限制在 2^28 以内，合法的头部远小于此 */
+        for (shift = 0; /* void */ ; shift += 7) {
+            if (p >= end || shift > 21) {
+                return NGX_ERROR;
+            }
+
+            v += (ngx_uint_t) (*p & 0x7f) << shift;
+
+            if (!(*p++ & 0x80)) {
+                break;
+            }
+        }
+    }
+
+    *pos = p;
+    *value = v;
+
+    return NGX_OK;
+}
+
+/* 解码一个字符串写到 *dst，按需做 Huffman 解码 */
+static ngx_int_t ngx_http_myupstream_http2_decode_string(ngx_http_myupstream_http2_conn_t *hc, u_char **pos, u_char *end, u_char **dst) {
+    u_char      *p, state;
+    ngx_uint_t   huff, len;
+
+    p = *pos;
+
+    if (p >= end) {
+        return NGX_ERROR;
+    }
+
+    huff = *p & 0x80;
+
+    if (ngx_http_myupstream_http2_decode_int(&p, end, 7, &len) != NGX_OK || len > (ngx_uint_t) (end - p)) {
+        return NGX_ERROR;
+    }
+
+    if (huff) {
+        state = 0;
+
+        if (ngx_http_v2_huff_decode(&state, p, len, dst, 1, &hc->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        *dst = ngx_cpymem(*dst, p, len);
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+/* 按索引查找静态表和动态表，索引从 1 开始，62 是动态表中最新的一项 */
+static ngx_int_t ngx_http_myupstream_http2_lookup(ngx_http_myupstream_http2_conn_t *hc, ngx_uint_t index, ngx_str_t *name, ngx_str_t *value) {
+    ngx_http_myupstream_http2_entry_t  *e;
+
+    if (index == 0) {
+        return NGX_ERROR;
+    }
+
+    if (index <= NGX_HTTP_MYUPSTREAM_HTTP2_STATIC_ENTRIES) {
+        *name = ngx_http_myupstream_http2_static_table[index - 1][0];
+        *value = ngx_http_myupstream_http2_static_table[index - 1][1];
+        return NGX_OK;
+    }
+
+    e = ngx_http_myupstream_http2_table_get(&hc->decoder, index - NGX_HTTP_MYUPSTREAM_HTTP2_STATIC_ENTRIES - 1);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    name->data = e->data;
+    name->len = e->name_len;
+    value->data = e->data + e->name_len;
+    value->len = e->value_len;
+
+    return NGX_OK;
+}
+
+/*
+把解码出的一个响应头放入 r->headers_out，字符串复制到请求内存池
+返回值：NGX_OK - 成功
+       NGX_DECLINED - 不合法的响应
+       NGX_ERROR - 内存不足，同样作为不合法的响应处理
+*/
+static ngx_int_t ngx_http_myupstream_http2_header(ngx_http_myupstream_http2_stream_t *st, ngx_str_t *name, ngx_str_t *value) {
+    u_char                     *p;
+    ngx_uint_t                  i;
+    ngx_table_elt_t            *h;
+    ngx_http_request_t         *r;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    r = st->request;
+
+    /* trailer 和 1xx 响应中的头部都不转发 */
+    if (st->response || st->informational) {
+        return NGX_OK;
+    }
+
+    if (name->len && name->data[0] == ':') {
+        if (name->len == sizeof(":status") - 1 && ngx_strncmp(name->data, ":status", name->len) == 0) {
+            if (value->len != 3 || st->status) {
+                return NGX_DECLINED;
+            }
+
+            st->status = ngx_atoi(value->data, 3);
+            if (st->status == (ngx_uint_t) NGX_ERROR || st->status < 100) {
+                return NGX_DECLINED;
+            }
+
+            if (st->status < 200) {
+                st->informational = 1;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    if (st->status == 0) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; ngx_http_myupstream_http2_hide_headers[i].len; i++) {
+        if (name->len == ngx_http_myupstream_http2_hide_headers[i].len
+            && ngx_strncmp(name->data, ngx_http_myupstream_http2_hide_headers[i].data, name->len) == 0)
+        {
+            return NGX_OK;
+        }
+    }
+
+    p = ngx_pnalloc(r->pool, name->len + value->len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* HTTP/2 的头部名已经是小写 */
+    h->key.data = p;
+    h->key.len = name->len;
+    h->lowcase_key = p;
+    p = ngx_cpymem(p, name->data, name->len);
+
+    h->value.data = p;
+    h->value.len = value->len;
+    p = ngx_cpymem(p, value->data, value->len);
+    *p = '\0';
+
+    h->hash = ngx_hash_key(h->key.data, h->key.len);
+
+    switch (name->len) {
+
+    case sizeof("etag") - 1:
+        if (ngx_strncmp(name->data, "etag", name->len) == 0) {
+            r->headers_out.etag = h;
+        }
+        break;
+
+    case sizeof("vary") - 1:
+        if (ngx_strncmp(name->data, "vary", name->len) == 0
+            && ngx_strlcasestrn(h->value.data, h->value.data + h->value.len, (u_char *) "accept-encoding", sizeof("accept-encoding") - 2))
+        {
+            myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+            myctx->gzip_vary = 1;
+        }
+        break;
+
+    case sizeof("content-type") - 1:
+        if (ngx_strncmp(name->data, "content-type", name->len) == 0) {
+            /* Content-Type 由 header 过滤模块生成，不能重复 */
+            h->hash = 0;
+            r->headers_out.content_type = h->value;
+            r->headers_out.content_type_len = h->value.len;
+
+            p = ngx_strlchr(h->value.data, h->value.data + h->value.len, ';');
+            if (p) {
+                while (p > h->value.data && p[-1] == ' ') {
+                    p--;
+                }
+
+                r->headers_out.content_type_len = p - h->value.data;
+            }
+        }
+        break;
+
+    case sizeof("last-modified") - 1:
+        if (ngx_strncmp(name->data, "last-modified", name->len) == 0) {
+            r->headers_out.last_modified = h;
+            r->headers_out.last_modified_time = ngx_parse_http_time(h->value.data, h->value.len);
+        }
+        break;
+
+    case sizeof("content-length") - 1:
+        if (ngx_strncmp(name->data, "content-length", name->len) == 0) {
+            r->headers_out.content_length_n = ngx_atoof(h->value.data, h->value.len);
+            if (r->headers_out.content_length_n == NGX_ERROR) {
+                return NGX_DECLINED;
+            }
+
+            h->hash = 0;
+        }
+        break;
+
+    case sizeof("content-encoding") - 1:
+        if (ngx_strncmp(name->data, "content-encoding", name->len) == 0) {
+            r->headers_out.content_encoding = h;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return NGX_OK;
+}
+
+/*
+收到最终的响应头，发送给客户端
+返回值：NGX_OK - 继续接收包体
+       NGX_DECLINED - 不需要包体（比如 HEAD 请求），请求已经结束，调用者需要取消这个流
+*/
+static ngx_int_t ngx_http_myupstream_http2_response(ngx_http_myupstream_http2_stream_t *st) {
+    ngx_int_t                   rc;
+    ngx_http_request_t         *r;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    r = st->request;
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    st->response = 1;
+
+    r->headers_out.status = st->status;
+
+    /* 与 HTTP/1.1 后端一样，转发的压缩响应需要 Vary */
+    if (myctx->gzip && !myctx->gzip_vary && ngx_http_myupstream_gzip_headers(r, 0) != NGX_OK) {
+        ngx_http_myupstream_http2_finish(st, NGX_ERROR);
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only || r->post_action) {
+        ngx_http_myupstream_http2_finish(st, rc);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/* 把收到的包体复制进流的缓冲区，缓冲区在交给客户端之后回收 */
+static ngx_int_t ngx_http_myupstream_http2_append(ngx_http_myupstream_http2_stream_t *st, u_char *data, size_t len) {
+    size_t               n;
+    ngx_buf_t           *b;
+    ngx_chain_t         *cl;
+    ngx_http_request_t  *r;
+
+    r = st->request;
+
+    while (len) {
+        b = st->out ? st->tail->buf : NULL;
+
+        if (b == NULL || b->last == b->end) {
+            cl = ngx_chain_get_free_buf(r->pool, &st->free);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = cl->buf;
+
+            if (b->start == NULL) {
+                b->start = ngx_palloc(r->pool, NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE);
+                if (b->start == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->end = b->start + NGX_HTTP_MYUPSTREAM_HTTP2_FRAME_SIZE;
+                b->temporary = 1;
+                b->tag = (ngx_buf_tag_t) &ngx_http_myupstream_module;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+
+            *st->last_out = cl;
+            st->last_out = &cl->next;
+            st->tail = cl;
+        }
+
+        n = ngx_min(len, (size_t) (b->end - b->last));
+        b->last = ngx_cpymem(b->last, data, n);
+
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+/* 把本轮收到的包体交给过滤模块，流结束时结束请求；客户端可写时以空链调用，继续发送积压的包体 */
+static void ngx_http_myupstream_http2_deliver(ngx_http_myupstream_http2_stream_t *st) {
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl;
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = st->request;
+    c = r->connection;
+
+    if (st->done) {
+        /* 最后一个缓冲区不放回 free 链，last_buf 标记不会被带到复用的缓冲区上 */
+        if (st->out == NULL) {
+            b = ngx_calloc_buf(r->pool);
+            cl = ngx_alloc_chain_link(r->pool);
+            if (b == NULL || cl == NULL) {
+                ngx_http_myupstream_http2_fail(st, NGX_ERROR);
+                ngx_http_run_posted_requests(c);
+                return;
+            }
+
+            cl->buf = b;
+            cl->next = NULL;
+            st->out = cl;
+            st->tail = cl;
+
+        } else {
+            b = st->tail->buf;
+        }
+
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+    }
+
+    rc = ngx_http_output_filter(r, st->out);
+
+    ngx_chain_update_chains(r->pool, &st->free, &st->busy, &st->out, (ngx_buf_tag_t) &ngx_http_myupstream_module);
+    st->last_out = &st->out;
+
+    if (rc == NGX_ERROR) {
+        ngx_http_myupstream_http2_reset(st->conn, st->id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+        ngx_http_myupstream_http2_finish(st, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (st->done) {
+        ngx_http_myupstream_http2_finish(st, NGX_OK);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        ngx_http_myupstream_http2_reset(st->conn, st->id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+        ngx_http_myupstream_http2_finish(st, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (c->write->active && !c->write->ready) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    ngx_http_myupstream_http2_update_window(st);
+}
+
+/* 客户端取走了多少数据，就向后端归还多少流的窗口，累计到窗口的一半时才发送 WINDOW_UPDATE */
+static void ngx_http_myupstream_http2_update_window(ngx_http_myupstream_http2_stream_t *st) {
+    size_t        buffered, open;
+    ngx_chain_t  *cl;
+
+    if (st->conn == NULL || st->done) {
+        return;
+    }
+
+    buffered = 0;
+    for (cl = st->busy; cl; cl = cl->next) {
+        buffered += ngx_buf_size(cl->buf);
+    }
+
+    if (st->recv_window + st->window_update + buffered >= NGX_HTTP_MYUPSTREAM_HTTP2_STREAM_WINDOW) {
+        return;
+    }
+
+    open = NGX_HTTP_MYUPSTREAM_HTTP2_STREAM_WINDOW - st->recv_window - st->window_update - buffered;
+
+    if (st->window_update + open < NGX_HTTP_MYUPSTREAM_HTTP2_STREAM_WINDOW / 2) {
+        return;
+    }
+
+    st->window_update += open;
+    st->recv_window += open;
+
+    if (st->conn->connected) {
+        ngx_post_event(st->conn->peer.connection->write, &ngx_posted_events);
+    }
+}
+
+/* 客户端可写：继续发送积压的包体，发出去之后归还窗口 */
+static void ngx_http_myupstream_http2_client_write(ngx_http_request_t *r) {
+    ngx_connection_t                    *c;
+    ngx_http_myupstream_ctx_t           *myctx;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    c = r->connection;
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    st = myctx->http2;
+
+    if (st == NULL || st->request == NULL || !st->response) {
+        return;
+    }
+
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+
+        ngx_http_myupstream_http2_reset(st->conn, st->id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+        ngx_http_myupstream_http2_finish(st, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_myupstream_http2_deliver(st);
+}
+
+/* 等待连接、等待响应或者两个 DATA 之间超时 */
+static void ngx_http_myupstream_http2_timeout(ngx_event_t *ev) {
+    ngx_connection_t                    *c;
+    ngx_http_myupstream_http2_stream_t  *st;
+
+    st = ev->data;
+    c = st->request->connection;
+
+    ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, st->waiting ? "myupstream http2: no free stream" : "myupstream http2: upstream timed out");
+
+    ngx_http_myupstream_http2_reset(st->conn, st->id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+    ngx_http_myupstream_http2_fail(st, NGX_HTTP_GATEWAY_TIME_OUT);
+    ngx_http_run_posted_requests(c);
+}
+
+/* 请求提前结束（比如客户端断开）时取消流，否则连接上的数据会交给一个已经释放的请求 */
+static void ngx_http_myupstream_http2_cleanup(void *data) {
+    ngx_http_myupstream_http2_stream_t  *st = data;
+
+    if (st->conn && !st->done) {
+        ngx_http_myupstream_http2_reset(st->conn, st->id, NGX_HTTP_MYUPSTREAM_HTTP2_CANCEL);
+    }
+
+    ngx_http_myupstream_http2_detach(st);
+    st->request = NULL;
+}
+
+/* 向表中加入一项，先淘汰最旧的项腾出空间，比整个表还大的项只会清空表 */
+static ngx_int_t ngx_http_myupstream_http2_table_add(ngx_http_myupstream_http2_table_t *t, ngx_str_t *name, ngx_str_t *value) {
+    size_t                              size;
+    ngx_http_myupstream_http2_entry_t  *e;
+
+    size = name->len + value->len + NGX_HTTP_MYUPSTREAM_HTTP2_ENTRY_OVERHEAD;
+
+    if (size > t->max) {
+        ngx_http_myupstream_http2_table_size(t, 0);
+        return NGX_OK;
+    }
+
+    /* 名字可能引用表中将被淘汰的项，先复制再淘汰 */
+    e = ngx_alloc(sizeof(ngx_http_myupstream_http2_entry_t) + name->len + value->len, ngx_cycle->log);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    e->name_len = name->len;
+    e->value_len = value->len;
+    ngx_memcpy(e->data, name->data, name->len);
+    ngx_memcpy(e->data + name->len, value->data, value->len);
+
+    ngx_http_myupstream_http2_table_size(t, t->max - size);
+
+    t->last = (t->last + 1) % NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES;
+    t->entries[t->last] = e;
+    t->n++;
+    t->size += size;
+
+    return NGX_OK;
+}
+
+/* 淘汰最旧的项，直到表的大小不超过 max */
+static void ngx_http_myupstream_http2_table_size(ngx_http_myupstream_http2_table_t *t, size_t max) {
+    ngx_uint_t                          slot;
+    ngx_http_myupstream_http2_entry_t  *e;
+
+    while (t->n && t->size > max) {
+        slot = (t->last + NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES - (t->n - 1)) % NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES;
+        e = t->entries[slot];
+
+        t->size -= e->name_len + e->value_len + NGX_HTTP_MYUPSTREAM_HTTP2_ENTRY_OVERHEAD;
+        t->n--;
+
+        ngx_free(e);
+        t->entries[slot] = NULL;
+    }
+}
+
+/* 第 k 新的一项，k 从 0 开始 */
+static ngx_http_myupstream_http2_entry_t *ngx_http_myupstream_http2_table_get(ngx_http_myupstream_http2_table_t *t, ngx_uint_t k) {
+    if (k >= t->n) {
+        return NULL;
+    }
+
+    return t->entries[(t->last + NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES - k) % NGX_HTTP_MYUPSTREAM_HTTP2_TABLE_ENTRIES];
+}
+
+static void ngx_http_myupstream_http2_table_free(ngx_http_myupstream_http2_table_t *t) {
+    ngx_http_myupstream_http2_table_size(t, 0);
+}
+
+/* 编码 HPACK 整数，mask 是第一个字节中前缀之外的高位 */
+static u_char *ngx_http_myupstream_http2_encode_int(u_char *p, ngx_uint_t prefix, ngx_uint_t mask, ngx_uint_t value) {
+    ngx_uint_t  max;
+
+    max = (1 << prefix) - 1;
+
+    if (value < max) {
+        *p++ = (u_char) (mask | value);
+        return p;
+    }
+
+    *p++ = (u_char) (mask | max);
+    value -= max;
+
+    while (value >= 0x80) {
+        *p++ = (u_char) (0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+
+    *p++ = (u_char) value;
+
+    return p;
+}
+
+/* 编码字符串，Huffman 编码更短时使用 Huffman 编码 */
+static u_char *ngx_http_myupstream_http2_encode_string(u_char *p, u_char *data, size_t len, u_char *tmp) {
+    size_t  hlen;
+
+    hlen = ngx_http_v2_huff_encode(data, len, tmp, 0);
+
+    if (hlen) {
+        p = ngx_http_myupstream_http2_encode_int(p, 7, 0x80, hlen);
+        return ngx_cpymem(p, tmp, hlen);
+    }
+
+    p = ngx_http_myupstream_http2_encode_int(p, 7, 0x00, len);
+    return ngx_cpymem(p, data, len);
+}
+
+/*
+编码一个请求头：动态表或静态表中有完全相同的项时只写索引，
+否则写入字面量并加入动态表，名字尽量引用表中已有的项
+*/
+static u_char *ngx_http_myupstream_http2_encode_header(ngx_http_myupstream_http2_conn_t *hc, u_char *p, ngx_str_t *name, ngx_str_t *value, ngx_uint_t index, u_char *tmp) {
+    ngx_uint_t                          i, name_index;
+    ngx_http_myupstream_http2_entry_t  *e;
+
+    name_index = 0;
+
+    for (i = 0; i < hc->encoder.n; i++) {
+        e = ngx_http_myupstream_http2_table_get(&hc->encoder, i);
+
+        if (e->name_len != name->len || ngx_strncmp(e->data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (e->value_len == value->len && ngx_strncmp(e->data + e->name_len, value->data, value->len) == 0) {
+            return ngx_http_myupstream_http2_encode_int(p, 7, 0x80, NGX_HTTP_MYUPSTREAM_HTTP2_STATIC_ENTRIES + 1 + i);
+        }
+
+        if (name_index == 0) {
+            name_index = NGX_HTTP_MYUPSTREAM_HTTP2_STATIC_ENTRIES + 1 + i;
+        }
+    }
+
+    for (i = 0; i < NGX_HTTP_MYUPSTREAM_HTTP2_STATIC_ENTRIES; i++) {
+        if (ngx_http_myupstream_http2_static_table[i][0].len != name->len
+            || ngx_strncmp(ngx_http_myupstream_http2_static_table[i][0].data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (ngx_http_myupstream_http2_static_table[i][1].len == value->len
+            && ngx_strncmp(ngx_http_myupstream_http2_static_table[i][1].data, value->data, value->len) == 0)
+        {
+            return ngx_http_myupstream_http2_encode_int(p, 7, 0x80, i + 1);
+        }
+
+        /* 静态表的索引更稳定，优先引用 */
+        name_index = i + 1;
+        break;
+    }
+
+    if (index) {
+        p = ngx_http_myupstream_http2_encode_int(p, 6, 0x40, name_index);
+
+    } else {
+        p = ngx_http_myupstream_http2_encode_int(p, 4, 0x00, name_index);
+    }
+
+    if (name_index == 0) {
+        p = ngx_http_myupstream_http2_encode_string(p, name->data, name->len, tmp);
+    }
+
+    p = ngx_http_myupstream_http2_encode_string(p, value->data, value->len, tmp);
+
+    if (index && ngx_http_myupstream_http2_table_add(&hc->encoder, name, value) != NGX_OK) {
+        /* 分配失败时对端的表里有这一项而我们没有，之后只会少用一个索引，不影响正确性 */
+        ngx_log_error(NGX_LOG_ALERT, &hc->log, 0, "myupstream http2: failed to add header to encoder table");
+    }
+
+    return p;
+}
+
+#endif /* NGX_HTTP_V2 */
@@ -0,0 +1,657 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 并发上限的估计值以千分之一为单位保存，平滑时不会因为取整而停在较小的值上 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_SCALE       1000
+/* 每个窗口（毫秒）最多调整一次上限，样本太少时延长窗口 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_WINDOW      100
+#define NGX_HTTP_MYUPSTREAM_LIMIT_MIN_SAMPLES 10
+#define NGX_HTTP_MYUPSTREAM_LIMIT_MAX_WINDOW  1000
+/* 长期 RTT 基线每个窗口向本窗口的平均 RTT 靠近 1/20 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_LONG_DECAY  20
+/* 本窗口的 RTT 不超过基线的 1.5 倍时认为后端没有排队 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_TOLERANCE   1500
+/* 新的上限占平滑结果的比例（千分之一） */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_SMOOTHING   200
+/* 本窗口失败的请求超过该比例（百分比）时上限乘以 0.9 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_DROP_RATE   10
+/* 排队的请求多久（毫秒）检查一次其他 worker 是否释放了名额 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_POLL        10
+
+/* 共享内存中的限流状态，所有 worker 用原子操作读写，调整上限时另外持有 shpool->mutex */
+typedef struct {
+    ngx_atomic_t                        inflight;      /* 所有 worker 正在访问后端的请求数 */
+    ngx_atomic_t                        limit;         /* 当前的并发上限 */
+    ngx_atomic_t                        estimate;      /* 上限的估计值，乘以 NGX_HTTP_MYUPSTREAM_LIMIT_SCALE */
+
+    ngx_atomic_t                        rtt_sum;       /* 本窗口成功请求的 RTT 之和，微秒 */
+    ngx_atomic_t                        samples;
+    ngx_atomic_t                        drops;         /* 本窗口失败的请求数 */
+    ngx_atomic_t                        window_start;
+    ngx_atomic_t                        rtt_long;      /* 长期 RTT 基线，微秒，即后端没有排队时的 RTT */
+
+    ngx_atomic_t                        passed;
+    ngx_atomic_t                        delayed;
+    ngx_atomic_t                        rejected;
+} ngx_http_myupstream_limit_sh_t;
+
+/* 限流区，即 shm_zone->data */
+typedef struct {
+    ngx_http_myupstream_limit_sh_t     *sh;
+    ngx_slab_pool_t                    *shpool;
+
+    ngx_uint_t                          initial;       /* 启动时的并发上限 */
+    ngx_uint_t                          min;
+    ngx_uint_t                          max;
+} ngx_http_myupstream_limit_zone_t;
+
+/* 每个 worker 中一个 location 的等待队列，挂在 location 配置上 */
+struct ngx_http_myupstream_limit_queue_s {
+    ngx_queue_t                         waiters;
+    ngx_uint_t                          n;
+};
+
+/* 每个请求的限流状态，从请求内存池中分配 */
+struct ngx_http_myupstream_limit_s {
+    ngx_http_request_t                 *request;
+    ngx_queue_t                         queue;         /* 在等待队列中的位置 */
+    ngx_event_t                         timer;
+    ngx_msec_t                          start;         /* 开始访问后端的时间 */
+    ngx_msec_t                          deadline;      /* 排队的最后期限 */
+
+    unsigned                            acquired:1;    /* 占用了一个并发名额 */
+    unsigned                            waiting:1;
+};
+
+static ngx_int_t ngx_http_myupstream_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_myupstream_limit_try(ngx_http_myupstream_limit_zone_t *limit);
+static ngx_int_t ngx_http_myupstream_limit_reject(ngx_http_request_t *r);
+static void ngx_http_myupstream_limit_done(ngx_http_myupstream_limit_zone_t *limit, ngx_msec_t rtt, ngx_uint_t failed);
+static void ngx_http_myupstream_limit_update(ngx_http_myupstream_limit_zone_t *limit);
+static void ngx_http_myupstream_limit_wake(ngx_http_myupstream_limit_queue_t *queue);
+static void ngx_http_myupstream_limit_timer_handler(ngx_event_t *ev);
+static void ngx_http_myupstream_limit_cleanup(void *data);
+
+/* $myupstream_limit 的取值，与 $limit_req_status 相同 */
+static ngx_str_t ngx_http_myupstream_limit_status[] = {
+    ngx_null_string,
+    ngx_string("PASSED"),
+    ngx_string("DELAYED"),
+    ngx_string("REJECTED")
+};
+
+/*
+myupstream_limit_zone 配置项的回调函数，在 http 块中为一个后端定义自适应的并发上限，引用同一个 zone 的 location 共用这个上限
+格式：myupstream_limit_zone name [initial=N] [min=N] [max=N];
+*/
+char *ngx_http_myupstream_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_int_t                          n;
+    ngx_str_t                         *value, name;
+    ngx_uint_t                         i;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_myupstream_limit_zone_t  *limit;
+
+    value = cf->args->elts;
+    name = value[1];
+
+    limit = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_limit_zone_t));
+    if (limit == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    limit->initial = 20;
+    limit->min = 1;
+    limit->max = 1000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "initial=", 8) == 0) {
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            limit->initial = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            limit->min = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            limit->max = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (limit->min > limit->max || limit->initial < limit->min || limit->initial > limit->max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" requires min <= initial <= max", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* 限流状态只有几十个字节，slab 最小要 8 页 */
+    shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_http_myupstream_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_myupstream_limit_init_zone;
+    shm_zone->data = limit;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/*
+myupstream_limit 配置项的回调函数。并发数达到上限时，配置了 queue 就在本 worker 中排队最多 timeout，否则直接返回 503
+格式：myupstream_limit zone [queue=N] [timeout=time] | off;
+*/
+char *ngx_http_myupstream_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s;
+    ngx_uint_t                  i;
+
+    if (mycf->limit_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mycf->limit_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    mycf->limit_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (mycf->limit_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mycf->limit_queue_size = 0;
+    mycf->limit_timeout = 100;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            mycf->limit_queue_size = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            mycf->limit_timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/* 初始化共享内存，reload 时沿用旧的上限和 RTT 基线 */
+static ngx_int_t ngx_http_myupstream_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_myupstream_limit_zone_t  *olimit = data;
+    ngx_http_myupstream_limit_zone_t  *limit;
+
+    limit = shm_zone->data;
+
+    if (olimit) {
+        limit->sh = olimit->sh;
+        limit->shpool = olimit->shpool;
+        return NGX_OK;
+    }
+
+    limit->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        limit->sh = limit->shpool->data;
+        return NGX_OK;
+    }
+
+    limit->sh = ngx_slab_calloc(limit->shpool, sizeof(ngx_http_myupstream_limit_sh_t));
+    if (limit->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    limit->shpool->data = limit->sh;
+
+    limit->sh->limit = limit->initial;
+    limit->sh->estimate = limit->initial * NGX_HTTP_MYUPSTREAM_LIMIT_SCALE;
+    limit->sh->window_start = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+/* 每个 worker 中每个配置了 myupstream_limit 的 location 一个等待队列 */
+ngx_http_myupstream_limit_queue_t *ngx_http_myupstream_limit_init(ngx_conf_t *cf) {
+    ngx_http_myupstream_limit_queue_t  *queue;
+
+    queue = ngx_palloc(cf->pool, sizeof(ngx_http_myupstream_limit_queue_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    ngx_queue_init(&queue->waiters);
+    queue->n = 0;
+
+    return queue;
+}
+
+/*
+开始访问后端之前调用，占用一个并发名额
+返回值：NGX_OK - 拿到了名额，可以访问后端
+       NGX_DONE - 在排队，拿到名额后由 ngx_http_myupstream_start 继续处理，已经增加了引用计数
+       NGX_HTTP_SERVICE_UNAVAILABLE - 超出上限，作为 handler 的返回值
+       NGX_ERROR - 内存不足
+*/
+ngx_int_t ngx_http_myupstream_limit_acquire(ngx_http_request_t *r) {
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_limit_zone_t  *limit;
+    ngx_http_myupstream_limit_t       *lim;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    limit = mycf->limit_zone->data;
+
+    lim = myctx->limit;
+
+    if (lim == NULL) {
+        lim = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_limit_t));
+        if (lim == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        lim->request = r;
+        lim->timer.handler = ngx_http_myupstream_limit_timer_handler;
+        lim->timer.data = lim;
+        lim->timer.log = r->connection->log;
+
+        cln->handler = ngx_http_myupstream_limit_cleanup;
+        cln->data = lim;
+
+        myctx->limit = lim;
+    }
+
+    if (lim->acquired) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_myupstream_limit_try(limit) == NGX_OK) {
+        lim->acquired = 1;
+        lim->start = ngx_current_msec;
+
+        myctx->limit_status = NGX_HTTP_MYUPSTREAM_LIMIT_PASSED;
+        (void) ngx_atomic_fetch_add(&limit->sh->passed, 1);
+
+        return NGX_OK;
+    }
+
+    /* 后台更新缓存的子请求没有客户端在等，不排队 */
+    if (r != r->main || mycf->limit_queue->n >= mycf->limit_queue_size) {
+        return ngx_http_myupstream_limit_reject(r);
+    }
+
+    ngx_queue_insert_tail(&mycf->limit_queue->waiters, &lim->queue);
+    mycf->limit_queue->n++;
+
+    lim->waiting = 1;
+    lim->deadline = ngx_current_msec + mycf->limit_timeout;
+
+    ngx_add_timer(&lim->timer, ngx_min(NGX_HTTP_MYUPSTREAM_LIMIT_POLL, mycf->limit_timeout));
+
+    myctx->limit_status = NGX_HTTP_MYUPSTREAM_LIMIT_DELAYED;
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/*
+访问后端结束时调用，归还名额、记录 RTT，并唤醒本 worker 中排队的请求
+参数：r - 请求
+     rc - upstream 结束的原因
+*/
+void ngx_http_myupstream_limit_release(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_uint_t                    failed, status;
+    ngx_http_myupstream_ctx_t    *myctx;
+    ngx_http_myupstream_conf_t   *mycf;
+    ngx_http_myupstream_limit_t  *lim;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    lim = myctx->limit;
+
+    if (lim == NULL || !lim->acquired) {
+        return;
+    }
+
+    /* myupstream_http2 不创建 upstream，后端的状态码直接放在 headers_out 中 */
+    status = r->upstream ? r->upstream->headers_in.status_n : r->headers_out.status;
+
+    /* 连接失败、超时和后端的 5xx 都说明后端已经过载，不记录 RTT，只计入失败 */
+    failed = (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE
+              || status >= NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    lim->acquired = 0;
+
+    ngx_http_myupstream_limit_done(mycf->limit_zone->data, ngx_current_msec - lim->start, failed);
+
+    ngx_http_myupstream_limit_wake(mycf->limit_queue);
+}
+
+/* $myupstream_limit：PASSED、DELAYED 或 REJECTED */
+ngx_int_t ngx_http_myupstream_limit_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx == NULL || myctx->limit_status == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_http_myupstream_limit_status[myctx->limit_status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_http_myupstream_limit_status[myctx->limit_status].data;
+
+    return NGX_OK;
+}
+
+/* 先占用名额再检查，超出上限时退回，这样多个 worker 同时检查也不会超出 */
+static ngx_int_t ngx_http_myupstream_limit_try(ngx_http_myupstream_limit_zone_t *limit) {
+    ngx_atomic_uint_t  max;
+
+    max = limit->sh->limit;
+
+    if (ngx_atomic_fetch_add(&limit->sh->inflight, 1) < max) {
+        return NGX_OK;
+    }
+
+    (void) ngx_atomic_fetch_add(&limit->sh->inflight, -1);
+
+    return NGX_BUSY;
+}
+
+/* 返回 503，让客户端过一秒再试 */
+static ngx_int_t ngx_http_myupstream_limit_reject(ngx_http_request_t *r) {
+    ngx_table_elt_t                   *h;
+    ngx_http_myupstream_ctx_t         *myctx;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_limit_zone_t  *limit;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    limit = mycf->limit_zone->data;
+
+    myctx->limit_status = NGX_HTTP_MYUPSTREAM_LIMIT_REJECTED;
+    (void) ngx_atomic_fetch_add(&limit->sh->rejected, 1);
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "myupstream: limiting requests to \"%V\", limit %uA",
+                  &mycf->limit_zone->shm.name, limit->sh->limit);
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Retry-After");
+    ngx_str_set(&h->value, "1");
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+/* 归还名额，把 RTT 计入本窗口，窗口结束时调整上限 */
+static void ngx_http_myupstream_limit_done(ngx_http_myupstream_limit_zone_t *limit, ngx_msec_t rtt, ngx_uint_t failed) {
+    ngx_http_myupstream_limit_sh_t  *sh = limit->sh;
+
+    (void) ngx_atomic_fetch_add(&sh->inflight, -1);
+
+    if (failed) {
+        (void) ngx_atomic_fetch_add(&sh->drops, 1);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&sh->rtt_sum, (ngx_atomic_int_t) (rtt * 1000 + 1));
+        (void) ngx_atomic_fetch_add(&sh->samples, 1);
+    }
+
+    if ((ngx_msec_int_t) (ngx_current_msec - sh->window_start) < NGX_HTTP_MYUPSTREAM_LIMIT_WINDOW) {
+        return;
+    }
+
+    /* 别的 worker 正在调整时不等待，访问后端的请求不能被这里阻塞 */
+    if (!ngx_shmtx_trylock(&limit->shpool->mutex)) {
+        return;
+    }
+
+    ngx_http_myupstream_limit_update(limit);
+
+    ngx_shmtx_unlock(&limit->shpool->mutex);
+}
+
+/*
+按 gradient 算法调整并发上限，调用者持有锁。
+本窗口的平均 RTT 与长期基线之比就是后端排队的程度：gradient = 1.5 * 基线 / 本窗口，限制在 [0.5, 1]，
+新上限 = 上限 * gradient + sqrt(上限)，后一项让后端不排队时上限缓慢增长；再与旧的估计值做平滑。
+本窗口失败过多时不看 RTT，直接乘以 0.9；并发数不到上限一半时，RTT 说明不了上限是否合适，不增长
+*/
+static void ngx_http_myupstream_limit_update(ngx_http_myupstream_limit_zone_t *limit) {
+    uint64_t                         sum, samples, drops, rtt, rtt_long, gradient, cur, estimate, target, q;
+    ngx_msec_t                       elapsed;
+    ngx_http_myupstream_limit_sh_t  *sh = limit->sh;
+
+    elapsed = ngx_current_msec - sh->window_start;
+
+    if ((ngx_msec_int_t) elapsed < NGX_HTTP_MYUPSTREAM_LIMIT_WINDOW) {
+        return;
+    }
+
+    samples = sh->samples;
+    drops = sh->drops;
+
+    if (samples + drops < NGX_HTTP_MYUPSTREAM_LIMIT_MIN_SAMPLES && elapsed < NGX_HTTP_MYUPSTREAM_LIMIT_MAX_WINDOW) {
+        return;
+    }
+
+    sum = sh->rtt_sum;
+
+    /* 读和清零之间完成的请求留到下一个窗口 */
+    (void) ngx_atomic_fetch_add(&sh->samples, -(ngx_atomic_int_t) samples);
+    (void) ngx_atomic_fetch_add(&sh->drops, -(ngx_atomic_int_t) drops);
+    (void) ngx_atomic_fetch_add(&sh->rtt_sum, -(ngx_atomic_int_t) sum);
+    sh->window_start = ngx_current_msec;
+
+    estimate = sh->estimate;
+    cur = estimate / NGX_HTTP_MYUPSTREAM_LIMIT_SCALE;
+
+    if (drops * 100 > (samples + drops) * NGX_HTTP_MYUPSTREAM_LIMIT_DROP_RATE) {
+        estimate = estimate * 9 / 10;
+        goto done;
+    }
+
+    if (samples == 0) {
+        return;
+    }
+
+    rtt = sum / samples;
+    rtt_long = sh->rtt_long;
+
+    if (rtt_long == 0) {
+        rtt_long = rtt;
+
+    } else if (rtt > rtt_long) {
+        rtt_long += (rtt - rtt_long) / NGX_HTTP_MYUPSTREAM_LIMIT_LONG_DECAY;
+
+    } else {
+        /* 后端恢复后基线要尽快跟上，否则会长时间高估 RTT */
+        rtt_long -= (rtt_long - rtt) / 2;
+    }
+
+    sh->rtt_long = rtt_long;
+
+    if (sh->inflight * 2 < cur) {
+        return;
+    }
+
+    gradient = NGX_HTTP_MYUPSTREAM_LIMIT_TOLERANCE * rtt_long / ngx_max(rtt, 1);
+    gradient = ngx_max(ngx_min(gradient, 1000), 500);
+
+    for (q = 1; (q + 1) * (q + 1) <= cur; q++) { /* void */ }
+
+    target = estimate * gradient / 1000 + q * NGX_HTTP_MYUPSTREAM_LIMIT_SCALE;
+
+    estimate = (estimate * (1000 - NGX_HTTP_MYUPSTREAM_LIMIT_SMOOTHING) + target * NGX_HTTP_MYUPSTREAM_LIMIT_SMOOTHING) / 1000;
+
+done:
+
+    estimate = ngx_max(estimate, limit->min * NGX_HTTP_MYUPSTREAM_LIMIT_SCALE);
+    estimate = ngx_min(estimate, limit->max * NGX_HTTP_MYUPSTREAM_LIMIT_SCALE);
+
+    sh->estimate = estimate;
+    sh->limit = estimate / NGX_HTTP_MYUPSTREAM_LIMIT_SCALE;
+}
+
+/*
+名额被归还后，让队头的请求在下一轮事件循环中重新尝试。
+不在这里直接继续处理它，此时还在另一个请求的 finalize 过程中
+*/
+static void ngx_http_myupstream_limit_wake(ngx_http_myupstream_limit_queue_t *queue) {
+    ngx_http_myupstream_limit_t       *lim;
+
+    if (ngx_queue_empty(&queue->waiters)) {
+        return;
+    }
+
+    lim = ngx_queue_data(ngx_queue_head(&queue->waiters), ngx_http_myupstream_limit_t, queue);
+
+    if (lim->timer.timer_set) {
+        ngx_del_timer(&lim->timer);
+    }
+
+    ngx_add_timer(&lim->timer, 0);
+}
+
+/* 排队的请求重新尝试：拿到名额就继续访问后端，超过期限就返回 503，否则继续等待 */
+static void ngx_http_myupstream_limit_timer_handler(ngx_event_t *ev) {
+    ngx_int_t                          rc;
+    ngx_msec_int_t                     left;
+    ngx_connection_t                  *c;
+    ngx_http_request_t                *r;
+    ngx_http_myupstream_conf_t        *mycf;
+    ngx_http_myupstream_limit_zone_t  *limit;
+    ngx_http_myupstream_limit_t       *lim;
+
+    lim = ev->data;
+    r = lim->request;
+    c = r->connection;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    limit = mycf->limit_zone->data;
+
+    if (ngx_http_myupstream_limit_try(limit) == NGX_OK) {
+        ngx_queue_remove(&lim->queue);
+        mycf->limit_queue->n--;
+
+        lim->waiting = 0;
+        lim->acquired = 1;
+        lim->start = ngx_current_msec;
+
+        (void) ngx_atomic_fetch_add(&limit->sh->delayed, 1);
+
+        ngx_http_finalize_request(r, ngx_http_myupstream_start(r));
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    left = (ngx_msec_int_t) (lim->deadline - ngx_current_msec);
+
+    if (left > 0) {
+        ngx_add_timer(ev, ngx_min(NGX_HTTP_MYUPSTREAM_LIMIT_POLL, (ngx_msec_t) left));
+        return;
+    }
+
+    ngx_queue_remove(&lim->queue);
+    mycf->limit_queue->n--;
+    lim->waiting = 0;
+
+    rc = ngx_http_myupstream_limit_reject(r);
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+/* 请求销毁时离开等待队列；没有经过 finalize_request 回调的请求（比如解析后端地址失败）在这里归还名额 */
+static void ngx_http_myupstream_limit_cleanup(void *data) {
+    ngx_http_myupstream_limit_t  *lim = data;
+
+    ngx_http_request_t          *r;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    r = lim->request;
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    if (lim->timer.timer_set) {
+        ngx_del_timer(&lim->timer);
+    }
+
+    if (lim->waiting) {
+        ngx_queue_remove(&lim->queue);
+        mycf->limit_queue->n--;
+        lim->waiting = 0;
+    }
+
+    if (lim->acquired) {
+        lim->acquired = 0;
+        (void) ngx_atomic_fetch_add(&((ngx_http_myupstream_limit_zone_t *) mycf->limit_zone->data)->sh->inflight, -1);
+        ngx_http_myupstream_limit_wake(mycf->limit_queue);
+    }
+}
@@ -0,0 +1,969 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 统计的阶段 */
+#define NGX_HTTP_MYUPSTREAM_PHASE_DNS          0   /* 异步解析后端域名 */
+#define NGX_HTTP_MYUPSTREAM_PHASE_CONNECT      1   /* 建立后端连接 */
+#define NGX_HTTP_MYUPSTREAM_PHASE_FIRST_BYTE   2   /* 开始连接到收到响应的第一个字节 */
+#define NGX_HTTP_MYUPSTREAM_PHASE_HEADER       3   /* 解析响应行和响应头消耗的CPU时间 */
+#define NGX_HTTP_MYUPSTREAM_PHASE_TOTAL        4   /* 开始访问后端到请求结束 */
+#define NGX_HTTP_MYUPSTREAM_PHASES             5
+
+/* 按后端响应码分类，0 表示没有收到响应 */
+#define NGX_HTTP_MYUPSTREAM_CLASSES            6
+
+/*
+HDR 风格的对数线性直方图，单位为微秒。
+0~3 各占一个桶，之后每个2的幂区间再等分为4个桶，相对误差不超过25%；
+最大的有限桶上界约为134秒，更大的值只计入 +Inf
+*/
+#define NGX_HTTP_MYUPSTREAM_SUB_BUCKETS        4
+#define NGX_HTTP_MYUPSTREAM_MAX_EXP            26
+#define NGX_HTTP_MYUPSTREAM_BUCKETS                                           \
+    (NGX_HTTP_MYUPSTREAM_SUB_BUCKETS                                          \
+     + (NGX_HTTP_MYUPSTREAM_MAX_EXP - 1) * NGX_HTTP_MYUPSTREAM_SUB_BUCKETS)
+
+/* 批次大小的桶：le 为 1、2、4……64，即 myupstream_batch 的 size 上限，最后一个只计入 +Inf */
+#define NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS      7
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+/* 每个请求从内存池分配的字节数和内存池大小的桶：le 为 256、512……1M，最后一个只计入 +Inf */
+#define NGX_HTTP_MYUPSTREAM_POOL_BYTES_SHIFT   8
+#define NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS 13
+/* 每个请求分配次数的桶：le 为 1、2、4……256 */
+#define NGX_HTTP_MYUPSTREAM_POOL_COUNT_BUCKETS 9
+#endif
+
+/* 每个 worker 只写自己的槽位，计数器的原子操作不需要内存屏障 */
+#if (NGX_HAVE_GCC_ATOMIC) && defined(__ATOMIC_RELAXED)
+#define ngx_http_myupstream_metrics_add(p, n)  __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+#else
+#define ngx_http_myupstream_metrics_add(p, n)  ngx_atomic_fetch_add(p, n)
+#endif
+
+typedef struct {
+    ngx_atomic_t                      bucket[NGX_HTTP_MYUPSTREAM_BUCKETS + 1]; /* 最后一个只计入 +Inf */
+    ngx_atomic_t                      sum;         /* 微秒 */
+} ngx_http_myupstream_histogram_t;
+
+/* 一个 worker 的计数器 */
+typedef struct {
+    ngx_atomic_t                      requests[NGX_HTTP_MYUPSTREAM_CLASSES];
+    ngx_atomic_t                      bytes[NGX_HTTP_MYUPSTREAM_CLASSES];
+    ngx_http_myupstream_histogram_t   phase[NGX_HTTP_MYUPSTREAM_PHASES][NGX_HTTP_MYUPSTREAM_CLASSES];
+    ngx_atomic_t                      hedges[NGX_HTTP_MYUPSTREAM_HEDGE_RESULTS];
+    ngx_atomic_t                      batch_size[NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS + 1];
+    ngx_atomic_t                      batch_size_sum;
+    ngx_http_myupstream_histogram_t   batch_wait;  /* 请求等到所在批次发出的时间 */
+    ngx_atomic_t                      batches[NGX_HTTP_MYUPSTREAM_BATCH_RESULTS];
+    ngx_atomic_t                      fanouts[NGX_HTTP_MYUPSTREAM_FANOUT_RESULTS];
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+    ngx_atomic_t                      pool_allocations[NGX_HTTP_MYUPSTREAM_POOL_SITES][2]; /* 第二维 0 为小块，1 为大块 */
+    ngx_atomic_t                      pool_bytes[NGX_HTTP_MYUPSTREAM_POOL_SITES][2];
+    ngx_atomic_t                      pool_request_bytes[NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS + 1];
+    ngx_atomic_t                      pool_request_bytes_sum;
+    ngx_atomic_t                      pool_request_allocations[NGX_HTTP_MYUPSTREAM_POOL_COUNT_BUCKETS + 1];
+    ngx_atomic_t                      pool_request_allocations_sum;
+    ngx_atomic_t                      pool_size[NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS + 1]; /* 请求结束时内存池的大小 */
+    ngx_atomic_t                      pool_size_sum;
+#endif
+} ngx_http_myupstream_metrics_slot_t;
+
+/* 共享内存中的统计数据，每个 worker 一个槽位，读取时再把所有槽位加起来 */
+typedef struct {
+    ngx_uint_t                           nslots;
+    ngx_http_myupstream_metrics_slot_t   slot[1];
+} ngx_http_myupstream_metrics_sh_t;
+
+/* 统计区，即 shm_zone->data */
+typedef struct {
+    ngx_http_myupstream_metrics_sh_t  *sh;
+    ngx_slab_pool_t                   *shpool;
+    ngx_cycle_t                       *cycle;      /* 定义统计区的 cycle，初始化共享内存时从中取 worker 数量 */
+} ngx_http_myupstream_metrics_t;
+
+static ngx_int_t ngx_http_myupstream_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_myupstream_metrics_process_header(ngx_http_request_t *r);
+static uint64_t ngx_http_myupstream_metrics_now(void);
+static ngx_uint_t ngx_http_myupstream_metrics_bucket(uint64_t us);
+static uint64_t ngx_http_myupstream_metrics_bound(ngx_uint_t bucket);
+static void ngx_http_myupstream_metrics_observe(ngx_http_myupstream_metrics_slot_t *slot, ngx_uint_t phase, ngx_uint_t class, uint64_t us);
+static ngx_int_t ngx_http_myupstream_metrics_handler(ngx_http_request_t *r);
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+static ngx_uint_t ngx_http_myupstream_metrics_pool_bucket(size_t value, ngx_uint_t shift, ngx_uint_t n);
+static u_char *ngx_http_myupstream_metrics_pool_histogram(u_char *p, ngx_str_t *zone, char *name, ngx_atomic_t *bucket,
+    ngx_uint_t shift, ngx_uint_t n, ngx_atomic_uint_t sum);
+#endif
+
+static ngx_str_t ngx_http_myupstream_metrics_phases[] = {
+    ngx_string("dns"),
+    ngx_string("connect"),
+    ngx_string("first_byte"),
+    ngx_string("header"),
+    ngx_string("total")
+};
+
+static ngx_str_t ngx_http_myupstream_metrics_hedges[] = {
+    ngx_string("won"),
+    ngx_string("lost"),
+    ngx_string("failed"),
+    ngx_string("throttled")
+};
+
+static ngx_str_t ngx_http_myupstream_metrics_batches[] = {
+    ngx_string("ok"),
+    ngx_string("failed"),
+    ngx_string("timeout")
+};
+
+static ngx_str_t ngx_http_myupstream_metrics_fanouts[] = {
+    ngx_string("ok"),
+    ngx_string("failed"),
+    ngx_string("late")
+};
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+/* 按 NGX_HTTP_MYUPSTREAM_POOL_* 的顺序 */
+static ngx_str_t ngx_http_myupstream_metrics_pool_sites[][2] = {
+    { ngx_string("myupstream"), ngx_string("ctx") },
+    { ngx_string("myupstream"), ngx_string("addr") },
+    { ngx_string("myupstream"), ngx_string("peer") },
+    { ngx_string("myupstream"), ngx_string("request") },
+    { ngx_string("myupstream"), ngx_string("chain") },
+    { ngx_string("myupstream"), ngx_string("pipe") },
+    { ngx_string("myupstream"), ngx_string("status_line") },
+    { ngx_string("myupstream"), ngx_string("header") },
+    { ngx_string("myupstream"), ngx_string("lowcase") },
+    { ngx_string("myupstream"), ngx_string("body_buffer") },
+    { ngx_string("mymodule"), ngx_string("buf") },
+    { ngx_string("mymodule"), ngx_string("file") },
+    { ngx_string("mymodule"), ngx_string("ingest") },
+    { ngx_string("mymodule"), ngx_string("response") }
+};
+
+static ngx_str_t ngx_http_myupstream_metrics_pool_kinds[] = {
+    ngx_string("small"),
+    ngx_string("large")
+};
+#endif
+
+static ngx_str_t ngx_http_myupstream_metrics_classes[] = {
+    ngx_string("none"),
+    ngx_string("1xx"),
+    ngx_string("2xx"),
+    ngx_string("3xx"),
+    ngx_string("4xx"),
+    ngx_string("5xx")
+};
+
+/*
+myupstream_metrics_zone 配置项的回调函数，在 http 块中定义一块保存各阶段耗时的共享内存
+格式：myupstream_metrics_zone name size;
+*/
+char *ngx_http_myupstream_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ssize_t                         size;
+    ngx_str_t                      *value;
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_http_myupstream_metrics_t  *metrics;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    metrics = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_metrics_t));
+    if (metrics == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size, &ngx_http_myupstream_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    metrics->cycle = cf->cycle;
+
+    shm_zone->init = ngx_http_myupstream_metrics_init_zone;
+    shm_zone->data = metrics;
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_metrics 配置项的回调函数，该 location 访问后端的各阶段耗时记入指定的统计区
+格式：myupstream_metrics name | off;
+*/
+char *ngx_http_myupstream_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+
+    if (mycf->metrics_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mycf->metrics_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    mycf->metrics_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (mycf->metrics_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_metrics_export 配置项的回调函数，该 location 以 Prometheus 文本格式输出指定统计区
+格式：myupstream_metrics_export name;
+*/
+char *ngx_http_myupstream_metrics_export(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_http_core_loc_conf_t   *clcf;
+
+    value = cf->args->elts;
+
+    mycf->metrics_export_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (mycf->metrics_export_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_myupstream_metrics_handler;
+
+    return NGX_CONF_OK;
+}
+
+/*
+初始化共享内存，按 worker 数量分配槽位，reload 时沿用旧的计数。
+reload 后 worker 数量变多时，多出来的 worker 共用最后一个槽位，计数器都是原子操作，结果仍然正确
+*/
+static ngx_int_t ngx_http_myupstream_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_myupstream_metrics_t  *ometrics = data;
+    ngx_http_myupstream_metrics_t  *metrics;
+    size_t                          size;
+    ngx_uint_t                      nslots;
+    ngx_core_conf_t                *ccf;
+
+    metrics = shm_zone->data;
+
+    if (ometrics) {
+        metrics->sh = ometrics->sh;
+        metrics->shpool = ometrics->shpool;
+        return NGX_OK;
+    }
+
+    metrics->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        metrics->sh = metrics->shpool->data;
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(metrics->cycle->conf_ctx, ngx_core_module);
+
+    nslots = ccf->worker_processes > 0 ? (ngx_uint_t) ccf->worker_processes : 1;
+
+    size = sizeof(ngx_http_myupstream_metrics_sh_t) + (nslots - 1) * sizeof(ngx_http_myupstream_metrics_slot_t);
+
+    metrics->sh = ngx_slab_calloc(metrics->shpool, size);
+    if (metrics->sh == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "zone \"%V\" is too small for %ui worker processes, at least %uz bytes needed", &shm_zone->shm.name, nslots, size + 8 * ngx_pagesize);
+        return NGX_ERROR;
+    }
+
+    metrics->sh->nslots = nslots;
+    metrics->shpool->data = metrics->sh;
+
+    return NGX_OK;
+}
+
+/*
+创建 upstream 之后调用，开始记录本次请求的各阶段耗时。
+用一个包装函数替换 process_header，统计解析响应行和响应头消耗的时间
+参数：r - 请求，r->upstream 必须已经设置好 process_header
+*/
+void ngx_http_myupstream_metrics_start(ngx_http_request_t *r) {
+    ngx_http_upstream_t        *u = r->upstream;
+    ngx_http_myupstream_ctx_t  *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    myctx->metrics = 1;
+    myctx->metrics_start = ngx_current_msec;
+    myctx->metrics_process_header = u->process_header;
+
+    u->process_header = ngx_http_myupstream_metrics_process_header;
+}
+
+/*
+每次收到响应头的数据时调用，调用真正的解析函数并累计耗时。
+解析函数会把 u->process_header 从解析响应行切换为解析头部，这里要记下切换后的函数再换回包装函数
+*/
+static ngx_int_t ngx_http_myupstream_metrics_process_header(ngx_http_request_t *r) {
+    uint64_t                    start;
+    ngx_int_t                   rc;
+    ngx_http_upstream_t        *u = r->upstream;
+    ngx_http_myupstream_ctx_t  *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    //重试其他后端时upstream机制会换一个新的u->state，从头统计
+    if (myctx->metrics_state != u->state) {
+        myctx->metrics_state = u->state;
+        myctx->metrics_first_byte = ngx_current_msec - u->start_time;
+        myctx->metrics_header = 0;
+    }
+
+    start = ngx_http_myupstream_metrics_now();
+
+    u->process_header = myctx->metrics_process_header;
+    rc = u->process_header(r);
+    myctx->metrics_process_header = u->process_header;
+    u->process_header = ngx_http_myupstream_metrics_process_header;
+
+    myctx->metrics_header += ngx_http_myupstream_metrics_now() - start;
+
+    return rc;
+}
+
+/*
+upstream 结束时调用，把本次请求的各阶段耗时记入当前 worker 的槽位。
+只有确实发生了的阶段才会记录，例如地址缓存命中时没有 dns 阶段
+参数：r - 请求
+     rc - upstream 结束的返回值
+*/
+void ngx_http_myupstream_metrics_record(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_uint_t                           class, status;
+    ngx_http_upstream_t                 *u = r->upstream;
+    ngx_http_myupstream_ctx_t           *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_conf_t          *mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_metrics_t       *metrics;
+    ngx_http_myupstream_metrics_slot_t  *slot;
+
+    if (myctx == NULL || !myctx->metrics) {
+        return;
+    }
+
+    metrics = mycf->metrics_zone->data;
+
+    slot = &metrics->sh->slot[ngx_min(ngx_worker, metrics->sh->nslots - 1)];
+
+    status = u->headers_in.status_n;
+    class = (status >= 100 && status < 600) ? status / 100 : 0;
+
+    ngx_http_myupstream_metrics_add(&slot->requests[class], 1);
+
+    if (u->state) {
+        ngx_http_myupstream_metrics_add(&slot->bytes[class], (ngx_atomic_int_t) u->state->bytes_received);
+    }
+
+    if (myctx->dns_resolved) {
+        ngx_http_myupstream_metrics_observe(slot, NGX_HTTP_MYUPSTREAM_PHASE_DNS, class, (uint64_t) myctx->dns_time * 1000);
+    }
+
+    /* 地址竞速时连接在 upstream 机制之外建立，连接阶段是整个竞速的耗时 */
+    if (myctx->eyeballs_connected) {
+        ngx_http_myupstream_metrics_observe(slot, NGX_HTTP_MYUPSTREAM_PHASE_CONNECT, class, (uint64_t) myctx->eyeballs_time * 1000);
+
+    } else if (u->state && u->state->connect_time != (ngx_msec_t) -1) {
+        ngx_http_myupstream_metrics_observe(slot, NGX_HTTP_MYUPSTREAM_PHASE_CONNECT, class, (uint64_t) u->state->connect_time * 1000);
+    }
+
+    if (myctx->metrics_state) {
+        ngx_http_myupstream_metrics_observe(slot, NGX_HTTP_MYUPSTREAM_PHASE_FIRST_BYTE, class, (uint64_t) myctx->metrics_first_byte * 1000);
+        ngx_http_myupstream_metrics_observe(slot, NGX_HTTP_MYUPSTREAM_PHASE_HEADER, class, myctx->metrics_header);
+    }
+
+    ngx_http_myupstream_metrics_observe(slot, NGX_HTTP_MYUPSTREAM_PHASE_TOTAL, class, (uint64_t) (ngx_current_msec - myctx->metrics_start) * 1000);
+
+    if (myctx->hedge_status) {
+        ngx_http_myupstream_metrics_add(&slot->hedges[myctx->hedge_status - 1], 1);
+    }
+
+    //同一个请求只记录一次
+    myctx->metrics = 0;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream metrics class:%ui, total:%M, rc:%i", class, ngx_current_msec - myctx->metrics_start, rc);
+}
+
+/*
+myupstream_batch 发出一个批次时调用，记录批次的实际大小
+参数：zone - myupstream_metrics 引用的统计区
+     size - 批次中的请求数
+*/
+void ngx_http_myupstream_metrics_batch(ngx_shm_zone_t *zone, ngx_uint_t size) {
+    ngx_uint_t                           k;
+    ngx_http_myupstream_metrics_t       *metrics = zone->data;
+    ngx_http_myupstream_metrics_slot_t  *slot;
+
+    slot = &metrics->sh->slot[ngx_min(ngx_worker, metrics->sh->nslots - 1)];
+
+    for (k = 0; k < NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS && size > ((ngx_uint_t) 1 << k); k++) { /* void */ }
+
+    ngx_http_myupstream_metrics_add(&slot->batch_size[k], 1);
+    ngx_http_myupstream_metrics_add(&slot->batch_size_sum, size);
+}
+
+/*
+批量的请求结束时调用，记录结果和等到批次发出的时间
+参数：zone - myupstream_metrics 引用的统计区
+     result - NGX_HTTP_MYUPSTREAM_BATCH_OK 等
+     wait - 毫秒，批次没有发出时为等待的全部时间
+*/
+void ngx_http_myupstream_metrics_batch_request(ngx_shm_zone_t *zone, ngx_uint_t result, ngx_msec_t wait) {
+    ngx_http_myupstream_metrics_t       *metrics = zone->data;
+    ngx_http_myupstream_metrics_slot_t  *slot;
+
+    slot = &metrics->sh->slot[ngx_min(ngx_worker, metrics->sh->nslots - 1)];
+
+    ngx_http_myupstream_metrics_add(&slot->batches[result], 1);
+    ngx_http_myupstream_metrics_add(&slot->batch_wait.bucket[ngx_http_myupstream_metrics_bucket((uint64_t) wait * 1000)], 1);
+    ngx_http_myupstream_metrics_add(&slot->batch_wait.sum, (ngx_atomic_int_t) wait * 1000);
+}
+
+/*
+myupstream_fanout 结束时对每个目标调用一次，记录这个目标的结果
+参数：zone - myupstream_metrics 引用的统计区
+     result - NGX_HTTP_MYUPSTREAM_FANOUT_OK 等
+*/
+void ngx_http_myupstream_metrics_fanout(ngx_shm_zone_t *zone, ngx_uint_t result) {
+    ngx_http_myupstream_metrics_t       *metrics = zone->data;
+    ngx_http_myupstream_metrics_slot_t  *slot;
+
+    slot = &metrics->sh->slot[ngx_min(ngx_worker, metrics->sh->nslots - 1)];
+
+    ngx_http_myupstream_metrics_add(&slot->fanouts[result], 1);
+}
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+
+/*
+一个调用点从请求内存池分配一次时调用
+参数：zone - myupstream_metrics 引用的统计区
+     site - NGX_HTTP_MYUPSTREAM_POOL_CTX 等
+     size - 分配的字节数
+     large - 1 表示超过 pool->max，由 malloc 单独分配
+*/
+void ngx_http_myupstream_metrics_pool_alloc(ngx_shm_zone_t *zone, ngx_uint_t site, size_t size, ngx_uint_t large) {
+    ngx_http_myupstream_metrics_t       *metrics = zone->data;
+    ngx_http_myupstream_metrics_slot_t  *slot;
+
+    slot = &metrics->sh->slot[ngx_min(ngx_worker, metrics->sh->nslots - 1)];
+
+    ngx_http_myupstream_metrics_add(&slot->pool_allocations[site][large], 1);
+    ngx_http_myupstream_metrics_add(&slot->pool_bytes[site][large], size);
+}
+
+/*
+请求内存池销毁时调用，记录整个请求的分配总量和内存池的峰值大小
+参数：zone - myupstream_metrics 引用的统计区
+     allocations - 统计到的分配次数
+     bytes - 统计到的分配字节数
+     size - 内存池的所有内存块加上大块内存的字节数
+*/
+void ngx_http_myupstream_metrics_pool_request(ngx_shm_zone_t *zone, ngx_uint_t allocations, size_t bytes, size_t size) {
+    ngx_http_myupstream_metrics_t       *metrics = zone->data;
+    ngx_http_myupstream_metrics_slot_t  *slot;
+
+    slot = &metrics->sh->slot[ngx_min(ngx_worker, metrics->sh->nslots - 1)];
+
+    ngx_http_myupstream_metrics_add(&slot->pool_request_allocations[ngx_http_myupstream_metrics_pool_bucket(allocations, 0,
+                                    NGX_HTTP_MYUPSTREAM_POOL_COUNT_BUCKETS)], 1);
+    ngx_http_myupstream_metrics_add(&slot->pool_request_allocations_sum, allocations);
+
+    ngx_http_myupstream_metrics_add(&slot->pool_request_bytes[ngx_http_myupstream_metrics_pool_bucket(bytes,
+                                    NGX_HTTP_MYUPSTREAM_POOL_BYTES_SHIFT, NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS)], 1);
+    ngx_http_myupstream_metrics_add(&slot->pool_request_bytes_sum, bytes);
+
+    ngx_http_myupstream_metrics_add(&slot->pool_size[ngx_http_myupstream_metrics_pool_bucket(size,
+                                    NGX_HTTP_MYUPSTREAM_POOL_BYTES_SHIFT, NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS)], 1);
+    ngx_http_myupstream_metrics_add(&slot->pool_size_sum, size);
+}
+
+/* 按2的幂划分的桶，第 k 个桶的上界为 1 << (shift + k)，超出范围时返回只计入 +Inf 的桶 */
+static ngx_uint_t ngx_http_myupstream_metrics_pool_bucket(size_t value, ngx_uint_t shift, ngx_uint_t n) {
+    ngx_uint_t  k;
+
+    for (k = 0; k < n && value > ((size_t) 1 << (shift + k)); k++) { /* void */ }
+
+    return k;
+}
+
+/* 输出一个按2的幂划分的直方图，没有观测时什么也不输出 */
+static u_char *ngx_http_myupstream_metrics_pool_histogram(u_char *p, ngx_str_t *zone, char *name, ngx_atomic_t *bucket,
+    ngx_uint_t shift, ngx_uint_t n, ngx_atomic_uint_t sum) {
+    uint64_t    count;
+    ngx_uint_t  k;
+
+    count = 0;
+
+    for (k = 0; k <= n; k++) {
+        count += bucket[k];
+    }
+
+    if (count == 0) {
+        return p;
+    }
+
+    count = 0;
+
+    for (k = 0; k < n; k++) {
+        count += bucket[k];
+
+        p = ngx_sprintf(p, "%s_bucket{zone=\"%V\",le=\"%uz\"} %uL\n", name, zone, (size_t) 1 << (shift + k), count);
+    }
+
+    count += bucket[n];
+
+    p = ngx_sprintf(p, "%s_bucket{zone=\"%V\",le=\"+Inf\"} %uL\n", name, zone, count);
+    p = ngx_sprintf(p, "%s_sum{zone=\"%V\"} %uA\n", name, zone, sum);
+    p = ngx_sprintf(p, "%s_count{zone=\"%V\"} %uL\n", name, zone, count);
+
+    return p;
+}
+
+#endif
+
+/* 单调递增的微秒时间，只用来计算间隔 */
+static uint64_t ngx_http_myupstream_metrics_now(void) {
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* 计算一个微秒值所在的桶，超出范围时返回只计入 +Inf 的桶 */
+static ngx_uint_t ngx_http_myupstream_metrics_bucket(uint64_t us) {
+    ngx_uint_t  e;
+
+    if (us < NGX_HTTP_MYUPSTREAM_SUB_BUCKETS) {
+        return (ngx_uint_t) us;
+    }
+
+    /* e 为最高位的位置，至少为2 */
+#if (defined __GNUC__) || (defined __clang__)
+    e = 63 - __builtin_clzll((unsigned long long) us);
+#else
+    for (e = 2; us >> (e + 1); e++) { /* void */ }
+#endif
+
+    if (e > NGX_HTTP_MYUPSTREAM_MAX_EXP) {
+        return NGX_HTTP_MYUPSTREAM_BUCKETS;
+    }
+
+    return NGX_HTTP_MYUPSTREAM_SUB_BUCKETS + (e - 2) * NGX_HTTP_MYUPSTREAM_SUB_BUCKETS + ((us >> (e - 2)) & (NGX_HTTP_MYUPSTREAM_SUB_BUCKETS - 1));
+}
+
+/* 桶的上界（包含），单位微秒 */
+static uint64_t ngx_http_myupstream_metrics_bound(ngx_uint_t bucket) {
+    ngx_uint_t  e, m;
+
+    if (bucket < NGX_HTTP_MYUPSTREAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    e = (bucket - NGX_HTTP_MYUPSTREAM_SUB_BUCKETS) / NGX_HTTP_MYUPSTREAM_SUB_BUCKETS + 2;
+    m = (bucket - NGX_HTTP_MYUPSTREAM_SUB_BUCKETS) % NGX_HTTP_MYUPSTREAM_SUB_BUCKETS;
+
+    return ((uint64_t) (NGX_HTTP_MYUPSTREAM_SUB_BUCKETS + 1 + m) << (e - 2)) - 1;
+}
+
+/* 一次观测只有两次原子加法：所在的桶和总和，count 由读取时累加所有桶得到 */
+static void ngx_http_myupstream_metrics_observe(ngx_http_myupstream_metrics_slot_t *slot, ngx_uint_t phase, ngx_uint_t class, uint64_t us) {
+    ngx_http_myupstream_histogram_t  *h = &slot->phase[phase][class];
+
+    ngx_http_myupstream_metrics_add(&h->bucket[ngx_http_myupstream_metrics_bucket(us)], 1);
+    ngx_http_myupstream_metrics_add(&h->sum, (ngx_atomic_int_t) us);
+}
+
+/* myupstream_metrics_export 的 handler，合并所有 worker 的槽位后以 Prometheus 文本格式输出 */
+static ngx_int_t ngx_http_myupstream_metrics_handler(ngx_http_request_t *r) {
+    size_t                               len, line;
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+    size_t                               pline;
+#endif
+    uint64_t                             count, bound;
+    ngx_int_t                            rc;
+    ngx_buf_t                           *b;
+    ngx_str_t                           *zone;
+    ngx_uint_t                           i, p, c, k, series;
+    ngx_chain_t                          out;
+    ngx_http_myupstream_conf_t          *mycf;
+    ngx_http_myupstream_metrics_t       *metrics;
+    ngx_http_myupstream_metrics_slot_t  *sum, *slot;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    metrics = mycf->metrics_export_zone->data;
+    zone = &mycf->metrics_export_zone->shm.name;
+
+    /* 各个 worker 只做原子加法，这里不加锁直接读，合并到一份临时的计数器中 */
+    sum = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_metrics_slot_t));
+    if (sum == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < metrics->sh->nslots; i++) {
+        slot = &metrics->sh->slot[i];
+
+        for (c = 0; c < NGX_HTTP_MYUPSTREAM_CLASSES; c++) {
+            sum->requests[c] += slot->requests[c];
+            sum->bytes[c] += slot->bytes[c];
+
+            for (p = 0; p < NGX_HTTP_MYUPSTREAM_PHASES; p++) {
+                for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+                    sum->phase[p][c].bucket[k] += slot->phase[p][c].bucket[k];
+                }
+
+                sum->phase[p][c].sum += slot->phase[p][c].sum;
+            }
+        }
+
+        for (k = 0; k < NGX_HTTP_MYUPSTREAM_HEDGE_RESULTS; k++) {
+            sum->hedges[k] += slot->hedges[k];
+        }
+
+        for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS; k++) {
+            sum->batch_size[k] += slot->batch_size[k];
+        }
+
+        sum->batch_size_sum += slot->batch_size_sum;
+
+        for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+            sum->batch_wait.bucket[k] += slot->batch_wait.bucket[k];
+        }
+
+        sum->batch_wait.sum += slot->batch_wait.sum;
+
+        for (k = 0; k < NGX_HTTP_MYUPSTREAM_BATCH_RESULTS; k++) {
+            sum->batches[k] += slot->batches[k];
+        }
+
+        for (k = 0; k < NGX_HTTP_MYUPSTREAM_FANOUT_RESULTS; k++) {
+            sum->fanouts[k] += slot->fanouts[k];
+        }
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+        for (k = 0; k < NGX_HTTP_MYUPSTREAM_POOL_SITES; k++) {
+            for (c = 0; c < 2; c++) {
+                sum->pool_allocations[k][c] += slot->pool_allocations[k][c];
+                sum->pool_bytes[k][c] += slot->pool_bytes[k][c];
+            }
+        }
+
+        for (k = 0; k <= NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS; k++) {
+            sum->pool_request_bytes[k] += slot->pool_request_bytes[k];
+            sum->pool_size[k] += slot->pool_size[k];
+        }
+
+        for (k = 0; k <= NGX_HTTP_MYUPSTREAM_POOL_COUNT_BUCKETS; k++) {
+            sum->pool_request_allocations[k] += slot->pool_request_allocations[k];
+        }
+
+        sum->pool_request_bytes_sum += slot->pool_request_bytes_sum;
+        sum->pool_request_allocations_sum += slot->pool_request_allocations_sum;
+        sum->pool_size_sum += slot->pool_size_sum;
+#endif
+    }
+
+    /* 只输出有过观测的直方图 */
+    series = 0;
+
+    for (p = 0; p < NGX_HTTP_MYUPSTREAM_PHASES; p++) {
+        for (c = 0; c < NGX_HTTP_MYUPSTREAM_CLASSES; c++) {
+            for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+                if (sum->phase[p][c].bucket[k]) {
+                    series++;
+                    break;
+                }
+            }
+        }
+    }
+
+    line = sizeof("myupstream_phase_seconds_bucket{zone=\"\",phase=\"first_byte\",class=\"none\",le=\"\"} \n") - 1
+           + zone->len + NGX_INT64_LEN + NGX_ATOMIC_T_LEN;
+
+    len = sizeof("# HELP myupstream_requests_total Requests sent to the backend, by response status class.\n") - 1
+          + sizeof("# TYPE myupstream_requests_total counter\n") - 1
+          + sizeof("# HELP myupstream_received_bytes_total Bytes received from the backend, by response status class.\n") - 1
+          + sizeof("# TYPE myupstream_received_bytes_total counter\n") - 1
+          + sizeof("# HELP myupstream_phase_seconds Time spent in each phase of a backend request.\n") - 1
+          + sizeof("# TYPE myupstream_phase_seconds histogram\n") - 1
+          + sizeof("# HELP myupstream_hedges_total Hedging decisions, by outcome.\n") - 1
+          + sizeof("# TYPE myupstream_hedges_total counter\n") - 1
+          + sizeof("# HELP myupstream_batch_requests_total Requests served through myupstream_batch, by outcome.\n") - 1
+          + sizeof("# TYPE myupstream_batch_requests_total counter\n") - 1
+          + sizeof("# HELP myupstream_batch_size Number of requests in each batch sent to the backend.\n") - 1
+          + sizeof("# TYPE myupstream_batch_size histogram\n") - 1
+          + sizeof("# HELP myupstream_batch_wait_seconds Time a request waited for its batch to be sent.\n") - 1
+          + sizeof("# TYPE myupstream_batch_wait_seconds histogram\n") - 1
+          + sizeof("# HELP myupstream_fanout_targets_total Targets of myupstream_fanout requests, by outcome.\n") - 1
+          + sizeof("# TYPE myupstream_fanout_targets_total counter\n") - 1
+          + (2 * NGX_HTTP_MYUPSTREAM_CLASSES + NGX_HTTP_MYUPSTREAM_HEDGE_RESULTS + NGX_HTTP_MYUPSTREAM_BATCH_RESULTS
+             + NGX_HTTP_MYUPSTREAM_FANOUT_RESULTS) * line
+          + (NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS + 3) * line
+          + (series + 1) * (NGX_HTTP_MYUPSTREAM_BUCKETS + 3) * line;
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+    pline = sizeof("myupstream_pool_allocated_bytes_total{zone=\"\",module=\"myupstream\",site=\"status_line\",kind=\"small\"} \n") - 1
+            + zone->len + NGX_ATOMIC_T_LEN;
+
+    len += sizeof("# HELP myupstream_pool_allocations_total Allocations from the request pool, by call site and size class.\n") - 1
+           + sizeof("# TYPE myupstream_pool_allocations_total counter\n") - 1
+           + sizeof("# HELP myupstream_pool_allocated_bytes_total Bytes allocated from the request pool, by call site and size class.\n") - 1
+           + sizeof("# TYPE myupstream_pool_allocated_bytes_total counter\n") - 1
+           + sizeof("# HELP myupstream_pool_request_allocations Allocations from the pool of each request.\n") - 1
+           + sizeof("# TYPE myupstream_pool_request_allocations histogram\n") - 1
+           + sizeof("# HELP myupstream_pool_request_bytes Bytes allocated from the pool of each request.\n") - 1
+           + sizeof("# TYPE myupstream_pool_request_bytes histogram\n") - 1
+           + sizeof("# HELP myupstream_pool_size_bytes Size of each request pool when it is destroyed, including large allocations.\n") - 1
+           + sizeof("# TYPE myupstream_pool_size_bytes histogram\n") - 1
+           + 2 * 2 * NGX_HTTP_MYUPSTREAM_POOL_SITES * pline
+           + (2 * NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS + NGX_HTTP_MYUPSTREAM_POOL_COUNT_BUCKETS + 9) * line;
+#endif
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_requests_total Requests sent to the backend, by response status class.\n",
+                         sizeof("# HELP myupstream_requests_total Requests sent to the backend, by response status class.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_requests_total counter\n", sizeof("# TYPE myupstream_requests_total counter\n") - 1);
+
+    for (c = 0; c < NGX_HTTP_MYUPSTREAM_CLASSES; c++) {
+        b->last = ngx_sprintf(b->last, "myupstream_requests_total{zone=\"%V\",class=\"%V\"} %uA\n",
+                              zone, &ngx_http_myupstream_metrics_classes[c], sum->requests[c]);
+    }
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_received_bytes_total Bytes received from the backend, by response status class.\n",
+                         sizeof("# HELP myupstream_received_bytes_total Bytes received from the backend, by response status class.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_received_bytes_total counter\n", sizeof("# TYPE myupstream_received_bytes_total counter\n") - 1);
+
+    for (c = 0; c < NGX_HTTP_MYUPSTREAM_CLASSES; c++) {
+        b->last = ngx_sprintf(b->last, "myupstream_received_bytes_total{zone=\"%V\",class=\"%V\"} %uA\n",
+                              zone, &ngx_http_myupstream_metrics_classes[c], sum->bytes[c]);
+    }
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_hedges_total Hedging decisions, by outcome.\n",
+                         sizeof("# HELP myupstream_hedges_total Hedging decisions, by outcome.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_hedges_total counter\n", sizeof("# TYPE myupstream_hedges_total counter\n") - 1);
+
+    for (k = 0; k < NGX_HTTP_MYUPSTREAM_HEDGE_RESULTS; k++) {
+        b->last = ngx_sprintf(b->last, "myupstream_hedges_total{zone=\"%V\",result=\"%V\"} %uA\n",
+                              zone, &ngx_http_myupstream_metrics_hedges[k], sum->hedges[k]);
+    }
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_batch_requests_total Requests served through myupstream_batch, by outcome.\n",
+                         sizeof("# HELP myupstream_batch_requests_total Requests served through myupstream_batch, by outcome.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_batch_requests_total counter\n", sizeof("# TYPE myupstream_batch_requests_total counter\n") - 1);
+
+    for (k = 0; k < NGX_HTTP_MYUPSTREAM_BATCH_RESULTS; k++) {
+        b->last = ngx_sprintf(b->last, "myupstream_batch_requests_total{zone=\"%V\",result=\"%V\"} %uA\n",
+                              zone, &ngx_http_myupstream_metrics_batches[k], sum->batches[k]);
+    }
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_fanout_targets_total Targets of myupstream_fanout requests, by outcome.\n",
+                         sizeof("# HELP myupstream_fanout_targets_total Targets of myupstream_fanout requests, by outcome.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_fanout_targets_total counter\n", sizeof("# TYPE myupstream_fanout_targets_total counter\n") - 1);
+
+    for (k = 0; k < NGX_HTTP_MYUPSTREAM_FANOUT_RESULTS; k++) {
+        b->last = ngx_sprintf(b->last, "myupstream_fanout_targets_total{zone=\"%V\",result=\"%V\"} %uA\n",
+                              zone, &ngx_http_myupstream_metrics_fanouts[k], sum->fanouts[k]);
+    }
+
+    /* 批次大小的桶按2的幂划分，le 是请求数 */
+    count = 0;
+
+    for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS; k++) {
+        count += sum->batch_size[k];
+    }
+
+    if (count) {
+        b->last = ngx_cpymem(b->last, "# HELP myupstream_batch_size Number of requests in each batch sent to the backend.\n",
+                             sizeof("# HELP myupstream_batch_size Number of requests in each batch sent to the backend.\n") - 1);
+        b->last = ngx_cpymem(b->last, "# TYPE myupstream_batch_size histogram\n", sizeof("# TYPE myupstream_batch_size histogram\n") - 1);
+
+        count = 0;
+
+        for (k = 0; k < NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS; k++) {
+            count += sum->batch_size[k];
+
+            b->last = ngx_sprintf(b->last, "myupstream_batch_size_bucket{zone=\"%V\",le=\"%ui\"} %uL\n",
+                                  zone, (ngx_uint_t) 1 << k, count);
+        }
+
+        count += sum->batch_size[NGX_HTTP_MYUPSTREAM_BATCH_BUCKETS];
+
+        b->last = ngx_sprintf(b->last, "myupstream_batch_size_bucket{zone=\"%V\",le=\"+Inf\"} %uL\n", zone, count);
+        b->last = ngx_sprintf(b->last, "myupstream_batch_size_sum{zone=\"%V\"} %uA\n", zone, sum->batch_size_sum);
+        b->last = ngx_sprintf(b->last, "myupstream_batch_size_count{zone=\"%V\"} %uL\n", zone, count);
+    }
+
+    count = 0;
+
+    for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+        count += sum->batch_wait.bucket[k];
+    }
+
+    if (count) {
+        b->last = ngx_cpymem(b->last, "# HELP myupstream_batch_wait_seconds Time a request waited for its batch to be sent.\n",
+                             sizeof("# HELP myupstream_batch_wait_seconds Time a request waited for its batch to be sent.\n") - 1);
+        b->last = ngx_cpymem(b->last, "# TYPE myupstream_batch_wait_seconds histogram\n", sizeof("# TYPE myupstream_batch_wait_seconds histogram\n") - 1);
+
+        count = 0;
+
+        for (k = 0; k < NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+            count += sum->batch_wait.bucket[k];
+            bound = ngx_http_myupstream_metrics_bound(k);
+
+            b->last = ngx_sprintf(b->last, "myupstream_batch_wait_seconds_bucket{zone=\"%V\",le=\"%uL.%06uL\"} %uL\n",
+                                  zone, bound / 1000000, bound % 1000000, count);
+        }
+
+        count += sum->batch_wait.bucket[NGX_HTTP_MYUPSTREAM_BUCKETS];
+
+        b->last = ngx_sprintf(b->last, "myupstream_batch_wait_seconds_bucket{zone=\"%V\",le=\"+Inf\"} %uL\n", zone, count);
+        b->last = ngx_sprintf(b->last, "myupstream_batch_wait_seconds_sum{zone=\"%V\"} %uA.%06uA\n",
+                              zone, sum->batch_wait.sum / 1000000, sum->batch_wait.sum % 1000000);
+        b->last = ngx_sprintf(b->last, "myupstream_batch_wait_seconds_count{zone=\"%V\"} %uL\n", zone, count);
+    }
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_pool_allocations_total Allocations from the request pool, by call site and size class.\n",
+                         sizeof("# HELP myupstream_pool_allocations_total Allocations from the request pool, by call site and size class.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_pool_allocations_total counter\n", sizeof("# TYPE myupstream_pool_allocations_total counter\n") - 1);
+
+    for (k = 0; k < NGX_HTTP_MYUPSTREAM_POOL_SITES; k++) {
+        for (c = 0; c < 2; c++) {
+            b->last = ngx_sprintf(b->last, "myupstream_pool_allocations_total{zone=\"%V\",module=\"%V\",site=\"%V\",kind=\"%V\"} %uA\n",
+                                  zone, &ngx_http_myupstream_metrics_pool_sites[k][0], &ngx_http_myupstream_metrics_pool_sites[k][1],
+                                  &ngx_http_myupstream_metrics_pool_kinds[c], sum->pool_allocations[k][c]);
+        }
+    }
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_pool_allocated_bytes_total Bytes allocated from the request pool, by call site and size class.\n",
+                         sizeof("# HELP myupstream_pool_allocated_bytes_total Bytes allocated from the request pool, by call site and size class.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_pool_allocated_bytes_total counter\n", sizeof("# TYPE myupstream_pool_allocated_bytes_total counter\n") - 1);
+
+    for (k = 0; k < NGX_HTTP_MYUPSTREAM_POOL_SITES; k++) {
+        for (c = 0; c < 2; c++) {
+            b->last = ngx_sprintf(b->last, "myupstream_pool_allocated_bytes_total{zone=\"%V\",module=\"%V\",site=\"%V\",kind=\"%V\"} %uA\n",
+                                  zone, &ngx_http_myupstream_metrics_pool_sites[k][0], &ngx_http_myupstream_metrics_pool_sites[k][1],
+                                  &ngx_http_myupstream_metrics_pool_kinds[c], sum->pool_bytes[k][c]);
+        }
+    }
+
+    /* 三个直方图的桶都按2的幂划分，le 是次数或字节数 */
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_pool_request_allocations Allocations from the pool of each request.\n",
+                         sizeof("# HELP myupstream_pool_request_allocations Allocations from the pool of each request.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_pool_request_allocations histogram\n", sizeof("# TYPE myupstream_pool_request_allocations histogram\n") - 1);
+    b->last = ngx_http_myupstream_metrics_pool_histogram(b->last, zone, "myupstream_pool_request_allocations", sum->pool_request_allocations,
+                                                         0, NGX_HTTP_MYUPSTREAM_POOL_COUNT_BUCKETS, sum->pool_request_allocations_sum);
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_pool_request_bytes Bytes allocated from the pool of each request.\n",
+                         sizeof("# HELP myupstream_pool_request_bytes Bytes allocated from the pool of each request.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_pool_request_bytes histogram\n", sizeof("# TYPE myupstream_pool_request_bytes histogram\n") - 1);
+    b->last = ngx_http_myupstream_metrics_pool_histogram(b->last, zone, "myupstream_pool_request_bytes", sum->pool_request_bytes,
+                                                         NGX_HTTP_MYUPSTREAM_POOL_BYTES_SHIFT, NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS,
+                                                         sum->pool_request_bytes_sum);
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_pool_size_bytes Size of each request pool when it is destroyed, including large allocations.\n",
+                         sizeof("# HELP myupstream_pool_size_bytes Size of each request pool when it is destroyed, including large allocations.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_pool_size_bytes histogram\n", sizeof("# TYPE myupstream_pool_size_bytes histogram\n") - 1);
+    b->last = ngx_http_myupstream_metrics_pool_histogram(b->last, zone, "myupstream_pool_size_bytes", sum->pool_size,
+                                                         NGX_HTTP_MYUPSTREAM_POOL_BYTES_SHIFT, NGX_HTTP_MYUPSTREAM_POOL_BYTES_BUCKETS,
+                                                         sum->pool_size_sum);
+#endif
+
+    b->last = ngx_cpymem(b->last, "# HELP myupstream_phase_seconds Time spent in each phase of a backend request.\n",
+                         sizeof("# HELP myupstream_phase_seconds Time spent in each phase of a backend request.\n") - 1);
+    b->last = ngx_cpymem(b->last, "# TYPE myupstream_phase_seconds histogram\n", sizeof("# TYPE myupstream_phase_seconds histogram\n") - 1);
+
+    for (p = 0; p < NGX_HTTP_MYUPSTREAM_PHASES; p++) {
+        for (c = 0; c < NGX_HTTP_MYUPSTREAM_CLASSES; c++) {
+
+            count = 0;
+
+            for (k = 0; k <= NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+                count += sum->phase[p][c].bucket[k];
+            }
+
+            if (count == 0) {
+                continue;
+            }
+
+            /* Prometheus 的桶是累积的，le 的单位为秒 */
+            count = 0;
+
+            for (k = 0; k < NGX_HTTP_MYUPSTREAM_BUCKETS; k++) {
+                count += sum->phase[p][c].bucket[k];
+                bound = ngx_http_myupstream_metrics_bound(k);
+
+                b->last = ngx_sprintf(b->last, "myupstream_phase_seconds_bucket{zone=\"%V\",phase=\"%V\",class=\"%V\",le=\"%uL.%06uL\"} %uL\n",
+                                      zone, &ngx_http_myupstream_metrics_phases[p], &ngx_http_myupstream_metrics_classes[c],
+                                      bound / 1000000, bound % 1000000, count);
+            }
+
+            count += sum->phase[p][c].bucket[NGX_HTTP_MYUPSTREAM_BUCKETS];
+
+            b->last = ngx_sprintf(b->last, "myupstream_phase_seconds_bucket{zone=\"%V\",phase=\"%V\",class=\"%V\",le=\"+Inf\"} %uL\n",
+                                  zone, &ngx_http_myupstream_metrics_phases[p], &ngx_http_myupstream_metrics_classes[c], count);
+
+            b->last = ngx_sprintf(b->last, "myupstream_phase_seconds_sum{zone=\"%V\",phase=\"%V\",class=\"%V\"} %uA.%06uA\n",
+                                  zone, &ngx_http_myupstream_metrics_phases[p], &ngx_http_myupstream_metrics_classes[c],
+                                  sum->phase[p][c].sum / 1000000, sum->phase[p][c].sum % 1000000);
+
+            b->last = ngx_sprintf(b->last, "myupstream_phase_seconds_count{zone=\"%V\",phase=\"%V\",class=\"%V\"} %uL\n",
+                                  zone, &ngx_http_myupstream_metrics_phases[p], &ngx_http_myupstream_metrics_classes[c], count);
+        }
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
@@ -1,21 +1,43 @@
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
+#include "ngx_http_myupstream_module.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static void *ngx_http_myupstream_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_myupstream_create_srv_conf(ngx_conf_t *cf);
 static void* ngx_http_myupstream_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_myupstream_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+static char *ngx_http_myupstream_merge_buffers(ngx_conf_t *cf, ngx_http_myupstream_conf_t *prev, ngx_http_myupstream_conf_t *conf);
+static char *ngx_http_myupstream_merge_http2(ngx_conf_t *cf, ngx_http_myupstream_conf_t *prev, ngx_http_myupstream_conf_t *conf);
+static char *ngx_http_myupstream_merge_batch(ngx_conf_t *cf, ngx_http_myupstream_conf_t *prev, ngx_http_myupstream_conf_t *conf);
 static ngx_int_t myupstream_upstream_create_request(ngx_http_request_t *r);
 static ngx_int_t myupstream_process_status_line(ngx_http_request_t *r);
 static ngx_int_t myupstream_upstream_process_header(ngx_http_request_t *r);
 static void myupstream_upstream_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
 static char* ngx_http_myupstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
-static ngx_int_t ngx_http_myupstream_handler(ngx_http_request_t *r);
+static char *ngx_http_myupstream_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void myupstream_strlow(u_char *dst, u_char *src, size_t n);
+static ngx_int_t myupstream_detach_header_buffer(ngx_http_request_t *r);
+static ngx_int_t myupstream_input_filter_init(void *data);
+static ngx_int_t myupstream_non_buffered_copy_filter(void *data, ssize_t bytes);
+static ngx_int_t myupstream_non_buffered_chunked_filter(void *data, ssize_t bytes);
+static ngx_int_t myupstream_pipe_copy_filter(ngx_event_pipe_t *p, ngx_buf_t *buf);
+static ngx_int_t myupstream_pipe_chunked_filter(ngx_event_pipe_t *p, ngx_buf_t *buf);
+static ngx_int_t ngx_http_myupstream_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_myupstream_keepalive_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+/* myupstream_relay 的取值 */
+static ngx_conf_enum_t ngx_http_myupstream_relay[] = {
+    { ngx_string("copy"), NGX_HTTP_MYUPSTREAM_RELAY_COPY },
+    { ngx_string("splice"), NGX_HTTP_MYUPSTREAM_RELAY_SPLICE },
+    { ngx_null_string, 0 }
+};
 
-/* 存储该模块配置项参数的数据结构 */
-typedef struct {
-    ngx_str_t search_engine;
-    ngx_http_upstream_conf_t upstream;
-} ngx_http_myupstream_conf_t;
+/* 缓冲模式下临时文件的缺省目录，相对于 nginx 的安装目录 */
+static ngx_path_init_t ngx_http_myupstream_temp_path = {
+    ngx_string("myupstream_temp"), { 1, 2, 0 }
+};
 
 /* commands 数组 */
 static ngx_command_t ngx_http_myupstream_commands[] = {
@@ -28,14 +50,350 @@ static ngx_command_t ngx_http_myupstream_commands[] = {
         offsetof(ngx_http_myupstream_conf_t, search_engine),  
         NULL                                    /* 配置项处理后的回调函数，本模块暂时用不到 */
     },
+    {
+        ngx_string("myupstream_request_uri"),   /* 发往后端的路径，可以引用 $args 和 $arg_name，优先于 search_engine */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, request_uri),
+        NULL
+    },
+    {
+        ngx_string("myupstream_request_header"), /* 发往后端的额外头部：myupstream_request_header name value，value 可以引用参数 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+        ngx_conf_set_keyval_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, request_headers),
+        NULL
+    },
     {
 		ngx_string("myupstream"),            
 		NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS, 
 		ngx_http_myupstream,                 /* set回调函数, 当出现了myupstream配置项后，ngx_http_myupstream函数被调用*/
-        0,                                   
+        NGX_HTTP_LOC_CONF_OFFSET,            
 		0,                                   /* 使用预设方式处理配置项时有用，本模块使用的是自定义模块 */
 		NULL                                 
 	},
+    {
+        ngx_string("myupstream_pass"),          /* 使用指定名字的 upstream {} 块中的后端，同时开启 myupstream */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_pass,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_chash"),         /* 出现在 upstream {} 块内，按请求参数做一致性哈希选择后端 */
+        NGX_HTTP_UPS_CONF | NGX_CONF_NOARGS,
+        ngx_http_myupstream_chash,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_p2c_zone"),      /* 定义保存后端延迟和错误统计的共享内存：myupstream_p2c_zone name size */
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+        ngx_http_myupstream_p2c_zone,
+        0,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_p2c"),           /* 按延迟 EWMA 和在途请求数做 power-of-two-choices 选择，并摘除异常的后端 */
+        NGX_HTTP_UPS_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_p2c,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_peers_zone"),    /* 定义保存可在运行时修改的后端表的共享内存：myupstream_peers_zone name size */
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+        ngx_http_myupstream_peers_zone,
+        0,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_peers"),         /* 出现在 upstream {} 块内，从共享内存中的后端表选择后端，不需要 reload 即可增删改 */
+        NGX_HTTP_UPS_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_peers,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_peers_admin"),   /* 查看和修改后端表：GET 输出，POST ?action=add|remove|drain|resume|weight&server=... */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_peers_admin,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_happy_eyeballs"), /* 解析出多个地址时错开连接各个地址，先连上的用来发送请求：time | off */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_happy_eyeballs,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_cache_zone"),    /* 定义共享内存响应缓存：myupstream_cache_zone name size */
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+        ngx_http_myupstream_cache_zone,
+        0,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_cache"),         /* 该 location 使用的响应缓存，off 表示不使用 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_cache,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_cache_valid"),   /* 后端没有返回 Cache-Control: max-age 时的缓存时间 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, cache_valid),
+        NULL
+    },
+    {
+        ngx_string("myupstream_cache_max_size"), /* 能缓存的最大响应包体 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, cache_max_size),
+        NULL
+    },
+    {
+        ngx_string("myupstream_cache_stats"),   /* 该 location 输出指定响应缓存的统计信息 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_cache_stats,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_metrics_zone"),  /* 定义保存各阶段耗时的共享内存：myupstream_metrics_zone name size */
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+        ngx_http_myupstream_metrics_zone,
+        0,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_metrics"),       /* 该 location 访问后端的耗时记入的统计区，off 表示不统计 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_metrics,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_metrics_export"), /* 该 location 以 Prometheus 文本格式输出指定的统计区 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_metrics_export,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_trace_file"),    /* 保存请求记录的文件：myupstream_trace_file path size */
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+        ngx_http_myupstream_trace_file,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_trace"),         /* 该 location 的请求的各个时间点写入 myupstream_trace_file */
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, trace),
+        NULL
+    },
+    {
+        ngx_string("myupstream_zero_copy_headers"), /* 响应头直接引用接收缓冲区中的字符串，off 时逐个复制 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, zero_copy_headers),
+        NULL
+    },
+    {
+        ngx_string("myupstream_gzip"),          /* 客户端接受时让后端返回 gzip 压缩的响应，缓存项同时保存压缩版本 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, gzip),
+        NULL
+    },
+    {
+        ngx_string("myupstream_hedge"),         /* 主请求在指定时间或首字节延迟的百分位内没有响应时，向另一个后端重发：time | pN | off */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_hedge,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_hedge_budget"),  /* 对冲请求最多占请求数的百分比，避免后端过载时成倍放大压力 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_myupstream_hedge_budget,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_coalesce"),      /* 合并相同参数的并发请求，只访问一次后端 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, coalesce),
+        NULL
+    },
+    {
+        ngx_string("myupstream_coalesce_timeout"), /* 等待其他请求的响应的最长时间，超时后自己访问后端 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, coalesce_timeout),
+        NULL
+    },
+    {
+        ngx_string("myupstream_limit_zone"),    /* 为一个后端定义自适应的并发上限：myupstream_limit_zone name [initial=N] [min=N] [max=N] */
+        NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+        ngx_http_myupstream_limit_zone,
+        0,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_limit"),         /* 访问后端的并发数达到上限时排队或返回503：zone [queue=N] [timeout=time] | off */
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_myupstream_limit,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_http2"),         /* 用 HTTP/2（h2c）访问 myupstream_pass 指定的后端，请求作为流复用少量连接；只发送没有包体的 GET，客户端的包体被丢弃 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, http2),
+        NULL
+    },
+    {
+        ngx_string("myupstream_http2_connections"), /* 每个 worker 到后端的最大 HTTP/2 连接数 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, http2_connections),
+        NULL
+    },
+    {
+        ngx_string("myupstream_batch"),         /* 把短时间内到达的请求合成一个批量请求发往后端：uri [window=time] [size=N] [timeout=time] | off */
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_myupstream_batch,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_fanout"),        /* 把请求并行发往多个 location，合并最后期限内返回的响应：uri ... [first=N] [timeout=time] */
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_myupstream_fanout,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("myupstream_keepalive"),     /* 每个 worker 缓存的空闲后端长连接数，0 表示不使用长连接 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, keepalive),
+        NULL
+    },
+    {
+        ngx_string("myupstream_keepalive_timeout"), /* 空闲长连接的超时时间 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, keepalive_timeout),
+        NULL
+    },
+    {
+        ngx_string("myupstream_buffering"),     /* on 时先把包体读进多个缓冲区，必要时写临时文件，尽快释放后端连接 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.buffering),
+        NULL
+    },
+    {
+        ngx_string("myupstream_buffer_size"),   /* 接收响应头的缓冲区大小，非缓冲模式下也用它转发包体 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.buffer_size),
+        NULL
+    },
+    {
+        ngx_string("myupstream_buffers"),       /* 缓冲模式下每个请求的缓冲区个数和大小：myupstream_buffers number size */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+        ngx_conf_set_bufs_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.bufs),
+        NULL
+    },
+    {
+        ngx_string("myupstream_busy_buffers_size"), /* 缓冲模式下正在发往客户端的缓冲区的总大小上限 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.busy_buffers_size_conf),
+        NULL
+    },
+    {
+        ngx_string("myupstream_temp_path"),     /* 缓冲区用完后写临时文件的目录：myupstream_temp_path path [level1 [level2 [level3]]] */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+        ngx_conf_set_path_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.temp_path),
+        NULL
+    },
+    {
+        ngx_string("myupstream_max_temp_file_size"), /* 每个请求的临时文件大小上限，0 表示不写临时文件 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.max_temp_file_size_conf),
+        NULL
+    },
+    {
+        ngx_string("myupstream_temp_file_write_size"), /* 每次写临时文件的数据量上限 */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, upstream.temp_file_write_size_conf),
+        NULL
+    },
+    {
+        ngx_string("myupstream_relay"),         /* 非缓冲模式下转发包体的方式：copy 或 splice */
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_myupstream_conf_t, relay),
+        &ngx_http_myupstream_relay
+    },
 	ngx_null_command                         /* commands 数组结束标志，其值为{ ngx_null_string, 0, NULL, 0, 0, NULL } */
 };
 
@@ -53,29 +411,25 @@ static ngx_str_t  ngx_http_proxy_hide_headers[] =
     ngx_null_string
 };
 
-/* myupstream 的上下文，upstream 每次接收到一段TCP流都会回调myupstream的process_header 方法，所以需要一个上下文来保存状态 */
-typedef struct
-{
-    /*
-        typedef struct {
-            ngx_uint_t           http_version;
-            ngx_uint_t           code;
-            ngx_uint_t           count;
-            u_char              *start;
-            u_char              *end;
-        } ngx_http_status_t;
-    */
-    ngx_http_status_t status;
-    ngx_str_t backendServer;
-} ngx_http_myupstream_ctx_t;
-
-/* 这些函数是用来对自定义的存储配置的结构体进行管理，本文模块暂时用不到，所以可全设为 NULL */
+/* 本模块提供的变量，可以在 log_format 中输出长连接池和响应缓存的命中情况 */
+static ngx_http_variable_t ngx_http_myupstream_vars[] = {
+    { ngx_string("myupstream_keepalive_hits"), NULL, ngx_http_myupstream_keepalive_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("myupstream_keepalive_misses"), NULL, ngx_http_myupstream_keepalive_variable, 1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("myupstream_cache_status"), NULL, ngx_http_myupstream_cache_status_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("myupstream_hedge"), NULL, ngx_http_myupstream_hedge_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("myupstream_limit"), NULL, ngx_http_myupstream_limit_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("myupstream_batch_size"), NULL, ngx_http_myupstream_batch_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("myupstream_fanout"), NULL, ngx_http_myupstream_fanout_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    ngx_http_null_variable
+};
+
+/* 这些函数是用来对自定义的存储配置的结构体进行管理 */
 static ngx_http_module_t ngx_http_mymodule_module_ctx = {
-    NULL, /* preconfiguration */
+    ngx_http_myupstream_add_variables, /* preconfiguration */
     NULL, /* postconfiguration */
-    NULL, /* create main configuration */
+    ngx_http_myupstream_create_main_conf, /* create main configuration */
     NULL, /* init main configuration */
-    NULL, /* create server configuration */
+    ngx_http_myupstream_create_srv_conf, /* create server configuration */
     NULL, /* merge server configuration */
     ngx_http_myupstream_create_loc_conf, /* create location configuration */
     ngx_http_myupstream_merge_loc_conf  /* merge location configuration */
@@ -88,7 +442,7 @@ ngx_module_t ngx_http_myupstream_module = {
 	ngx_http_myupstream_commands,   /* 指向 commands 数组 */
 	NGX_HTTP_MODULE,              /* 指明本模块为 HTTP 模块 */
     NULL,                         /* init master */
-    NULL,                         /* init module */
+    ngx_http_myupstream_trace_init, /* init module：创建 myupstream_trace_file */
     NULL,                         /* init process */
     NULL,                         /* init thread */
     NULL,                         /* exit thread */
@@ -97,6 +451,16 @@ ngx_module_t ngx_http_myupstream_module = {
 	NGX_MODULE_V1_PADDING         /* 预留参数，使用预设宏来填充 */
 };
 
+/* 生成存储 http 级别的配置参数结构体 */
+static void *ngx_http_myupstream_create_main_conf(ngx_conf_t *cf) {
+    return ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_main_conf_t));
+}
+
+/* 生成存储 srv 级别的配置参数结构体，只在 upstream {} 块中有用 */
+static void *ngx_http_myupstream_create_srv_conf(ngx_conf_t *cf) {
+    return ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_srv_conf_t));
+}
+
 /* 生成存储 loc 级别的配置参数结构体 */
 static void* ngx_http_myupstream_create_loc_conf(ngx_conf_t *cf) {
     ngx_http_myupstream_conf_t *mycf;
@@ -113,17 +477,50 @@ static void* ngx_http_myupstream_create_loc_conf(ngx_conf_t *cf) {
     mycf->upstream.read_timeout = 60000;
     mycf->upstream.store_access = 0600; 
 
-    mycf->upstream.buffering = 0; /* 使用固定大小的内存作为缓冲区来转发响应包体 */
-    mycf->upstream.bufs.num = 8;
-    mycf->upstream.bufs.size = ngx_pagesize;
-    mycf->upstream.buffer_size = ngx_pagesize;
-    mycf->upstream.busy_buffers_size = 2 * ngx_pagesize;
-    mycf->upstream.temp_file_write_size = 2 * ngx_pagesize;
-    mycf->upstream.max_temp_file_size = 1024 * 1024 * 1024;
+    /* 转发包体的缓冲区和临时文件由配置项决定，在 merge 函数中设置缺省值并检查 */
+    mycf->upstream.buffering = NGX_CONF_UNSET;
+    mycf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+    mycf->upstream.busy_buffers_size_conf = NGX_CONF_UNSET_SIZE;
+    mycf->upstream.max_temp_file_size_conf = NGX_CONF_UNSET_SIZE;
+    mycf->upstream.temp_file_write_size_conf = NGX_CONF_UNSET_SIZE;
 
     /* 此处设为NGX_CONF_UNSET_PTR，是为后面 merge 函数中调用 ngx_http_upstream_hide_headers_hash进行初始化做准备 */
     mycf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
     mycf->upstream.pass_headers = NGX_CONF_UNSET_PTR;
+
+    mycf->request_headers = NGX_CONF_UNSET_PTR;
+
+    mycf->p2c_zone = NGX_CONF_UNSET_PTR;
+
+    mycf->keepalive = NGX_CONF_UNSET_UINT;
+    mycf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    mycf->eyeballs_delay = NGX_CONF_UNSET_MSEC;
+
+    mycf->cache_zone = NGX_CONF_UNSET_PTR;
+    mycf->cache_valid = NGX_CONF_UNSET;
+    mycf->cache_max_size = NGX_CONF_UNSET_SIZE;
+
+    mycf->metrics_zone = NGX_CONF_UNSET_PTR;
+    mycf->trace = NGX_CONF_UNSET;
+
+    mycf->zero_copy_headers = NGX_CONF_UNSET;
+    mycf->gzip = NGX_CONF_UNSET;
+    mycf->relay = NGX_CONF_UNSET_UINT;
+    mycf->hedge_delay = NGX_CONF_UNSET_MSEC;
+    mycf->hedge_percentile = NGX_CONF_UNSET_UINT;
+    mycf->hedge_budget = NGX_CONF_UNSET_UINT;
+
+    mycf->coalesce = NGX_CONF_UNSET;
+    mycf->coalesce_timeout = NGX_CONF_UNSET_MSEC;
+
+    mycf->limit_zone = NGX_CONF_UNSET_PTR;
+    mycf->limit_queue_size = NGX_CONF_UNSET_UINT;
+    mycf->limit_timeout = NGX_CONF_UNSET_MSEC;
+
+    mycf->http2 = NGX_CONF_UNSET;
+    mycf->http2_connections = NGX_CONF_UNSET_UINT;
+
+    mycf->batch_size = NGX_CONF_UNSET_UINT;
     
     return mycf;
 }
@@ -150,38 +547,327 @@ static char *ngx_http_myupstream_merge_loc_conf(ngx_conf_t *cf, void *parent, vo
         return NGX_CONF_ERROR;
     }
 
+    ngx_conf_merge_str_value(conf->search_engine, prev->search_engine, "");
+    ngx_conf_merge_str_value(conf->request_uri, prev->request_uri, "");
+    ngx_conf_merge_ptr_value(conf->request_headers, prev->request_headers, NULL);
+
+    ngx_conf_merge_ptr_value(conf->p2c_zone, prev->p2c_zone, NULL);
+    /* RFC 8305 推荐的连接尝试间隔 */
+    ngx_conf_merge_msec_value(conf->eyeballs_delay, prev->eyeballs_delay, 250);
+
+    ngx_conf_merge_uint_value(conf->keepalive, prev->keepalive, 0);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout, prev->keepalive_timeout, 60000);
+
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 0);
+    ngx_conf_merge_size_value(conf->cache_max_size, prev->cache_max_size, 1024 * 1024);
+
+    ngx_conf_merge_ptr_value(conf->metrics_zone, prev->metrics_zone, NULL);
+    ngx_conf_merge_value(conf->trace, prev->trace, 0);
+
+    if (conf->trace) {
+        ngx_http_myupstream_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_myupstream_module);
+
+        if (mmcf->trace == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_trace\" requires \"myupstream_trace_file\"");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ngx_conf_merge_value(conf->zero_copy_headers, prev->zero_copy_headers, 1);
+    ngx_conf_merge_value(conf->gzip, prev->gzip, 0);
+
+    if (ngx_http_myupstream_merge_buffers(cf, prev, conf) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_conf_merge_msec_value(conf->hedge_delay, prev->hedge_delay, 0);
+    ngx_conf_merge_uint_value(conf->hedge_percentile, prev->hedge_percentile, 0);
+    ngx_conf_merge_uint_value(conf->hedge_budget, prev->hedge_budget, 5);
+
+    /* 首字节延迟的分布和对冲预算，每个 location 一份，fork 之后每个 worker 各有一份 */
+    if (conf->enable && (conf->hedge_delay || conf->hedge_percentile) && conf->hedge_budget) {
+        conf->hedge_stats = ngx_http_myupstream_hedge_init(cf);
+        if (conf->hedge_stats == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    ngx_conf_merge_msec_value(conf->coalesce_timeout, prev->coalesce_timeout, NGX_HTTP_MYUPSTREAM_COALESCE_TIMEOUT);
+
+    /* 正在访问后端的请求表，每个 location 一张，fork 之后每个 worker 各有一份 */
+    if (conf->enable && conf->coalesce) {
+        conf->coalesce_tree = ngx_palloc(cf->pool, sizeof(ngx_http_myupstream_coalesce_tree_t));
+        if (conf->coalesce_tree == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_rbtree_init(&conf->coalesce_tree->rbtree, &conf->coalesce_tree->sentinel, ngx_str_rbtree_insert_value);
+    }
+
+    /* myupstream_peers_admin 不继承，只检查它引用的共享内存是不是后端表 */
+    if (conf->peers_admin_zone && ngx_http_myupstream_peers_check(cf, conf->peers_admin_zone) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_ptr_value(conf->limit_zone, prev->limit_zone, NULL);
+    ngx_conf_merge_uint_value(conf->limit_queue_size, prev->limit_queue_size, 0);
+    ngx_conf_merge_msec_value(conf->limit_timeout, prev->limit_timeout, 100);
+
+    /* 等待并发名额的请求队列，每个 location 一个，fork 之后每个 worker 各有一份 */
+    if (conf->enable && conf->limit_zone) {
+        conf->limit_queue = ngx_http_myupstream_limit_init(cf);
+        if (conf->limit_queue == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* search_engine 决定请求路径和 Host 头部，不使用 upstream {} 块时也决定解析哪个域名 */
+    if (conf->enable && ngx_http_myupstream_template_engine(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* 使用 upstream {} 块时，后端地址、负载均衡和长连接都由该块负责 */
+    if (conf->pass) {
+        conf->upstream.upstream = conf->pass;
+        if (conf->host.len == 0) {
+            conf->host = conf->pass->host;
+        }
+
+    /* 只有配置了 myupstream 的 location 才需要后端地址缓存 */
+    } else if (conf->enable) {
+        conf->dns = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_dns_t));
+        if (conf->dns == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (conf->host.len == 0) {
+            ngx_str_set(&conf->host, NGX_HTTP_MYUPSTREAM_DEFAULT_HOST);
+        }
+        conf->dns->host = conf->host;
+        conf->dns->port = NGX_HTTP_MYUPSTREAM_DEFAULT_PORT;
+
+        if (ngx_http_myupstream_dns_init(cf, conf->dns) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* 使用私有的 upstream 配置块，由本模块负责选择后端和管理长连接 */
+        conf->upstream.upstream = ngx_http_myupstream_peer_conf(cf, conf);
+        if (conf->upstream.upstream == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* Host 和长连接确定之后才能编译请求模板 */
+    if (conf->enable) {
+        conf->request_template = ngx_http_myupstream_template_compile(cf, conf);
+        if (conf->request_template == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_http_myupstream_merge_http2(cf, prev, conf) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_myupstream_merge_batch(cf, prev, conf) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* 两者都是 location 的 handler，扇出的目标要放在单独的 location 中 */
+    if (conf->enable && conf->fanout) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_fanout\" cannot be used together with \"myupstream\" or \"myupstream_pass\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+}
+
+/*
+合并转发包体相关的配置项，检查缓冲区和临时文件的大小是否匹配
+参数：cf - 配置对象
+     prev - 父配置块
+     conf - 子配置块
+返回值：成功 - NGX_CONF_OK
+       失败 - NGX_CONF_ERROR
+*/
+static char *ngx_http_myupstream_merge_buffers(ngx_conf_t *cf, ngx_http_myupstream_conf_t *prev, ngx_http_myupstream_conf_t *conf) {
+    size_t  size;
+
+    /* 缺省使用非缓冲模式，用一块固定大小的内存边收边发 */
+    ngx_conf_merge_value(conf->upstream.buffering, prev->upstream.buffering, 0);
+    ngx_conf_merge_size_value(conf->upstream.buffer_size, prev->upstream.buffer_size, (size_t) ngx_pagesize);
+    ngx_conf_merge_bufs_value(conf->upstream.bufs, prev->upstream.bufs, 8, ngx_pagesize);
+    ngx_conf_merge_uint_value(conf->relay, prev->relay, NGX_HTTP_MYUPSTREAM_RELAY_COPY);
+
+    if (conf->upstream.bufs.num < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "there must be at least 2 \"myupstream_buffers\"");
+        return NGX_CONF_ERROR;
+    }
+
+    size = conf->upstream.buffer_size;
+    if (size < conf->upstream.bufs.size) {
+        size = conf->upstream.bufs.size;
+    }
+
+    ngx_conf_merge_size_value(conf->upstream.busy_buffers_size_conf, prev->upstream.busy_buffers_size_conf, NGX_CONF_UNSET_SIZE);
+
+    if (conf->upstream.busy_buffers_size_conf == NGX_CONF_UNSET_SIZE) {
+        conf->upstream.busy_buffers_size = 2 * size;
+    } else {
+        conf->upstream.busy_buffers_size = conf->upstream.busy_buffers_size_conf;
+    }
+
+    if (conf->upstream.busy_buffers_size < size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_busy_buffers_size\" must be equal to or greater than the maximum of the value of \"myupstream_buffer_size\" and one of the \"myupstream_buffers\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->upstream.busy_buffers_size > (conf->upstream.bufs.num - 1) * conf->upstream.bufs.size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_busy_buffers_size\" must be less than the size of all \"myupstream_buffers\" minus one buffer");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_size_value(conf->upstream.temp_file_write_size_conf, prev->upstream.temp_file_write_size_conf, NGX_CONF_UNSET_SIZE);
+
+    if (conf->upstream.temp_file_write_size_conf == NGX_CONF_UNSET_SIZE) {
+        conf->upstream.temp_file_write_size = 2 * size;
+    } else {
+        conf->upstream.temp_file_write_size = conf->upstream.temp_file_write_size_conf;
+    }
+
+    if (conf->upstream.temp_file_write_size < size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_temp_file_write_size\" must be equal to or greater than the maximum of the value of \"myupstream_buffer_size\" and one of the \"myupstream_buffers\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* 缺省最多写1G的临时文件，与原来的硬编码一致 */
+    ngx_conf_merge_size_value(conf->upstream.max_temp_file_size_conf, prev->upstream.max_temp_file_size_conf, NGX_CONF_UNSET_SIZE);
+
+    if (conf->upstream.max_temp_file_size_conf == NGX_CONF_UNSET_SIZE) {
+        conf->upstream.max_temp_file_size = 1024 * 1024 * 1024;
+    } else {
+        conf->upstream.max_temp_file_size = conf->upstream.max_temp_file_size_conf;
+    }
+
+    if (conf->upstream.max_temp_file_size != 0 && conf->upstream.max_temp_file_size < size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_max_temp_file_size\" must be equal to zero to disable temporary files usage or must be equal to or greater than the maximum of the value of \"myupstream_buffer_size\" and one of the \"myupstream_buffers\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_conf_merge_path_value(cf, &conf->upstream.temp_path, prev->upstream.temp_path, &ngx_http_myupstream_temp_path) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+#if !(NGX_LINUX)
+    if (conf->relay == NGX_HTTP_MYUPSTREAM_RELAY_SPLICE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "\"myupstream_relay splice\" is not supported on this platform, ignored");
+        conf->relay = NGX_HTTP_MYUPSTREAM_RELAY_COPY;
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+/*
+合并 myupstream_http2 相关的配置项。HTTP/2 模式不经过 upstream 机制，
+依赖 upstream 回调的缓存、合并请求、对冲、统计、splice 和缓冲模式都不能同时使用
+参数：cf - 配置对象
+     prev - 父配置块
+     conf - 子配置块
+返回值：成功 - NGX_CONF_OK
+       失败 - NGX_CONF_ERROR
+*/
+static char *ngx_http_myupstream_merge_http2(ngx_conf_t *cf, ngx_http_myupstream_conf_t *prev, ngx_http_myupstream_conf_t *conf) {
+    ngx_conf_merge_value(conf->http2, prev->http2, 0);
+    ngx_conf_merge_uint_value(conf->http2_connections, prev->http2_connections, 2);
+
+    if (!conf->enable || !conf->http2) {
+        return NGX_CONF_OK;
+    }
+
+#if !(NGX_HTTP_V2)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_http2\" requires ngx_http_v2_module");
+    return NGX_CONF_ERROR;
+#else
+    if (conf->http2_connections == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_http2_connections\" must be greater than zero");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->cache_zone || conf->coalesce || conf->hedge_stats || conf->metrics_zone
+        || conf->upstream.buffering || conf->relay == NGX_HTTP_MYUPSTREAM_RELAY_SPLICE)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_http2\" cannot be used together with \"myupstream_cache\", \"myupstream_coalesce\", \"myupstream_hedge\", \"myupstream_metrics\", \"myupstream_buffering\" or \"myupstream_relay splice\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* 连接池每个 location 一个，fork 之后每个 worker 各有一份 */
+    conf->http2_pool = ngx_http_myupstream_http2_init(cf, conf);
+    if (conf->http2_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
+#endif
+}
+
+/*
+合并 myupstream_batch 相关的配置项。uri、window、size 和 timeout 作为一个整体继承；
+批量请求由子请求发出，响应拆分后由本模块直接发给等待的请求，缓存、合并请求、对冲、gzip、HTTP/2 和 splice 都不能同时使用
+参数：cf - 配置对象
+     prev - 父配置块
+     conf - 子配置块
+返回值：成功 - NGX_CONF_OK
+       失败 - NGX_CONF_ERROR
+*/
+static char *ngx_http_myupstream_merge_batch(ngx_conf_t *cf, ngx_http_myupstream_conf_t *prev, ngx_http_myupstream_conf_t *conf) {
+    if (conf->batch_size == NGX_CONF_UNSET_UINT) {
+        conf->batch_uri = prev->batch_uri;
+        conf->batch_window = prev->batch_window;
+        conf->batch_size = (prev->batch_size == NGX_CONF_UNSET_UINT) ? 0 : prev->batch_size;
+        conf->batch_timeout = prev->batch_timeout;
+    }
 
+    if (!conf->enable || conf->batch_size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (conf->cache_zone || conf->coalesce || conf->hedge_stats || conf->gzip || conf->http2
+        || conf->relay == NGX_HTTP_MYUPSTREAM_RELAY_SPLICE)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"myupstream_batch\" cannot be used together with \"myupstream_cache\", \"myupstream_coalesce\", \"myupstream_hedge\", \"myupstream_gzip\", \"myupstream_http2\" or \"myupstream_relay splice\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* 收集队列每个 location 一个，fork 之后每个 worker 各有一份 */
+    conf->batch_queue = ngx_http_myupstream_batch_init(cf);
+    if (conf->batch_queue == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
 }
 
 static ngx_int_t myupstream_upstream_create_request(ngx_http_request_t *r) {
-    // ngx_http_myupstream_conf_t *mycf = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
-    static ngx_str_t backendQueryLine = ngx_string("GET / HTTP/1.1\r\nHost: cn.bing.com\r\nConnection: close\r\n\r\n");
-    // if( ngx_strncmp(mycf->search_engine.data, "bing",  mycf->search_engine.len) == 0 ) {
-    //     ngx_str_t temp = ngx_string("GET /search?q=%V HTTP/1.1\r\nHost: cn.bing.com\r\nConnection: close\r\n\r\n");
-    //     backendQueryLine = temp;
-    // }
-    // else{
-    //     ngx_str_t temp = ngx_string("GET /s?wd=%V HTTP/1.1\r\nHost: www.baidu.com\r\nConnection: close\r\n\r\n");
-    //     backendQueryLine = temp;
-    // }
-    ngx_int_t queryLineLen = backendQueryLine.len + r->args.len - 2;
-
-    ngx_buf_t* b = ngx_create_temp_buf(r->pool, queryLineLen);
+    ngx_http_myupstream_conf_t *mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_ctx_t *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    //请求模板在 merge 时已经编译好，这里只需分配一次内存，再把字面量和转义后的参数依次复制进去；
+    //发送批量请求的子请求改为POST批量接口，包体是批次中每个请求的参数
+    ngx_buf_t* b = myctx->batch_call ? ngx_http_myupstream_batch_render(r)
+                                     : ngx_http_myupstream_template_render(r, mycf->request_template);
     if (b == NULL)
         return NGX_ERROR;
-    //last要指向请求的末尾
-    b->last = b->pos + queryLineLen;
-
-    //作用相当于snprintf
-    ngx_snprintf(b->pos, queryLineLen ,
-                 (char*)backendQueryLine.data, &r->args);
     // r->upstream->request_bufs是一个ngx_chain_t结构，它包含着要
     //发送给上游服务器的请求
     r->upstream->request_bufs = ngx_alloc_chain_link(r->pool);
     if (r->upstream->request_bufs == NULL)
         return NGX_ERROR;
 
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_CHAIN, sizeof(ngx_chain_t));
+
     // request_bufs这里只包含1个ngx_buf_t缓冲区
     r->upstream->request_bufs->buf = b;
     r->upstream->request_bufs->next = NULL;
@@ -190,6 +876,12 @@ static ngx_int_t myupstream_upstream_create_request(ngx_http_request_t *r) {
     r->upstream->header_sent = 0;
     // header_hash不可以为0
     r->header_hash = 1;
+
+    //主请求迟迟没有响应时，用同一个请求缓冲区向另一个后端对冲
+    if (mycf->hedge_stats)
+    {
+        ngx_http_myupstream_hedge_start(r);
+    }
     
     return NGX_OK;
 }
@@ -206,6 +898,15 @@ static ngx_int_t myupstream_process_status_line(ngx_http_request_t *r) {
     }
 
     u = r->upstream;
+
+    ngx_http_myupstream_trace(r, NGX_HTTP_MYUPSTREAM_TRACE_FIRST_BYTE);
+
+    //收到了第一段响应，主请求和对冲请求中只保留先响应的一个
+    if (ctx->hedge)
+    {
+        ngx_http_myupstream_hedge_header(r);
+    }
+
     //http框架提供的ngx_http_parse_status_line方法可以解析http
     //响应行，它的输入就是收到的字符流和上下文中的ngx_http_status_t结构
     rc = ngx_http_parse_status_line(r, &u->buffer, &ctx->status);
@@ -238,6 +939,12 @@ static ngx_int_t myupstream_process_status_line(ngx_http_request_t *r) {
 
     u->headers_in.status_n = ctx->status.code;
 
+    //HTTP/1.0的后端在响应结束后会关闭连接，不能放回长连接池
+    if (ctx->status.http_version < NGX_HTTP_VERSION_11)
+    {
+        u->headers_in.connection_close = 1;
+    }
+
     len = ctx->status.end - ctx->status.start;
     u->headers_in.status_line.len = len;
 
@@ -247,6 +954,8 @@ static ngx_int_t myupstream_process_status_line(ngx_http_request_t *r) {
         return NGX_ERROR;
     }
 
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_STATUS_LINE, len);
+
     ngx_memcpy(u->headers_in.status_line.data, ctx->status.start, len);
 
     //下一步将开始解析http头部，设置process_header回调方法为myupstream_upstream_process_header
@@ -262,6 +971,10 @@ static ngx_int_t myupstream_upstream_process_header(ngx_http_request_t *r) {
     ngx_table_elt_t                *h;
     ngx_http_upstream_header_t     *hh;
     ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_myupstream_ctx_t      *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_conf_t     *mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    u_char                         *lowcase = NULL;
+    size_t                          lowcase_size;
     //这里将upstream模块配置项ngx_http_upstream_main_conf_t取了
     //出来，目的只有1个，对将要转发给下游客户端的http响应头部作统一
     //处理。该结构体中存储了需要做统一处理的http头部名称和回调方法
@@ -286,28 +999,81 @@ static ngx_int_t myupstream_upstream_process_header(ngx_http_request_t *r) {
 
             h->key.len = r->header_name_end - r->header_name_start;
             h->value.len = r->header_end - r->header_start;
-            //必须由内存池中分配存放http头部的内存
-            h->key.data = ngx_pnalloc(r->pool, h->key.len + 1 + h->value.len + 1 + h->key.len);
-            if (h->key.data == NULL)
+
+            if (mycf->zero_copy_headers)
             {
-                return NGX_ERROR;
-            }
+                //与nginx解析客户端请求头的方式相同，键和值直接指向接收缓冲区，
+                //把键后面的':'和值后面的'\r'改写为'\0'，这两个位置已经解析过了
+                h->key.data = r->header_name_start;
+                h->key.data[h->key.len] = '\0';
+                h->value.data = r->header_start;
+                h->value.data[h->value.len] = '\0';
 
-            h->value.data = h->key.data + h->key.len + 1;
-            h->lowcase_key = h->key.data + h->key.len + 1 + h->value.len + 1;
+                //小写的键从本次调用共用的一块内存中切出来。名字被拆在两次读取中时，
+                //header_name_start 指向上一次读到的部分，在 buffer.pos 之前，
+                //所以从本次第一个键的开头算起：之后的键都在它和 buffer.last 之间，且互不重叠
+                if (lowcase == NULL)
+                {
+                    lowcase_size = r->upstream->buffer.last - r->header_name_start;
+                    lowcase = ngx_pnalloc(r->pool, lowcase_size);
+                    if (lowcase == NULL)
+                    {
+                        return NGX_ERROR;
+                    }
 
-            ngx_memcpy(h->key.data, r->header_name_start, h->key.len);
-            h->key.data[h->key.len] = '\0';
-            ngx_memcpy(h->value.data, r->header_start, h->value.len);
-            h->value.data[h->value.len] = '\0';
+                    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_LOWCASE, lowcase_size);
+                }
 
-            if (h->key.len == r->lowcase_index)
-            {
-                ngx_memcpy(h->lowcase_key, r->lowcase_header, h->key.len);
-            }
+                h->lowcase_key = lowcase;
+                lowcase += h->key.len;
+
+                //哈希值已经由ngx_http_parse_header_line逐字节算好，这里只需要转换小写
+                myupstream_strlow(h->lowcase_key, h->key.data, h->key.len);
+
+                myctx->headers_in_buffer = 1;
+            }
             else
             {
-                ngx_strlow(h->lowcase_key, h->key.data, h->key.len);
+                //必须由内存池中分配存放http头部的内存
+                h->key.data = ngx_pnalloc(r->pool, h->key.len + 1 + h->value.len + 1 + h->key.len);
+                if (h->key.data == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_HEADER, h->key.len + 1 + h->value.len + 1 + h->key.len);
+
+                h->value.data = h->key.data + h->key.len + 1;
+                h->lowcase_key = h->key.data + h->key.len + 1 + h->value.len + 1;
+
+                ngx_memcpy(h->key.data, r->header_name_start, h->key.len);
+                h->key.data[h->key.len] = '\0';
+                ngx_memcpy(h->value.data, r->header_start, h->value.len);
+                h->value.data[h->value.len] = '\0';
+
+                if (h->key.len == r->lowcase_index)
+                {
+                    ngx_memcpy(h->lowcase_key, r->lowcase_header, h->key.len);
+                }
+                else
+                {
+                    ngx_strlow(h->lowcase_key, h->key.data, h->key.len);
+                }
+            }
+
+            //后端自己声明了按Accept-Encoding区分版本时，不再重复添加Vary
+            if (mycf->gzip && h->key.len == sizeof("vary") - 1
+                && ngx_strncmp(h->lowcase_key, "vary", h->key.len) == 0
+                && ngx_strlcasestrn(h->value.data, h->value.data + h->value.len, (u_char *) "accept-encoding", sizeof("accept-encoding") - 1 - 1) != NULL)
+            {
+                myctx->gzip_vary = 1;
+            }
+
+            //使用响应缓存时，由Cache-Control决定能否缓存、缓存多久
+            if (myctx->cache_key.data && h->key.len == sizeof("cache-control") - 1
+                && ngx_strncmp(h->lowcase_key, "cache-control", h->key.len) == 0)
+            {
+                ngx_http_myupstream_cache_control(r, &h->value);
             }
 
             //upstream模块会对一些http头部做特殊处理
@@ -324,6 +1090,12 @@ static ngx_int_t myupstream_upstream_process_header(ngx_http_request_t *r) {
         //完毕，接下来再接收到的都将是http包体
         if (rc == NGX_HTTP_PARSE_HEADER_DONE)
         {
+            //chunked编码的响应以chunked为准，忽略Content-Length
+            if (r->upstream->headers_in.chunked)
+            {
+                r->upstream->headers_in.content_length_n = -1;
+            }
+
             //如果之前解析http头部时没有发现server和date头部，以下会
             //根据http协议添加这两个头部
             if (r->upstream->headers_in.server == NULL)
@@ -352,6 +1124,25 @@ static ngx_int_t myupstream_upstream_process_header(ngx_http_request_t *r) {
                 ngx_str_null(&h->value);
                 h->lowcase_key = (u_char *) "date";
             }
+            //开启myupstream_gzip后，同一个URL的响应是否压缩取决于客户端的Accept-Encoding
+            if (mycf->gzip && !myctx->gzip_vary)
+            {
+                h = ngx_list_push(&r->upstream->headers_in.headers);
+                if (h == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                h->hash = ngx_hash(ngx_hash(ngx_hash('v', 'a'), 'r'), 'y');
+                ngx_str_set(&h->key, "Vary");
+                ngx_str_set(&h->value, "Accept-Encoding");
+                h->lowcase_key = (u_char *) "vary";
+            }
+
+            if (mycf->trace)
+            {
+                ngx_http_myupstream_trace(r, NGX_HTTP_MYUPSTREAM_TRACE_HEADER);
+            }
 
             return NGX_OK;
         }
@@ -369,38 +1160,191 @@ static ngx_int_t myupstream_upstream_process_header(ngx_http_request_t *r) {
 }
 
 static void myupstream_upstream_finalize_request(ngx_http_request_t *r, ngx_int_t rc) {
-    //在请求结束时，会调用该方法，可以释放资源，如打开的句柄等，由于我们没有任何需要释放的资源
-    //故该方法没有任何实际的工作
+    //在请求结束时，会调用该方法，可以释放资源，如打开的句柄等
+    ngx_http_myupstream_conf_t *mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
     ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,"myupstream_upstream_finalize_request");
+
+    //关闭还在等待响应的对冲连接，对冲的结果随后记入统计区
+    if (mycf->hedge_stats)
+    {
+        ngx_http_myupstream_hedge_finalize(r);
+    }
+
+    //完整接收的响应写入缓存
+    if (mycf->cache_zone)
+    {
+        ngx_http_myupstream_cache_finalize(r, rc);
+    }
+
+    //缓存写好之后再唤醒等待同一个响应的请求，释放跨worker的锁
+    if (mycf->coalesce_tree)
+    {
+        ngx_http_myupstream_coalesce_finalize(r, rc);
+    }
+
+    if (mycf->metrics_zone)
+    {
+        ngx_http_myupstream_metrics_record(r, rc);
+    }
+
+    //归还并发名额，记录本次的RTT，唤醒排队的请求
+    if (mycf->limit_zone)
+    {
+        ngx_http_myupstream_limit_release(r, rc);
+    }
 }
 
 static char* ngx_http_myupstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
     ngx_http_core_loc_conf_t  *clcf;
+
+    mycf->enable = 1;
+
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
     clcf->handler = ngx_http_myupstream_handler;
     return NGX_CONF_OK;
 }
+
+/*
+myupstream_pass 配置项的回调函数，与 proxy_pass 一样通过名字引用 upstream {} 块，
+该块可以出现在配置文件中的任意位置
+参数：cf - 配置对象
+     cmd - 指向自身commands结构体的指针
+     conf - 该 location 的 ngx_http_myupstream_conf_t
+返回值：成功 - NGX_CONF_OK
+       失败 - NGX_CONF_ERROR
+*/
+static char *ngx_http_myupstream_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_url_t                   u;
+
+    if (mycf->pass) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+    u.url = value[1];
+    u.no_resolve = 1;
+
+    mycf->pass = ngx_http_upstream_add(cf, &u, 0);
+    if (mycf->pass == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return ngx_http_myupstream(cf, cmd, conf);
+}
 /******************************************************
 函数名：ngx_http_myupstream_handler(ngx_http_request_t *r)
 参数：ngx_http_request_t结构体
 功能：ngx_http_myupstream_handler方法的实现，启动upstream
 *******************************************************/
-static ngx_int_t ngx_http_myupstream_handler(ngx_http_request_t *r) {
+ngx_int_t ngx_http_myupstream_handler(ngx_http_request_t *r) {
      //首先建立http上下文结构体ngx_http_myupstream_ctx_t
     //ngx_http_get_module_ctx是一个宏定义：(r)->ctx[module.ctx_index],r为ngx_http_request_t指针
     //第二个参数为HTTP模块对象
     ngx_http_myupstream_ctx_t* myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
     if (myctx == NULL)//失败
     {//开辟空间
-        myctx = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_ctx_t));
+        myctx = ngx_pcalloc(r->pool, sizeof(ngx_http_myupstream_ctx_t));
         if (myctx == NULL)//还失败
         {
             return NGX_ERROR;//返回
         }
+        ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_CTX, sizeof(ngx_http_myupstream_ctx_t));
         //将新建的上下文与请求关联起来
         //ngx_http_set_module_ctx是一个宏定义：(r)->ctx[module.ctx_index]=c;r为ngx_http_request_t指针
         ngx_http_set_ctx(r, myctx, ngx_http_myupstream_module);
     }
+
+    ngx_http_myupstream_conf_t  *mycf = (ngx_http_myupstream_conf_t  *) ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    if (mycf->trace)
+    {
+        ngx_http_myupstream_trace(r, NGX_HTTP_MYUPSTREAM_TRACE_HANDLER);
+    }
+
+    //扇出的子请求要经过本模块的过滤方法收集包体，HTTP/2模式的流不经过这些方法
+    if (myctx->fanout_part && mycf->http2_pool)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "myupstream: fanout target \"%V\" cannot use myupstream_http2", &r->uri);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    //先查询响应缓存，命中时直接从共享内存发送，不需要创建upstream；
+    //扇出的子请求不查缓存，命中时包体直接发给子请求，扇出收集不到
+    if (mycf->cache_zone && myctx->fanout_part == NULL)
+    {
+        ngx_int_t rc = ngx_http_myupstream_cache_lookup(r);
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+    }
+
+    //响应不会写入缓存时，客户端接受gzip就让后端直接返回压缩的包体，原样转发，不再由gzip过滤模块逐个请求压缩；
+    //要写入缓存的响应总是请求原始包体，写缓存时压缩一次，两个版本都保存
+    //扇出要合并各个目标的原始包体，不请求压缩
+    if (mycf->gzip && (mycf->cache_zone == NULL || myctx->cache_status == NGX_HTTP_MYUPSTREAM_CACHE_BYPASS)
+        && myctx->fanout_part == NULL && ngx_http_myupstream_gzip_accepted(r) == NGX_OK)
+    {
+        myctx->gzip = 1;
+    }
+
+    //相同参数的请求正在访问后端时，等待它的响应而不是再访问一次后端
+    if (mycf->coalesce_tree)
+    {
+        ngx_int_t rc = ngx_http_myupstream_coalesce(r);
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+    }
+
+    //短时间内到达的请求合成一批，由其中一个请求的后台子请求一次访问后端，响应拆分后再交给每个请求
+    if (mycf->batch_queue)
+    {
+        ngx_int_t rc = ngx_http_myupstream_batch_join(r);
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+    }
+
+    //后端的并发数达到上限时排队或者直接返回503，排队等到名额后由定时器继续启动upstream
+    if (mycf->limit_zone)
+    {
+        ngx_int_t rc = ngx_http_myupstream_limit_acquire(r);
+        if (rc != NGX_OK)
+        {
+            return rc;
+        }
+    }
+
+    return ngx_http_myupstream_start(r);
+}
+
+/******************************************************
+函数名：ngx_http_myupstream_start(ngx_http_request_t *r)
+参数：ngx_http_request_t结构体
+功能：创建并启动upstream，访问后端。handler没有命中缓存、也没有合并到其他请求时调用，
+     在myupstream_limit的队列中等到名额的请求也从这里继续
+*******************************************************/
+ngx_int_t ngx_http_myupstream_start(ngx_http_request_t *r) {
+    ngx_http_myupstream_ctx_t *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_conf_t  *mycf = (ngx_http_myupstream_conf_t  *) ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+#if (NGX_HTTP_V2)
+    //HTTP/2模式不创建upstream，请求作为一个流复用已有的后端连接
+    if (mycf->http2_pool)
+    {
+        return ngx_http_myupstream_http2_start(r);
+    }
+#endif
+
     //对每1个要使用upstream的请求，必须调用且只能调用1次
     //ngx_http_upstream_create方法，它会初始化r->upstream成员
     if (ngx_http_upstream_create(r) != NGX_OK)
@@ -409,68 +1353,57 @@ static ngx_int_t ngx_http_myupstream_handler(ngx_http_request_t *r) {
         return NGX_ERROR;
     }
 
-    //得到配置结构体ngx_http_myupstream_conf_t
-    ngx_http_myupstream_conf_t  *mycf = (ngx_http_myupstream_conf_t  *) ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
     ngx_http_upstream_t *u = r->upstream;
     //这里用配置文件中的结构体来赋给r->upstream->conf成员
     u->conf = &mycf->upstream;
-    //决定转发包体时使用的缓冲区
-    u->buffering = mycf->upstream.buffering;
+    //决定转发包体时使用的缓冲区，后台更新缓存、发送批量请求和扇出的子请求不向客户端输出，总是使用非缓冲模式
+    u->buffering = mycf->upstream.buffering && !myctx->cache_update && !myctx->batch_call && !myctx->fanout_part;
 
-    //以下代码开始初始化resolved结构体，用来保存上游服务器的地址
-    //resolved为ngx_http_upstream_resolved_t类型的指针，用于直接指定上游服务器的地址
-    u->resolved = (ngx_http_upstream_resolved_t*) ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_resolved_t));
-    if (u->resolved == NULL)//resolved结构体初始化失败
+    //缓冲模式下由event pipe读取后端，包体的边界同样需要本模块的过滤方法来确定
+    if (u->buffering)
     {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_pcalloc resolved error. %s.", strerror(errno));
-        return NGX_ERROR;
-    }
-
+        u->pipe = ngx_pcalloc(r->pool, sizeof(ngx_event_pipe_t));
+        if (u->pipe == NULL)
+        {
+            return NGX_ERROR;
+        }
 
-    static struct sockaddr_in backendSockAddr;
-    //得到给定主机名的包含主机名字和地址信息的hostent结构指针
-    struct hostent *pHost = gethostbyname((char*) "cn.bing.com");
-    // if( ngx_strncmp(mycf->search_engine.data, "bing",  mycf->search_engine.len) == 0 ) {
-    //     pHost = gethostbyname((char*) "cn.bing.com");
-    // }
-    // else{
-    //     pHost = gethostbyname((char*) "www.baidu.com");
-    // }
-    
-    if (pHost == NULL)
-    {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "gethostbyname fail. %s", strerror(errno));
+        ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_PIPE, sizeof(ngx_event_pipe_t));
 
-        return NGX_ERROR;
+        u->pipe->input_filter = myupstream_pipe_copy_filter;
+        u->pipe->input_ctx = r;
     }
 
-    //访问上游服务器的80端口
-    backendSockAddr.sin_family = AF_INET;
-    backendSockAddr.sin_port = htons((in_port_t) 80);
-    //将IP转换成一个互联网标准点分格式的字符串
-    char* pDmsIP = inet_ntoa(*(struct in_addr*) (pHost->h_addr_list[0]));
-    //将字符串转换为32位二进制网络字节序的IPV4地址
-    backendSockAddr.sin_addr.s_addr = inet_addr(pDmsIP);
-    myctx->backendServer.data = (u_char*)pDmsIP;
-    myctx->backendServer.len = strlen(pDmsIP);
-
-    //将地址设置到resolved成员中
-    //typedef struct{
-    //....
-    //ngx_uint_t naddrs;//地址个数
-    //struct sockaddr *sockaddr;//上游服务器的地址
-    //socklen_t socklen;//长度
-    //....
-    //}ngx_http_upstream_resolved_t；
-    u->resolved->sockaddr = (struct sockaddr *)&backendSockAddr;
-    u->resolved->socklen = sizeof(struct sockaddr_in);
-    u->resolved->naddrs = 1;
     //ngx_http_upstream_t有8个回调方法
     //设置三个必须实现的回调方法
     u->create_request = myupstream_upstream_create_request;
     u->process_header = myupstream_process_status_line;
     u->finalize_request = myupstream_upstream_finalize_request;
+    //按Content-Length或chunked确定响应包体的边界，包体完整读完后连接才能放回长连接池
+    u->input_filter_init = myupstream_input_filter_init;
+    u->input_filter = myupstream_non_buffered_copy_filter;
+    u->input_filter_ctx = r;
+
+    //从这里开始统计访问后端的各阶段耗时
+    if (mycf->metrics_zone)
+    {
+        ngx_http_myupstream_metrics_start(r);
+    }
+
+    //查找后端地址，结果复制到请求上下文中，由u->conf->upstream->peer.init交给upstream机制
+    //u->resolved为NULL时，upstream机制会使用u->conf->upstream这个upstream配置块
+    //缓存中有地址时直接返回NGX_OK；否则发起异步解析，返回NGX_DONE，解析完成后在回调中启动upstream
+    //使用myupstream_pass时由upstream {}块负责选择后端
+    ngx_int_t rc = mycf->pass ? NGX_OK : ngx_http_myupstream_dns_lookup(r, mycf->dns);
+    if (rc == NGX_DONE)
+    {
+        return NGX_DONE;
+    }
+
+    if (rc != NGX_OK)
+    {
+        return rc;
+    }
 
     //这里必须将count成员加1，告诉HTTP框架将当前请求的引用计数加1，即告诉ngx_http_myupstream_handler方法暂时不要
     //销毁请求，因为HTTP框架只有在引用计数为0时才正真地销毁请求
@@ -480,3 +1413,581 @@ static ngx_int_t ngx_http_myupstream_handler(ngx_http_request_t *r) {
     //必须返回NGX_DONE
     return NGX_DONE;//通过返回NGX_DONE告诉HTTP框架暂停执行请求的下一个阶段
 }
+
+
+/*
+把src的前n个字节转换为小写写入dst。支持SSE2时每次处理16个字节：
+用两次有符号比较找出'A'到'Z'之间的字节，对这些字节加上0x20，其余字节（包括大于0x7f的）不变；
+不足16个字节的尾部逐字节处理，不会越过src的末尾读取
+*/
+static void myupstream_strlow(u_char *dst, u_char *src, size_t n) {
+#if defined(__SSE2__)
+    __m128i  v, mask, lo, hi, delta;
+
+    lo = _mm_set1_epi8('A' - 1);
+    hi = _mm_set1_epi8('Z' + 1);
+    delta = _mm_set1_epi8(0x20);
+
+    while (n >= 16) {
+        v = _mm_loadu_si128((const __m128i *) src);
+        mask = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        v = _mm_add_epi8(v, _mm_and_si128(mask, delta));
+        _mm_storeu_si128((__m128i *) dst, v);
+
+        src += 16;
+        dst += 16;
+        n -= 16;
+    }
+#endif
+
+    while (n--) {
+        *dst++ = ngx_tolower(*src);
+        src++;
+    }
+}
+
+/*
+零拷贝解析的响应头指向u->buffer，而接收包体时upstream会从头复用这块缓冲区。
+在开始接收包体之前给u->buffer换一块同样大小的新内存，只搬移已经预读的包体，旧缓冲区连同响应头原样保留到请求结束。
+*/
+static ngx_int_t myupstream_detach_header_buffer(ngx_http_request_t *r) {
+    u_char               *p;
+    size_t                size;
+    ngx_buf_t            *b;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+    b = &u->buffer;
+
+    size = b->end - b->start;
+
+    p = ngx_palloc(r->pool, size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_BODY_BUFFER, size);
+
+    b->last = ngx_cpymem(p, b->pos, b->last - b->pos);
+    b->pos = p;
+    b->start = p;
+    b->end = p + size;
+
+    return NGX_OK;
+}
+
+/*
+开始转发响应包体之前调用，根据响应头部决定如何确定包体的结束位置
+参数：data - 即 input_filter_ctx，这里是请求
+返回值：NGX_OK
+*/
+static ngx_int_t myupstream_input_filter_init(void *data) {
+    ngx_http_request_t   *r = data;
+    ngx_http_upstream_t  *u = r->upstream;
+    ngx_http_myupstream_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_conf_t *mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    //决定本次响应是否写入缓存
+    if (mycf->cache_zone)
+    {
+        ngx_http_myupstream_cache_init_store(r);
+    }
+
+    if (u->headers_in.status_n == NGX_HTTP_NO_CONTENT
+        || u->headers_in.status_n == NGX_HTTP_NOT_MODIFIED)
+    {
+        //204和304没有包体
+        u->length = 0;
+        u->keepalive = !u->headers_in.connection_close;
+    }
+    else if (u->headers_in.chunked)
+    {
+        //chunked编码，由chunked过滤器解析出每一块的数据
+        ngx_memzero(&ctx->chunked, sizeof(ngx_http_chunked_t));
+        u->input_filter = myupstream_non_buffered_chunked_filter;
+        u->length = 1;
+
+        if (u->pipe)
+        {
+            u->pipe->input_filter = myupstream_pipe_chunked_filter;
+        }
+    }
+    else if (u->headers_in.content_length_n == 0)
+    {
+        u->length = 0;
+        u->keepalive = !u->headers_in.connection_close;
+    }
+    else
+    {
+        //有Content-Length时按长度接收，否则为-1，一直接收到后端关闭连接
+        u->length = u->headers_in.content_length_n;
+    }
+
+    //缓冲模式下event pipe按p->length判断包体是否收完，chunked时是至少还要收到的字节数，最后一块"0" CRLF CRLF至少3个字节
+    if (u->pipe)
+    {
+        u->pipe->length = u->headers_in.chunked && u->length ? 3 : u->length;
+    }
+
+    //响应头引用着u->buffer，之后upstream会从头复用这块缓冲区接收数据，先换一块新的
+    if (ctx->headers_in_buffer)
+    {
+        if (myupstream_detach_header_buffer(r) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    //把响应头同样发给等待本请求的其他请求
+    ngx_uint_t followers = 0;
+    if (ctx->coalesce)
+    {
+        followers = ngx_http_myupstream_coalesce_header(r);
+    }
+
+    //包体不需要经过过滤模块时，用splice在内核中从后端套接字直接转发到客户端套接字
+    if (!u->buffering && mycf->relay == NGX_HTTP_MYUPSTREAM_RELAY_SPLICE && followers == 0)
+    {
+        if (ngx_http_myupstream_splice_start(r) == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+非缓冲模式下转发Content-Length或者以关闭连接结束的包体，
+把u->buffer中新收到的bytes字节挂到u->out_bufs上
+*/
+static ngx_int_t myupstream_non_buffered_copy_filter(void *data, ssize_t bytes) {
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_request_t   *r = data;
+    ngx_http_upstream_t  *u = r->upstream;
+    ngx_http_myupstream_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    b = &u->buffer;
+
+    if (ctx->cache_store) {
+        ngx_http_myupstream_cache_capture(r, b->last, bytes);
+    }
+
+    if (ctx->coalesce) {
+        ngx_http_myupstream_coalesce_body(r, b->last, bytes);
+    }
+
+    if (ctx->batch_call) {
+        ngx_http_myupstream_batch_capture(r, b->last, bytes);
+    }
+
+    if (ctx->fanout_part) {
+        ngx_http_myupstream_fanout_capture(r, b->last, bytes);
+    }
+
+    //后台更新缓存、发送批量请求和扇出的子请求不向客户端输出
+    if (ctx->cache_update || ctx->batch_call || ctx->fanout_part) {
+        b->last += bytes;
+        goto length;
+    }
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    *ll = cl;
+
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+
+    cl->buf->pos = b->last;
+    b->last += bytes;
+    cl->buf->last = b->last;
+    cl->buf->tag = u->output.tag;
+
+length:
+
+    if (u->length == -1) {
+        return NGX_OK;
+    }
+
+    u->length -= bytes;
+
+    //包体已经完整接收，连接可以复用
+    if (u->length == 0) {
+        u->keepalive = !u->headers_in.connection_close;
+    }
+
+    return NGX_OK;
+}
+
+/*
+非缓冲模式下解析chunked编码的包体，只把每块的数据部分转发给客户端，
+读到最后一块（长度为0的块）后包体结束
+*/
+static ngx_int_t myupstream_non_buffered_chunked_filter(void *data, ssize_t bytes) {
+    off_t                 size;
+    ngx_int_t             rc;
+    ngx_buf_t            *b, *buf;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_request_t   *r = data;
+    ngx_http_upstream_t  *u = r->upstream;
+    ngx_http_myupstream_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    buf = &u->buffer;
+
+    buf->pos = buf->last;
+    buf->last += bytes;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    for ( ;; ) {
+
+        rc = ngx_http_parse_chunked(r, buf, &ctx->chunked);
+
+        if (rc == NGX_OK) {
+
+            size = ngx_min(buf->last - buf->pos, ctx->chunked.size);
+
+            if (ctx->cache_store) {
+                ngx_http_myupstream_cache_capture(r, buf->pos, size);
+            }
+
+            if (ctx->coalesce) {
+                ngx_http_myupstream_coalesce_body(r, buf->pos, size);
+            }
+
+            if (ctx->batch_call) {
+                ngx_http_myupstream_batch_capture(r, buf->pos, size);
+            }
+
+            if (ctx->fanout_part) {
+                ngx_http_myupstream_fanout_capture(r, buf->pos, size);
+            }
+
+            //后台更新缓存、发送批量请求和扇出的子请求不向客户端输出
+            if (ctx->cache_update || ctx->batch_call || ctx->fanout_part) {
+                buf->pos += size;
+                ctx->chunked.size -= size;
+                continue;
+            }
+
+            //解析出一块数据
+            cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            *ll = cl;
+            ll = &cl->next;
+
+            b = cl->buf;
+
+            b->flush = 1;
+            b->memory = 1;
+
+            b->pos = buf->pos;
+            b->tag = u->output.tag;
+
+            if (buf->last - buf->pos >= ctx->chunked.size) {
+                buf->pos += (size_t) ctx->chunked.size;
+                b->last = buf->pos;
+                ctx->chunked.size = 0;
+
+            } else {
+                ctx->chunked.size -= buf->last - buf->pos;
+                buf->pos = buf->last;
+                b->last = buf->last;
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            //整个包体解析完毕
+            u->keepalive = !u->headers_in.connection_close;
+            u->length = 0;
+
+            if (buf->pos != buf->last) {
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "upstream sent data after final chunk");
+                u->keepalive = 0;
+            }
+
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "upstream sent invalid chunked response");
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+缓冲模式下转发Content-Length或者以关闭连接结束的包体，event pipe每读到一块缓冲区调用一次。
+新建一个影子缓冲区指向收到的数据挂到p->in上，超出Content-Length的部分丢弃
+参数：p - event pipe
+     buf - 刚从后端读入数据的缓冲区
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t myupstream_pipe_copy_filter(ngx_event_pipe_t *p, ngx_buf_t *buf) {
+    size_t                len;
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl;
+    ngx_http_request_t   *r = p->input_ctx;
+    ngx_http_upstream_t  *u = r->upstream;
+    ngx_http_myupstream_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (buf->pos == buf->last) {
+        return NGX_OK;
+    }
+
+    if (p->upstream_done) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, p->log, 0, "myupstream data after close");
+        return NGX_OK;
+    }
+
+    if (p->length == 0) {
+        ngx_log_error(NGX_LOG_WARN, p->log, 0, "upstream sent more data than specified in \"Content-Length\" header");
+        p->upstream_done = 1;
+        u->keepalive = 0;
+        return NGX_OK;
+    }
+
+    cl = ngx_chain_get_free_buf(p->pool, &p->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    ngx_memcpy(b, buf, sizeof(ngx_buf_t));
+    b->shadow = buf;
+    b->tag = p->tag;
+    b->last_shadow = 1;
+    b->recycled = 1;
+    buf->shadow = b;
+
+    if (p->in) {
+        *p->last_in = cl;
+    } else {
+        p->in = cl;
+    }
+    p->last_in = &cl->next;
+
+    if (p->length != -1 && b->last - b->pos > p->length) {
+        ngx_log_error(NGX_LOG_WARN, p->log, 0, "upstream sent more data than specified in \"Content-Length\" header");
+        b->last = b->pos + p->length;
+        p->upstream_done = 1;
+    }
+
+    len = b->last - b->pos;
+
+    if (ctx->cache_store) {
+        ngx_http_myupstream_cache_capture(r, b->pos, len);
+    }
+
+    if (ctx->coalesce) {
+        ngx_http_myupstream_coalesce_body(r, b->pos, len);
+    }
+
+    if (p->length == -1) {
+        return NGX_OK;
+    }
+
+    //u->length与非缓冲模式保持一致，写缓存时据此判断包体是否完整
+    p->length -= len;
+    u->length = p->length;
+
+    //包体已经完整接收，连接可以复用
+    if (p->length == 0 && !p->upstream_done) {
+        u->keepalive = !u->headers_in.connection_close;
+    }
+
+    return NGX_OK;
+}
+
+/*
+缓冲模式下解析chunked编码的包体，每块数据对应一个影子缓冲区挂到p->in上，
+读到最后一块后包体结束
+参数：p - event pipe
+     buf - 刚从后端读入数据的缓冲区
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t myupstream_pipe_chunked_filter(ngx_event_pipe_t *p, ngx_buf_t *buf) {
+    size_t                size;
+    ngx_int_t             rc;
+    ngx_buf_t            *b, **prev;
+    ngx_chain_t          *cl;
+    ngx_http_request_t   *r = p->input_ctx;
+    ngx_http_upstream_t  *u = r->upstream;
+    ngx_http_myupstream_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (buf->pos == buf->last) {
+        return NGX_OK;
+    }
+
+    if (p->upstream_done) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, p->log, 0, "myupstream data after close");
+        return NGX_OK;
+    }
+
+    if (p->length == 0) {
+        ngx_log_error(NGX_LOG_WARN, p->log, 0, "upstream sent data after final chunk");
+        u->keepalive = 0;
+        p->upstream_done = 1;
+        return NGX_OK;
+    }
+
+    b = NULL;
+    prev = &buf->shadow;
+
+    for ( ;; ) {
+
+        rc = ngx_http_parse_chunked(r, buf, &ctx->chunked);
+
+        if (rc == NGX_OK) {
+
+            //解析出一块数据
+            cl = ngx_chain_get_free_buf(p->pool, &p->free);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = cl->buf;
+
+            ngx_memzero(b, sizeof(ngx_buf_t));
+
+            b->pos = buf->pos;
+            b->start = buf->start;
+            b->end = buf->end;
+            b->tag = p->tag;
+            b->temporary = 1;
+            b->recycled = 1;
+            b->num = buf->num;
+
+            *prev = b;
+            prev = &b->shadow;
+
+            if (p->in) {
+                *p->last_in = cl;
+            } else {
+                p->in = cl;
+            }
+            p->last_in = &cl->next;
+
+            size = (size_t) ngx_min(buf->last - buf->pos, ctx->chunked.size);
+
+            buf->pos += size;
+            b->last = buf->pos;
+            ctx->chunked.size -= size;
+
+            if (ctx->cache_store) {
+                ngx_http_myupstream_cache_capture(r, b->pos, size);
+            }
+
+            if (ctx->coalesce) {
+                ngx_http_myupstream_coalesce_body(r, b->pos, size);
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            //整个包体解析完毕
+            p->length = 0;
+            u->length = 0;
+            u->keepalive = !u->headers_in.connection_close;
+
+            if (buf->pos != buf->last) {
+                ngx_log_error(NGX_LOG_WARN, p->log, 0, "upstream sent data after final chunk");
+                u->keepalive = 0;
+            }
+
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+            //至少还要收到多少字节才可能解析出下一块
+            p->length = ctx->chunked.length;
+            break;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "upstream sent invalid chunked response");
+
+        return NGX_ERROR;
+    }
+
+    if (b) {
+        b->shadow = buf;
+        b->last_shadow = 1;
+        return NGX_OK;
+    }
+
+    //这块缓冲区里没有包体数据，直接放回空闲链表
+    if (ngx_event_pipe_add_free_buf(p, buf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* 注册本模块提供的变量 */
+static ngx_int_t ngx_http_myupstream_add_variables(ngx_conf_t *cf) {
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_myupstream_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+/* $myupstream_keepalive_hits 和 $myupstream_keepalive_misses，当前 worker 中该 location 长连接池的命中和未命中次数 */
+static ngx_int_t ngx_http_myupstream_keepalive_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char                      *p;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    if (mycf->keepalive_pool == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", data ? mycf->keepalive_pool->misses : mycf->keepalive_pool->hits) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
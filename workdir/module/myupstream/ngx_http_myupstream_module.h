@@ -0,0 +1,477 @@
+#ifndef _NGX_HTTP_MYUPSTREAM_MODULE_H_INCLUDED_
+#define _NGX_HTTP_MYUPSTREAM_MODULE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/* 后端缺省使用的主机名和端口 */
+#define NGX_HTTP_MYUPSTREAM_DEFAULT_HOST    "cn.bing.com"
+#define NGX_HTTP_MYUPSTREAM_DEFAULT_PORT    80
+
+/* 域名解析失败后，多久（秒）再次尝试刷新缓存 */
+#define NGX_HTTP_MYUPSTREAM_DNS_RETRY       5
+
+/* 本 worker 连接一个后端地址的记录，myupstream_happy_eyeballs 据此排序 */
+typedef struct {
+    ngx_msec_t              rtt;        /* 建立连接耗时的 EWMA，0 表示还没有连上过 */
+    ngx_uint_t              fails;      /* 连续连接失败的次数 */
+    ngx_msec_t              down_until; /* 最近连接失败，在这个时间之前排在最后，0 表示没有失败 */
+} ngx_http_myupstream_dns_stat_t;
+
+/*
+每个 worker 进程私有的域名解析缓存，挂在 location 配置上。
+fork 之后每个 worker 拥有自己的一份拷贝，所以这里的读写都不需要加锁。
+*/
+typedef struct {
+    ngx_str_t               host;      /* 需要解析的主机名 */
+    in_port_t               port;      /* 后端端口 */
+
+    ngx_resolver_addr_t    *addrs;     /* 解析结果，由 ngx_alloc 分配，刷新时整体替换 */
+    ngx_uint_t              naddrs;
+    ngx_http_myupstream_dns_stat_t  *stats;  /* 与 addrs 一一对应，和 addrs 在同一块内存中，刷新时保留仍然存在的地址的记录 */
+    time_t                  expire;    /* 缓存过期时间，0 表示永不过期（启动时静态解析） */
+
+    unsigned                resolving:1; /* 是否正在后台刷新 */
+} ngx_http_myupstream_dns_t;
+
+/*
+每个 worker 进程私有的后端长连接池。
+cache 队列保存空闲的长连接（最近使用的在队头），free 队列保存空闲的槽位。
+*/
+typedef struct {
+    ngx_uint_t              max_cached;  /* 每个 worker 最多缓存的空闲连接数 */
+    ngx_msec_t              timeout;     /* 空闲连接的超时时间 */
+
+    ngx_queue_t             cache;
+    ngx_queue_t             free;
+
+    ngx_uint_t              hits;        /* 复用了空闲连接的次数 */
+    ngx_uint_t              misses;      /* 需要新建连接的次数 */
+} ngx_http_myupstream_keepalive_t;
+
+/* myupstream_happy_eyeballs 一个请求的地址竞速 */
+typedef struct ngx_http_myupstream_eyeballs_s  ngx_http_myupstream_eyeballs_t;
+
+/* myupstream_trace_file 映射的文件 */
+typedef struct ngx_http_myupstream_trace_file_s  ngx_http_myupstream_trace_file_t;
+
+/* myupstream_trace 记录的时间点 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_HANDLER     0   /* myupstream 的 handler 开始处理 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_CONNECT     1   /* 连上后端 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_FIRST_BYTE  2   /* 收到响应的第一个字节 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_HEADER      3   /* 解析完响应头 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_EVENTS      4
+#define NGX_HTTP_MYUPSTREAM_TRACE_MYMODULE    4   /* mymodule 的 handler 开始处理，记为 HANDLER，编号与 mymodule 中一致 */
+
+/* $myupstream_cache_status 的取值 */
+#define NGX_HTTP_MYUPSTREAM_CACHE_BYPASS    1
+#define NGX_HTTP_MYUPSTREAM_CACHE_MISS      2
+#define NGX_HTTP_MYUPSTREAM_CACHE_EXPIRED   3
+#define NGX_HTTP_MYUPSTREAM_CACHE_STALE     4
+#define NGX_HTTP_MYUPSTREAM_CACHE_UPDATING  5
+#define NGX_HTTP_MYUPSTREAM_CACHE_HIT       6
+
+/* 响应缓存在共享内存中的头部，所有 worker 共享，访问时必须持有 shpool->mutex */
+typedef struct {
+    ngx_rbtree_t            rbtree;      /* 按缓存键查找 */
+    ngx_rbtree_node_t       sentinel;
+    ngx_queue_t             queue;       /* LRU 队列 */
+    ngx_rbtree_t            locks;       /* 合并请求时跨 worker 的锁 */
+    ngx_rbtree_node_t       locks_sentinel;
+
+    size_t                  bytes;       /* 缓存项占用的内存 */
+    ngx_uint_t              entries;
+    ngx_uint_t              hits;
+    ngx_uint_t              stale_hits;
+    ngx_uint_t              misses;
+    ngx_uint_t              stores;
+    ngx_uint_t              evictions;
+} ngx_http_myupstream_cache_sh_t;
+
+/* 响应缓存，即 shm_zone->data */
+typedef struct {
+    ngx_http_myupstream_cache_sh_t  *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_http_myupstream_cache_t;
+
+/* 合并请求时等待同一份响应的默认时间（毫秒），超时后自己访问后端 */
+#define NGX_HTTP_MYUPSTREAM_COALESCE_TIMEOUT  5000
+
+/* 每个 worker 进程私有的正在访问后端的请求表，按缓存键查找，同样挂在 location 配置上 */
+typedef struct {
+    ngx_rbtree_t            rbtree;
+    ngx_rbtree_node_t       sentinel;
+} ngx_http_myupstream_coalesce_tree_t;
+
+typedef struct ngx_http_myupstream_coalesce_s  ngx_http_myupstream_coalesce_t;
+
+/* myupstream_relay 的取值：包体经过用户态缓冲区转发，或者用 splice() 在内核中直接转发 */
+#define NGX_HTTP_MYUPSTREAM_RELAY_COPY      0
+#define NGX_HTTP_MYUPSTREAM_RELAY_SPLICE    1
+
+typedef struct ngx_http_myupstream_splice_s  ngx_http_myupstream_splice_t;
+
+/* $myupstream_hedge 的取值，同时是 myupstream_hedges_total 的 result 标签 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_WON        1   /* 对冲请求先响应 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_LOST       2   /* 主请求先响应，对冲连接被关闭 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_FAILED     3   /* 没有可用的后端，或者对冲连接出错 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_THROTTLED  4   /* 超出 myupstream_hedge_budget，没有对冲 */
+#define NGX_HTTP_MYUPSTREAM_HEDGE_RESULTS    4
+
+typedef struct ngx_http_myupstream_hedge_s  ngx_http_myupstream_hedge_t;
+typedef struct ngx_http_myupstream_hedge_stats_s  ngx_http_myupstream_hedge_stats_t;
+
+/* $myupstream_limit 的取值 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_PASSED    1
+#define NGX_HTTP_MYUPSTREAM_LIMIT_DELAYED   2   /* 排队等到了名额 */
+#define NGX_HTTP_MYUPSTREAM_LIMIT_REJECTED  3
+
+typedef struct ngx_http_myupstream_limit_s  ngx_http_myupstream_limit_t;
+typedef struct ngx_http_myupstream_limit_queue_s  ngx_http_myupstream_limit_queue_t;
+
+/* myupstream_http2 每个 worker 的连接池，以及一个请求对应的流 */
+typedef struct ngx_http_myupstream_http2_s  ngx_http_myupstream_http2_t;
+typedef struct ngx_http_myupstream_http2_stream_s  ngx_http_myupstream_http2_stream_t;
+
+/* myupstream_batch 的一批最多包含的请求数 */
+#define NGX_HTTP_MYUPSTREAM_BATCH_MAX_SIZE  64
+
+/* 批量请求中每个请求的结果，同时是 myupstream_batch_requests_total 的 result 标签 */
+#define NGX_HTTP_MYUPSTREAM_BATCH_OK        0
+#define NGX_HTTP_MYUPSTREAM_BATCH_FAILED    1   /* 批量请求失败，或者响应中缺少这个请求的部分 */
+#define NGX_HTTP_MYUPSTREAM_BATCH_TIMEOUT   2   /* 超过 myupstream_batch 的 timeout 仍没有结果 */
+#define NGX_HTTP_MYUPSTREAM_BATCH_RESULTS   3
+
+/* myupstream_batch 每个 worker 的收集队列、一个批次，以及一个请求的批量状态 */
+typedef struct ngx_http_myupstream_batch_queue_s  ngx_http_myupstream_batch_queue_t;
+typedef struct ngx_http_myupstream_batch_s  ngx_http_myupstream_batch_t;
+typedef struct ngx_http_myupstream_batch_member_s  ngx_http_myupstream_batch_member_t;
+
+/* myupstream_fanout 最多的目标数 */
+#define NGX_HTTP_MYUPSTREAM_FANOUT_MAX_TARGETS  16
+
+/* 扇出中每个目标的结果，同时是 myupstream_fanout_targets_total 的 result 标签 */
+#define NGX_HTTP_MYUPSTREAM_FANOUT_OK       0
+#define NGX_HTTP_MYUPSTREAM_FANOUT_FAILED   1   /* 目标返回了错误，或者响应超出了长度上限 */
+#define NGX_HTTP_MYUPSTREAM_FANOUT_LATE     2   /* 最后期限到达或者已经收够响应时还没有结束，被取消 */
+#define NGX_HTTP_MYUPSTREAM_FANOUT_RESULTS  3
+
+/* myupstream_fanout 的一次扇出，以及其中的一个目标 */
+typedef struct ngx_http_myupstream_fanout_s  ngx_http_myupstream_fanout_t;
+typedef struct ngx_http_myupstream_fanout_part_s  ngx_http_myupstream_fanout_part_t;
+
+/*
+请求内存池分配统计的调用点，同时是 myupstream_pool_* 指标的 site 标签。
+mymodule 的调用点也在这里编号，mymodule 中的同名定义必须与这里一致
+*/
+#define NGX_HTTP_MYUPSTREAM_POOL_CTX                0   /* 请求上下文 */
+#define NGX_HTTP_MYUPSTREAM_POOL_ADDR               1   /* 本次使用的后端地址和地址字符串 */
+#define NGX_HTTP_MYUPSTREAM_POOL_PEER               2   /* 选择后端连接的 peer data */
+#define NGX_HTTP_MYUPSTREAM_POOL_REQUEST            3   /* 发往后端的请求缓冲区 */
+#define NGX_HTTP_MYUPSTREAM_POOL_CHAIN              4   /* 指向请求缓冲区的 chain 节点 */
+#define NGX_HTTP_MYUPSTREAM_POOL_PIPE               5   /* 缓冲模式的 event pipe */
+#define NGX_HTTP_MYUPSTREAM_POOL_STATUS_LINE        6   /* 响应行的副本 */
+#define NGX_HTTP_MYUPSTREAM_POOL_HEADER             7   /* 不能原地引用时复制的响应头 */
+#define NGX_HTTP_MYUPSTREAM_POOL_LOWCASE            8   /* 响应头的小写键 */
+#define NGX_HTTP_MYUPSTREAM_POOL_BODY_BUFFER        9   /* 响应头原地引用时接收包体的新缓冲区 */
+#define NGX_HTTP_MYUPSTREAM_POOL_MYMODULE_BUF       10  /* mymodule 发送固定包体的缓冲区 */
+#define NGX_HTTP_MYUPSTREAM_POOL_MYMODULE_FILE      11  /* 文件模式的文件名、缓冲区和 ngx_file_t */
+#define NGX_HTTP_MYUPSTREAM_POOL_MYMODULE_INGEST    12  /* 上传模式的状态、文件名和写缓冲区 */
+#define NGX_HTTP_MYUPSTREAM_POOL_MYMODULE_RESPONSE  13  /* 上传模式的响应包体 */
+#define NGX_HTTP_MYUPSTREAM_POOL_SITES              14
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+#define ngx_http_myupstream_pool_profile(r, site, size)  ngx_http_myupstream_pool_record(r, site, size)
+#else
+#define ngx_http_myupstream_pool_profile(r, site, size)
+#endif
+
+/* 编译后的请求模板 */
+typedef struct ngx_http_myupstream_template_s  ngx_http_myupstream_template_t;
+
+typedef struct ngx_http_myupstream_chash_points_s  ngx_http_myupstream_chash_points_t;
+
+/* 一个后端在 myupstream_p2c_zone 中的延迟和错误统计 */
+typedef struct ngx_http_myupstream_p2c_node_s  ngx_http_myupstream_p2c_node_t;
+
+/* 每个 worker 的 myupstream_peers 后端表快照 */
+typedef struct ngx_http_myupstream_peers_local_s  ngx_http_myupstream_peers_local_t;
+
+/* http 块级别的配置 */
+typedef struct {
+    ngx_http_myupstream_trace_file_t    *trace;       /* myupstream_trace_file 指定的文件，没有配置时为 NULL */
+} ngx_http_myupstream_main_conf_t;
+
+/* upstream {} 块级别的配置，保存 myupstream_chash 构建的哈希环、myupstream_p2c 使用的统计区和 myupstream_peers 的后端表 */
+typedef struct {
+    ngx_http_myupstream_chash_points_t  *points;
+
+    ngx_shm_zone_t                      *p2c_zone;
+    ngx_http_myupstream_p2c_node_t     **p2c_nodes;   /* 按后端顺序缓存统计的位置，每个 worker 各自填充 */
+    ngx_uint_t                           p2c_npeers;
+
+    ngx_shm_zone_t                      *peers_zone;  /* myupstream_peers 引用的后端表 */
+    ngx_http_myupstream_peers_local_t   *peers;
+} ngx_http_myupstream_srv_conf_t;
+
+/* 存储该模块配置项参数的数据结构 */
+typedef struct {
+    ngx_str_t search_engine;
+    ngx_http_upstream_conf_t upstream;
+
+    ngx_flag_t                  enable;   /* 该 location 是否配置了 myupstream */
+    ngx_str_t                   host;     /* 发往后端的 Host 头部 */
+    ngx_http_upstream_srv_conf_t  *pass;  /* myupstream_pass 指定的 upstream {} 块，为 NULL 时使用 dns */
+    ngx_http_myupstream_dns_t  *dns;      /* 后端地址缓存 */
+    ngx_shm_zone_t             *p2c_zone; /* 不使用 upstream {} 块时，在解析出的多个地址之间按延迟选择 */
+    ngx_msec_t                  eyeballs_delay; /* 解析出多个地址时，间隔多久连接下一个地址，0 表示只连接选中的一个 */
+
+    ngx_str_t                   request_uri;      /* myupstream_request_uri，为空时由 search_engine 决定 */
+    ngx_array_t                *request_headers;  /* myupstream_request_header 添加的头部，ngx_keyval_t */
+    ngx_http_myupstream_template_t  *request_template;
+
+    ngx_uint_t                  keepalive;          /* 长连接池大小，0 表示不使用长连接 */
+    ngx_msec_t                  keepalive_timeout;
+    ngx_http_myupstream_keepalive_t  *keepalive_pool;
+
+    ngx_shm_zone_t             *cache_zone;        /* myupstream_cache 引用的共享内存 */
+    ngx_shm_zone_t             *cache_stats_zone;  /* myupstream_cache_stats 输出的共享内存 */
+    ngx_shm_zone_t             *peers_admin_zone;  /* myupstream_peers_admin 查看和修改的后端表 */
+    time_t                      cache_valid;       /* 后端没有给出 max-age 时的缓存时间 */
+    size_t                      cache_max_size;    /* 能缓存的最大包体 */
+
+    ngx_flag_t                  zero_copy_headers; /* 响应头的键和值直接指向接收缓冲区，不复制 */
+    ngx_flag_t                  gzip;              /* 向后端请求 gzip 压缩的响应，缓存项同时保存压缩版本 */
+    ngx_uint_t                  relay;             /* 非缓冲模式下转发包体的方式 */
+
+    ngx_shm_zone_t             *metrics_zone;        /* myupstream_metrics 引用的统计区 */
+    ngx_shm_zone_t             *metrics_export_zone; /* myupstream_metrics_export 输出的统计区 */
+    ngx_flag_t                  trace;               /* 请求的各个时间点写入 myupstream_trace_file */
+
+    ngx_msec_t                  hedge_delay;       /* 主请求多久没有响应时对冲，0 表示按百分位 */
+    ngx_uint_t                  hedge_percentile;  /* 按首字节延迟的百分位对冲，单位千分之一，0 表示不使用 */
+    ngx_uint_t                  hedge_budget;      /* 对冲请求最多占请求数的百分比 */
+    ngx_http_myupstream_hedge_stats_t  *hedge_stats;
+
+    ngx_flag_t                  coalesce;          /* 是否合并相同参数的并发请求 */
+    ngx_msec_t                  coalesce_timeout;  /* 等待其他请求的响应的最长时间 */
+    ngx_http_myupstream_coalesce_tree_t  *coalesce_tree;
+
+    ngx_shm_zone_t             *limit_zone;        /* myupstream_limit 引用的自适应并发上限 */
+    ngx_uint_t                  limit_queue_size;  /* 超出上限时每个 worker 最多排队的请求数 */
+    ngx_msec_t                  limit_timeout;     /* 排队的最长时间 */
+    ngx_http_myupstream_limit_queue_t  *limit_queue;
+
+    ngx_flag_t                  http2;             /* 用 HTTP/2（h2c）访问后端，多个请求复用少量连接 */
+    ngx_uint_t                  http2_connections; /* 每个 worker 到后端的最大连接数 */
+    ngx_http_myupstream_http2_t  *http2_pool;
+
+    ngx_str_t                   batch_uri;         /* 后端的批量接口，为空时不批量 */
+    ngx_msec_t                  batch_window;      /* 第一个请求加入后多久发出批次 */
+    ngx_uint_t                  batch_size;        /* 一批最多的请求数，0 表示不批量 */
+    ngx_msec_t                  batch_timeout;     /* 每个请求等待批量响应的最长时间 */
+    ngx_http_myupstream_batch_queue_t  *batch_queue;
+
+    ngx_array_t                *fanout;            /* myupstream_fanout 的目标 location，ngx_str_t */
+    ngx_uint_t                  fanout_first;      /* 收到这么多个成功的响应后不再等待，0 表示等待全部目标 */
+    ngx_msec_t                  fanout_timeout;    /* 扇出的最后期限 */
+} ngx_http_myupstream_conf_t;
+
+/* myupstream 的上下文，upstream 每次接收到一段TCP流都会回调myupstream的process_header 方法，所以需要一个上下文来保存状态 */
+typedef struct
+{
+    /*
+        typedef struct {
+            ngx_uint_t           http_version;
+            ngx_uint_t           code;
+            ngx_uint_t           count;
+            u_char              *start;
+            u_char              *end;
+        } ngx_http_status_t;
+    */
+    ngx_http_status_t status;
+    ngx_str_t backendServer;
+
+    ngx_resolver_ctx_t *resolve;  /* 正在进行的异步解析，完成或取消后置为 NULL */
+    ngx_msec_t dns_start;
+    ngx_msec_t dns_time;          /* 异步解析的耗时，dns_resolved 为 1 时有效 */
+    unsigned dns_resolved:1;
+
+    /* 本次请求使用的后端地址，从地址缓存中复制而来，backendServer 是它的字符串形式 */
+    struct sockaddr *sockaddr;
+    socklen_t socklen;
+
+    /* 地址竞速的状态，没有竞速时为 NULL；竞速建立的连接不经过 upstream 机制的连接阶段，耗时记在这里 */
+    ngx_http_myupstream_eyeballs_t *eyeballs;
+    ngx_msec_t eyeballs_time;
+    unsigned eyeballs_connected:1;
+
+    /* 响应头的字符串指向 u->buffer，接收包体复用该缓冲区之前要换一块新的 */
+    unsigned headers_in_buffer:1;
+
+    /* 请求中带了 Accept-Encoding: gzip，后端的压缩包体原样转发给客户端 */
+    unsigned gzip:1;
+    /* 后端的 Vary 头部已经包含 Accept-Encoding */
+    unsigned gzip_vary:1;
+
+    /* 解析 chunked 响应包体的状态 */
+    ngx_http_chunked_t chunked;
+
+    /* 响应缓存相关的状态 */
+    ngx_str_t cache_key;          /* 规范化之后的请求参数 */
+    uint32_t cache_hash;
+    ngx_uint_t cache_status;
+    time_t cache_valid;           /* 本次响应的缓存时间 */
+    time_t cache_swr;             /* stale-while-revalidate 窗口 */
+    ngx_buf_t *cache_body;        /* 边转发边复制的包体，用于写缓存 */
+    unsigned cache_update:1;      /* 本请求是后台更新缓存的子请求 */
+    unsigned cache_start_update:1;
+    unsigned cache_store:1;       /* 本次响应需要写入缓存 */
+    unsigned cache_no_store:1;
+    unsigned cache_valid_set:1;
+    unsigned cache_locked:1;      /* 持有共享内存中的合并请求锁 */
+
+    /* 请求合并的状态，没有开启 myupstream_coalesce 时为 NULL */
+    ngx_http_myupstream_coalesce_t *coalesce;
+
+    /* splice 中继的状态，没有使用 splice 转发包体时为 NULL */
+    ngx_http_myupstream_splice_t *splice;
+
+    /* 对冲状态，没有开启 myupstream_hedge 时为 NULL */
+    ngx_http_myupstream_hedge_t *hedge;
+    ngx_uint_t hedge_status;
+
+    /* 并发限制的状态，没有配置 myupstream_limit 时为 NULL */
+    ngx_http_myupstream_limit_t *limit;
+    ngx_uint_t limit_status;
+
+    /* myupstream_http2 的流，不使用 HTTP/2 时为 NULL */
+    ngx_http_myupstream_http2_stream_t *http2;
+
+    /* 微批量的状态，没有配置 myupstream_batch 时为 NULL */
+    ngx_http_myupstream_batch_member_t *batch;
+    ngx_http_myupstream_batch_t *batch_call;  /* 本请求是发送批量请求的子请求，收到的包体交给该批次 */
+    ngx_uint_t batch_size;        /* 本请求所在批次实际包含的请求数 */
+
+    /* 扇出的状态：配置了 myupstream_fanout 的请求上是整个扇出，扇出的子请求上是它对应的目标 */
+    ngx_http_myupstream_fanout_t *fanout;
+    ngx_http_myupstream_fanout_part_t *fanout_part;
+
+    /* 各阶段耗时，upstream 结束时写入 myupstream_metrics 引用的统计区 */
+    unsigned metrics:1;
+    ngx_msec_t metrics_start;     /* 开始访问后端的时间 */
+    ngx_msec_t metrics_first_byte; /* 开始连接到收到第一个字节 */
+    uint64_t metrics_header;      /* 解析响应头累计的微秒数 */
+    ngx_http_upstream_state_t *metrics_state;  /* 正在统计的那一次尝试 */
+    ngx_int_t (*metrics_process_header)(ngx_http_request_t *r);
+} ngx_http_myupstream_ctx_t;
+
+
+ngx_int_t ngx_http_myupstream_dns_init(ngx_conf_t *cf, ngx_http_myupstream_dns_t *dns);
+ngx_int_t ngx_http_myupstream_dns_lookup(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns);
+
+char *ngx_http_myupstream_happy_eyeballs(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_myupstream_eyeballs_start(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns, ngx_uint_t *index);
+ngx_connection_t *ngx_http_myupstream_eyeballs_connection(ngx_http_request_t *r);
+
+ngx_http_upstream_srv_conf_t *ngx_http_myupstream_peer_conf(ngx_conf_t *cf, ngx_http_myupstream_conf_t *mycf);
+ngx_uint_t ngx_http_myupstream_keepalive_cached(ngx_http_myupstream_keepalive_t *pool, struct sockaddr *sockaddr, socklen_t socklen);
+
+char *ngx_http_myupstream_chash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+char *ngx_http_myupstream_p2c_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_p2c(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_uint_t ngx_http_myupstream_p2c_select(ngx_shm_zone_t *zone, ngx_resolver_addr_t *addrs, ngx_uint_t naddrs, ngx_log_t *log);
+ngx_http_myupstream_p2c_node_t *ngx_http_myupstream_p2c_acquire(ngx_shm_zone_t *zone, struct sockaddr *sockaddr, socklen_t socklen);
+void ngx_http_myupstream_p2c_release(ngx_shm_zone_t *zone, ngx_http_myupstream_p2c_node_t *node, ngx_msec_t start, ngx_uint_t failed);
+
+char *ngx_http_myupstream_peers_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_peers_admin(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_myupstream_peers_check(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone);
+
+char *ngx_http_myupstream_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_cache_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_myupstream_request_key(ngx_http_request_t *r);
+ngx_int_t ngx_http_myupstream_cache_lookup(ngx_http_request_t *r);
+void ngx_http_myupstream_cache_control(ngx_http_request_t *r, ngx_str_t *value);
+void ngx_http_myupstream_cache_init_store(ngx_http_request_t *r);
+void ngx_http_myupstream_cache_capture(ngx_http_request_t *r, u_char *pos, size_t len);
+void ngx_http_myupstream_cache_finalize(ngx_http_request_t *r, ngx_int_t rc);
+ngx_int_t ngx_http_myupstream_cache_status_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_http_myupstream_cache_lock(ngx_http_request_t *r, ngx_msec_t timeout);
+void ngx_http_myupstream_cache_unlock(ngx_http_request_t *r);
+ngx_int_t ngx_http_myupstream_cache_lock_wait(ngx_http_request_t *r);
+
+ngx_int_t ngx_http_myupstream_coalesce(ngx_http_request_t *r);
+ngx_uint_t ngx_http_myupstream_coalesce_header(ngx_http_request_t *r);
+void ngx_http_myupstream_coalesce_body(ngx_http_request_t *r, u_char *pos, size_t len);
+void ngx_http_myupstream_coalesce_finalize(ngx_http_request_t *r, ngx_int_t rc);
+
+ngx_int_t ngx_http_myupstream_template_engine(ngx_conf_t *cf, ngx_http_myupstream_conf_t *conf);
+ngx_http_myupstream_template_t *ngx_http_myupstream_template_compile(ngx_conf_t *cf, ngx_http_myupstream_conf_t *conf);
+ngx_buf_t *ngx_http_myupstream_template_render(ngx_http_request_t *r, ngx_http_myupstream_template_t *t);
+
+char *ngx_http_myupstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_hedge_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_http_myupstream_hedge_stats_t *ngx_http_myupstream_hedge_init(ngx_conf_t *cf);
+void ngx_http_myupstream_hedge_start(ngx_http_request_t *r);
+void ngx_http_myupstream_hedge_header(ngx_http_request_t *r);
+void ngx_http_myupstream_hedge_finalize(ngx_http_request_t *r);
+ngx_int_t ngx_http_myupstream_hedge_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+char *ngx_http_myupstream_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_http_myupstream_limit_queue_t *ngx_http_myupstream_limit_init(ngx_conf_t *cf);
+ngx_int_t ngx_http_myupstream_limit_acquire(ngx_http_request_t *r);
+void ngx_http_myupstream_limit_release(ngx_http_request_t *r, ngx_int_t rc);
+ngx_int_t ngx_http_myupstream_limit_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+ngx_int_t ngx_http_myupstream_splice_start(ngx_http_request_t *r);
+
+ngx_http_myupstream_http2_t *ngx_http_myupstream_http2_init(ngx_conf_t *cf, ngx_http_myupstream_conf_t *conf);
+ngx_int_t ngx_http_myupstream_http2_start(ngx_http_request_t *r);
+
+char *ngx_http_myupstream_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_http_myupstream_batch_queue_t *ngx_http_myupstream_batch_init(ngx_conf_t *cf);
+ngx_int_t ngx_http_myupstream_batch_join(ngx_http_request_t *r);
+ngx_buf_t *ngx_http_myupstream_batch_render(ngx_http_request_t *r);
+void ngx_http_myupstream_batch_capture(ngx_http_request_t *r, u_char *pos, size_t len);
+ngx_int_t ngx_http_myupstream_batch_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+char *ngx_http_myupstream_fanout(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+void ngx_http_myupstream_fanout_capture(ngx_http_request_t *r, u_char *pos, size_t len);
+ngx_int_t ngx_http_myupstream_fanout_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+ngx_int_t ngx_http_myupstream_gzip_accepted(ngx_http_request_t *r);
+ngx_int_t ngx_http_myupstream_gzip_compress(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst, ngx_log_t *log);
+ngx_int_t ngx_http_myupstream_gzip_headers(ngx_http_request_t *r, ngx_uint_t encoded);
+
+char *ngx_http_myupstream_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_myupstream_metrics_export(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+void ngx_http_myupstream_metrics_start(ngx_http_request_t *r);
+void ngx_http_myupstream_metrics_record(ngx_http_request_t *r, ngx_int_t rc);
+void ngx_http_myupstream_metrics_batch(ngx_shm_zone_t *zone, ngx_uint_t size);
+void ngx_http_myupstream_metrics_batch_request(ngx_shm_zone_t *zone, ngx_uint_t result, ngx_msec_t wait);
+void ngx_http_myupstream_metrics_fanout(ngx_shm_zone_t *zone, ngx_uint_t result);
+
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+void ngx_http_myupstream_pool_record(ngx_http_request_t *r, ngx_uint_t site, size_t size);
+void ngx_http_myupstream_metrics_pool_alloc(ngx_shm_zone_t *zone, ngx_uint_t site, size_t size, ngx_uint_t large);
+void ngx_http_myupstream_metrics_pool_request(ngx_shm_zone_t *zone, ngx_uint_t allocations, size_t bytes, size_t size);
+#endif
+
+char *ngx_http_myupstream_trace_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_myupstream_trace_init(ngx_cycle_t *cycle);
+void ngx_http_myupstream_trace(ngx_http_request_t *r, ngx_uint_t event);
+
+ngx_int_t ngx_http_myupstream_handler(ngx_http_request_t *r);
+ngx_int_t ngx_http_myupstream_start(ngx_http_request_t *r);
+
+
+extern ngx_module_t  ngx_http_myupstream_module;
+
+#endif /* _NGX_HTTP_MYUPSTREAM_MODULE_H_INCLUDED_ */
@@ -0,0 +1,714 @@
+#include "ngx_http_myupstream_module.h"
+
+/* EWMA 的时间常数（毫秒）：距离上次更新越久，新样本的权重越大 */
+#define NGX_HTTP_MYUPSTREAM_P2C_DECAY           10000
+/* 每个新样本的最小权重（1/1024），请求很密集时 EWMA 也能较快地跟上 */
+#define NGX_HTTP_MYUPSTREAM_P2C_MIN_WEIGHT      64
+/* 错误率统计的窗口，请求数达到后计数减半 */
+#define NGX_HTTP_MYUPSTREAM_P2C_WINDOW          100
+/* 请求数不少于该值才判断是否需要摘除 */
+#define NGX_HTTP_MYUPSTREAM_P2C_MIN_REQUESTS    20
+/* 错误率达到该百分比时摘除 */
+#define NGX_HTTP_MYUPSTREAM_P2C_ERROR_PERCENT   50
+/* EWMA 超过可用后端中位数的倍数时摘除 */
+#define NGX_HTTP_MYUPSTREAM_P2C_SLOW_FACTOR     3
+/* EWMA 低于该值（微秒）时不按延迟摘除，避免把毫秒以下的抖动当作异常 */
+#define NGX_HTTP_MYUPSTREAM_P2C_SLOW_MIN        10000
+/* 第一次摘除的时间（毫秒），之后每次加倍，不超过上限 */
+#define NGX_HTTP_MYUPSTREAM_P2C_EJECT_TIME      10000
+#define NGX_HTTP_MYUPSTREAM_P2C_EJECT_MAX       300000
+/* 最多同时摘除的后端比例（百分比） */
+#define NGX_HTTP_MYUPSTREAM_P2C_EJECT_PERCENT   50
+/* 重新引入后逐步恢复流量的时间（毫秒），期间的代价按比例放大 */
+#define NGX_HTTP_MYUPSTREAM_P2C_RAMP            30000
+/* 刚重新引入时只按 10% 的权重参与选择 */
+#define NGX_HTTP_MYUPSTREAM_P2C_RAMP_MIN        10
+/* 一次最多参与选择的后端个数，更多的后端退化为轮询 */
+#define NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS       64
+
+/* 一个后端在共享内存中的统计，按地址查找，所有 worker 共享，读写时必须持有 shpool->mutex */
+struct ngx_http_myupstream_p2c_node_s {
+    ngx_rbtree_node_t                   node;          /* key 为地址的 crc32 */
+    ngx_sockaddr_t                      sockaddr;
+    socklen_t                           socklen;
+
+    ngx_uint_t                          inflight;      /* 所有 worker 正在进行的请求数 */
+    uint64_t                            ewma;          /* 响应时间的 EWMA，微秒，0 表示还没有样本 */
+    ngx_msec_t                          stamp;         /* 上次更新 EWMA 的时间 */
+
+    ngx_uint_t                          requests;      /* 最近的请求数和失败数，按窗口减半 */
+    ngx_uint_t                          failures;
+
+    ngx_uint_t                          ejections;     /* 连续被摘除的次数，决定下一次摘除的时间 */
+    ngx_msec_t                          ejected_until;
+    ngx_msec_t                          recover_start; /* 重新引入的时间 */
+    unsigned                            ejected:1;
+    unsigned                            recovering:1;
+};
+
+/* 共享内存中的统计表 */
+typedef struct {
+    ngx_rbtree_t                        rbtree;
+    ngx_rbtree_node_t                   sentinel;
+} ngx_http_myupstream_p2c_sh_t;
+
+/* 统计区，即 shm_zone->data */
+typedef struct {
+    ngx_http_myupstream_p2c_sh_t       *sh;
+    ngx_slab_pool_t                    *shpool;
+} ngx_http_myupstream_p2c_t;
+
+/* upstream {} 块中每个请求的负载均衡数据，rrp 必须是第一个成员，轮询算法的 free 回调会把 data 当作 rrp 使用 */
+typedef struct {
+    ngx_http_upstream_rr_peer_data_t    rrp;
+    ngx_http_request_t                 *request;
+    ngx_http_myupstream_srv_conf_t     *conf;
+    ngx_http_myupstream_p2c_node_t     *node;          /* 本次选中的后端，退化为轮询时为 NULL */
+    ngx_msec_t                          start;
+} ngx_http_myupstream_p2c_peer_data_t;
+
+static ngx_int_t ngx_http_myupstream_p2c_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_myupstream_init_p2c(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_myupstream_init_p2c_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_myupstream_get_p2c_peer(ngx_peer_connection_t *pc, void *data);
+static void ngx_http_myupstream_free_p2c_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static ngx_http_myupstream_p2c_node_t *ngx_http_myupstream_p2c_lookup(ngx_http_myupstream_p2c_t *p2c, struct sockaddr *sockaddr, socklen_t socklen);
+static ngx_uint_t ngx_http_myupstream_p2c_pick(ngx_http_myupstream_p2c_node_t **nodes, ngx_uint_t n, ngx_log_t *log);
+static void ngx_http_myupstream_p2c_eject(ngx_http_myupstream_p2c_node_t *node, ngx_msec_t now, const char *reason, ngx_log_t *log);
+static uint64_t ngx_http_myupstream_p2c_cost(ngx_http_myupstream_p2c_node_t *node, uint64_t median, ngx_msec_t now);
+
+/*
+myupstream_p2c_zone 配置项的回调函数，在 http 块中定义一块保存后端延迟和错误统计的共享内存
+格式：myupstream_p2c_zone name size;
+*/
+char *ngx_http_myupstream_p2c_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ssize_t                     size;
+    ngx_str_t                  *value;
+    ngx_shm_zone_t             *shm_zone;
+    ngx_http_myupstream_p2c_t  *p2c;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    p2c = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_p2c_t));
+    if (p2c == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size, &ngx_http_myupstream_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_myupstream_p2c_init_zone;
+    shm_zone->data = p2c;
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_p2c 配置项的回调函数。
+出现在 upstream {} 块中时把该块的负载均衡算法替换为 EWMA + power-of-two-choices，proxy_pass 和 myupstream_pass 都可以使用；
+出现在 location 中时，不使用 upstream {} 块的 myupstream 在解析出的多个地址之间按同样的算法选择
+格式：myupstream_p2c zone;
+*/
+char *ngx_http_myupstream_p2c(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t      *mycf = conf;
+    ngx_str_t                       *value;
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_http_myupstream_srv_conf_t  *myscf;
+
+    value = cf->args->elts;
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->cmd_type != NGX_HTTP_UPS_CONF) {
+        if (mycf->p2c_zone != NGX_CONF_UNSET_PTR) {
+            return "is duplicate";
+        }
+
+        mycf->p2c_zone = shm_zone;
+        return NGX_CONF_OK;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    myscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_myupstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_myupstream_init_p2c;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    myscf->p2c_zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+/* 初始化共享内存，reload 时沿用旧的统计 */
+static ngx_int_t ngx_http_myupstream_p2c_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_myupstream_p2c_t  *op2c = data;
+    ngx_http_myupstream_p2c_t  *p2c;
+
+    p2c = shm_zone->data;
+
+    if (op2c) {
+        p2c->sh = op2c->sh;
+        p2c->shpool = op2c->shpool;
+        return NGX_OK;
+    }
+
+    p2c->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        p2c->sh = p2c->shpool->data;
+        return NGX_OK;
+    }
+
+    p2c->sh = ngx_slab_alloc(p2c->shpool, sizeof(ngx_http_myupstream_p2c_sh_t));
+    if (p2c->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    p2c->shpool->data = p2c->sh;
+
+    ngx_rbtree_init(&p2c->sh->rbtree, &p2c->sh->sentinel, ngx_rbtree_insert_value);
+
+    return NGX_OK;
+}
+
+/*
+不使用 upstream {} 块时，在解析出的地址中选择本次请求使用的一个
+参数：zone - myupstream_p2c 引用的统计区
+     addrs, naddrs - 地址缓存中的地址
+     log - 日志
+返回值：选中的下标
+*/
+ngx_uint_t ngx_http_myupstream_p2c_select(ngx_shm_zone_t *zone, ngx_resolver_addr_t *addrs, ngx_uint_t naddrs, ngx_log_t *log) {
+    ngx_uint_t                       i, k;
+    ngx_http_myupstream_p2c_t       *p2c = zone->data;
+    ngx_http_myupstream_p2c_node_t  *nodes[NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS];
+
+    naddrs = ngx_min(naddrs, NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS);
+
+    ngx_shmtx_lock(&p2c->shpool->mutex);
+
+    for (i = 0; i < naddrs; i++) {
+        nodes[i] = ngx_http_myupstream_p2c_lookup(p2c, addrs[i].sockaddr, addrs[i].socklen);
+    }
+
+    k = ngx_http_myupstream_p2c_pick(nodes, naddrs, log);
+
+    ngx_shmtx_unlock(&p2c->shpool->mutex);
+
+    return k;
+}
+
+/*
+开始向一个后端发送请求，增加它的在途请求数
+返回值：该后端的统计，共享内存不够时为 NULL
+*/
+ngx_http_myupstream_p2c_node_t *ngx_http_myupstream_p2c_acquire(ngx_shm_zone_t *zone, struct sockaddr *sockaddr, socklen_t socklen) {
+    ngx_http_myupstream_p2c_t       *p2c = zone->data;
+    ngx_http_myupstream_p2c_node_t  *node;
+
+    ngx_shmtx_lock(&p2c->shpool->mutex);
+
+    node = ngx_http_myupstream_p2c_lookup(p2c, sockaddr, socklen);
+    if (node) {
+        node->inflight++;
+    }
+
+    ngx_shmtx_unlock(&p2c->shpool->mutex);
+
+    return node;
+}
+
+/*
+一次请求结束，更新后端的 EWMA 和错误计数。
+EWMA 的权重随距离上次更新的时间增加，同时不低于 1/16，这样空闲的后端很快就能反映最新的延迟，繁忙的后端也不会被一个旧的慢请求拖累太久
+参数：zone - 统计区
+     node - ngx_http_myupstream_p2c_acquire 返回的统计
+     start - 开始请求的时间
+     failed - 连接失败、超时或者后端返回了 5xx
+*/
+void ngx_http_myupstream_p2c_release(ngx_shm_zone_t *zone, ngx_http_myupstream_p2c_node_t *node, ngx_msec_t start, ngx_uint_t failed) {
+    uint64_t                    sample, weight;
+    ngx_msec_t                  now, dt;
+    ngx_http_myupstream_p2c_t  *p2c = zone->data;
+
+    now = ngx_current_msec;
+    sample = (uint64_t) (now - start) * 1000;
+
+    ngx_shmtx_lock(&p2c->shpool->mutex);
+
+    if (node->inflight) {
+        node->inflight--;
+    }
+
+    if (node->ewma == 0) {
+        node->ewma = sample ? sample : 1;
+
+    } else {
+        dt = now - node->stamp;
+        weight = (uint64_t) dt * 1024 / (dt + NGX_HTTP_MYUPSTREAM_P2C_DECAY);
+        weight = ngx_max(weight, NGX_HTTP_MYUPSTREAM_P2C_MIN_WEIGHT);
+
+        if (sample > node->ewma) {
+            node->ewma += (sample - node->ewma) * weight / 1024;
+        } else {
+            node->ewma -= (node->ewma - sample) * weight / 1024;
+        }
+
+        if (node->ewma == 0) {
+            node->ewma = 1;
+        }
+    }
+
+    node->stamp = now;
+
+    node->requests++;
+    if (failed) {
+        node->failures++;
+    }
+
+    if (node->requests >= NGX_HTTP_MYUPSTREAM_P2C_WINDOW) {
+        node->requests /= 2;
+        node->failures /= 2;
+    }
+
+    ngx_shmtx_unlock(&p2c->shpool->mutex);
+}
+
+/* 构建轮询算法的后端列表，再接管每个请求的 get/free */
+static ngx_int_t ngx_http_myupstream_init_p2c(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us) {
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_myupstream_srv_conf_t  *myscf;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_myupstream_init_p2c_peer;
+
+    myscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_myupstream_module);
+    peers = us->peer.data;
+
+    /* 每个 worker 缓存各个后端在共享内存中的统计的位置，按后端在列表中的顺序 */
+    myscf->p2c_npeers = peers->number;
+    myscf->p2c_nodes = ngx_pcalloc(cf->pool, peers->number * sizeof(ngx_http_myupstream_p2c_node_t *));
+    if (myscf->p2c_nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_myupstream_init_p2c_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us) {
+    ngx_http_myupstream_p2c_peer_data_t  *pd;
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_p2c_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &pd->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_myupstream_get_p2c_peer;
+    r->upstream->peer.free = ngx_http_myupstream_free_p2c_peer;
+
+    pd->request = r;
+    pd->conf = ngx_http_conf_upstream_srv_conf(us, ngx_http_myupstream_module);
+    pd->node = NULL;
+    pd->start = 0;
+
+    return NGX_OK;
+}
+
+/*
+在没有尝试过、没有被标记为 down、没有超出 max_fails 和 max_conns 的后端中按 power-of-two-choices 选择。
+全都不可用、只有一个后端或者后端太多时交给轮询算法，由它处理 backup
+*/
+static ngx_int_t ngx_http_myupstream_get_p2c_peer(ngx_peer_connection_t *pc, void *data) {
+    ngx_http_myupstream_p2c_peer_data_t  *pd = data;
+
+    time_t                           now;
+    uintptr_t                        m;
+    ngx_uint_t                       i, k, n, idx[NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS];
+    ngx_http_myupstream_p2c_t       *p2c;
+    ngx_http_upstream_rr_peer_t     *peer, *best, *cand[NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS];
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_myupstream_p2c_node_t  *nodes[NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS];
+
+    peers = pd->rrp.peers;
+    pd->node = NULL;
+
+    if (peers->single || peers->number > NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &pd->rrp);
+    }
+
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    n = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+        k = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (pd->rrp.tried[k] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout) {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        cand[n] = peer;
+        idx[n] = i;
+        n++;
+    }
+
+    if (n == 0) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, &pd->rrp);
+    }
+
+    p2c = pd->conf->p2c_zone->data;
+
+    ngx_shmtx_lock(&p2c->shpool->mutex);
+
+    for (i = 0; i < n; i++) {
+        if (pd->conf->p2c_nodes[idx[i]] == NULL) {
+            pd->conf->p2c_nodes[idx[i]] = ngx_http_myupstream_p2c_lookup(p2c, cand[i]->sockaddr, cand[i]->socklen);
+        }
+
+        nodes[i] = pd->conf->p2c_nodes[idx[i]];
+    }
+
+    k = ngx_http_myupstream_p2c_pick(nodes, n, pc->log);
+
+    if (nodes[k]) {
+        nodes[k]->inflight++;
+    }
+
+    ngx_shmtx_unlock(&p2c->shpool->mutex);
+
+    best = cand[k];
+
+    pd->rrp.current = best;
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pd->node = nodes[k];
+    pd->start = ngx_current_msec;
+
+    i = idx[k];
+    k = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    pd->rrp.tried[k] |= m;
+
+    return NGX_OK;
+}
+
+/* 更新本次选中的后端的统计，再交给轮询算法处理 max_fails 和连接数 */
+static void ngx_http_myupstream_free_p2c_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state) {
+    ngx_http_myupstream_p2c_peer_data_t  *pd = data;
+
+    ngx_uint_t  failed;
+
+    if (pd->node) {
+        failed = (state & NGX_PEER_FAILED)
+                 || pd->request->upstream->headers_in.status_n >= NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        ngx_http_myupstream_p2c_release(pd->conf->p2c_zone, pd->node, pd->start, failed);
+        pd->node = NULL;
+    }
+
+    ngx_http_upstream_free_round_robin_peer(pc, &pd->rrp, state);
+}
+
+/*
+按地址查找后端的统计，不存在时创建，调用者持有锁。
+统计一旦创建就不再释放，后端的个数是有限的
+返回值：统计，共享内存不够时为 NULL，这个后端按没有统计处理
+*/
+static ngx_http_myupstream_p2c_node_t *ngx_http_myupstream_p2c_lookup(ngx_http_myupstream_p2c_t *p2c, struct sockaddr *sockaddr, socklen_t socklen) {
+    uint32_t                         hash;
+    ngx_int_t                        rc;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_myupstream_p2c_node_t  *pn;
+
+    if (socklen > sizeof(ngx_sockaddr_t)) {
+        return NULL;
+    }
+
+    hash = ngx_crc32_short((u_char *) sockaddr, socklen);
+
+    node = p2c->sh->rbtree.root;
+    sentinel = p2c->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash 相同时 ngx_rbtree_insert_value 把新节点放在右边 */
+        pn = (ngx_http_myupstream_p2c_node_t *) node;
+
+        rc = ngx_memn2cmp((u_char *) sockaddr, (u_char *) &pn->sockaddr, socklen, pn->socklen);
+        if (rc == 0) {
+            return pn;
+        }
+
+        node = node->right;
+    }
+
+    pn = ngx_slab_calloc_locked(p2c->shpool, sizeof(ngx_http_myupstream_p2c_node_t));
+    if (pn == NULL) {
+        return NULL;
+    }
+
+    pn->node.key = hash;
+    ngx_memcpy(&pn->sockaddr, sockaddr, socklen);
+    pn->socklen = socklen;
+
+    ngx_rbtree_insert(&p2c->sh->rbtree, &pn->node);
+
+    return pn;
+}
+
+/*
+在 n 个候选后端中选择一个，调用者持有锁。
+先处理到期的摘除和恢复，再按错误率和延迟摘除异常的后端（最多摘除一半），
+然后在剩下的后端中随机取两个，选代价较小的。所有后端都被摘除时忽略摘除，宁可慢也不拒绝请求
+参数：nodes - 候选后端的统计，可以为 NULL
+     n - 候选后端的个数，不为 0
+     log - 日志
+返回值：选中的下标
+*/
+static ngx_uint_t ngx_http_myupstream_p2c_pick(ngx_http_myupstream_p2c_node_t **nodes, ngx_uint_t n, ngx_log_t *log) {
+    uint64_t                         median, ca, cb, lat[NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS];
+    ngx_msec_t                       now;
+    ngx_uint_t                       i, j, a, b, nlat, nejected, navail, avail[NGX_HTTP_MYUPSTREAM_P2C_MAX_PEERS];
+    ngx_http_myupstream_p2c_node_t  *node;
+
+    if (n == 1) {
+        return 0;
+    }
+
+    now = ngx_current_msec;
+    nejected = 0;
+    nlat = 0;
+
+    for (i = 0; i < n; i++) {
+        node = nodes[i];
+
+        if (node == NULL) {
+            continue;
+        }
+
+        if (node->ejected && (ngx_msec_int_t) (now - node->ejected_until) >= 0) {
+            node->ejected = 0;
+            node->recovering = 1;
+            node->recover_start = now;
+            node->requests = 0;
+            node->failures = 0;
+            node->ewma = 0;
+        }
+
+        if (node->recovering && now - node->recover_start >= NGX_HTTP_MYUPSTREAM_P2C_RAMP) {
+            node->recovering = 0;
+            node->ejections = 0;
+        }
+
+        if (node->ejected) {
+            nejected++;
+            continue;
+        }
+
+        if (node->ewma) {
+            /* 插入排序，后端的个数很少 */
+            for (j = nlat; j > 0 && lat[j - 1] > node->ewma; j--) {
+                lat[j] = lat[j - 1];
+            }
+
+            lat[j] = node->ewma;
+            nlat++;
+        }
+    }
+
+    /* 取下中位数，两个后端时就是较快的那个 */
+    median = nlat ? lat[(nlat - 1) / 2] : 0;
+
+    navail = 0;
+
+    for (i = 0; i < n; i++) {
+        node = nodes[i];
+
+        if (node == NULL) {
+            avail[navail++] = i;
+            continue;
+        }
+
+        if (node->ejected) {
+            continue;
+        }
+
+        /* 刚重新引入的后端没有样本，先按中位数估计，避免因为代价为 0 一下子涌入大量请求 */
+        if (node->ewma == 0) {
+            node->ewma = median;
+        }
+
+        if (!node->recovering && node->requests >= NGX_HTTP_MYUPSTREAM_P2C_MIN_REQUESTS
+            && (nejected + 1) * 100 <= n * NGX_HTTP_MYUPSTREAM_P2C_EJECT_PERCENT)
+        {
+            if (node->failures * 100 >= node->requests * NGX_HTTP_MYUPSTREAM_P2C_ERROR_PERCENT) {
+                ngx_http_myupstream_p2c_eject(node, now, "error rate", log);
+                nejected++;
+                continue;
+            }
+
+            if (node->ewma > NGX_HTTP_MYUPSTREAM_P2C_SLOW_MIN && node->ewma > median * NGX_HTTP_MYUPSTREAM_P2C_SLOW_FACTOR) {
+                ngx_http_myupstream_p2c_eject(node, now, "latency", log);
+                nejected++;
+                continue;
+            }
+        }
+
+        avail[navail++] = i;
+    }
+
+    if (navail == 0) {
+        for (i = 0; i < n; i++) {
+            avail[i] = i;
+        }
+
+        navail = n;
+    }
+
+    if (navail == 1) {
+        return avail[0];
+    }
+
+    a = ngx_random() % navail;
+    b = ngx_random() % (navail - 1);
+
+    if (b >= a) {
+        b++;
+    }
+
+    a = avail[a];
+    b = avail[b];
+
+    ca = ngx_http_myupstream_p2c_cost(nodes[a], median, now);
+    cb = ngx_http_myupstream_p2c_cost(nodes[b], median, now);
+
+    return (cb < ca) ? b : a;
+}
+
+/* 摘除一个后端，连续摘除的时间成倍增加 */
+static void ngx_http_myupstream_p2c_eject(ngx_http_myupstream_p2c_node_t *node, ngx_msec_t now, const char *reason, ngx_log_t *log) {
+    u_char      text[NGX_SOCKADDR_STRLEN];
+    size_t      len;
+    ngx_msec_t  time;
+
+    time = NGX_HTTP_MYUPSTREAM_P2C_EJECT_TIME << ngx_min(node->ejections, 5);
+    time = ngx_min(time, NGX_HTTP_MYUPSTREAM_P2C_EJECT_MAX);
+
+    node->ejected = 1;
+    node->recovering = 0;
+    node->ejections++;
+    node->ejected_until = now + time;
+
+    len = ngx_sock_ntop((struct sockaddr *) &node->sockaddr, node->socklen, text, NGX_SOCKADDR_STRLEN, 1);
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "myupstream: ejecting %*s for %M ms, %s: %ui/%ui failed, ewma %uLus",
+                  len, text, time, reason, node->failures, node->requests, node->ewma);
+}
+
+/*
+后端的代价：EWMA 乘以在途请求数加一，即估计的排队时间。
+正在恢复的后端按恢复的进度放大代价，从 10% 的权重逐步增加到 100%
+*/
+static uint64_t ngx_http_myupstream_p2c_cost(ngx_http_myupstream_p2c_node_t *node, uint64_t median, ngx_msec_t now) {
+    uint64_t  cost, percent;
+
+    if (node == NULL) {
+        return (median + 1);
+    }
+
+    cost = (node->ewma + 1) * (node->inflight + 1);
+
+    if (node->recovering) {
+        percent = (uint64_t) (now - node->recover_start) * 100 / NGX_HTTP_MYUPSTREAM_P2C_RAMP;
+        percent = ngx_max(percent, NGX_HTTP_MYUPSTREAM_P2C_RAMP_MIN);
+
+        cost = cost * 100 / percent;
+    }
+
+    return cost;
+}
@@ -0,0 +1,363 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 长连接池中的一项 */
+typedef struct {
+    ngx_http_myupstream_keepalive_t  *pool;
+    ngx_queue_t                       queue;
+    ngx_connection_t                 *connection;
+
+    socklen_t                         socklen;
+    ngx_sockaddr_t                    sockaddr;
+} ngx_http_myupstream_keepalive_cache_t;
+
+/* 每个请求的负载均衡数据，即 u->peer.data */
+typedef struct {
+    ngx_http_request_t               *request;
+    ngx_http_myupstream_keepalive_t  *pool;
+
+    struct sockaddr                  *sockaddr;
+    socklen_t                         socklen;
+    ngx_str_t                         name;
+
+    ngx_connection_t                 *connection; /* myupstream_happy_eyeballs 已经建立的连接，没有时为 NULL */
+
+    ngx_shm_zone_t                   *p2c_zone;   /* myupstream_p2c 的统计区，没有配置时为 NULL */
+    ngx_http_myupstream_p2c_node_t   *p2c_node;
+    ngx_msec_t                        p2c_start;
+} ngx_http_myupstream_peer_data_t;
+
+static ngx_int_t ngx_http_myupstream_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_myupstream_get_peer(ngx_peer_connection_t *pc, void *data);
+static void ngx_http_myupstream_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static void ngx_http_myupstream_keepalive_dummy_handler(ngx_event_t *ev);
+static void ngx_http_myupstream_keepalive_close_handler(ngx_event_t *ev);
+static void ngx_http_myupstream_keepalive_close(ngx_connection_t *c);
+
+/*
+为配置了 myupstream 的 location 创建一个私有的 upstream 配置块。
+upstream 机制在 u->resolved 为空时会调用 u->conf->upstream->peer.init，这样我们就能接管
+get/free 两个回调，在其中实现长连接池。
+参数：cf - 配置对象
+     mycf - 该 location 的配置
+返回值：成功 - upstream 配置块
+       失败 - NULL
+*/
+ngx_http_upstream_srv_conf_t *ngx_http_myupstream_peer_conf(ngx_conf_t *cf, ngx_http_myupstream_conf_t *mycf) {
+    ngx_uint_t                              i;
+    ngx_http_upstream_srv_conf_t           *uscf;
+    ngx_http_myupstream_keepalive_t        *pool;
+    ngx_http_myupstream_keepalive_cache_t  *cached;
+
+    uscf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_srv_conf_t));
+    if (uscf == NULL) {
+        return NULL;
+    }
+
+    uscf->host = mycf->dns->host;
+    uscf->port = mycf->dns->port;
+    uscf->file_name = cf->conf_file->file.name.data;
+    uscf->line = cf->conf_file->line;
+    uscf->peer.init = ngx_http_myupstream_init_peer;
+    uscf->peer.data = mycf;
+
+    if (mycf->keepalive == 0) {
+        return uscf;
+    }
+
+    pool = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_keepalive_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    cached = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_keepalive_cache_t) * mycf->keepalive);
+    if (cached == NULL) {
+        return NULL;
+    }
+
+    pool->max_cached = mycf->keepalive;
+    pool->timeout = mycf->keepalive_timeout;
+
+    ngx_queue_init(&pool->cache);
+    ngx_queue_init(&pool->free);
+
+    for (i = 0; i < mycf->keepalive; i++) {
+        cached[i].pool = pool;
+        ngx_queue_insert_head(&pool->free, &cached[i].queue);
+    }
+
+    mycf->keepalive_pool = pool;
+
+    return uscf;
+}
+
+/* 每个请求连接后端之前由 upstream 机制调用，初始化 u->peer */
+static ngx_int_t ngx_http_myupstream_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us) {
+    ngx_http_myupstream_conf_t       *mycf = us->peer.data;
+    ngx_http_myupstream_ctx_t        *myctx;
+    ngx_http_myupstream_peer_data_t  *pd;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    if (myctx == NULL || myctx->sockaddr == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_PEER, sizeof(ngx_http_myupstream_peer_data_t));
+
+    pd->request = r;
+    pd->pool = mycf->keepalive_pool;
+    pd->sockaddr = myctx->sockaddr;
+    pd->socklen = myctx->socklen;
+    pd->name = myctx->backendServer;
+    pd->connection = ngx_http_myupstream_eyeballs_connection(r);
+    pd->p2c_zone = mycf->p2c_zone;
+    pd->p2c_node = NULL;
+
+    r->upstream->peer.data = pd;
+    r->upstream->peer.get = ngx_http_myupstream_get_peer;
+    r->upstream->peer.free = ngx_http_myupstream_free_peer;
+    r->upstream->peer.tries = 1;
+
+    return NGX_OK;
+}
+
+/*
+选择后端。长连接池中有同一地址的空闲连接时直接复用，返回 NGX_DONE 告诉 upstream 机制不需要再建立连接。
+*/
+static ngx_int_t ngx_http_myupstream_get_peer(ngx_peer_connection_t *pc, void *data) {
+    ngx_http_myupstream_peer_data_t        *pd = data;
+    ngx_queue_t                            *q;
+    ngx_connection_t                       *c;
+    ngx_http_myupstream_keepalive_t        *pool;
+    ngx_http_myupstream_keepalive_cache_t  *item;
+
+    pc->sockaddr = pd->sockaddr;
+    pc->socklen = pd->socklen;
+    pc->name = &pd->name;
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    /* 地址已经在 ngx_http_myupstream_dns_lookup 中选好，这里只记录在途请求数 */
+    if (pd->p2c_zone) {
+        pd->p2c_node = ngx_http_myupstream_p2c_acquire(pd->p2c_zone, pc->sockaddr, pc->socklen);
+        pd->p2c_start = ngx_current_msec;
+    }
+
+    /* 地址竞速胜出的连接已经建立好，和复用长连接一样返回 NGX_DONE */
+    if (pd->connection) {
+        pc->connection = pd->connection;
+        pd->connection = NULL;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "myupstream: get peer using raced connection %p", pc->connection);
+
+        return NGX_DONE;
+    }
+
+    pool = pd->pool;
+    if (pool == NULL) {
+        return NGX_OK;
+    }
+
+    for (q = ngx_queue_head(&pool->cache); q != ngx_queue_sentinel(&pool->cache); q = ngx_queue_next(q)) {
+        item = ngx_queue_data(q, ngx_http_myupstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr, item->socklen, pc->socklen) == 0) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&pool->free, q);
+
+            c = item->connection;
+
+            c->idle = 0;
+            c->sent = 0;
+            c->data = NULL;
+            c->log = pc->log;
+            c->read->log = pc->log;
+            c->write->log = pc->log;
+            c->pool->log = pc->log;
+
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
+            pc->connection = c;
+            pc->cached = 1;
+
+            pool->hits++;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "myupstream: get keepalive peer using connection %p", c);
+
+            return NGX_DONE;
+        }
+    }
+
+    pool->misses++;
+
+    return NGX_OK;
+}
+
+/*
+长连接池中是否有到指定地址的空闲连接，地址竞速前用来判断是否可以直接复用
+*/
+ngx_uint_t ngx_http_myupstream_keepalive_cached(ngx_http_myupstream_keepalive_t *pool, struct sockaddr *sockaddr, socklen_t socklen) {
+    ngx_queue_t                            *q;
+    ngx_http_myupstream_keepalive_cache_t  *item;
+
+    for (q = ngx_queue_head(&pool->cache); q != ngx_queue_sentinel(&pool->cache); q = ngx_queue_next(q)) {
+        item = ngx_queue_data(q, ngx_http_myupstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) sockaddr, item->socklen, socklen) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+请求结束或连接失败时调用。只有响应包体按 Content-Length 或 chunked 完整读完（u->keepalive 被置位）、
+连接上没有错误时，才把连接放回长连接池，否则交给 upstream 机制关闭。
+池满时关闭最久没有使用的连接。
+*/
+static void ngx_http_myupstream_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state) {
+    ngx_http_myupstream_peer_data_t        *pd = data;
+    ngx_queue_t                            *q;
+    ngx_connection_t                       *c;
+    ngx_http_upstream_t                    *u;
+    ngx_http_myupstream_keepalive_t        *pool;
+    ngx_http_myupstream_keepalive_cache_t  *item;
+
+    pool = pd->pool;
+    u = pd->request->upstream;
+    c = pc->connection;
+
+    if (pd->p2c_node) {
+        ngx_http_myupstream_p2c_release(pd->p2c_zone, pd->p2c_node, pd->p2c_start,
+                                        (state & NGX_PEER_FAILED) || u->headers_in.status_n >= NGX_HTTP_INTERNAL_SERVER_ERROR);
+        pd->p2c_node = NULL;
+    }
+
+    if (pool == NULL
+        || state & NGX_PEER_FAILED
+        || c == NULL
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout)
+    {
+        return;
+    }
+
+    if (!u->keepalive || ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    /*
+     * 与 keepalive 模块相同：后端可能在请求包体没有发完时就给出了完整的响应（比如批量的 POST 被提前拒绝），
+     * 连接上还有没发出去的数据，再复用它会把上一个请求的包体剩余部分当成下一个请求发给后端
+     */
+    if (!u->request_body_sent || u->writer.out) {
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "myupstream: free keepalive peer, saving connection %p", c);
+
+    if (ngx_queue_empty(&pool->free)) {
+        q = ngx_queue_last(&pool->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_myupstream_keepalive_cache_t, queue);
+
+        ngx_http_myupstream_keepalive_close(item->connection);
+
+    } else {
+        q = ngx_queue_head(&pool->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_myupstream_keepalive_cache_t, queue);
+    }
+
+    ngx_queue_insert_head(&pool->cache, q);
+
+    item->connection = c;
+
+    /* 连接交给连接池后，upstream 机制就不会再关闭它 */
+    pc->connection = NULL;
+
+    c->read->delayed = 0;
+    ngx_add_timer(c->read, pool->timeout);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_http_myupstream_keepalive_dummy_handler;
+    c->read->handler = ngx_http_myupstream_keepalive_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool->log = ngx_cycle->log;
+
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    /* 后端在我们放回连接之前就已经关闭了它 */
+    if (c->read->ready) {
+        ngx_http_myupstream_keepalive_close_handler(c->read);
+    }
+}
+
+static void ngx_http_myupstream_keepalive_dummy_handler(ngx_event_t *ev) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "myupstream: keepalive dummy handler");
+}
+
+/* 空闲连接上发生了读事件：超时、后端关闭了连接或者发来了多余的数据，都直接关闭连接 */
+static void ngx_http_myupstream_keepalive_close_handler(ngx_event_t *ev) {
+    int                                     n;
+    char                                    buf[1];
+    ngx_connection_t                       *c;
+    ngx_http_myupstream_keepalive_cache_t  *item;
+
+    c = ev->data;
+
+    if (c->close || c->read->timedout) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+
+    ngx_http_myupstream_keepalive_close(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->pool->free, &item->queue);
+}
+
+static void ngx_http_myupstream_keepalive_close(ngx_connection_t *c) {
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
@@ -0,0 +1,771 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 一个后端表最多的后端数，每个请求尝试过的后端用一个 uint64_t 的位图记录 */
+#define NGX_HTTP_MYUPSTREAM_PEERS_MAX        64
+/* 权重的上限 */
+#define NGX_HTTP_MYUPSTREAM_PEERS_MAX_WEIGHT 1000
+/* 复制后端表时遇到正在写入的版本最多重试的次数，超过后继续使用旧的快照，下一个请求再读 */
+#define NGX_HTTP_MYUPSTREAM_PEERS_RETRIES    16
+
+/* 后端的状态 */
+#define NGX_HTTP_MYUPSTREAM_PEER_UP          0
+#define NGX_HTTP_MYUPSTREAM_PEER_DRAINING    1   /* 不再分配新的请求，进行中的请求和已有的长连接不受影响 */
+
+/* myupstream_peers_admin 的操作 */
+#define NGX_HTTP_MYUPSTREAM_PEERS_ADD        0
+#define NGX_HTTP_MYUPSTREAM_PEERS_REMOVE     1
+#define NGX_HTTP_MYUPSTREAM_PEERS_DRAIN      2
+#define NGX_HTTP_MYUPSTREAM_PEERS_RESUME     3
+#define NGX_HTTP_MYUPSTREAM_PEERS_WEIGHT     4
+
+/* 一个后端 */
+typedef struct {
+    ngx_sockaddr_t                      sockaddr;
+    socklen_t                           socklen;
+    ngx_uint_t                          weight;
+    ngx_uint_t                          state;         /* NGX_HTTP_MYUPSTREAM_PEER_UP 等 */
+    size_t                              name_len;
+    u_char                              name[NGX_SOCKADDR_STRLEN];
+} ngx_http_myupstream_peers_peer_t;
+
+/*
+共享内存中的后端表，所有 worker 共享。
+写者持有 shpool->mutex，修改之前把 version 加一变为奇数，改完再加一变为偶数；
+读者不加锁，复制前后读到的是同一个偶数版本，才说明复制到的是完整的表
+*/
+typedef struct {
+    volatile ngx_atomic_uint_t          version;
+    uint32_t                            seed;          /* 初始化表时 server 配置的 crc32 */
+    ngx_uint_t                          npeers;
+    ngx_http_myupstream_peers_peer_t    peer[NGX_HTTP_MYUPSTREAM_PEERS_MAX];
+} ngx_http_myupstream_peers_sh_t;
+
+/* 后端表，即 shm_zone->data */
+typedef struct {
+    ngx_http_myupstream_peers_sh_t     *sh;
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_upstream_srv_conf_t       *upstream;      /* 使用该表的 upstream {} 块，用它的 server 初始化表 */
+    uint32_t                            seed;          /* 本次配置中 server 的 crc32 */
+} ngx_http_myupstream_peers_t;
+
+/* 每个 worker 的快照，挂在 upstream {} 块的配置上，fork 之后每个 worker 各有一份，读写都不需要加锁 */
+struct ngx_http_myupstream_peers_local_s {
+    ngx_shm_zone_t                     *zone;
+    ngx_str_t                          *name;          /* upstream 的名字，没有可用的后端时作为 pc->name */
+    ngx_atomic_uint_t                   version;       /* 快照对应的版本，0 表示还没有读过 */
+    ngx_uint_t                          npeers;
+    ngx_uint_t                          nup;           /* 可以分配请求的后端数 */
+    ngx_http_myupstream_peers_peer_t   *peer;          /* 指向 buffer 中的一个，复制新版本时写另一个 */
+    ngx_http_myupstream_peers_peer_t    buffer[2][NGX_HTTP_MYUPSTREAM_PEERS_MAX];
+    ngx_int_t                           current[NGX_HTTP_MYUPSTREAM_PEERS_MAX];  /* 平滑加权轮询的当前权重 */
+};
+
+/* 每个请求的负载均衡数据，即 u->peer.data */
+typedef struct {
+    ngx_http_myupstream_peers_local_t  *local;
+    ngx_atomic_uint_t                   version;       /* tried 对应的快照版本，快照更新后下标不再有效 */
+    uint64_t                            tried;
+    ngx_sockaddr_t                      sockaddr;      /* 选中的后端复制到这里，请求进行中快照可能被替换 */
+    ngx_str_t                           name;
+    u_char                              name_data[NGX_SOCKADDR_STRLEN];
+} ngx_http_myupstream_peers_data_t;
+
+static ngx_int_t ngx_http_myupstream_peers_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_myupstream_init_peers(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_myupstream_init_peers_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_myupstream_get_peers_peer(ngx_peer_connection_t *pc, void *data);
+static void ngx_http_myupstream_free_peers_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static void ngx_http_myupstream_peers_refresh(ngx_http_myupstream_peers_local_t *local, ngx_log_t *log);
+static void ngx_http_myupstream_peers_lock(ngx_http_myupstream_peers_t *peers);
+static void ngx_http_myupstream_peers_unlock(ngx_http_myupstream_peers_t *peers);
+static void ngx_http_myupstream_peers_seed(ngx_http_myupstream_peers_t *peers, ngx_log_t *log);
+static ngx_int_t ngx_http_myupstream_peers_update(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone, ngx_str_t *action);
+static ngx_int_t ngx_http_myupstream_peers_admin_handler(ngx_http_request_t *r);
+
+static ngx_str_t ngx_http_myupstream_peers_actions[] = {
+    ngx_string("add"),
+    ngx_string("remove"),
+    ngx_string("drain"),
+    ngx_string("resume"),
+    ngx_string("weight")
+};
+
+static ngx_str_t ngx_http_myupstream_peers_states[] = {
+    ngx_string("up"),
+    ngx_string("draining")
+};
+
+/*
+myupstream_peers_zone 配置项的回调函数，在 http 块中定义一块保存后端表的共享内存
+格式：myupstream_peers_zone name size;
+*/
+char *ngx_http_myupstream_peers_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ssize_t                       size;
+    ngx_str_t                    *value;
+    ngx_shm_zone_t               *shm_zone;
+    ngx_http_myupstream_peers_t  *peers;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize + sizeof(ngx_http_myupstream_peers_sh_t))) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_peers_t));
+    if (peers == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size, &ngx_http_myupstream_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_myupstream_peers_init_zone;
+    shm_zone->data = peers;
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_peers 配置项的回调函数，出现在 upstream {} 块中，该块的后端改为从共享内存中的后端表选择，
+表由块中的 server 初始化，之后可以通过 myupstream_peers_admin 增删改，不需要 reload。
+必须写在 server 和 keepalive 之前
+格式：myupstream_peers zone;
+*/
+char *ngx_http_myupstream_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_str_t                       *value;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_http_myupstream_srv_conf_t  *myscf = conf;
+
+    if (myscf->peers_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    myscf->peers_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (myscf->peers_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_myupstream_init_peers;
+
+    /* 后端表只保存地址、权重和是否摘除，其他 server 参数没有意义 */
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    return NGX_CONF_OK;
+}
+
+/*
+myupstream_peers_admin 配置项的回调函数，该 location 查看和修改指定的后端表。
+只应在本机或内网可以访问的 location 中使用，配合 allow/deny 限制来源
+格式：myupstream_peers_admin zone;
+*/
+char *ngx_http_myupstream_peers_admin(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_conf_t *mycf = conf;
+    ngx_str_t                  *value;
+    ngx_http_core_loc_conf_t   *clcf;
+
+    value = cf->args->elts;
+
+    mycf->peers_admin_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_myupstream_module);
+    if (mycf->peers_admin_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_myupstream_peers_admin_handler;
+
+    return NGX_CONF_OK;
+}
+
+/*
+检查 myupstream_peers 和 myupstream_peers_admin 引用的共享内存是否由 myupstream_peers_zone 定义，
+同名的其他共享内存（比如 myupstream_cache_zone）的 data 是别的结构。在 http 块解析完之后调用
+返回值：NGX_OK - 是后端表
+       NGX_ERROR - 不是，已输出错误日志
+*/
+ngx_int_t ngx_http_myupstream_peers_check(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone) {
+    if (shm_zone->init != ngx_http_myupstream_peers_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown myupstream_peers_zone \"%V\"", &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+初始化共享内存。reload 时沿用旧的表，运行时的修改不会丢失；
+只有新建共享内存、或者配置中的 server 与初始化表时不同，才用配置中的 server 重新初始化
+*/
+static ngx_int_t ngx_http_myupstream_peers_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_myupstream_peers_t  *opeers = data;
+    ngx_http_myupstream_peers_t  *peers;
+
+    peers = shm_zone->data;
+
+    /* 没有 upstream {} 块使用的表无法初始化，myupstream_peers_admin 也就无从修改 */
+    if (peers->upstream == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "myupstream_peers_zone \"%V\" is not used by any upstream", &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    if (opeers) {
+        peers->sh = opeers->sh;
+        peers->shpool = opeers->shpool;
+
+    } else {
+        peers->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+        if (shm_zone->shm.exists) {
+            peers->sh = peers->shpool->data;
+
+        } else {
+            peers->sh = ngx_slab_calloc(peers->shpool, sizeof(ngx_http_myupstream_peers_sh_t));
+            if (peers->sh == NULL) {
+                return NGX_ERROR;
+            }
+
+            /* 新建的表一定用配置中的 server 初始化 */
+            peers->sh->seed = ~peers->seed;
+            peers->shpool->data = peers->sh;
+        }
+    }
+
+    if (peers->sh->seed != peers->seed) {
+        ngx_http_myupstream_peers_seed(peers, shm_zone->shm.log);
+    }
+
+    return NGX_OK;
+}
+
+/* 用 upstream {} 块中的 server 重新生成后端表，旧的 worker 可能正在读，同样按版本写入 */
+static void ngx_http_myupstream_peers_seed(ngx_http_myupstream_peers_t *peers, ngx_log_t *log) {
+    ngx_uint_t                         i, j, n;
+    ngx_http_upstream_server_t        *server;
+    ngx_http_myupstream_peers_peer_t  *peer;
+
+    ngx_http_myupstream_peers_lock(peers);
+
+    server = peers->upstream->servers->elts;
+    n = 0;
+
+    for (i = 0; i < peers->upstream->servers->nelts; i++) {
+        for (j = 0; j < server[i].naddrs && n < NGX_HTTP_MYUPSTREAM_PEERS_MAX; j++) {
+            peer = &peers->sh->peer[n++];
+
+            ngx_memcpy(&peer->sockaddr, server[i].addrs[j].sockaddr, server[i].addrs[j].socklen);
+            peer->socklen = server[i].addrs[j].socklen;
+            peer->weight = server[i].weight;
+            peer->state = server[i].down ? NGX_HTTP_MYUPSTREAM_PEER_DRAINING : NGX_HTTP_MYUPSTREAM_PEER_UP;
+            peer->name_len = ngx_min(server[i].addrs[j].name.len, NGX_SOCKADDR_STRLEN);
+            ngx_memcpy(peer->name, server[i].addrs[j].name.data, peer->name_len);
+        }
+    }
+
+    peers->sh->npeers = n;
+    peers->sh->seed = peers->seed;
+
+    ngx_http_myupstream_peers_unlock(peers);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0, "myupstream_peers: upstream \"%V\" initialized with %ui peers", &peers->upstream->host, n);
+}
+
+/* 开始修改后端表 */
+static void ngx_http_myupstream_peers_lock(ngx_http_myupstream_peers_t *peers) {
+    ngx_shmtx_lock(&peers->shpool->mutex);
+
+    /* 上一个写者在修改中途退出时版本停在奇数，不再加一 */
+    if (!(peers->sh->version & 1)) {
+        peers->sh->version++;
+    }
+
+    ngx_memory_barrier();
+}
+
+/* 修改完成，版本变为新的偶数，worker 在下一个请求时复制新的表 */
+static void ngx_http_myupstream_peers_unlock(ngx_http_myupstream_peers_t *peers) {
+    ngx_memory_barrier();
+
+    peers->sh->version++;
+
+    ngx_shmtx_unlock(&peers->shpool->mutex);
+}
+
+/* 检查 server 配置并计算它们的 crc32，接管每个请求的 init/get/free */
+static ngx_int_t ngx_http_myupstream_init_peers(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us) {
+    uint32_t                            crc;
+    ngx_uint_t                          i, j, n;
+    ngx_http_upstream_server_t         *server;
+    ngx_http_myupstream_peers_t        *peers;
+    ngx_http_myupstream_srv_conf_t     *myscf;
+    ngx_http_myupstream_peers_local_t  *local;
+
+    myscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_myupstream_module);
+    if (ngx_http_myupstream_peers_check(cf, myscf->peers_zone) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    peers = myscf->peers_zone->data;
+
+    if (peers->upstream) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "myupstream_peers_zone \"%V\" is already used by upstream \"%V\"", &myscf->peers_zone->shm.name, &peers->upstream->host);
+        return NGX_ERROR;
+    }
+
+    ngx_crc32_init(crc);
+    n = 0;
+
+    server = us->servers ? us->servers->elts : NULL;
+
+    for (i = 0; server && i < us->servers->nelts; i++) {
+        if (server[i].backup) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "backup servers are not supported by myupstream_peers in upstream \"%V\"", &us->host);
+            return NGX_ERROR;
+        }
+
+        for (j = 0; j < server[i].naddrs; j++) {
+            ngx_crc32_update(&crc, (u_char *) server[i].addrs[j].sockaddr, server[i].addrs[j].socklen);
+            ngx_crc32_update(&crc, (u_char *) &server[i].weight, sizeof(ngx_uint_t));
+            ngx_crc32_update(&crc, (u_char *) (server[i].down ? "d" : "u"), 1);
+            n++;
+        }
+    }
+
+    ngx_crc32_final(crc);
+
+    if (n > NGX_HTTP_MYUPSTREAM_PEERS_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too many servers in upstream \"%V\", at most %d are supported by myupstream_peers", &us->host, NGX_HTTP_MYUPSTREAM_PEERS_MAX);
+        return NGX_ERROR;
+    }
+
+    /* 没有 server 时 upstream 模块不会给 servers 分配数组，生成表时统一按空数组处理 */
+    if (us->servers == NULL) {
+        us->servers = ngx_array_create(cf->pool, 1, sizeof(ngx_http_upstream_server_t));
+        if (us->servers == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    peers->upstream = us;
+    peers->seed = crc;
+
+    local = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_peers_local_t));
+    if (local == NULL) {
+        return NGX_ERROR;
+    }
+
+    local->zone = myscf->peers_zone;
+    local->name = &us->host;
+    local->peer = local->buffer[0];
+
+    myscf->peers = local;
+
+    us->peer.init = ngx_http_myupstream_init_peers_peer;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_myupstream_init_peers_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us) {
+    ngx_http_myupstream_srv_conf_t     *myscf;
+    ngx_http_myupstream_peers_data_t   *pd;
+    ngx_http_myupstream_peers_local_t  *local;
+
+    myscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_myupstream_module);
+    local = myscf->peers;
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_peers_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_PEER, sizeof(ngx_http_myupstream_peers_data_t));
+
+    ngx_http_myupstream_peers_refresh(local, r->connection->log);
+
+    pd->local = local;
+    pd->version = local->version;
+    pd->tried = 0;
+
+    r->upstream->peer.data = pd;
+    r->upstream->peer.get = ngx_http_myupstream_get_peers_peer;
+    r->upstream->peer.free = ngx_http_myupstream_free_peers_peer;
+    r->upstream->peer.tries = ngx_max(local->nup, 1);
+
+    return NGX_OK;
+}
+
+/*
+在本 worker 的快照中按平滑加权轮询选择一个没有尝试过、没有在摘除中的后端。
+每次选择之前比较一次版本，没有变化时不访问共享内存中的表，也不加锁
+*/
+static ngx_int_t ngx_http_myupstream_get_peers_peer(ngx_peer_connection_t *pc, void *data) {
+    ngx_http_myupstream_peers_data_t  *pd = data;
+
+    ngx_int_t                           total;
+    ngx_uint_t                          i, best;
+    ngx_http_myupstream_peers_peer_t   *peer;
+    ngx_http_myupstream_peers_local_t  *local;
+
+    local = pd->local;
+
+    ngx_http_myupstream_peers_refresh(local, pc->log);
+
+    if (pd->version != local->version) {
+        pd->version = local->version;
+        pd->tried = 0;
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    total = 0;
+    best = local->npeers;
+
+    for (i = 0; i < local->npeers; i++) {
+        peer = &local->peer[i];
+
+        if (peer->state != NGX_HTTP_MYUPSTREAM_PEER_UP || (pd->tried & ((uint64_t) 1 << i))) {
+            continue;
+        }
+
+        local->current[i] += peer->weight;
+        total += peer->weight;
+
+        if (best == local->npeers || local->current[i] > local->current[best]) {
+            best = i;
+        }
+    }
+
+    if (best == local->npeers) {
+        pc->name = local->name;
+        return NGX_BUSY;
+    }
+
+    local->current[best] -= total;
+    pd->tried |= (uint64_t) 1 << best;
+
+    peer = &local->peer[best];
+
+    ngx_memcpy(&pd->sockaddr, &peer->sockaddr, peer->socklen);
+    ngx_memcpy(pd->name_data, peer->name, peer->name_len);
+    pd->name.len = peer->name_len;
+    pd->name.data = pd->name_data;
+
+    pc->sockaddr = &pd->sockaddr.sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &pd->name;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0, "myupstream_peers: get peer %V, version %uA", pc->name, local->version);
+
+    return NGX_OK;
+}
+
+static void ngx_http_myupstream_free_peers_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state) {
+    if (pc->tries) {
+        pc->tries--;
+    }
+}
+
+/*
+共享内存中的表的版本变化时复制一份新的快照。复制到不在使用的那一份缓冲区，
+复制前后版本相同才切换过去，否则重试；写者长时间没有完成时继续使用旧的快照
+*/
+static void ngx_http_myupstream_peers_refresh(ngx_http_myupstream_peers_local_t *local, ngx_log_t *log) {
+    ngx_uint_t                          i, n, retries;
+    ngx_atomic_uint_t                   version;
+    ngx_http_myupstream_peers_t        *peers = local->zone->data;
+    ngx_http_myupstream_peers_sh_t     *sh = peers->sh;
+    ngx_http_myupstream_peers_peer_t   *buffer;
+
+    version = sh->version;
+
+    if (version == local->version) {
+        return;
+    }
+
+    buffer = (local->peer == local->buffer[0]) ? local->buffer[1] : local->buffer[0];
+
+    for (retries = 0; retries < NGX_HTTP_MYUPSTREAM_PEERS_RETRIES; retries++) {
+
+        if (version & 1) {
+            ngx_cpu_pause();
+            version = sh->version;
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        n = ngx_min(sh->npeers, NGX_HTTP_MYUPSTREAM_PEERS_MAX);
+        ngx_memcpy(buffer, (void *) sh->peer, n * sizeof(ngx_http_myupstream_peers_peer_t));
+
+        ngx_memory_barrier();
+
+        if (sh->version != version) {
+            version = sh->version;
+            continue;
+        }
+
+        local->peer = buffer;
+        local->npeers = n;
+        local->version = version;
+        local->nup = 0;
+
+        for (i = 0; i < n; i++) {
+            local->current[i] = 0;
+
+            if (buffer[i].state == NGX_HTTP_MYUPSTREAM_PEER_UP) {
+                local->nup++;
+            }
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0, "myupstream_peers: upstream \"%V\" switched to version %uA, %ui peers", local->name, version, n);
+
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, log, 0, "myupstream_peers: upstream \"%V\" is being updated, using version %uA", local->name, local->version);
+}
+
+/*
+输出后端表，带 action 参数时先修改再输出。修改必须使用 POST：
+    POST ?action=add&server=127.0.0.1:81&weight=2
+    POST ?action=remove|drain|resume&server=127.0.0.1:81
+    POST ?action=weight&server=127.0.0.1:81&weight=3
+*/
+static ngx_int_t ngx_http_myupstream_peers_admin_handler(ngx_http_request_t *r) {
+    size_t                           len;
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_str_t                        action;
+    ngx_uint_t                       i;
+    ngx_chain_t                      out;
+    ngx_http_myupstream_conf_t      *mycf;
+    ngx_http_myupstream_peers_t     *peers;
+    ngx_http_myupstream_peers_sh_t  *sh;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+    peers = mycf->peers_admin_zone->data;
+
+    if (ngx_http_arg(r, (u_char *) "action", sizeof("action") - 1, &action) == NGX_OK) {
+        if (r->method != NGX_HTTP_POST) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        rc = ngx_http_myupstream_peers_update(r, mycf->peers_admin_zone, &action);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+    } else if (r->method == NGX_HTTP_POST) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    sh = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_peers_sh_t));
+    if (sh == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* 在锁内复制一份表，输出时不再持有锁 */
+    ngx_shmtx_lock(&peers->shpool->mutex);
+    ngx_memcpy(sh, (void *) peers->sh, sizeof(ngx_http_myupstream_peers_sh_t));
+    ngx_shmtx_unlock(&peers->shpool->mutex);
+
+    len = sizeof("zone: \n") + mycf->peers_admin_zone->shm.name.len
+          + sizeof("version: \n") + NGX_ATOMIC_T_LEN
+          + sizeof("peers: \n") + NGX_INT_T_LEN
+          + sh->npeers * (NGX_SOCKADDR_STRLEN + sizeof(" weight= draining\n") + NGX_INT_T_LEN);
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "zone: %V\n", &mycf->peers_admin_zone->shm.name);
+    b->last = ngx_sprintf(b->last, "version: %uA\n", sh->version);
+    b->last = ngx_sprintf(b->last, "peers: %ui\n", sh->npeers);
+
+    for (i = 0; i < sh->npeers; i++) {
+        b->last = ngx_sprintf(b->last, "%*s weight=%ui %V\n", sh->peer[i].name_len, sh->peer[i].name, sh->peer[i].weight,
+                              &ngx_http_myupstream_peers_states[sh->peer[i].state]);
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/*
+按请求参数修改后端表。地址必须是 IP:端口，不做域名解析
+返回值：NGX_OK - 修改成功
+       NGX_HTTP_BAD_REQUEST - 参数错误
+       NGX_HTTP_NOT_FOUND - 要修改的后端不在表中
+       NGX_HTTP_CONFLICT - 要添加的后端已经在表中
+       NGX_HTTP_INSUFFICIENT_STORAGE - 表已满
+*/
+static ngx_int_t ngx_http_myupstream_peers_update(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone, ngx_str_t *action) {
+    u_char                            *dst, *src;
+    ngx_int_t                          weight, rc;
+    ngx_str_t                          arg, server;
+    ngx_uint_t                         i, op;
+    ngx_addr_t                         addr;
+    ngx_http_myupstream_peers_t       *peers;
+    ngx_http_myupstream_peers_sh_t    *sh;
+    ngx_http_myupstream_peers_peer_t  *peer;
+
+    peers = shm_zone->data;
+
+    for (op = 0; op < sizeof(ngx_http_myupstream_peers_actions) / sizeof(ngx_str_t); op++) {
+        if (action->len == ngx_http_myupstream_peers_actions[op].len
+            && ngx_strncmp(action->data, ngx_http_myupstream_peers_actions[op].data, action->len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (op == sizeof(ngx_http_myupstream_peers_actions) / sizeof(ngx_str_t)) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "server", sizeof("server") - 1, &arg) != NGX_OK || arg.len == 0) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    /* IPv6 地址的方括号可能被转义 */
+    server.data = ngx_pnalloc(r->pool, arg.len);
+    if (server.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    dst = server.data;
+    src = arg.data;
+    ngx_unescape_uri(&dst, &src, arg.len, 0);
+    server.len = dst - server.data;
+
+    if (ngx_parse_addr_port(r->pool, &addr, server.data, server.len) != NGX_OK || ngx_inet_get_port(addr.sockaddr) == 0) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "myupstream_peers: invalid server \"%V\"", &server);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    weight = 0;
+
+    if (ngx_http_arg(r, (u_char *) "weight", sizeof("weight") - 1, &arg) == NGX_OK) {
+        weight = ngx_atoi(arg.data, arg.len);
+
+        if (weight < 1 || weight > NGX_HTTP_MYUPSTREAM_PEERS_MAX_WEIGHT) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+    } else if (op == NGX_HTTP_MYUPSTREAM_PEERS_WEIGHT) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_http_myupstream_peers_lock(peers);
+
+    sh = peers->sh;
+
+    for (i = 0; i < sh->npeers; i++) {
+        if (ngx_cmp_sockaddr((struct sockaddr *) &sh->peer[i].sockaddr, sh->peer[i].socklen, addr.sockaddr, addr.socklen, 1) == NGX_OK) {
+            break;
+        }
+    }
+
+    rc = NGX_OK;
+
+    if (op == NGX_HTTP_MYUPSTREAM_PEERS_ADD) {
+        if (i < sh->npeers) {
+            rc = NGX_HTTP_CONFLICT;
+
+        } else if (sh->npeers == NGX_HTTP_MYUPSTREAM_PEERS_MAX) {
+            rc = NGX_HTTP_INSUFFICIENT_STORAGE;
+
+        } else {
+            peer = &sh->peer[sh->npeers];
+
+            ngx_memcpy(&peer->sockaddr, addr.sockaddr, addr.socklen);
+            peer->socklen = addr.socklen;
+            peer->weight = weight ? (ngx_uint_t) weight : 1;
+            peer->state = NGX_HTTP_MYUPSTREAM_PEER_UP;
+            peer->name_len = ngx_sock_ntop(addr.sockaddr, addr.socklen, peer->name, NGX_SOCKADDR_STRLEN, 1);
+
+            sh->npeers++;
+        }
+
+    } else if (i == sh->npeers) {
+        rc = NGX_HTTP_NOT_FOUND;
+
+    } else {
+        switch (op) {
+
+        case NGX_HTTP_MYUPSTREAM_PEERS_REMOVE:
+            /* 保持其余后端的顺序，平滑加权轮询的结果不会因为删除一个后端而整体错位 */
+            ngx_memmove(&sh->peer[i], &sh->peer[i + 1], (sh->npeers - i - 1) * sizeof(ngx_http_myupstream_peers_peer_t));
+            sh->npeers--;
+            break;
+
+        case NGX_HTTP_MYUPSTREAM_PEERS_DRAIN:
+            sh->peer[i].state = NGX_HTTP_MYUPSTREAM_PEER_DRAINING;
+            break;
+
+        case NGX_HTTP_MYUPSTREAM_PEERS_RESUME:
+            sh->peer[i].state = NGX_HTTP_MYUPSTREAM_PEER_UP;
+            break;
+
+        default: /* NGX_HTTP_MYUPSTREAM_PEERS_WEIGHT */
+            sh->peer[i].weight = weight;
+            break;
+        }
+    }
+
+    ngx_http_myupstream_peers_unlock(peers);
+
+    if (rc == NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "myupstream_peers: %V %V in zone \"%V\"", action, &server, &shm_zone->shm.name);
+    }
+
+    return rc;
+}
@@ -0,0 +1,104 @@
+#include "ngx_http_myupstream_module.h"
+
+/*
+请求内存池的分配统计。只在编译时设置了 MYUPSTREAM_POOL_PROFILE=YES 时编译，
+运行时只统计配置了 myupstream_metrics 的 location 中的请求
+*/
+#if (NGX_HTTP_MYUPSTREAM_POOL_PROFILE)
+
+/* 一个请求内存池的累计分配，挂在内存池的清理函数上，子请求与主请求共用一份 */
+typedef struct {
+    ngx_pool_t                  *pool;
+    ngx_shm_zone_t              *zone;         /* 第一次记录分配的 location 的统计区 */
+    ngx_uint_t                   allocations;
+    size_t                       bytes;
+    size_t                       large;        /* 超过 pool->max，由 malloc 单独分配的字节数 */
+} ngx_http_myupstream_pool_profile_t;
+
+static ngx_http_myupstream_pool_profile_t *ngx_http_myupstream_pool_get(ngx_http_request_t *r, ngx_shm_zone_t *zone);
+static void ngx_http_myupstream_pool_cleanup(void *data);
+
+/*
+在一个调用点从请求内存池分配之后调用，按调用点累计次数和字节数，按请求累计总量。
+统计用的结构本身不计入
+参数：r - 请求
+     site - NGX_HTTP_MYUPSTREAM_POOL_CTX 等
+     size - 分配的字节数
+*/
+void ngx_http_myupstream_pool_record(ngx_http_request_t *r, ngx_uint_t site, size_t size) {
+    ngx_uint_t                           large;
+    ngx_http_myupstream_conf_t          *mycf;
+    ngx_http_myupstream_pool_profile_t  *prof;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    if (mycf->metrics_zone == NULL) {
+        return;
+    }
+
+    prof = ngx_http_myupstream_pool_get(r, mycf->metrics_zone);
+    if (prof == NULL) {
+        return;
+    }
+
+    large = (size > r->pool->max);
+
+    prof->allocations++;
+    prof->bytes += size;
+
+    if (large) {
+        prof->large += size;
+    }
+
+    ngx_http_myupstream_metrics_pool_alloc(prof->zone, site, size, large);
+}
+
+/* 找到本请求内存池的统计结构，第一次分配时创建 */
+static ngx_http_myupstream_pool_profile_t *ngx_http_myupstream_pool_get(ngx_http_request_t *r, ngx_shm_zone_t *zone) {
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_myupstream_pool_profile_t  *prof;
+
+    /* 一个请求的清理函数只有几个，顺序查找比在上下文中保存指针更通用：mymodule 的请求没有本模块的上下文 */
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_myupstream_pool_cleanup) {
+            return cln->data;
+        }
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_myupstream_pool_profile_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    prof = cln->data;
+    ngx_memzero(prof, sizeof(ngx_http_myupstream_pool_profile_t));
+
+    prof->pool = r->pool;
+    prof->zone = zone;
+
+    cln->handler = ngx_http_myupstream_pool_cleanup;
+
+    return prof;
+}
+
+/*
+内存池销毁时调用，此时内存池还没有释放。内存池只增不减，这时的大小就是请求处理过程中的峰值：
+所有小块内存块的大小（每块都是 request_pool_size）加上单独分配的大块内存
+*/
+static void ngx_http_myupstream_pool_cleanup(void *data) {
+    size_t                               size;
+    ngx_pool_t                          *p;
+    ngx_http_myupstream_pool_profile_t  *prof = data;
+
+    size = 0;
+
+    for (p = prof->pool; p; p = p->d.next) {
+        size += p->d.end - (u_char *) p;
+    }
+
+    size += prof->large;
+
+    ngx_http_myupstream_metrics_pool_request(prof->zone, prof->allocations, prof->bytes, size);
+}
+
+#endif
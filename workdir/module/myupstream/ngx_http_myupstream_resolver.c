@@ -0,0 +1,388 @@
+#include "ngx_http_myupstream_module.h"
+
+static ngx_int_t ngx_http_myupstream_dns_update(ngx_http_myupstream_dns_t *dns, ngx_resolver_addr_t *addrs, ngx_uint_t naddrs, time_t valid, ngx_log_t *log);
+static ngx_int_t ngx_http_myupstream_dns_set_peer(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns);
+static ngx_int_t ngx_http_myupstream_dns_peer(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns);
+static void ngx_http_myupstream_dns_refresh(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns);
+static void ngx_http_myupstream_dns_refresh_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_myupstream_dns_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_myupstream_dns_cleanup(void *data);
+
+/*
+在配置合并阶段初始化地址缓存。
+如果该 location 配置了 resolver，则什么也不做，留到运行时由 ngx_resolver 异步解析；
+否则与 proxy_pass 一样在启动时解析一次，之后一直使用这份结果，请求处理过程中不会再阻塞在域名解析上。
+参数：cf - 配置对象
+     dns - 待初始化的地址缓存
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+ngx_int_t ngx_http_myupstream_dns_init(ngx_conf_t *cf, ngx_http_myupstream_dns_t *dns) {
+    ngx_uint_t                 i;
+    ngx_url_t                  u;
+    ngx_resolver_addr_t       *addrs;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (clcf->resolver && clcf->resolver->connections.nelts) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+    u.url = dns->host;
+    u.default_port = dns->port;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        /* 启动时解析失败不阻止启动，运行时该 location 会返回 502 */
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "myupstream: %s in \"%V\" and no resolver defined", u.err ? u.err : "invalid url", &dns->host);
+        return NGX_OK;
+    }
+
+    addrs = ngx_pcalloc(cf->temp_pool, u.naddrs * sizeof(ngx_resolver_addr_t));
+    if (addrs == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        addrs[i].sockaddr = u.addrs[i].sockaddr;
+        addrs[i].socklen = u.addrs[i].socklen;
+    }
+
+    /* valid 为 0 表示永不过期 */
+    return ngx_http_myupstream_dns_update(dns, addrs, u.naddrs, 0, cf->log);
+}
+
+/*
+为请求查找后端地址，请求处理过程中永远不会调用阻塞的 gethostbyname。
+缓存中有地址时直接使用（即使已过期也先用旧地址，同时在后台发起一次刷新）；
+缓存为空时发起异步解析，解析完成后在回调中启动 upstream。
+参数：r - 请求，r->upstream 和 myupstream 上下文必须已经创建
+     dns - 地址缓存
+返回值：NGX_OK - 已将地址复制到请求上下文中，调用者需自行启动 upstream
+       NGX_DONE - 已发起异步解析或者地址竞速，并增加了请求引用计数，调用者直接返回 NGX_DONE 即可
+       其他 - HTTP 错误码或 NGX_ERROR
+*/
+ngx_int_t ngx_http_myupstream_dns_lookup(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns) {
+    ngx_resolver_ctx_t         *ctx, temp;
+    ngx_http_cleanup_t         *cln;
+    ngx_http_core_loc_conf_t   *clcf;
+    ngx_http_myupstream_ctx_t  *myctx;
+
+    if (dns->naddrs) {
+        if (dns->expire && dns->expire <= ngx_time() && !dns->resolving) {
+            ngx_http_myupstream_dns_refresh(r, dns);
+        }
+
+        return ngx_http_myupstream_dns_peer(r, dns);
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    temp.name = dns->host;
+
+    ctx = ngx_resolve_start(clcf->resolver, &temp);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no resolver defined to resolve %V", &dns->host);
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    /* 主机名本身就是 IP 地址，不需要解析 */
+    if (ctx == &temp) {
+        if (ngx_http_myupstream_dns_update(dns, temp.addrs, temp.naddrs, 0, r->connection->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return ngx_http_myupstream_dns_peer(r, dns);
+    }
+
+    /* 请求提前结束时需要取消解析，否则回调中会访问已经释放的请求 */
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        ngx_resolve_name_done(ctx);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_myupstream_dns_cleanup;
+    cln->data = r;
+
+    ctx->name = dns->host;
+    ctx->handler = ngx_http_myupstream_dns_handler;
+    ctx->data = r;
+    ctx->timeout = clcf->resolver_timeout;
+
+    myctx->resolve = ctx;
+    myctx->dns_start = ngx_current_msec;
+
+    /* 回调可能在 ngx_resolve_name 内部被同步调用，所以必须先增加引用计数 */
+    r->main->count++;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        myctx->resolve = NULL;
+        r->main->count--;
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_DONE;
+}
+
+/* 缓存为空时，请求发起的异步解析完成后的回调 */
+static void ngx_http_myupstream_dns_handler(ngx_resolver_ctx_t *ctx) {
+    ngx_int_t                    rc;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_myupstream_ctx_t   *myctx;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    r = ctx->data;
+    c = r->connection;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    myctx->resolve = NULL;
+    myctx->dns_time = ngx_current_msec - myctx->dns_start;
+    myctx->dns_resolved = 1;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "%V could not be resolved (%i: %s)", &ctx->name, ctx->state, ngx_resolver_strerror(ctx->state));
+
+        ngx_resolve_name_done(ctx);
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        goto done;
+    }
+
+    rc = ngx_http_myupstream_dns_update(mycf->dns, ctx->addrs, ctx->naddrs, ctx->valid, c->log);
+
+    ngx_resolve_name_done(ctx);
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_myupstream_dns_set_peer(r, mycf->dns);
+    }
+
+    /* 正在地址竞速，解析时增加的引用计数留给竞速，连上后由它启动 upstream */
+    if (rc == NGX_DONE) {
+        goto done;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_http_finalize_request(r, rc == NGX_ERROR ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc);
+        goto done;
+    }
+
+    ngx_http_upstream_init(r);
+
+done:
+
+    ngx_http_run_posted_requests(c);
+}
+
+/* 缓存命中时选择地址，开始地址竞速时增加请求的引用计数，竞速结束时启动 upstream 或者结束请求 */
+static ngx_int_t ngx_http_myupstream_dns_peer(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns) {
+    ngx_int_t  rc;
+
+    rc = ngx_http_myupstream_dns_set_peer(r, dns);
+
+    if (rc == NGX_DONE) {
+        r->main->count++;
+    }
+
+    return rc;
+}
+
+/* 请求被销毁时取消尚未完成的解析 */
+static void ngx_http_myupstream_dns_cleanup(void *data) {
+    ngx_http_request_t *r = data;
+    ngx_http_myupstream_ctx_t *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (myctx && myctx->resolve) {
+        ngx_resolve_name_done(myctx->resolve);
+        myctx->resolve = NULL;
+    }
+}
+
+/* 缓存过期后在后台刷新，刷新期间请求继续使用旧地址 */
+static void ngx_http_myupstream_dns_refresh(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns) {
+    ngx_resolver_ctx_t        *ctx;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ctx = ngx_resolve_start(clcf->resolver, NULL);
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        dns->expire = ngx_time() + NGX_HTTP_MYUPSTREAM_DNS_RETRY;
+        return;
+    }
+
+    ctx->name = dns->host;
+    ctx->handler = ngx_http_myupstream_dns_refresh_handler;
+    ctx->data = dns;
+    ctx->timeout = clcf->resolver_timeout;
+
+    dns->resolving = 1;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        dns->resolving = 0;
+        dns->expire = ngx_time() + NGX_HTTP_MYUPSTREAM_DNS_RETRY;
+    }
+}
+
+/* 后台刷新完成的回调，不关联任何请求 */
+static void ngx_http_myupstream_dns_refresh_handler(ngx_resolver_ctx_t *ctx) {
+    ngx_http_myupstream_dns_t *dns = ctx->data;
+
+    dns->resolving = 0;
+
+    if (ctx->state) {
+        /* 解析失败时保留旧地址，稍后再试 */
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "%V could not be resolved (%i: %s), keep using cached addresses", &ctx->name, ctx->state, ngx_resolver_strerror(ctx->state));
+        dns->expire = ngx_time() + NGX_HTTP_MYUPSTREAM_DNS_RETRY;
+
+    } else if (ngx_http_myupstream_dns_update(dns, ctx->addrs, ctx->naddrs, ctx->valid, ngx_cycle->log) != NGX_OK) {
+        dns->expire = ngx_time() + NGX_HTTP_MYUPSTREAM_DNS_RETRY;
+    }
+
+    ngx_resolve_name_done(ctx);
+}
+
+/*
+用新的解析结果替换缓存。地址、连接记录、地址的字符串形式都放在同一块内存里，整体分配、整体释放。
+参数：dns - 地址缓存
+     addrs, naddrs - 解析结果，端口会被替换为 dns->port
+     valid - 解析结果的有效期（绝对时间，来自 DNS 应答的 TTL），0 表示永不过期
+     log - 日志对象
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t ngx_http_myupstream_dns_update(ngx_http_myupstream_dns_t *dns, ngx_resolver_addr_t *addrs, ngx_uint_t naddrs, time_t valid, ngx_log_t *log) {
+    size_t                           len;
+    u_char                          *p;
+    ngx_uint_t                       i, j;
+    ngx_resolver_addr_t             *cached;
+    ngx_http_myupstream_dns_stat_t  *stats;
+
+    if (naddrs == 0) {
+        return NGX_ERROR;
+    }
+
+    len = naddrs * (sizeof(ngx_resolver_addr_t) + sizeof(ngx_http_myupstream_dns_stat_t));
+
+    for (i = 0; i < naddrs; i++) {
+        len += ngx_align(addrs[i].socklen, sizeof(void *)) + NGX_SOCKADDR_STRLEN;
+    }
+
+    cached = ngx_alloc(len, log);
+    if (cached == NULL) {
+        return NGX_ERROR;
+    }
+
+    stats = (ngx_http_myupstream_dns_stat_t *) &cached[naddrs];
+    p = (u_char *) &stats[naddrs];
+
+    for (i = 0; i < naddrs; i++) {
+        ngx_memzero(&cached[i], sizeof(ngx_resolver_addr_t));
+        ngx_memzero(&stats[i], sizeof(ngx_http_myupstream_dns_stat_t));
+
+        cached[i].sockaddr = (struct sockaddr *) p;
+        cached[i].socklen = addrs[i].socklen;
+        ngx_memcpy(p, addrs[i].sockaddr, addrs[i].socklen);
+        ngx_inet_set_port(cached[i].sockaddr, dns->port);
+        p += ngx_align(addrs[i].socklen, sizeof(void *));
+
+        cached[i].name.data = p;
+        cached[i].name.len = ngx_sock_ntop(cached[i].sockaddr, cached[i].socklen, p, NGX_SOCKADDR_STRLEN, 1);
+        p += NGX_SOCKADDR_STRLEN;
+
+        /* 刷新前后都存在的地址保留连接耗时和失败的记录 */
+        for (j = 0; j < dns->naddrs; j++) {
+            if (ngx_cmp_sockaddr(dns->addrs[j].sockaddr, dns->addrs[j].socklen, cached[i].sockaddr, cached[i].socklen, 1) == NGX_OK) {
+                stats[i] = dns->stats[j];
+                break;
+            }
+        }
+    }
+
+    if (dns->addrs) {
+        ngx_free(dns->addrs);
+    }
+
+    dns->addrs = cached;
+    dns->naddrs = naddrs;
+    dns->stats = stats;
+
+    if (valid == 0) {
+        dns->expire = 0;
+
+    } else {
+        dns->expire = ngx_max(valid, ngx_time() + 1);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0, "myupstream: %V resolved to %ui addresses, expire %T", &dns->host, naddrs, dns->expire);
+
+    return NGX_OK;
+}
+
+/*
+选择本次请求使用的地址，复制一份到请求自己的内存池中，之后缓存被刷新、旧地址被释放也不会影响该请求。
+解析出多个地址并开启了 myupstream_happy_eyeballs 时交给地址竞速，由先连上的地址决定
+参数：r - 请求
+     dns - 地址缓存
+返回值：成功 - NGX_OK
+       正在地址竞速 - NGX_DONE，调用者需要增加请求的引用计数
+       失败 - NGX_ERROR 或 HTTP 错误码
+*/
+static ngx_int_t ngx_http_myupstream_dns_set_peer(ngx_http_request_t *r, ngx_http_myupstream_dns_t *dns) {
+    u_char                      *p;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_resolver_addr_t         *addr;
+    ngx_http_myupstream_ctx_t   *myctx;
+    ngx_http_myupstream_conf_t  *mycf;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    /*
+    解析出多个地址时，开启了 myupstream_happy_eyeballs 就错开连接各个地址；
+    否则配置了 myupstream_p2c 就按延迟和在途请求数选择，再否则总是使用第一个
+    */
+    i = 0;
+
+    if (mycf->eyeballs_delay && dns->naddrs > 1) {
+        rc = ngx_http_myupstream_eyeballs_start(r, dns, &i);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+
+    } else if (mycf->p2c_zone && dns->naddrs > 1) {
+        i = ngx_http_myupstream_p2c_select(mycf->p2c_zone, dns->addrs, dns->naddrs, r->connection->log);
+    }
+
+    addr = &dns->addrs[i];
+
+    p = ngx_palloc(r->pool, ngx_align(addr->socklen, sizeof(void *)) + addr->name.len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_ADDR, ngx_align(addr->socklen, sizeof(void *)) + addr->name.len);
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    myctx->sockaddr = (struct sockaddr *) p;
+    myctx->socklen = addr->socklen;
+    ngx_memcpy(p, addr->sockaddr, addr->socklen);
+    p += ngx_align(addr->socklen, sizeof(void *));
+
+    myctx->backendServer.data = p;
+    myctx->backendServer.len = addr->name.len;
+    ngx_memcpy(p, addr->name.data, addr->name.len);
+
+    return NGX_OK;
+}
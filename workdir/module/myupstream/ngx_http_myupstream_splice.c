@@ -0,0 +1,360 @@
+#include "ngx_http_myupstream_module.h"
+
+#if (NGX_LINUX)
+
+/* 每次从后端 splice 进管道的最大字节数，与 Linux 管道的默认容量一致 */
+#define NGX_HTTP_MYUPSTREAM_SPLICE_SIZE     65536
+
+/*
+splice 中继的状态，从请求内存池中分配。
+包体从后端套接字 splice 进管道，再从管道 splice 到客户端套接字，不经过用户态缓冲区。
+中继结束（包体收完、超时或后端出错）后把事件处理方法交还给 upstream 机制，由它结束请求。
+*/
+struct ngx_http_myupstream_splice_s {
+    ngx_fd_t                          fd[2];       /* 管道，fd[0] 为读端，fd[1] 为写端 */
+    size_t                            pending;     /* 已经进入管道、还没有写给客户端的字节数 */
+
+    ngx_http_upstream_handler_pt      read_event_handler;   /* upstream 原来的事件处理方法 */
+    ngx_http_event_handler_pt         write_event_handler;
+};
+
+static ngx_uint_t ngx_http_myupstream_splice_test(ngx_http_request_t *r);
+static void ngx_http_myupstream_splice_cleanup(void *data);
+static void ngx_http_myupstream_splice_upstream(ngx_http_request_t *r, ngx_http_upstream_t *u);
+static void ngx_http_myupstream_splice_downstream(ngx_http_request_t *r);
+static void ngx_http_myupstream_splice_relay(ngx_http_request_t *r);
+static void ngx_http_myupstream_splice_finish(ngx_http_request_t *r, ngx_uint_t do_write);
+
+/*
+在 input_filter_init 中调用，条件满足时接管本次响应包体的转发。
+接收响应头时预读的包体先按普通方式发送，之后的包体都用 splice 转发。
+参数：r - 请求
+返回值：NGX_OK - 已经接管，upstream 机制不会再读取后端
+       NGX_DECLINED - 条件不满足，按普通方式转发
+       NGX_ERROR - 出错
+*/
+ngx_int_t ngx_http_myupstream_splice_start(ngx_http_request_t *r) {
+    off_t                          n;
+    ngx_buf_t                     *b;
+    ngx_chain_t                    out;
+    ngx_connection_t              *uc;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_upstream_t           *u;
+    ngx_http_myupstream_ctx_t     *myctx;
+    ngx_http_myupstream_splice_t  *sp;
+
+    if (!ngx_http_myupstream_splice_test(r)) {
+        return NGX_DECLINED;
+    }
+
+    u = r->upstream;
+    uc = u->peer.connection;
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    n = u->buffer.last - u->buffer.pos;
+
+    //预读的部分已经包含了整个包体，不值得再建管道
+    if (u->length != -1 && n >= u->length) {
+        return NGX_DECLINED;
+    }
+
+    sp = ngx_palloc(r->pool, sizeof(ngx_http_myupstream_splice_t));
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pipe2(sp->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno, "pipe2() failed");
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_http_myupstream_splice_cleanup;
+    cln->data = sp;
+
+    sp->pending = 0;
+    myctx->splice = sp;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream splice relay, length:%O, preread:%O", u->length, n);
+
+    //预读的包体直接引用u->buffer发送，upstream机制不会再往这块缓冲区里读数据
+    if (n) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->pos = u->buffer.pos;
+        b->last = u->buffer.last;
+        b->memory = 1;
+        b->flush = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        u->buffer.pos = u->buffer.last;
+        u->state->response_length += n;
+
+        if (u->length != -1) {
+            u->length -= n;
+        }
+
+        if (ngx_http_output_filter(r, &out) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    /*
+    upstream机制在input_filter_init之前已经设置好自己的事件处理方法，保存下来，中继结束时交还。
+    清掉后端读事件的ready标志，upstream机制返回后就不会自己去读后端；
+    再把读事件投递出去，由本模块的处理方法开始中继
+    */
+    sp->read_event_handler = u->read_event_handler;
+    sp->write_event_handler = r->write_event_handler;
+
+    u->read_event_handler = ngx_http_myupstream_splice_upstream;
+    r->write_event_handler = ngx_http_myupstream_splice_downstream;
+
+    uc->read->ready = 0;
+    ngx_post_event(uc->read, &ngx_posted_events);
+
+    return NGX_OK;
+}
+
+/* 只有包体原样发给客户端时才能绕过过滤模块，任何会改写包体的设置都会让本次响应回到普通转发 */
+static ngx_uint_t ngx_http_myupstream_splice_test(ngx_http_request_t *r) {
+    ngx_http_upstream_t        *u = r->upstream;
+    ngx_http_myupstream_ctx_t  *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+
+    if (r != r->main || r->header_only || u->length == 0 || u->headers_in.chunked) {
+        return 0;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (r->connection->ssl) {
+        return 0;
+    }
+#endif
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return 0;
+    }
+#endif
+
+    //包体还要写缓存或者交给扇出，是否有合并的请求由调用者判断
+    if (myctx->cache_store || myctx->cache_update || myctx->fanout_part) {
+        return 0;
+    }
+
+    //gzip、sub、ssi等过滤模块要处理包体，chunked过滤模块要加上分块编码
+    if (r->main_filter_need_in_memory || r->filter_need_in_memory || r->filter_need_temporary || r->chunked) {
+        return 0;
+    }
+
+    //range等过滤模块改写了包体长度
+    if (r->headers_out.content_length_n != u->headers_in.content_length_n) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static void ngx_http_myupstream_splice_cleanup(void *data) {
+    ngx_http_myupstream_splice_t  *sp = data;
+
+    if (close(sp->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno, "close() pipe failed");
+    }
+
+    if (close(sp->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno, "close() pipe failed");
+    }
+}
+
+/* 后端可读或者读超时 */
+static void ngx_http_myupstream_splice_upstream(ngx_http_request_t *r, ngx_http_upstream_t *u) {
+    //超时交给upstream机制处理，它会返回504
+    if (u->peer.connection->read->timedout) {
+        ngx_http_myupstream_splice_finish(r, 0);
+        return;
+    }
+
+    ngx_http_myupstream_splice_relay(r);
+}
+
+/* 客户端可写或者写超时 */
+static void ngx_http_myupstream_splice_downstream(ngx_http_request_t *r) {
+    if (r->connection->write->timedout) {
+        ngx_http_myupstream_splice_finish(r, 1);
+        return;
+    }
+
+    ngx_http_myupstream_splice_relay(r);
+}
+
+/*
+先把管道中的数据写给客户端，管道空了再从后端读入，直到某一端暂时不能读写。
+包体收完、后端关闭连接或者出错时，管道写空后交还给upstream机制结束请求
+*/
+static void ngx_http_myupstream_splice_relay(ngx_http_request_t *r) {
+    size_t                         size;
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_connection_t              *c, *uc;
+    ngx_http_upstream_t           *u;
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_http_myupstream_ctx_t     *myctx;
+    ngx_http_myupstream_splice_t  *sp;
+
+    c = r->connection;
+    u = r->upstream;
+    uc = u->peer.connection;
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    sp = myctx->splice;
+
+    //响应头和预读的包体还在nginx的缓冲区里，必须先发完，才能直接往套接字里写
+    if (c->buffered) {
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+    }
+
+    while (!c->buffered) {
+
+        while (sp->pending) {
+            n = splice(sp->fd[0], NULL, c->fd, NULL, sp->pending, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    c->write->ready = 0;
+                    break;
+                }
+
+                c->error = 1;
+                ngx_connection_error(c, err, "splice() to client failed");
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+
+            sp->pending -= n;
+            c->sent += n;
+        }
+
+        if (sp->pending) {
+            break;
+        }
+
+        if (u->length == 0 || uc->read->eof || uc->read->error) {
+            ngx_http_myupstream_splice_finish(r, 1);
+            return;
+        }
+
+        size = NGX_HTTP_MYUPSTREAM_SPLICE_SIZE;
+
+        if (u->length != -1 && u->length < (off_t) size) {
+            size = (size_t) u->length;
+        }
+
+        n = splice(uc->fd, NULL, sp->fd[1], NULL, size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN) {
+                uc->read->ready = 0;
+                break;
+            }
+
+            //交给upstream机制，它会按后端出错返回502
+            ngx_log_error(NGX_LOG_ERR, c->log, err, "splice() from upstream failed");
+            uc->read->error = 1;
+            continue;
+        }
+
+        if (n == 0) {
+            uc->read->eof = 1;
+            continue;
+        }
+
+        sp->pending += n;
+        u->state->bytes_received += n;
+        u->state->response_length += n;
+
+        if (u->length != -1) {
+            u->length -= n;
+
+            //包体已经完整接收，连接可以复用
+            if (u->length == 0) {
+                u->keepalive = !u->headers_in.connection_close;
+            }
+        }
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (c->write->active && !c->write->ready) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_handle_read_event(uc->read, 0) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    //还有数据没有写给客户端时只等客户端，不计后端的读超时
+    if (!sp->pending && !c->buffered && uc->read->active && !uc->read->ready) {
+        ngx_add_timer(uc->read, u->conf->read_timeout);
+
+    } else if (uc->read->timer_set) {
+        ngx_del_timer(uc->read);
+    }
+}
+
+/*
+中继结束，恢复upstream机制的事件处理方法并调用一次。
+此时管道已经写空，upstream机制看到的是没有待发送数据的非缓冲转发，
+它按u->length、后端连接的eof/error标志和超时标志结束请求，并决定后端连接能否放回长连接池
+参数：r - 请求
+     do_write - 1 调用客户端写事件的处理方法，0 调用后端读事件的处理方法
+*/
+static void ngx_http_myupstream_splice_finish(ngx_http_request_t *r, ngx_uint_t do_write) {
+    ngx_http_upstream_t           *u = r->upstream;
+    ngx_http_myupstream_ctx_t     *myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    ngx_http_myupstream_splice_t  *sp = myctx->splice;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "myupstream splice relay done, length:%O", u->length);
+
+    u->read_event_handler = sp->read_event_handler;
+    r->write_event_handler = sp->write_event_handler;
+
+    if (do_write) {
+        r->write_event_handler(r);
+
+    } else {
+        u->read_event_handler(r, u);
+    }
+}
+
+#else
+
+ngx_int_t ngx_http_myupstream_splice_start(ngx_http_request_t *r) {
+    return NGX_DECLINED;
+}
+
+#endif
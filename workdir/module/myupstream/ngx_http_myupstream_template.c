@@ -0,0 +1,493 @@
+#include "ngx_http_myupstream_module.h"
+
+/* 一个请求模板最多引用的参数个数，生成请求时参数值暂存在栈上 */
+#define NGX_HTTP_MYUPSTREAM_TEMPLATE_MAX_SLOTS  16
+
+/* 模板片段的类型 */
+#define NGX_HTTP_MYUPSTREAM_PART_LITERAL   0   /* 字面量，编译时已经拼好 */
+#define NGX_HTTP_MYUPSTREAM_PART_ARG       1   /* $arg_name，客户端请求中的一个查询参数 */
+#define NGX_HTTP_MYUPSTREAM_PART_ARGS      2   /* $args，客户端请求的整个查询串 */
+#define NGX_HTTP_MYUPSTREAM_PART_GZIP      3   /* Accept-Encoding 头部，只在客户端接受 gzip 时输出 */
+
+typedef struct {
+    ngx_uint_t                            type;
+    ngx_uint_t                            escape;  /* 出现在请求行中，需要转义 */
+    ngx_str_t                             value;   /* 字面量的内容，或者参数名 */
+} ngx_http_myupstream_template_part_t;
+
+/* 编译后的请求模板，相邻的字面量已经合并 */
+struct ngx_http_myupstream_template_s {
+    ngx_http_myupstream_template_part_t  *parts;
+    ngx_uint_t                            nparts;
+    size_t                                len;     /* 所有字面量的总长度 */
+};
+
+/* search_engine 的取值，选择请求路径和 Host 头部 */
+typedef struct {
+    ngx_str_t                             name;
+    ngx_str_t                             uri;
+    ngx_str_t                             host;
+} ngx_http_myupstream_engine_t;
+
+static ngx_int_t myupstream_template_literal(ngx_array_t *parts, u_char *data, size_t len);
+static ngx_int_t myupstream_template_parse(ngx_conf_t *cf, ngx_array_t *parts, ngx_str_t *src, ngx_uint_t escape);
+static ngx_http_myupstream_template_t *myupstream_template_link(ngx_conf_t *cf, ngx_array_t *parts);
+static ngx_inline ngx_uint_t myupstream_template_must_escape(u_char *p, u_char *end);
+static uintptr_t myupstream_template_escape(u_char *dst, u_char *src, size_t size);
+
+static ngx_http_myupstream_engine_t ngx_http_myupstream_engines[] = {
+    { ngx_string("bing"), ngx_string("/search?q=$arg_q"), ngx_string("cn.bing.com") },
+    { ngx_string("baidu"), ngx_string("/s?wd=$arg_q"), ngx_string("www.baidu.com") },
+    { ngx_null_string, ngx_null_string, ngx_null_string }
+};
+
+/*
+查询参数的值放进请求行时需要转义的字符：控制字符、空格、" # < > \ ^ ` { | } 和非ASCII字符。
+已经转义过的 %XX 原样保留，其余的 % 另外判断
+*/
+static uint32_t ngx_http_myupstream_template_escape_map[] = {
+    0xffffffff, /* 0x00 - 0x1f */
+    0x5000000d, /* 0x20 - 0x3f: 空格 " # < > */
+    0x50000000, /* 0x40 - 0x5f: \ ^ */
+    0xb8000001, /* 0x60 - 0x7f: ` { | } DEL */
+    0xffffffff, /* 0x80 - 0xff */
+    0xffffffff,
+    0xffffffff,
+    0xffffffff
+};
+
+/*
+根据 search_engine 确定请求路径和 Host 头部，必须在确定后端地址之前调用
+参数：cf - 配置对象
+     conf - location 的配置
+返回值：成功 - NGX_OK
+       未知的 search_engine - NGX_ERROR
+*/
+ngx_int_t ngx_http_myupstream_template_engine(ngx_conf_t *cf, ngx_http_myupstream_conf_t *conf) {
+    ngx_http_myupstream_engine_t  *engine;
+
+    if (conf->search_engine.len == 0) {
+        /* 没有指定搜索引擎时请求根路径，与原来的行为一致 */
+        if (conf->request_uri.len == 0) {
+            ngx_str_set(&conf->request_uri, "/");
+        }
+
+        return NGX_OK;
+    }
+
+    for (engine = ngx_http_myupstream_engines; engine->name.len; engine++) {
+        if (engine->name.len == conf->search_engine.len
+            && ngx_strncasecmp(engine->name.data, conf->search_engine.data, engine->name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (engine->name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown search_engine \"%V\"", &conf->search_engine);
+        return NGX_ERROR;
+    }
+
+    /* myupstream_request_uri 优先于搜索引擎的缺省路径 */
+    if (conf->request_uri.len == 0) {
+        conf->request_uri = engine->uri;
+    }
+
+    conf->host = engine->host;
+
+    return NGX_OK;
+}
+
+/*
+把请求行、Host、myupstream_request_header、Accept-Encoding 和 Connection 编译成一个模板，
+每个请求只需要取出参数、分配一次内存、按顺序复制
+参数：cf - 配置对象
+     conf - location 的配置，host 和 keepalive 必须已经确定
+返回值：成功 - 编译后的模板
+       失败 - NULL
+*/
+ngx_http_myupstream_template_t *ngx_http_myupstream_template_compile(ngx_conf_t *cf, ngx_http_myupstream_conf_t *conf) {
+    ngx_array_t                           parts;
+    ngx_keyval_t                         *h;
+    ngx_uint_t                            i, j;
+    ngx_http_myupstream_template_part_t  *part;
+
+    if (conf->request_uri.data[0] != '/') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "request uri \"%V\" must start with \"/\"", &conf->request_uri);
+        return NULL;
+    }
+
+    if (ngx_array_init(&parts, cf->temp_pool, 16, sizeof(ngx_http_myupstream_template_part_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (myupstream_template_literal(&parts, (u_char *) "GET ", 4) != NGX_OK
+        || myupstream_template_parse(cf, &parts, &conf->request_uri, 1) != NGX_OK
+        || myupstream_template_literal(&parts, (u_char *) " HTTP/1.1" CRLF "Host: ", sizeof(" HTTP/1.1" CRLF "Host: ") - 1) != NGX_OK
+        || myupstream_template_literal(&parts, conf->host.data, conf->host.len) != NGX_OK
+        || myupstream_template_literal(&parts, (u_char *) CRLF, 2) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (conf->request_headers) {
+        h = conf->request_headers->elts;
+
+        for (i = 0; i < conf->request_headers->nelts; i++) {
+
+            for (j = 0; j < h[i].key.len; j++) {
+                if (h[i].key.data[j] <= ' ' || h[i].key.data[j] == ':' || h[i].key.data[j] >= 0x7f) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid header name \"%V\"", &h[i].key);
+                    return NULL;
+                }
+            }
+
+            for (j = 0; j < h[i].value.len; j++) {
+                if (h[i].value.data[j] == CR || h[i].value.data[j] == LF) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value of header \"%V\"", &h[i].key);
+                    return NULL;
+                }
+            }
+
+            /* 头部的值不在请求行中，参数原样放入 */
+            if (myupstream_template_literal(&parts, h[i].key.data, h[i].key.len) != NGX_OK
+                || myupstream_template_literal(&parts, (u_char *) ": ", 2) != NGX_OK
+                || myupstream_template_parse(cf, &parts, &h[i].value, 0) != NGX_OK
+                || myupstream_template_literal(&parts, (u_char *) CRLF, 2) != NGX_OK)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    if (conf->gzip) {
+        part = ngx_array_push(&parts);
+        if (part == NULL) {
+            return NULL;
+        }
+
+        part->type = NGX_HTTP_MYUPSTREAM_PART_GZIP;
+        part->escape = 0;
+        ngx_str_set(&part->value, "Accept-Encoding: gzip" CRLF);
+    }
+
+    /* 使用长连接时不带Connection头部，HTTP/1.1默认就是长连接 */
+    if (!conf->keepalive
+        && myupstream_template_literal(&parts, (u_char *) "Connection: close" CRLF, sizeof("Connection: close" CRLF) - 1) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (myupstream_template_literal(&parts, (u_char *) CRLF, 2) != NGX_OK) {
+        return NULL;
+    }
+
+    return myupstream_template_link(cf, &parts);
+}
+
+/*
+按模板生成发往后端的请求
+参数：r - 客户端请求
+     t - 编译后的模板
+返回值：成功 - 大小正好是整个请求的缓冲区
+       失败 - NULL
+*/
+ngx_buf_t *ngx_http_myupstream_template_render(ngx_http_request_t *r, ngx_http_myupstream_template_t *t) {
+    ngx_http_myupstream_template_part_t  *part;
+    ngx_str_t                             values[NGX_HTTP_MYUPSTREAM_TEMPLATE_MAX_SLOTS], *v;
+    ngx_buf_t                            *b;
+    ngx_uint_t                            i, n, gzip;
+    size_t                                len;
+    u_char                               *p;
+    ngx_http_myupstream_ctx_t            *myctx;
+
+    myctx = ngx_http_get_module_ctx(r, ngx_http_myupstream_module);
+    gzip = myctx->gzip;
+
+    /* 先取出所有参数的值，算出请求的确切长度 */
+    len = t->len;
+    n = 0;
+
+    for (i = 0; i < t->nparts; i++) {
+        part = &t->parts[i];
+
+        if (part->type == NGX_HTTP_MYUPSTREAM_PART_LITERAL) {
+            continue;
+        }
+
+        if (part->type == NGX_HTTP_MYUPSTREAM_PART_GZIP) {
+            len += gzip ? part->value.len : 0;
+            continue;
+        }
+
+        v = &values[n++];
+
+        if (part->type == NGX_HTTP_MYUPSTREAM_PART_ARGS) {
+            *v = r->args;
+
+        } else if (ngx_http_arg(r, part->value.data, part->value.len, v) != NGX_OK) {
+            ngx_str_null(v);
+        }
+
+        len += v->len;
+
+        if (part->escape) {
+            len += 2 * myupstream_template_escape(NULL, v->data, v->len);
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    ngx_http_myupstream_pool_profile(r, NGX_HTTP_MYUPSTREAM_POOL_REQUEST, len);
+
+    p = b->last;
+    n = 0;
+
+    for (i = 0; i < t->nparts; i++) {
+        part = &t->parts[i];
+
+        if (part->type == NGX_HTTP_MYUPSTREAM_PART_LITERAL) {
+            p = ngx_cpymem(p, part->value.data, part->value.len);
+            continue;
+        }
+
+        if (part->type == NGX_HTTP_MYUPSTREAM_PART_GZIP) {
+            if (gzip) {
+                p = ngx_cpymem(p, part->value.data, part->value.len);
+            }
+
+            continue;
+        }
+
+        v = &values[n++];
+
+        if (part->escape) {
+            p = (u_char *) myupstream_template_escape(p, v->data, v->len);
+        } else {
+            p = ngx_cpymem(p, v->data, v->len);
+        }
+    }
+
+    /* last要指向请求的末尾，长连接上多余的字节会被后端当作下一个请求 */
+    b->last = p;
+
+    return b;
+}
+
+/* 追加一个字面量片段，合并留到 myupstream_template_link 中做 */
+static ngx_int_t myupstream_template_literal(ngx_array_t *parts, u_char *data, size_t len) {
+    ngx_http_myupstream_template_part_t  *part;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    part = ngx_array_push(parts);
+    if (part == NULL) {
+        return NGX_ERROR;
+    }
+
+    part->type = NGX_HTTP_MYUPSTREAM_PART_LITERAL;
+    part->escape = 0;
+    part->value.data = data;
+    part->value.len = len;
+
+    return NGX_OK;
+}
+
+/*
+把模板字符串拆成字面量和参数，支持 $args 和 $arg_name
+参数：cf - 配置对象
+     parts - 片段数组
+     src - 模板字符串
+     escape - 参数值是否需要转义
+返回值：成功 - NGX_OK
+       失败 - NGX_ERROR
+*/
+static ngx_int_t myupstream_template_parse(ngx_conf_t *cf, ngx_array_t *parts, ngx_str_t *src, ngx_uint_t escape) {
+    ngx_http_myupstream_template_part_t  *part;
+    u_char                               *p, *end, *start, *name, c;
+    size_t                                len;
+
+    p = src->data;
+    end = p + src->len;
+    start = p;
+
+    while (p < end) {
+        if (*p != '$') {
+            p++;
+            continue;
+        }
+
+        if (myupstream_template_literal(parts, start, p - start) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        name = ++p;
+
+        while (p < end) {
+            c = *p;
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_') {
+                p++;
+                continue;
+            }
+            break;
+        }
+
+        len = p - name;
+
+        part = ngx_array_push(parts);
+        if (part == NULL) {
+            return NGX_ERROR;
+        }
+
+        part->escape = escape;
+
+        if (len == sizeof("args") - 1 && ngx_strncmp(name, "args", len) == 0) {
+            part->type = NGX_HTTP_MYUPSTREAM_PART_ARGS;
+            ngx_str_null(&part->value);
+
+        } else if (len > sizeof("arg_") - 1 && ngx_strncmp(name, "arg_", sizeof("arg_") - 1) == 0) {
+            part->type = NGX_HTTP_MYUPSTREAM_PART_ARG;
+            part->value.data = name + sizeof("arg_") - 1;
+            part->value.len = len - (sizeof("arg_") - 1);
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown variable \"$%*s\" in request template \"%V\"", len, name, src);
+            return NGX_ERROR;
+        }
+
+        start = p;
+    }
+
+    return myupstream_template_literal(parts, start, p - start);
+}
+
+/*
+合并相邻的字面量，把片段复制到配置内存池中
+参数：cf - 配置对象
+     parts - 片段数组，分配在临时内存池中
+返回值：成功 - 编译后的模板
+       失败 - NULL
+*/
+static ngx_http_myupstream_template_t *myupstream_template_link(ngx_conf_t *cf, ngx_array_t *parts) {
+    ngx_http_myupstream_template_t       *t;
+    ngx_http_myupstream_template_part_t  *src, *dst;
+    ngx_uint_t                            i, j, nslots;
+    size_t                                len;
+    u_char                               *p;
+
+    t = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_template_t));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->parts = ngx_palloc(cf->pool, parts->nelts * sizeof(ngx_http_myupstream_template_part_t));
+    if (t->parts == NULL) {
+        return NULL;
+    }
+
+    src = parts->elts;
+    nslots = 0;
+
+    for (i = 0; i < parts->nelts; /* void */) {
+        dst = &t->parts[t->nparts++];
+
+        /* 按条件输出的片段不占参数槽位，也不能和字面量合并 */
+        if (src[i].type == NGX_HTTP_MYUPSTREAM_PART_GZIP) {
+            *dst = src[i++];
+            continue;
+        }
+
+        if (src[i].type != NGX_HTTP_MYUPSTREAM_PART_LITERAL) {
+            if (++nslots > NGX_HTTP_MYUPSTREAM_TEMPLATE_MAX_SLOTS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too many variables in request template, maximum is %d", NGX_HTTP_MYUPSTREAM_TEMPLATE_MAX_SLOTS);
+                return NULL;
+            }
+
+            *dst = src[i++];
+            continue;
+        }
+
+        len = 0;
+        for (j = i; j < parts->nelts && src[j].type == NGX_HTTP_MYUPSTREAM_PART_LITERAL; j++) {
+            len += src[j].value.len;
+        }
+
+        p = ngx_pnalloc(cf->pool, len);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        dst->type = NGX_HTTP_MYUPSTREAM_PART_LITERAL;
+        dst->escape = 0;
+        dst->value.data = p;
+        dst->value.len = len;
+
+        for ( /* void */ ; i < j; i++) {
+            p = ngx_cpymem(p, src[i].value.data, src[i].value.len);
+        }
+
+        t->len += len;
+    }
+
+    return t;
+}
+
+static ngx_inline ngx_uint_t myupstream_template_must_escape(u_char *p, u_char *end) {
+    u_char  c;
+
+    c = *p;
+
+    if (ngx_http_myupstream_template_escape_map[c >> 5] & (1U << (c & 0x1f))) {
+        return 1;
+    }
+
+    /* 客户端已经转义过的 %XX 不再重复转义 */
+    if (c == '%') {
+        return !(end - p > 2 && isxdigit(p[1]) && isxdigit(p[2]));
+    }
+
+    return 0;
+}
+
+/*
+一遍扫描完成转义，不需要先还原客户端的转义再重新转义
+参数：dst - 输出位置，为 NULL 时只计数
+     src - 参数值
+     size - 参数值的长度
+返回值：dst 为 NULL 时返回需要转义的字符数，否则返回输出的末尾
+*/
+static uintptr_t myupstream_template_escape(u_char *dst, u_char *src, size_t size) {
+    static u_char  hex[] = "0123456789ABCDEF";
+    u_char        *end;
+    ngx_uint_t     n;
+
+    end = src + size;
+
+    if (dst == NULL) {
+        n = 0;
+
+        for ( /* void */ ; src < end; src++) {
+            n += myupstream_template_must_escape(src, end);
+        }
+
+        return (uintptr_t) n;
+    }
+
+    for ( /* void */ ; src < end; src++) {
+        if (myupstream_template_must_escape(src, end)) {
+            *dst++ = '%';
+            *dst++ = hex[*src >> 4];
+            *dst++ = hex[*src & 0xf];
+
+        } else {
+            *dst++ = *src;
+        }
+    }
+
+    return (uintptr_t) dst;
+}
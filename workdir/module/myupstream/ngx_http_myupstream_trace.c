@@ -0,0 +1,410 @@
+#include "ngx_http_myupstream_module.h"
+#include "ngx_http_myupstream_trace.h"
+
+/* 每个槽位至少能保存的记录数 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_MIN_RECORDS  64
+
+/* myupstream_trace_file 映射的文件，每个 cycle 一份 */
+struct ngx_http_myupstream_trace_file_s {
+    ngx_str_t                             path;
+    size_t                                size;    /* 配置的大小，映射之后为实际使用的大小 */
+    ngx_http_myupstream_trace_header_t   *header;  /* 映射的起始地址，init_module 之前为 NULL */
+};
+
+/* 一个请求的各个时间点，挂在请求内存池的清理函数上，内存池销毁时写入记录 */
+typedef struct {
+    ngx_http_request_t                   *request;
+    ngx_http_myupstream_trace_file_t     *file;
+    uint64_t                              start;   /* 请求开始的时间，微秒 */
+    uint32_t                              stamp[NGX_HTTP_MYUPSTREAM_TRACE_EVENTS];
+    ngx_uint_t                            module;
+} ngx_http_myupstream_trace_ctx_t;
+
+static ngx_http_myupstream_trace_ctx_t *ngx_http_myupstream_trace_get(ngx_http_request_t *r, ngx_http_myupstream_trace_file_t *file);
+static void ngx_http_myupstream_trace_connect(ngx_http_myupstream_trace_ctx_t *ctx, ngx_http_upstream_t *u, uint64_t now);
+static void ngx_http_myupstream_trace_cleanup(void *data);
+static void ngx_http_myupstream_trace_unmap(void *data);
+static uint32_t ngx_http_myupstream_trace_offset(ngx_http_myupstream_trace_ctx_t *ctx, uint64_t us);
+static uint64_t ngx_http_myupstream_trace_now(void);
+
+/*
+myupstream_trace_file 配置项的回调函数，在 http 块中指定保存请求记录的文件。
+文件在 master 中创建并映射，读取工具映射同一个文件，不需要访问 nginx
+格式：myupstream_trace_file path size;
+*/
+char *ngx_http_myupstream_trace_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_myupstream_main_conf_t   *mmcf = conf;
+    ssize_t                            size;
+    ngx_str_t                         *value;
+    ngx_http_myupstream_trace_file_t  *file;
+
+    if (mmcf->trace) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    file = ngx_pcalloc(cf->pool, sizeof(ngx_http_myupstream_trace_file_t));
+    if (file == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    file->path = value[1];
+    file->size = size;
+
+    if (ngx_conf_full_name(cf->cycle, &file->path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf->trace = file;
+
+    return NGX_CONF_OK;
+}
+
+/*
+init_module 时在 master 中创建并映射文件，worker 在 fork 时继承映射。
+每次加载配置都写一个新文件再改名覆盖，旧的 worker 退出前继续写旧文件，
+同一个槽位始终只有一个写者；reload 之前的记录留在旧文件中，不再能从路径打开
+*/
+ngx_int_t ngx_http_myupstream_trace_init(ngx_cycle_t *cycle) {
+    size_t                               avail, size;
+    u_char                              *addr;
+    ngx_fd_t                             fd;
+    ngx_str_t                            tmp;
+    ngx_uint_t                           nslots, nrecords;
+    ngx_core_conf_t                     *ccf;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_myupstream_main_conf_t     *mmcf;
+    ngx_http_myupstream_trace_file_t    *file;
+    ngx_http_myupstream_trace_header_t  *header;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_myupstream_module);
+
+    if (mmcf == NULL || mmcf->trace == NULL || ngx_test_config) {
+        return NGX_OK;
+    }
+
+    file = mmcf->trace;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    nslots = ccf->worker_processes > 0 ? (ngx_uint_t) ccf->worker_processes : 1;
+
+    /* 每个槽位的记录数取能放下的最大的 2 的幂，写入时用掩码代替取模 */
+    avail = 0;
+
+    if (file->size > sizeof(ngx_http_myupstream_trace_header_t)) {
+        avail = (file->size - sizeof(ngx_http_myupstream_trace_header_t)) / nslots;
+        avail = avail > sizeof(ngx_http_myupstream_trace_slot_t) ? avail - sizeof(ngx_http_myupstream_trace_slot_t) : 0;
+    }
+
+    if (avail < NGX_HTTP_MYUPSTREAM_TRACE_MIN_RECORDS * sizeof(ngx_http_myupstream_trace_record_t)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "myupstream_trace_file \"%V\" is too small for %ui worker processes, at least %uz bytes needed",
+                      &file->path, nslots,
+                      sizeof(ngx_http_myupstream_trace_header_t)
+                      + nslots * (sizeof(ngx_http_myupstream_trace_slot_t) + NGX_HTTP_MYUPSTREAM_TRACE_MIN_RECORDS * sizeof(ngx_http_myupstream_trace_record_t)));
+        return NGX_ERROR;
+    }
+
+    for (nrecords = NGX_HTTP_MYUPSTREAM_TRACE_MIN_RECORDS;
+         (nrecords << 1) * sizeof(ngx_http_myupstream_trace_record_t) <= avail;
+         nrecords <<= 1)
+    { /* void */ }
+
+    size = sizeof(ngx_http_myupstream_trace_header_t)
+           + nslots * (sizeof(ngx_http_myupstream_trace_slot_t) + nrecords * sizeof(ngx_http_myupstream_trace_record_t));
+
+    tmp.len = file->path.len + sizeof(".tmp") - 1;
+    tmp.data = ngx_pnalloc(cycle->pool, tmp.len + 1);
+    if (tmp.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(tmp.data, "%V.tmp%Z", &file->path);
+
+    fd = ngx_open_file(tmp.data, NGX_FILE_RDWR, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, ngx_open_file_n " \"%s\" failed", tmp.data);
+        return NGX_ERROR;
+    }
+
+    /* 扩展出来的部分读出来都是 0，所有槽位的 head 和记录的 seq 都从 0 开始 */
+    if (ftruncate(fd, size) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, "ftruncate() \"%s\" failed", tmp.data);
+        goto failed;
+    }
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, "mmap(%uz) \"%s\" failed", size, tmp.data);
+        goto failed;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, ngx_close_file_n " \"%s\" failed", tmp.data);
+    }
+
+    header = (ngx_http_myupstream_trace_header_t *) addr;
+
+    header->magic = NGX_HTTP_MYUPSTREAM_TRACE_MAGIC;
+    header->version = NGX_HTTP_MYUPSTREAM_TRACE_VERSION;
+    header->nslots = nslots;
+    header->nrecords = nrecords;
+    header->record_size = sizeof(ngx_http_myupstream_trace_record_t);
+    header->slot_size = sizeof(ngx_http_myupstream_trace_slot_t) + nrecords * sizeof(ngx_http_myupstream_trace_record_t);
+    header->created = ngx_http_myupstream_trace_now();
+
+    if (ngx_rename_file(tmp.data, file->path.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%V\" failed", tmp.data, &file->path);
+        munmap(addr, size);
+        ngx_delete_file(tmp.data);
+        return NGX_ERROR;
+    }
+
+    file->header = header;
+    file->size = size;
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_myupstream_trace_unmap;
+    cln->data = file;
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "myupstream_trace_file \"%V\": %ui slots of %ui records", &file->path, nslots, nrecords);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_file(fd);
+    ngx_delete_file(tmp.data);
+
+    return NGX_ERROR;
+}
+
+/* cycle 销毁时解除映射，只发生在 master 中，worker 退出时由内核回收 */
+static void ngx_http_myupstream_trace_unmap(void *data) {
+    ngx_http_myupstream_trace_file_t  *file = data;
+
+    if (munmap((void *) file->header, file->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno, "munmap(%uz) \"%V\" failed", file->size, &file->path);
+    }
+
+    file->header = NULL;
+}
+
+/*
+记录请求到达一个时间点，同一个时间点只保留第一次。只记录配置了 myupstream_trace 的 location 中的主请求，
+第一次调用时创建请求的记录，请求内存池销毁时写入当前 worker 的槽位
+参数：r - 请求
+     event - NGX_HTTP_MYUPSTREAM_TRACE_HANDLER 等
+*/
+void ngx_http_myupstream_trace(ngx_http_request_t *r, ngx_uint_t event) {
+    uint64_t                          now;
+    ngx_http_myupstream_conf_t       *mycf;
+    ngx_http_myupstream_main_conf_t  *mmcf;
+    ngx_http_myupstream_trace_ctx_t  *ctx;
+
+    mycf = ngx_http_get_module_loc_conf(r, ngx_http_myupstream_module);
+
+    if (!mycf->trace || r != r->main) {
+        return;
+    }
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_myupstream_module);
+
+    if (mmcf->trace->header == NULL) {
+        return;
+    }
+
+    ctx = ngx_http_myupstream_trace_get(r, mmcf->trace);
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (event == NGX_HTTP_MYUPSTREAM_TRACE_MYMODULE) {
+        ctx->module = NGX_HTTP_MYUPSTREAM_TRACE_MODULE_MYMODULE;
+        event = NGX_HTTP_MYUPSTREAM_TRACE_HANDLER;
+
+    } else if (event == NGX_HTTP_MYUPSTREAM_TRACE_HANDLER) {
+        ctx->module = NGX_HTTP_MYUPSTREAM_TRACE_MODULE_MYUPSTREAM;
+    }
+
+    if (ctx->stamp[event] != NGX_HTTP_MYUPSTREAM_TRACE_NONE) {
+        return;
+    }
+
+    now = ngx_http_myupstream_trace_now();
+
+    ctx->stamp[event] = ngx_http_myupstream_trace_offset(ctx, now);
+
+    /* 收到第一个字节时连接一定已经建立，upstream 机制只记录了毫秒级的连接耗时，从它推算连上的时间 */
+    if (event == NGX_HTTP_MYUPSTREAM_TRACE_FIRST_BYTE) {
+        ngx_http_myupstream_trace_connect(ctx, r->upstream, now);
+    }
+}
+
+/* 找到请求的记录，第一次调用时创建。与内存池统计一样顺序查找清理函数：mymodule 的请求没有本模块的上下文 */
+static ngx_http_myupstream_trace_ctx_t *ngx_http_myupstream_trace_get(ngx_http_request_t *r, ngx_http_myupstream_trace_file_t *file) {
+    ngx_uint_t                        i;
+    ngx_pool_cleanup_t               *cln;
+    ngx_http_myupstream_trace_ctx_t  *ctx;
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_myupstream_trace_cleanup) {
+            return cln->data;
+        }
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_myupstream_trace_ctx_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    ctx = cln->data;
+
+    ctx->request = r;
+    ctx->file = file;
+    ctx->start = (uint64_t) r->start_sec * 1000000 + r->start_msec * 1000;
+    ctx->module = 0;
+
+    for (i = 0; i < NGX_HTTP_MYUPSTREAM_TRACE_EVENTS; i++) {
+        ctx->stamp[i] = NGX_HTTP_MYUPSTREAM_TRACE_NONE;
+    }
+
+    cln->handler = ngx_http_myupstream_trace_cleanup;
+
+    return ctx;
+}
+
+/*
+没有经过地址竞速时，由 upstream 机制记录的连接耗时推算连上后端的时间
+参数：ctx - 请求的记录
+     u - 请求的 upstream，可以为 NULL
+     now - 当前时间，微秒，与 ngx_current_msec 对应
+*/
+static void ngx_http_myupstream_trace_connect(ngx_http_myupstream_trace_ctx_t *ctx, ngx_http_upstream_t *u, uint64_t now) {
+    ngx_msec_t  elapsed;
+
+    if (ctx->stamp[NGX_HTTP_MYUPSTREAM_TRACE_CONNECT] != NGX_HTTP_MYUPSTREAM_TRACE_NONE
+        || u == NULL || u->state == NULL || u->state->connect_time == (ngx_msec_t) -1)
+    {
+        return;
+    }
+
+    elapsed = ngx_current_msec - u->start_time;
+
+    if (elapsed < u->state->connect_time) {
+        return;
+    }
+
+    ctx->stamp[NGX_HTTP_MYUPSTREAM_TRACE_CONNECT] = ngx_http_myupstream_trace_offset(ctx, now - (uint64_t) (elapsed - u->state->connect_time) * 1000);
+}
+
+/*
+请求内存池销毁时调用，这时请求已经结束并写完了访问日志，r 和 r->upstream 都还没有释放。
+先把 seq 清零，写完其他字段再写 seq 和 head，读者据此丢弃正在被覆盖的记录
+*/
+static void ngx_http_myupstream_trace_cleanup(void *data) {
+    uint64_t                             n, now;
+    struct sockaddr                     *sa;
+    struct sockaddr_in                  *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                 *sin6;
+#endif
+    ngx_http_request_t                  *r;
+    ngx_http_upstream_t                 *u;
+    ngx_http_myupstream_trace_ctx_t     *ctx = data;
+    ngx_http_myupstream_trace_slot_t    *slot;
+    ngx_http_myupstream_trace_header_t  *header;
+    ngx_http_myupstream_trace_record_t  *rec;
+
+    header = ctx->file->header;
+
+    if (header == NULL || (ngx_uint_t) ngx_worker >= header->nslots) {
+        return;
+    }
+
+    r = ctx->request;
+    u = r->upstream;
+
+    now = ngx_http_myupstream_trace_now();
+
+    /* 没有收到响应时连接可能已经建立过 */
+    ngx_http_myupstream_trace_connect(ctx, u, now);
+
+    slot = (ngx_http_myupstream_trace_slot_t *) ((u_char *) header + sizeof(ngx_http_myupstream_trace_header_t) + ngx_worker * header->slot_size);
+
+    n = slot->head;
+    rec = (ngx_http_myupstream_trace_record_t *) (slot + 1) + (n & (header->nrecords - 1));
+
+    rec->seq = 0;
+
+    ngx_memory_barrier();
+
+    rec->connection = r->connection->number;
+    rec->requests = (uint32_t) r->connection->requests;
+    rec->start = ctx->start;
+    rec->handler = ctx->stamp[NGX_HTTP_MYUPSTREAM_TRACE_HANDLER];
+    rec->connect = ctx->stamp[NGX_HTTP_MYUPSTREAM_TRACE_CONNECT];
+    rec->first_byte = ctx->stamp[NGX_HTTP_MYUPSTREAM_TRACE_FIRST_BYTE];
+    rec->header = ctx->stamp[NGX_HTTP_MYUPSTREAM_TRACE_HEADER];
+    rec->finalize = ngx_http_myupstream_trace_offset(ctx, now);
+    rec->status = (uint16_t) r->headers_out.status;
+    rec->upstream_status = u ? (uint16_t) u->headers_in.status_n : 0;
+    rec->module = (uint8_t) ctx->module;
+
+    sa = u ? u->peer.sockaddr : NULL;
+
+    if (sa && sa->sa_family == AF_INET) {
+        sin = (struct sockaddr_in *) sa;
+        rec->family = 4;
+        rec->port = ntohs(sin->sin_port);
+        ngx_memcpy(rec->addr, &sin->sin_addr, 4);
+
+#if (NGX_HAVE_INET6)
+    } else if (sa && sa->sa_family == AF_INET6) {
+        sin6 = (struct sockaddr_in6 *) sa;
+        rec->family = 6;
+        rec->port = ntohs(sin6->sin6_port);
+        ngx_memcpy(rec->addr, &sin6->sin6_addr, 16);
+#endif
+
+    } else {
+        rec->family = 0;
+        rec->port = 0;
+    }
+
+    ngx_memory_barrier();
+
+    rec->seq = n + 1;
+    slot->pid = ngx_pid;
+    slot->head = n + 1;
+}
+
+/* 时间点相对请求开始的微秒数。请求开始的时间是毫秒精度的缓存时间，可能稍晚于真实时间 */
+static uint32_t ngx_http_myupstream_trace_offset(ngx_http_myupstream_trace_ctx_t *ctx, uint64_t us) {
+    if (us <= ctx->start) {
+        return 0;
+    }
+
+    return (uint32_t) ngx_min(us - ctx->start, NGX_HTTP_MYUPSTREAM_TRACE_NONE - 1);
+}
+
+/* 当前时间，微秒。记录要与日志中的时间对应，使用墙上时间 */
+static uint64_t ngx_http_myupstream_trace_now(void) {
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
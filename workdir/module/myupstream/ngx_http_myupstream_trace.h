@@ -0,0 +1,64 @@
+#ifndef _NGX_HTTP_MYUPSTREAM_TRACE_H_INCLUDED_
+#define _NGX_HTTP_MYUPSTREAM_TRACE_H_INCLUDED_
+
+/*
+myupstream_trace_file 的文件格式，模块和 tools/myupstream_trace.c 共用，只依赖 <stdint.h>。
+文件由 master 创建并映射，worker 继承映射后各写自己的槽位，读取工具只读映射同一个文件：
+
+    header | slot 0 | records 0 | slot 1 | records 1 | ...
+
+每个槽位只有一个写者（对应的 worker），不加锁。写一条记录时先把 seq 清零，写完其他字段后再写 seq，
+最后增加 head；读者复制记录前后 seq 都等于期望的序号才说明复制到的是完整的记录，否则已经被覆盖
+*/
+
+#include <stdint.h>
+
+#define NGX_HTTP_MYUPSTREAM_TRACE_MAGIC      0x4d595452  /* "MYTR" */
+#define NGX_HTTP_MYUPSTREAM_TRACE_VERSION    1
+
+/* 相对时间的取值，表示请求没有经过这个阶段 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_NONE       0xffffffff
+
+/* 记录由哪个模块处理 */
+#define NGX_HTTP_MYUPSTREAM_TRACE_MODULE_MYUPSTREAM  1
+#define NGX_HTTP_MYUPSTREAM_TRACE_MODULE_MYMODULE    2
+
+/* 文件头，64 字节 */
+typedef struct {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            nslots;       /* worker 数量 */
+    uint32_t            nrecords;     /* 每个槽位的记录数，2 的幂 */
+    uint32_t            record_size;  /* sizeof(ngx_http_myupstream_trace_record_t) */
+    uint32_t            slot_size;    /* 槽位头加上它的全部记录 */
+    uint64_t            created;      /* 创建文件的时间，微秒 */
+    uint8_t             reserved[32];
+} ngx_http_myupstream_trace_header_t;
+
+/* 槽位头，64 字节，与其他 worker 的 head 不在同一个缓存行 */
+typedef struct {
+    volatile uint64_t   head;         /* 写入过的记录总数，下一条记录写在 head & (nrecords - 1) */
+    uint64_t            pid;          /* 最近写这个槽位的 worker */
+    uint8_t             reserved[48];
+} ngx_http_myupstream_trace_slot_t;
+
+/* 一个请求的记录，72 字节 */
+typedef struct {
+    volatile uint64_t   seq;          /* 记录的序号加 1，正在写入时为 0 */
+    uint64_t            connection;   /* 同 $connection */
+    uint64_t            start;        /* 请求开始的时间，微秒，精度为毫秒 */
+    uint32_t            requests;     /* 同 $connection_requests */
+    uint32_t            handler;      /* 以下都是相对 start 的微秒数 */
+    uint32_t            connect;      /* 连上后端，精度为毫秒（地址竞速时为微秒） */
+    uint32_t            first_byte;   /* 收到响应的第一个字节 */
+    uint32_t            header;       /* 解析完响应头 */
+    uint32_t            finalize;     /* 请求结束，释放内存池 */
+    uint16_t            status;       /* 发给客户端的响应码 */
+    uint16_t            upstream_status; /* 后端的响应码，0 表示没有收到 */
+    uint16_t            port;         /* 后端端口，主机字节序 */
+    uint8_t             family;       /* 4 或 6，0 表示没有后端地址 */
+    uint8_t             module;       /* NGX_HTTP_MYUPSTREAM_TRACE_MODULE_* */
+    uint8_t             addr[16];     /* 后端地址，网络字节序，IPv4 只用前 4 字节 */
+} ngx_http_myupstream_trace_record_t;
+
+#endif /* _NGX_HTTP_MYUPSTREAM_TRACE_H_INCLUDED_ */
@@ -0,0 +1,351 @@
+/*
+读取 myupstream_trace_file 的请求记录，不需要访问 nginx，也不会影响正在写入的 worker。
+编译：cc -O2 -o myupstream_trace tools/myupstream_trace.c
+用法：myupstream_trace [-f] [-i 毫秒] [-n 条数] 文件
+  不带 -f 时按请求结束的先后输出文件中现有的记录，-n 只输出最后若干条；
+  带 -f 时先输出最后 -n 条（缺省 10 条），之后每隔 -i 毫秒（缺省 200）输出新的记录，
+  nginx reload 后文件被替换时自动重新打开。
+每行一个请求，时间点是相对请求开始的微秒数，"-" 表示请求没有经过这个阶段：
+  time worker connection requests module status upstream_status backend handler connect first_byte header finalize
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../module/myupstream/ngx_http_myupstream_trace.h"
+
+/* 一条读出来的记录和它所在的槽位 */
+typedef struct {
+    ngx_http_myupstream_trace_record_t  rec;
+    uint32_t                            worker;
+} trace_entry_t;
+
+/* 映射的文件 */
+typedef struct {
+    const char                          *path;
+    ino_t                                ino;
+    size_t                               size;
+    ngx_http_myupstream_trace_header_t  *header;
+} trace_file_t;
+
+static int trace_open(trace_file_t *file);
+static void trace_close(trace_file_t *file);
+static ngx_http_myupstream_trace_slot_t *trace_slot(trace_file_t *file, uint32_t n);
+static int trace_read(trace_file_t *file, uint32_t worker, uint64_t seq, trace_entry_t *e);
+static size_t trace_collect(trace_file_t *file, uint64_t *from, trace_entry_t **entries);
+static int trace_cmp(const void *a, const void *b);
+static void trace_print(trace_entry_t *e);
+static void trace_usage(void);
+
+int main(int argc, char **argv) {
+    int            opt, follow;
+    long           interval, last;
+    size_t         i, n, skip;
+    uint64_t      *from;
+    struct stat    st;
+    trace_file_t   file;
+    trace_entry_t *entries;
+
+    follow = 0;
+    interval = 200;
+    last = -1;
+
+    while ((opt = getopt(argc, argv, "fi:n:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            follow = 1;
+            break;
+        case 'i':
+            interval = atol(optarg);
+            break;
+        case 'n':
+            last = atol(optarg);
+            break;
+        default:
+            trace_usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || interval <= 0) {
+        trace_usage();
+        return 1;
+    }
+
+    if (follow && last < 0) {
+        last = 10;
+    }
+
+    memset(&file, 0, sizeof(file));
+    file.path = argv[optind];
+
+    if (trace_open(&file) != 0) {
+        return 1;
+    }
+
+    printf("# time worker connection requests module status upstream_status backend handler connect first_byte header finalize\n");
+
+    for ( ;; ) {
+        from = calloc(file.header->nslots, sizeof(uint64_t));
+        if (from == NULL) {
+            perror("calloc");
+            return 1;
+        }
+
+        /* 第一次读取整个文件，之后每个槽位从上次读到的位置继续 */
+        n = trace_collect(&file, from, &entries);
+
+        skip = (last >= 0 && n > (size_t) last) ? n - (size_t) last : 0;
+
+        for (i = skip; i < n; i++) {
+            trace_print(&entries[i]);
+        }
+
+        free(entries);
+        fflush(stdout);
+
+        if (!follow) {
+            free(from);
+            break;
+        }
+
+        for ( ;; ) {
+            usleep(interval * 1000);
+
+            /* reload 之后路径指向新文件，旧文件不会再有新的记录 */
+            if (stat(file.path, &st) == 0 && st.st_ino != file.ino) {
+                trace_close(&file);
+
+                if (trace_open(&file) != 0) {
+                    return 1;
+                }
+
+                last = -1;
+                break;
+            }
+
+            n = trace_collect(&file, from, &entries);
+
+            for (i = 0; i < n; i++) {
+                trace_print(&entries[i]);
+            }
+
+            free(entries);
+            fflush(stdout);
+        }
+
+        free(from);
+    }
+
+    trace_close(&file);
+
+    return 0;
+}
+
+/* 只读映射文件并检查文件头，文件可能是别的版本的 nginx 写的 */
+static int trace_open(trace_file_t *file) {
+    int          fd;
+    void        *addr;
+    struct stat  st;
+    ngx_http_myupstream_trace_header_t  *header;
+
+    fd = open(file->path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "open \"%s\": %s\n", file->path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "fstat \"%s\": %s\n", file->path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t) st.st_size < sizeof(ngx_http_myupstream_trace_header_t)) {
+        fprintf(stderr, "\"%s\" is not a myupstream trace file\n", file->path);
+        close(fd);
+        return -1;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "mmap \"%s\": %s\n", file->path, strerror(errno));
+        return -1;
+    }
+
+    header = addr;
+
+    if (header->magic != NGX_HTTP_MYUPSTREAM_TRACE_MAGIC
+        || header->version != NGX_HTTP_MYUPSTREAM_TRACE_VERSION
+        || header->record_size != sizeof(ngx_http_myupstream_trace_record_t)
+        || header->nslots == 0
+        || header->nrecords == 0 || (header->nrecords & (header->nrecords - 1)) != 0
+        || sizeof(ngx_http_myupstream_trace_header_t) + (uint64_t) header->nslots * header->slot_size > (uint64_t) st.st_size)
+    {
+        fprintf(stderr, "\"%s\" is not a myupstream trace file of version %d\n", file->path, NGX_HTTP_MYUPSTREAM_TRACE_VERSION);
+        munmap(addr, st.st_size);
+        return -1;
+    }
+
+    file->ino = st.st_ino;
+    file->size = st.st_size;
+    file->header = header;
+
+    return 0;
+}
+
+static void trace_close(trace_file_t *file) {
+    munmap(file->header, file->size);
+    file->header = NULL;
+}
+
+static ngx_http_myupstream_trace_slot_t *trace_slot(trace_file_t *file, uint32_t n) {
+    return (ngx_http_myupstream_trace_slot_t *) ((char *) file->header + sizeof(ngx_http_myupstream_trace_header_t)
+                                                 + (size_t) n * file->header->slot_size);
+}
+
+/*
+复制一条记录。复制前后 seq 都等于期望的值才是完整的记录，否则 worker 正在覆盖它
+返回值：0 - 成功，-1 - 记录已经被覆盖
+*/
+static int trace_read(trace_file_t *file, uint32_t worker, uint64_t seq, trace_entry_t *e) {
+    ngx_http_myupstream_trace_record_t  *rec;
+
+    rec = (ngx_http_myupstream_trace_record_t *) (trace_slot(file, worker) + 1) + (seq & (file->header->nrecords - 1));
+
+    if (rec->seq != seq + 1) {
+        return -1;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    memcpy(&e->rec, (const void *) rec, sizeof(ngx_http_myupstream_trace_record_t));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (rec->seq != seq + 1 || e->rec.seq != seq + 1) {
+        return -1;
+    }
+
+    e->worker = worker;
+
+    return 0;
+}
+
+/*
+读出每个槽位中序号不小于 from[i] 的记录，按请求结束的时间排序，from 更新为下次开始的序号
+返回值：记录数，*entries 由调用者释放
+*/
+static size_t trace_collect(trace_file_t *file, uint64_t *from, trace_entry_t **entries) {
+    size_t     n, max;
+    uint32_t   k;
+    uint64_t   head, seq;
+
+    max = (size_t) file->header->nslots * file->header->nrecords;
+
+    *entries = malloc(max * sizeof(trace_entry_t));
+    if (*entries == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    n = 0;
+
+    for (k = 0; k < file->header->nslots; k++) {
+        head = trace_slot(file, k)->head;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        seq = from[k];
+
+        /* 落后太多的记录已经被覆盖 */
+        if (head - seq > file->header->nrecords) {
+            seq = head - file->header->nrecords;
+        }
+
+        for ( /* void */ ; seq < head; seq++) {
+            if (trace_read(file, k, seq, &(*entries)[n]) == 0) {
+                n++;
+            }
+        }
+
+        from[k] = head;
+    }
+
+    qsort(*entries, n, sizeof(trace_entry_t), trace_cmp);
+
+    return n;
+}
+
+static int trace_cmp(const void *a, const void *b) {
+    const ngx_http_myupstream_trace_record_t  *x = &((const trace_entry_t *) a)->rec;
+    const ngx_http_myupstream_trace_record_t  *y = &((const trace_entry_t *) b)->rec;
+    uint64_t                                   ex, ey;
+
+    ex = x->start + x->finalize;
+    ey = y->start + y->finalize;
+
+    return ex < ey ? -1 : ex > ey;
+}
+
+static void trace_print(trace_entry_t *e) {
+    int                                  i;
+    char                                 addr[INET6_ADDRSTRLEN], t[32];
+    time_t                               sec;
+    struct tm                            tm;
+    uint32_t                             stamp[5];
+    ngx_http_myupstream_trace_record_t  *rec = &e->rec;
+    static const char                   *modules[] = { "-", "myupstream", "mymodule" };
+
+    sec = (time_t) (rec->start / 1000000);
+    localtime_r(&sec, &tm);
+    strftime(t, sizeof(t), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    printf("%s.%06u %u %llu %u %s %u ", t, (unsigned) (rec->start % 1000000), e->worker,
+           (unsigned long long) rec->connection, rec->requests,
+           rec->module <= 2 ? modules[rec->module] : "?", rec->status);
+
+    if (rec->upstream_status) {
+        printf("%u ", rec->upstream_status);
+    } else {
+        printf("- ");
+    }
+
+    if (rec->family == 4 && inet_ntop(AF_INET, rec->addr, addr, sizeof(addr))) {
+        printf("%s:%u ", addr, rec->port);
+
+    } else if (rec->family == 6 && inet_ntop(AF_INET6, rec->addr, addr, sizeof(addr))) {
+        printf("[%s]:%u ", addr, rec->port);
+
+    } else {
+        printf("- ");
+    }
+
+    stamp[0] = rec->handler;
+    stamp[1] = rec->connect;
+    stamp[2] = rec->first_byte;
+    stamp[3] = rec->header;
+    stamp[4] = rec->finalize;
+
+    for (i = 0; i < 5; i++) {
+        if (stamp[i] == NGX_HTTP_MYUPSTREAM_TRACE_NONE) {
+            printf(i < 4 ? "- " : "-\n");
+        } else {
+            printf(i < 4 ? "%u " : "%u\n", stamp[i]);
+        }
+    }
+}
+
+static void trace_usage(void) {
+    fprintf(stderr, "usage: myupstream_trace [-f] [-i interval_ms] [-n count] file\n");
+}